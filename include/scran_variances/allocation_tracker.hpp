@@ -0,0 +1,220 @@
+#ifndef SCRAN_VARIANCES_ALLOCATION_TRACKER_HPP
+#define SCRAN_VARIANCES_ALLOCATION_TRACKER_HPP
+
+#include <array>
+#include <vector>
+#include <mutex>
+#include <cstddef>
+#include <algorithm>
+
+/**
+ * @file allocation_tracker.hpp
+ * @brief Account for memory allocations by phase and thread.
+ */
+
+namespace scran_variances {
+
+/**
+ * Phase of the variance modelling for which memory is allocated.
+ *
+ * - `OUTPUT`: output statistics allocated by the overloads that return a results object.
+ * - `EXTRACTION`: buffers for extracting and transforming rows/columns of the matrix, including the prefetch buffers.
+ * - `STATISTICS`: running statistics and per-thread buffers for the means, variances and extra statistics.
+ * - `TREND`: workspace for fitting the mean-variance trend.
+ * - `AVERAGE`: temporary buffers for averaging statistics across blocks.
+ */
+enum class AllocationPhase : unsigned char { OUTPUT, EXTRACTION, STATISTICS, TREND, AVERAGE };
+
+/**
+ * @brief Accounting of memory allocations during variance modelling.
+ *
+ * An instance of this class can be supplied via `ModelGeneVariancesOptions::allocation_tracker` to record the size of each allocation whose size depends on the number of genes or cells.
+ * Allocations are tagged with the phase and the index of the thread that performed them, as defined by `tatami::parallelize()`;
+ * allocations outside of parallel sections are assigned to thread 0.
+ * The tracker then reports the high-water mark for each phase, for each thread within a phase, and for all allocations combined.
+ *
+ * This only accounts for allocations made by this library, and not those in the matrix's extractors or in the LOWESS smoother.
+ * Allocations of a fixed size (i.e., independent of the dimensions of the matrix) are also ignored.
+ * The same tracker can be re-used across calls, in which case the high-water marks are accumulated across calls.
+ * Allocations in the `AllocationPhase::OUTPUT` phase are never released as the results are returned to the caller,
+ * so `reset()` should be called between calls if the high-water marks for each call are of interest.
+ *
+ * All methods are thread-safe.
+ */
+class AllocationTracker {
+public:
+    /**
+     * @cond
+     */
+    static constexpr std::size_t num_phases = 5;
+    /**
+     * @endcond
+     */
+
+    /**
+     * Record an allocation.
+     * @param phase Phase of the allocation.
+     * @param thread Index of the thread that performed the allocation.
+     * @param bytes Size of the allocation in bytes.
+     */
+    void allocate(const AllocationPhase phase, const int thread, const std::size_t bytes) {
+        std::lock_guard<std::mutex> lck(my_lock);
+        auto& per_thread = get_thread(phase, thread);
+        per_thread.current += bytes;
+        per_thread.peak = std::max(per_thread.peak, per_thread.current);
+        auto& per_phase = my_phases[static_cast<std::size_t>(phase)];
+        per_phase.current += bytes;
+        per_phase.peak = std::max(per_phase.peak, per_phase.current);
+        my_total.current += bytes;
+        my_total.peak = std::max(my_total.peak, my_total.current);
+    }
+
+    /**
+     * Record the release of an allocation.
+     * @param phase Phase of the allocation.
+     * @param thread Index of the thread that performed the allocation.
+     * @param bytes Size of the allocation in bytes.
+     */
+    void release(const AllocationPhase phase, const int thread, const std::size_t bytes) {
+        std::lock_guard<std::mutex> lck(my_lock);
+        get_thread(phase, thread).current -= bytes;
+        my_phases[static_cast<std::size_t>(phase)].current -= bytes;
+        my_total.current -= bytes;
+    }
+
+    /**
+     * @param phase Phase of interest.
+     * @return High-water mark of the memory allocated in `phase`, in bytes.
+     */
+    std::size_t peak(const AllocationPhase phase) const {
+        std::lock_guard<std::mutex> lck(my_lock);
+        return my_phases[static_cast<std::size_t>(phase)].peak;
+    }
+
+    /**
+     * @param phase Phase of interest.
+     * @param thread Index of the thread of interest.
+     * @return High-water mark of the memory allocated by `thread` in `phase`, in bytes.
+     */
+    std::size_t peak(const AllocationPhase phase, const int thread) const {
+        std::lock_guard<std::mutex> lck(my_lock);
+        const auto& threads = my_threads[static_cast<std::size_t>(phase)];
+        const std::size_t t = thread;
+        return (t < threads.size() ? threads[t].peak : 0);
+    }
+
+    /**
+     * @return High-water mark of the memory allocated in all phases, in bytes.
+     */
+    std::size_t peak() const {
+        std::lock_guard<std::mutex> lck(my_lock);
+        return my_total.peak;
+    }
+
+    /**
+     * @return Memory that is currently allocated in all phases, in bytes.
+     */
+    std::size_t current() const {
+        std::lock_guard<std::mutex> lck(my_lock);
+        return my_total.current;
+    }
+
+    /**
+     * @param phase Phase of interest.
+     * @return Number of threads that performed allocations in `phase`, i.e., one plus the largest thread index.
+     */
+    std::size_t num_threads(const AllocationPhase phase) const {
+        std::lock_guard<std::mutex> lck(my_lock);
+        return my_threads[static_cast<std::size_t>(phase)].size();
+    }
+
+    /**
+     * Reset all high-water marks and current allocations to zero.
+     */
+    void reset() {
+        std::lock_guard<std::mutex> lck(my_lock);
+        for (auto& threads : my_threads) {
+            threads.clear();
+        }
+        my_phases.fill(Usage());
+        my_total = Usage();
+    }
+
+private:
+    struct Usage {
+        std::size_t current = 0;
+        std::size_t peak = 0;
+    };
+
+    mutable std::mutex my_lock;
+    std::array<std::vector<Usage>, num_phases> my_threads;
+    std::array<Usage, num_phases> my_phases;
+    Usage my_total;
+
+    Usage& get_thread(const AllocationPhase phase, const int thread) {
+        auto& threads = my_threads[static_cast<std::size_t>(phase)];
+        const std::size_t t = thread;
+        if (t >= threads.size()) {
+            threads.resize(t + 1);
+        }
+        return threads[t];
+    }
+};
+
+/**
+ * @cond
+ */
+namespace internal {
+
+// Records an allocation for the lifetime of this object, or does nothing if no tracker is supplied.
+class TrackedAllocation {
+public:
+    TrackedAllocation(AllocationTracker* const tracker, const AllocationPhase phase, const int thread, const std::size_t bytes) :
+        my_tracker(tracker), my_phase(phase), my_thread(thread), my_bytes(bytes)
+    {
+        if (my_tracker) {
+            my_tracker->allocate(my_phase, my_thread, my_bytes);
+        }
+    }
+
+    ~TrackedAllocation() {
+        if (my_tracker) {
+            my_tracker->release(my_phase, my_thread, my_bytes);
+        }
+    }
+
+    TrackedAllocation(const TrackedAllocation&) = delete;
+    TrackedAllocation& operator=(const TrackedAllocation&) = delete;
+
+    // Updates the recorded size, e.g., when a workspace grows.
+    void update(const std::size_t bytes) {
+        if (my_tracker) {
+            if (bytes > my_bytes) {
+                my_tracker->allocate(my_phase, my_thread, bytes - my_bytes);
+            } else {
+                my_tracker->release(my_phase, my_thread, my_bytes - bytes);
+            }
+        }
+        my_bytes = bytes;
+    }
+
+private:
+    AllocationTracker* my_tracker;
+    AllocationPhase my_phase;
+    int my_thread;
+    std::size_t my_bytes;
+};
+
+template<class ... Containers_>
+std::size_t container_bytes(const Containers_& ... containers) {
+    return (static_cast<std::size_t>(0) + ... + (containers.capacity() * sizeof(typename Containers_::value_type)));
+}
+
+}
+/**
+ * @endcond
+ */
+
+}
+
+#endif
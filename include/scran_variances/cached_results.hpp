@@ -0,0 +1,294 @@
+#ifndef SCRAN_VARIANCES_CACHED_RESULTS_HPP
+#define SCRAN_VARIANCES_CACHED_RESULTS_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+
+#include <unistd.h>
+
+#include "tatami/tatami.hpp"
+#include "tatami_stats/tatami_stats.hpp"
+
+#include "model_gene_variances.hpp"
+#include "mapped_results.hpp"
+#include "utils.hpp"
+
+/**
+ * @file cached_results.hpp
+ * @brief Cache the per-block statistics from `model_gene_variances_blocked()` on disk.
+ *
+ * This header requires POSIX memory mapping (see `mapped_results.hpp`) and is not included by `scran_variances.hpp`.
+ */
+
+namespace scran_variances {
+
+/**
+ * @brief Options for `model_gene_variances_blocked_cached()`.
+ */
+struct ModelGeneVariancesCacheOptions {
+    /**
+     * Path to the directory in which to store the cached statistics.
+     * This is created if it does not already exist.
+     */
+    std::string directory;
+
+    /**
+     * Number of rows/columns of the matrix to sample when computing its fingerprint in `fingerprint_matrix()`.
+     * Larger values reduce the risk of failing to detect a change in the matrix contents, at the cost of more extraction.
+     */
+    std::size_t num_sampled = 50;
+
+    /**
+     * Additional string to include in the cache key.
+     * This can be used to distinguish between matrices that cannot be reliably distinguished by the fingerprint, e.g., by including a dataset identifier or version.
+     */
+    std::string extra_key;
+};
+
+/**
+ * @cond
+ */
+namespace internal {
+
+class Fnv1aHasher {
+public:
+    void add_bytes(const void* ptr, const std::size_t n) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(ptr);
+        for (std::size_t i = 0; i < n; ++i) {
+            my_hash ^= bytes[i];
+            my_hash *= 1099511628211ull;
+        }
+    }
+
+    template<typename Value_>
+    void add(const Value_ x) {
+        add_bytes(&x, sizeof(Value_));
+    }
+
+    std::uint64_t get() const {
+        return my_hash;
+    }
+
+private:
+    std::uint64_t my_hash = 14695981039346656037ull;
+};
+
+inline std::string to_hex(std::uint64_t x) {
+    static constexpr const char* digits = "0123456789abcdef";
+    std::string output(16, '0');
+    for (int i = 15; i >= 0; --i) {
+        output[i] = digits[x & 0xf];
+        x >>= 4;
+    }
+    return output;
+}
+
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Compute a cheap fingerprint of a matrix's contents.
+ * This considers the dimensions of the matrix, the number of non-zero values in a sample of rows or columns, and a hash of the values in that sample.
+ * Rows are sampled if `tatami::Matrix::prefer_rows()` is true, otherwise columns are sampled.
+ * Samples are evenly spaced across the matrix to avoid favoring any particular region.
+ *
+ * Note that the fingerprint is not guaranteed to change if the matrix contents change outside of the sampled rows/columns.
+ * Users should increase `num_sampled` or supply a `ModelGeneVariancesCacheOptions::extra_key` if stronger guarantees are required.
+ *
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ *
+ * @param mat A matrix.
+ * @param num_sampled Number of rows/columns to sample.
+ * This is capped at the extent of the sampled dimension.
+ *
+ * @return Fingerprint of the matrix.
+ */
+template<typename Value_, typename Index_>
+std::uint64_t fingerprint_matrix(const tatami::Matrix<Value_, Index_>& mat, const std::size_t num_sampled) {
+    const Index_ NR = mat.nrow(), NC = mat.ncol();
+    const bool row = mat.prefer_rows();
+    const Index_ primary = (row ? NR : NC), secondary = (row ? NC : NR);
+
+    internal::Fnv1aHasher hasher;
+    hasher.add(static_cast<std::uint64_t>(NR));
+    hasher.add(static_cast<std::uint64_t>(NC));
+    hasher.add(static_cast<unsigned char>(row));
+    hasher.add(static_cast<std::uint32_t>(sizeof(Value_)));
+
+    const std::size_t nsamples = std::min(num_sampled, static_cast<std::size_t>(primary));
+    std::uint64_t nonzeros = 0;
+    auto buffer = tatami::create_container_of_Index_size<std::vector<Value_> >(secondary);
+    auto ext = mat.dense(row, tatami::Options());
+
+    for (std::size_t s = 0; s < nsamples; ++s) {
+        // Evenly spaced samples, always including the first row/column.
+        const Index_ i = static_cast<Index_>(s * static_cast<std::size_t>(primary) / nsamples);
+        auto ptr = ext->fetch(i, buffer.data());
+        hasher.add(static_cast<std::uint64_t>(i));
+        hasher.add_bytes(ptr, sizeof(Value_) * static_cast<std::size_t>(secondary));
+        nonzeros += std::count_if(ptr, ptr + secondary, [](const Value_ x) -> bool { return x != 0; });
+    }
+
+    hasher.add(nonzeros);
+    return hasher.get();
+}
+
+/**
+ * Compute the cache key for `model_gene_variances_blocked_cached()`.
+ * This combines the matrix fingerprint from `fingerprint_matrix()`, the block assignments and the type of the statistics.
+ *
+ * @tparam Stat_ Floating-point type of the output statistics.
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam Block_ Integer type of the block IDs.
+ *
+ * @param mat Matrix of expression values.
+ * @param[in] block Pointer to an array of length equal to the number of cells, containing 0-based block identifiers.
+ * This may also be a `nullptr` in which case all cells are assumed to belong to the same block.
+ * @param cache_options Options for the cache.
+ *
+ * @return Cache key, to be used as the file name in the cache directory.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Block_>
+std::string model_gene_variances_cache_key(const tatami::Matrix<Value_, Index_>& mat, const Block_* const block, const ModelGeneVariancesCacheOptions& cache_options) {
+    internal::Fnv1aHasher hasher;
+    hasher.add(fingerprint_matrix(mat, cache_options.num_sampled));
+    hasher.add(static_cast<std::uint32_t>(sizeof(Stat_)));
+
+    hasher.add(static_cast<unsigned char>(block != NULL));
+    if (block) {
+        const Index_ NC = mat.ncol();
+        for (Index_ c = 0; c < NC; ++c) {
+            hasher.add(static_cast<std::uint64_t>(block[c]));
+        }
+    }
+
+    hasher.add(static_cast<std::uint64_t>(cache_options.extra_key.size()));
+    hasher.add_bytes(cache_options.extra_key.data(), cache_options.extra_key.size());
+    return internal::to_hex(hasher.get()) + ".bin";
+}
+
+/**
+ * Variant of `model_gene_variances_blocked()` that caches the per-block means and variances on disk.
+ * If the cache directory already contains statistics for the same matrix and blocking (as determined by `model_gene_variances_cache_key()`),
+ * they are loaded from the cache instead of being computed from the matrix.
+ * Otherwise, the statistics are computed and saved to the cache for future use.
+ *
+ * Only the means and variances are cached as these are the expensive part of the calculation.
+ * The trend fitting and averaging across blocks are always performed on the (possibly cached) statistics,
+ * so changes to `ModelGeneVariancesOptions::fit_variance_trend_options` or the averaging options are always respected.
+ *
+ * Multiple processes can safely use the same cache directory.
+ * Each cache file is written to a temporary file in the same directory and then atomically renamed, so readers will never observe a partially written file.
+ * If multiple processes compute the same statistics concurrently, the last rename wins, which is harmless as the contents are identical.
+ * If writing the cache file fails, the temporary file is removed before the error is propagated.
+ *
+ * The cache key only considers a sample of rows/columns of the matrix, see `fingerprint_matrix()`.
+ * In particular, the count of non-zero values in the fingerprint is computed from the sampled rows/columns, not from the entire matrix.
+ * This means that a matrix that differs from a previously cached matrix only outside of the sampled rows/columns will silently return stale statistics.
+ * Callers that cannot rule this out should supply a `ModelGeneVariancesCacheOptions::extra_key` that uniquely identifies the matrix contents,
+ * e.g., a checksum of the source file or a version number.
+ *
+ * @tparam Stat_ Floating-point type of the output statistics.
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam Block_ Integer type of the block IDs.
+ *
+ * @param mat Matrix of expression values, typically after normalization and log-transformation.
+ * Rows should be genes while columns should be cells.
+ * @param[in] block Pointer to an array of length equal to the number of cells, containing 0-based block identifiers.
+ * This may also be a `nullptr` in which case all cells are assumed to belong to the same block.
+ * @param options Further options.
+ * @param cache_options Options for the cache.
+ *
+ * @return Results of the variance modelling in each block.
+ * An average for each statistic is also computed if `ModelGeneVariancesOptions::average_policy` is not `BlockAveragePolicy::NONE`.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Block_>
+ModelGeneVariancesBlockedResults<Stat_> model_gene_variances_blocked_cached(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const Block_* const block,
+    const ModelGeneVariancesOptions& options,
+    const ModelGeneVariancesCacheOptions& cache_options
+) {
+    const Index_ NR = mat.nrow(), NC = mat.ncol();
+    std::vector<Index_> block_size;
+    if (block) {
+        block_size = tatami_stats::tabulate_groups(block, NC);
+    } else {
+        block_size.push_back(NC); // everything is one big block.
+    }
+    const auto nblocks = block_size.size();
+
+    const bool do_average = internal::use_average(options);
+    ModelGeneVariancesBlockedResults<Stat_> output(NR, nblocks, do_average, options.trend);
+    internal::track_results(options.allocation_tracker, output);
+    const auto buffers = internal::get_blocked_buffers(output, do_average, options.trend);
+
+    const std::filesystem::path dir(cache_options.directory);
+    const auto key = model_gene_variances_cache_key<Stat_>(mat, block, cache_options);
+    const auto path = dir / key;
+
+    bool found = false;
+    if (std::filesystem::exists(path)) {
+        try {
+            auto cached = ModelGeneVariancesMappedResults<Stat_>::open(path.string());
+            if (cached.num_genes() == static_cast<std::size_t>(NR) && cached.num_blocks() == nblocks) {
+                for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+                    const auto current = cached.per_block(b);
+                    std::copy_n(current.means, NR, buffers.per_block[b].means);
+                    std::copy_n(current.variances, NR, buffers.per_block[b].variances);
+                }
+                found = true;
+            }
+        } catch (std::exception&) {
+            // Treat unreadable files as a cache miss, in which case they'll just be overwritten.
+        }
+    }
+
+    if (!found) {
+        internal::compute_variances(mat, buffers.per_block, block, block_size, internal::drop_gene_chunk_callback(options));
+
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+        if (!std::filesystem::is_directory(dir)) {
+            throw std::runtime_error("failed to create the cache directory at '" + dir.string() + "'");
+        }
+
+        // Using a process- and thread-specific temporary name to avoid clobbering other writers.
+        auto tmp_path = dir / (key + ".tmp." + std::to_string(::getpid()) + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())));
+        try {
+            {
+                auto cached = ModelGeneVariancesMappedResults<Stat_>::create(tmp_path.string(), NR, nblocks, /* do_average = */ false, /* do_trend = */ false);
+                for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+                    const auto current = cached.per_block(b);
+                    std::copy_n(buffers.per_block[b].means, NR, current.means);
+                    std::copy_n(buffers.per_block[b].variances, NR, current.variances);
+                }
+                cached.sync();
+            }
+            std::filesystem::rename(tmp_path, path);
+        } catch (...) {
+            // Don't leave the temporary file lying around in a shared directory.
+            std::filesystem::remove(tmp_path, ec);
+            throw;
+        }
+    }
+
+    internal::fit_and_average(NR, block_size, buffers, options);
+    return output;
+}
+
+}
+
+#endif
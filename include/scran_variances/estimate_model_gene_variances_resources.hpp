@@ -0,0 +1,271 @@
+#ifndef SCRAN_VARIANCES_ESTIMATE_MODEL_GENE_VARIANCES_RESOURCES_HPP
+#define SCRAN_VARIANCES_ESTIMATE_MODEL_GENE_VARIANCES_RESOURCES_HPP
+
+#include <cstddef>
+#include <algorithm>
+#include <limits>
+
+#include "model_gene_variances.hpp"
+#include "utils.hpp"
+
+/**
+ * @file estimate_model_gene_variances_resources.hpp
+ * @brief Estimate the memory usage and work of `model_gene_variances_blocked()`.
+ */
+
+namespace scran_variances {
+
+/**
+ * @brief Summary of a matrix for `estimate_model_gene_variances_resources()`.
+ *
+ * This describes the matrix that will be passed to `model_gene_variances_blocked()`, without requiring the matrix itself.
+ * The fields correspond to the properties of a `tatami::Matrix` that are used to plan the calculation.
+ */
+struct ModelGeneVariancesMatrixSummary {
+    /**
+     * Number of genes, i.e., rows.
+     */
+    std::size_t num_genes = 0;
+
+    /**
+     * Number of cells, i.e., columns.
+     */
+    std::size_t num_cells = 0;
+
+    /**
+     * Proportion of the matrix that is sparse, see `tatami::Matrix::is_sparse_proportion()`.
+     */
+    double sparse_proportion = 0;
+
+    /**
+     * Proportion of non-zero values in the matrix.
+     * Only used if `ModelGeneVariancesMatrixSummary::sparse_proportion` is positive.
+     */
+    double density = 1;
+
+    /**
+     * Proportion of the matrix that prefers row access, see `tatami::Matrix::prefer_rows_proportion()`.
+     */
+    double prefer_rows_proportion = 1;
+};
+
+/**
+ * @brief Estimated resources for `model_gene_variances_blocked()`.
+ */
+struct ModelGeneVariancesResourceEstimate {
+    /**
+     * Plan for computing the per-gene statistics, as would be returned by `plan_model_gene_variances()`.
+     */
+    ModelGeneVariancesPlan plan;
+
+    /**
+     * Number of bytes for the output statistics allocated by the `model_gene_variances_blocked()` overload that returns a `ModelGeneVariancesBlockedResults`.
+     */
+    std::size_t output_bytes = 0;
+
+    /**
+     * Number of bytes for the temporary buffers that are used while computing the per-gene statistics, summed across all threads.
+     */
+    std::size_t compute_bytes = 0;
+
+    /**
+     * Number of bytes for the temporary buffers that are used while fitting the trend, i.e., the `FitVarianceTrendWorkspace`.
+     * This assumes that all genes are used in the fit, so it is an upper bound if `FitVarianceTrendOptions::mean_filter = true`.
+     * Allocations inside the LOWESS smoother are not included.
+     */
+    std::size_t fit_bytes = 0;
+
+    /**
+     * Peak number of bytes, i.e., the output plus the larger of `ModelGeneVariancesResourceEstimate::compute_bytes` and `ModelGeneVariancesResourceEstimate::fit_bytes`.
+     */
+    std::size_t peak_bytes = 0;
+
+    /**
+     * Estimated work for computing the per-gene statistics, in the same units as `ModelGeneVariancesPlan::costs`.
+     * This is divided by the number of threads with work to do, so it is roughly proportional to the run time.
+     */
+    double work = 0;
+};
+
+/**
+ * @cond
+ */
+namespace internal {
+
+inline std::size_t prefetch_bytes(const std::size_t extent, const std::size_t length, const std::size_t per_element, const std::size_t buffer_size, const bool sparse, const std::size_t index_size) {
+    if (buffer_size == 0 || length == 0) {
+        return 0;
+    }
+    const std::size_t per_fetch = std::max<std::size_t>(1, extent * per_element);
+    const std::size_t chunk = std::min(length, std::max<std::size_t>(1, buffer_size / 2 / per_fetch));
+    return 2 * chunk * (extent * per_element + (sparse ? index_size : 0));
+}
+
+// Mimics the job sizes of tatami::parallelize(), where all but the last job have the same size.
+inline std::pair<std::size_t, std::size_t> job_sizes(const std::size_t ntasks, const int num_threads) {
+    const std::size_t nthreads = std::max(1, num_threads);
+    if (ntasks == 0) {
+        return std::make_pair(0, 0);
+    }
+    const std::size_t per_job = (ntasks + nthreads - 1) / nthreads;
+    const std::size_t njobs = (ntasks + per_job - 1) / per_job;
+    return std::make_pair(njobs, per_job);
+}
+
+template<typename Stat_, typename Value_, typename Index_>
+ModelGeneVariancesResourceEstimate estimate_resources(
+    const ModelGeneVariancesMatrixSummary& summary,
+    const std::size_t num_blocks,
+    const ModelGeneVariancesOptions& options,
+    const bool transformed)
+{
+    ModelGeneVariancesResourceEstimate output;
+    const std::size_t NR = summary.num_genes, NC = summary.num_cells;
+    const std::size_t nblocks = std::max<std::size_t>(1, num_blocks);
+    const bool blocked = num_blocks > 1;
+    const double density = (summary.sparse_proportion > 0 ? summary.density : 1);
+
+    const auto create_model = [&]() -> AccessCostModel {
+        return AccessCostModel(NR, NC, nblocks, summary.prefer_rows_proportion, summary.sparse_proportion, density);
+    };
+    auto& plan = output.plan;
+    plan = plan_compute_variances<Value_>(NR, NC, nblocks, create_model, hinted_compute_path(summary.sparse_proportion, summary.prefer_rows_proportion), options);
+    output.work = create_model().compute(plan.path, plan.num_threads);
+
+    constexpr std::size_t sv = sizeof(Value_), si = sizeof(Index_), ss = sizeof(Stat_);
+    const std::size_t st = (transformed ? ss : 0); // size of each transformed value, if a transformation is applied.
+    const std::size_t nextra = (options.extra_statistics ? 4 : 0);
+
+    // Output statistics.
+    const std::size_t per_block_stats = 2 + (options.trend ? 2 : 0) + nextra;
+    std::size_t output_stats = nblocks * per_block_stats;
+    if (use_average(options)) {
+        output_stats += 2 + (options.trend ? 2 : 0);
+    }
+    output.output_bytes = output_stats * NR * ss;
+
+    // Temporary buffers for computing the statistics.
+    const bool sparse = (plan.path == ComputePath::SPARSE_ROW || plan.path == ComputePath::SPARSE_COLUMN);
+    const bool row = is_row_path(plan.path);
+    const std::size_t per_element = sv + (sparse ? si : 0);
+    const std::size_t prefetch = options.prefetch_buffer_size;
+    std::size_t compute = 0;
+
+    if (plan.cell_split) {
+        const std::size_t nthreads = std::max(1, plan.num_threads);
+        compute += nthreads * NR * nblocks * 2 * ss + nthreads * nblocks * si;
+        compute += nthreads * NR * nblocks * nextra * ss;
+
+        const auto jobs = job_sizes(NC, plan.num_threads);
+        for (std::size_t j = 0; j < jobs.first; ++j) {
+            const std::size_t length = std::min(jobs.second, NC - j * jobs.second);
+            if (row) {
+                compute += length * (per_element + st) + nblocks * (2 * ss + si) + (transformed && !sparse ? length * si : 0);
+                compute += prefetch_bytes(length, NR, sv + (sparse ? si : 0), prefetch, sparse, si);
+            } else {
+                compute += NR * (per_element + st) + (sparse ? nblocks * NR * si : 0);
+                compute += prefetch_bytes(NR, length, sv + (sparse ? si : 0), prefetch, sparse, si);
+            }
+        }
+
+    } else {
+        const auto jobs = job_sizes(NR, plan.num_threads);
+        for (std::size_t j = 0; j < jobs.first; ++j) {
+            const std::size_t length = std::min(jobs.second, NR - j * jobs.second);
+            switch (plan.path) {
+                case ComputePath::DENSE_ROW:
+                    compute += (blocked ? nblocks * 2 * ss : 0) + NC * (sv + st) + nblocks * nextra * ss;
+                    compute += prefetch_bytes(NC, length, sv, prefetch, false, si);
+                    break;
+                case ComputePath::SPARSE_ROW:
+                    compute += nblocks * (2 * ss + si) + NC * (sv + si + st) + nblocks * nextra * ss;
+                    compute += prefetch_bytes(NC, length, sv + si, prefetch, true, si);
+                    break;
+                case ComputePath::DENSE_COLUMN:
+                    if (plan.column_batch_size > 1) {
+                        const std::size_t batch_size = std::min(plan.column_batch_size, NC);
+                        // Transformed values are stored in the batch, with a separate buffer for the extracted values.
+                        compute += batch_size * length * (transformed ? ss : sv) + nblocks * si + length * (transformed ? sv : 0);
+                    } else {
+                        compute += length * (sv + st);
+                    }
+                    compute += prefetch_bytes(length, NC, sv, prefetch, false, si);
+                    break;
+                default:
+                    {
+                        std::size_t tile_size = length;
+                        if (plan.sparse_column_tile_cache_size > 0) {
+                            tile_size = choose_sparse_column_tile_size<Stat_, Index_>(length, nblocks, plan.sparse_column_tile_cache_size, density);
+                        }
+                        compute += tile_size * (sv + si + st) + nblocks * tile_size * si;
+
+                        // A shorter final tile can fit more columns into each prefetch slot, so we take the larger of the two.
+                        std::size_t tile_prefetch = prefetch_bytes(tile_size, NC, sv + si, prefetch, true, si);
+                        const std::size_t leftover = length % tile_size;
+                        if (leftover) {
+                            tile_prefetch = std::max(tile_prefetch, prefetch_bytes(leftover, NC, sv + si, prefetch, true, si));
+                        }
+                        compute += tile_prefetch;
+                    }
+                    break;
+            }
+
+            if (!row) {
+                // Statistics for all threads other than the first are stored in separate buffers before being transferred.
+                if (j > 0) {
+                    compute += nblocks * length * 2 * ss;
+                }
+                compute += nblocks * length * nextra * ss;
+            }
+        }
+    }
+    output.compute_bytes = compute;
+
+    // Temporary buffers for trend fitting, which is performed for each block in turn with the same workspace.
+    if (options.trend) {
+        output.fit_bytes = fit_variance_trend_workspace_bytes<Stat_>(NR, plan.fit_num_threads);
+    }
+
+    output.peak_bytes = output.output_bytes + std::max(output.compute_bytes, output.fit_bytes);
+    return output;
+}
+
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Estimate the memory usage and work of `model_gene_variances_blocked()` before running it, e.g., to choose the size of the node for a job.
+ * This uses the same plan as `model_gene_variances_blocked()` for a matrix with the specified properties,
+ * and accounts for the output statistics and the temporary buffers of the chosen access pattern for all threads,
+ * including the per-thread statistics of non-primary threads, the running statistics, the extraction buffers, the prefetch buffers and the trend fitting workspace.
+ *
+ * The estimate does not include the matrix itself or any memory allocated by its extractors, which depends on the matrix representation.
+ * It also ignores small allocations whose size does not depend on the number of genes or cells.
+ * This is the same set of allocations that is recorded by an `AllocationTracker`, so the estimate can be checked against `AllocationTracker::peak()` for an actual run.
+ * For `model_gene_variances_blocked_from_counts()`, see `estimate_model_gene_variances_from_counts_resources()` instead.
+ *
+ * @tparam Stat_ Floating-point type of the output statistics.
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ *
+ * @param summary Summary of the matrix.
+ * @param num_blocks Number of blocks, i.e., one plus the largest block identifier.
+ * This should be 1 if no blocking is performed.
+ * @param options Further options, including the number of threads.
+ *
+ * @return Estimated resources.
+ */
+template<typename Stat_ = double, typename Value_ = double, typename Index_ = int>
+ModelGeneVariancesResourceEstimate estimate_model_gene_variances_resources(
+    const ModelGeneVariancesMatrixSummary& summary,
+    const std::size_t num_blocks,
+    const ModelGeneVariancesOptions& options
+) {
+    return internal::estimate_resources<Stat_, Value_, Index_>(summary, num_blocks, options, false);
+}
+
+}
+
+#endif
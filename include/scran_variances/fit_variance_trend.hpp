@@ -5,6 +5,8 @@
 #include <vector>
 #include <array>
 #include <cstddef>
+#include <cmath>
+#include <stdexcept>
 
 #include "WeightedLowess/WeightedLowess.hpp"
 #include "sanisizer/sanisizer.hpp"
@@ -90,8 +92,9 @@ struct FitVarianceTrendOptions {
     double span = 0.3;
 
     /**
-     * Number of threads to use in the LOWESS fit.
+     * Number of threads to use in the LOWESS fit, as well as the filtering, sorting and back-transformation steps around it.
      * The parallelization scheme is defined by `WeightedLowess::parallelize()`.
+     * The results are the same regardless of the number of threads.
      */
     int num_threads = 1;
 };
@@ -106,9 +109,7 @@ struct FitVarianceTrendWorkspace {
     /**
      * @cond
      */
-    WeightedLowess::SortBy sorter;
-
-    std::vector<unsigned char> sort_workspace;
+    std::vector<std::size_t> kept, sort_buffer, chunk_counts;
 
     std::vector<Float_> xbuffer, ybuffer;
     /**
@@ -116,6 +117,230 @@ struct FitVarianceTrendWorkspace {
      */
 };
 
+/**
+ * @cond
+ */
+namespace internal {
+
+template<typename Float_>
+bool keep_for_trend(const Float_ mean, const FitVarianceTrendOptions& options) {
+    return !options.mean_filter || mean >= static_cast<Float_>(options.minimum_mean);
+}
+
+/*
+ * All parallel steps operate on the same contiguous chunks, so the results
+ * are independent of the number of threads. Chunk boundaries are computed
+ * with 'chunk_boundary()' to ensure consistency between steps.
+ */
+inline std::size_t num_chunks(const std::size_t n, const int num_threads) {
+    return std::max<std::size_t>(1, std::min<std::size_t>(n, std::max(num_threads, 1)));
+}
+
+inline std::size_t chunk_boundary(const std::size_t n, const std::size_t nchunks, const std::size_t i) {
+    // Avoiding overflow from n * i for large n.
+    return (n / nchunks) * i + ((n % nchunks) * i) / nchunks;
+}
+
+template<class Function_>
+void parallelize_chunks(const std::size_t n, const int num_threads, const Function_ fun) {
+    const auto nchunks = num_chunks(n, num_threads);
+    WeightedLowess::parallelize(num_threads, nchunks, [&](const int, const std::size_t start, const std::size_t length) -> void {
+        for (std::size_t i = start, end = start + length; i < end; ++i) {
+            fun(i, chunk_boundary(n, nchunks, i), chunk_boundary(n, nchunks, i + 1));
+        }
+    });
+}
+
+// Upper bound on the size of the workspace after fitting a trend to 'n' features, i.e., if all features are kept.
+template<typename Float_>
+std::size_t fit_variance_trend_workspace_bytes(const std::size_t n, const int num_threads) {
+    typedef FitVarianceTrendWorkspace<Float_> Workspace;
+    const auto nchunks = num_chunks(n, num_threads);
+    const std::size_t nindices = n /* kept */ + (nchunks > 1 ? n : 0) /* sort_buffer */ + (nchunks + 1) /* chunk_counts */;
+    return nindices * sizeof(typename decltype(Workspace::kept)::value_type) + 2 * n * sizeof(typename decltype(Workspace::xbuffer)::value_type);
+}
+
+// Reserving the exact size before resizing, so that a workspace that is
+// re-used for a larger fit does not over-allocate by the growth factor.
+template<class Vector_>
+void resize_exact(Vector_& vec, const std::size_t n) {
+    vec.reserve(n);
+    sanisizer::resize(vec, n);
+}
+
+template<typename Float_>
+void sort_kept_features(const Float_* const mean, FitVarianceTrendWorkspace<Float_>& workspace, const int num_threads) {
+    auto& kept = workspace.kept;
+    const auto n = kept.size();
+
+    // Ties are broken by the original index to define a total order,
+    // so that the sorted order is the same regardless of how the sort is parallelized.
+    const auto cmp = [&](const std::size_t left, const std::size_t right) -> bool {
+        const auto lmean = mean[left], rmean = mean[right];
+        return lmean < rmean || (lmean == rmean && left < right);
+    };
+
+    const auto nchunks = num_chunks(n, num_threads);
+    parallelize_chunks(n, num_threads, [&](const std::size_t, const std::size_t start, const std::size_t end) -> void {
+        std::sort(kept.begin() + start, kept.begin() + end, cmp);
+    });
+    if (nchunks == 1) {
+        return;
+    }
+
+    // Merging pairs of adjacent sorted runs, doubling the number of chunks in each run per round.
+    auto& buffer = workspace.sort_buffer;
+    resize_exact(buffer, n);
+    std::size_t* source = kept.data();
+    std::size_t* destination = buffer.data();
+
+    for (std::size_t width = 1; width < nchunks; width *= 2) {
+        const std::size_t npairs = (nchunks + 2 * width - 1) / (2 * width);
+        WeightedLowess::parallelize(num_threads, npairs, [&](const int, const std::size_t pstart, const std::size_t plength) -> void {
+            for (std::size_t p = pstart, pend = pstart + plength; p < pend; ++p) {
+                const auto first = p * 2 * width;
+                const auto middle = std::min(first + width, nchunks);
+                const auto last = std::min(first + 2 * width, nchunks);
+                const auto bfirst = chunk_boundary(n, nchunks, first);
+                const auto bmiddle = chunk_boundary(n, nchunks, middle);
+                const auto blast = chunk_boundary(n, nchunks, last);
+                std::merge(source + bfirst, source + bmiddle, source + bmiddle, source + blast, destination + bfirst, cmp);
+            }
+        });
+        std::swap(source, destination);
+    }
+
+    if (source != kept.data()) {
+        std::copy_n(source, n, kept.data());
+    }
+}
+
+template<typename Float_>
+std::size_t prepare_variance_trend(
+    const std::size_t n,
+    const Float_* const mean,
+    const Float_* const variance,
+    FitVarianceTrendWorkspace<Float_>& workspace,
+    const FitVarianceTrendOptions& options,
+    const int num_threads
+) {
+    // Compacting the indices of the retained features via a prefix sum of the per-chunk counts.
+    auto& chunk_counts = workspace.chunk_counts;
+    const auto nchunks = num_chunks(n, num_threads);
+    chunk_counts.clear();
+    chunk_counts.resize(nchunks + 1);
+
+    parallelize_chunks(n, num_threads, [&](const std::size_t i, const std::size_t start, const std::size_t end) -> void {
+        std::size_t count = 0;
+        for (auto j = start; j < end; ++j) {
+            count += keep_for_trend(mean[j], options);
+        }
+        chunk_counts[i + 1] = count;
+    });
+
+    for (I<decltype(nchunks)> i = 0; i < nchunks; ++i) {
+        chunk_counts[i + 1] += chunk_counts[i];
+    }
+    const auto counter = chunk_counts[nchunks];
+    if (counter < 2) {
+        throw std::runtime_error("not enough observations above the minimum mean");
+    }
+
+    auto& kept = workspace.kept;
+    resize_exact(kept, counter);
+    parallelize_chunks(n, num_threads, [&](const std::size_t i, const std::size_t start, const std::size_t end) -> void {
+        auto position = chunk_counts[i];
+        for (auto j = start; j < end; ++j) {
+            if (keep_for_trend(mean[j], options)) {
+                kept[position] = j;
+                ++position;
+            }
+        }
+    });
+
+    sort_kept_features(mean, workspace, num_threads);
+
+    auto& xbuffer = workspace.xbuffer;
+    resize_exact(xbuffer, counter);
+    auto& ybuffer = workspace.ybuffer;
+    resize_exact(ybuffer, counter);
+
+    parallelize_chunks(counter, num_threads, [&](const std::size_t, const std::size_t start, const std::size_t end) -> void {
+        for (auto k = start; k < end; ++k) {
+            const auto j = kept[k];
+            xbuffer[k] = mean[j];
+            if (options.transform) {
+                ybuffer[k] = std::pow(variance[j], 0.25); // Using the same quarter-root transform that limma::voom uses.
+            } else {
+                ybuffer[k] = variance[j];
+            }
+        }
+    });
+
+    return counter;
+}
+
+template<typename Float_>
+void fit_prepared_variance_trend(
+    const std::size_t n,
+    const Float_* const mean,
+    const Float_* const variance,
+    const std::size_t counter,
+    const FitVarianceTrendWorkspace<Float_>& workspace,
+    Float_* const fitted,
+    Float_* const residuals,
+    const FitVarianceTrendOptions& options,
+    const int num_threads
+) {
+    const auto quad = [](Float_ x) -> Float_ {
+        return x * x * x * x;
+    };
+
+    WeightedLowess::Options<Float_> smooth_opt;
+    if (options.use_minimum_width) {
+        smooth_opt.span = options.minimum_window_count;
+        smooth_opt.span_as_proportion = false;
+        smooth_opt.minimum_width = options.minimum_width;
+    } else {
+        smooth_opt.span = options.span;
+    }
+    smooth_opt.num_threads = num_threads;
+
+    // Storing the sorted fitted values in the residual array and using the
+    // fitted array to store the robustness weights as a placeholder; we'll be
+    // overwriting both of these later.
+    const auto& xbuffer = workspace.xbuffer;
+    WeightedLowess::compute(counter, xbuffer.data(), workspace.ybuffer.data(), residuals, fitted, smooth_opt);
+
+    // Determining the left edge before we scatter.
+    const Float_ left_x = xbuffer[0];
+    const Float_ left_fitted = (options.transform ? quad(residuals[0]) : residuals[0]);
+
+    // Scattering the fitted values back to their original positions. This
+    // needs to be done before any residuals are computed, as the residual
+    // array still holds the sorted fitted values at this point.
+    const auto& kept = workspace.kept;
+    parallelize_chunks(counter, num_threads, [&](const std::size_t, const std::size_t start, const std::size_t end) -> void {
+        for (auto k = start; k < end; ++k) {
+            fitted[kept[k]] = (options.transform ? quad(residuals[k]) : residuals[k]);
+        }
+    });
+
+    parallelize_chunks(n, num_threads, [&](const std::size_t, const std::size_t start, const std::size_t end) -> void {
+        for (auto i = start; i < end; ++i) {
+            if (!keep_for_trend(mean[i], options)) {
+                fitted[i] = mean[i] / left_x * left_fitted; // draw a y = x line to the origin from the left of the fitted trend.
+            }
+            residuals[i] = variance[i] - fitted[i];
+        }
+    });
+}
+
+}
+/**
+ * @endcond
+ */
+
 /**
  * Fit a trend to the per-feature variances against the means, both of which are typically computed from log-normalized expression data.
  * This involves several steps:
@@ -155,77 +380,8 @@ void fit_variance_trend(
     FitVarianceTrendWorkspace<Float_>& workspace,
     const FitVarianceTrendOptions& options
 ) {
-    auto& xbuffer = workspace.xbuffer;
-    sanisizer::resize(xbuffer, n);
-    auto& ybuffer = workspace.ybuffer;
-    sanisizer::resize(ybuffer, n);
-
-    const auto quad = [](Float_ x) -> Float_ {
-        return x * x * x * x;
-    };
-
-    std::size_t counter = 0;
-    const Float_ min_mean = options.minimum_mean;
-    for (I<decltype(n)> i = 0; i < n; ++i) {
-        if (!options.mean_filter || mean[i] >= min_mean) {
-            xbuffer[counter] = mean[i];
-            if (options.transform) {
-                ybuffer[counter] = std::pow(variance[i], 0.25); // Using the same quarter-root transform that limma::voom uses.
-            } else {
-                ybuffer[counter] = variance[i];
-            }
-            ++counter;
-        }
-    }
-
-    if (counter < 2) {
-        throw std::runtime_error("not enough observations above the minimum mean");
-    }
-
-    auto& sorter = workspace.sorter;
-    sorter.set(counter, xbuffer.data());
-    auto& work = workspace.sort_workspace;
-    sorter.permute(std::array<Float_*, 2>{ xbuffer.data(), ybuffer.data() }, work);
-
-    WeightedLowess::Options<Float_> smooth_opt;
-    if (options.use_minimum_width) {
-        smooth_opt.span = options.minimum_window_count;
-        smooth_opt.span_as_proportion = false;
-        smooth_opt.minimum_width = options.minimum_width;
-    } else {
-        smooth_opt.span = options.span;
-    }
-    smooth_opt.num_threads = options.num_threads;
-
-    // Using the residual array to store the robustness weights as a placeholder;
-    // we'll be overwriting this later.
-    WeightedLowess::compute(counter, xbuffer.data(), ybuffer.data(), fitted, residuals, smooth_opt);
-
-    // Determining the left edge before we unpermute.
-    const Float_ left_x = xbuffer[0];
-    const Float_ left_fitted = (options.transform ? quad(fitted[0]) : fitted[0]);
-
-    sorter.unpermute(fitted, work);
-
-    // Walking backwards to shift the elements back to their original position
-    // (i.e., before filtering on the mean) on the same array. We need to walk
-    // backwards to ensure that writing to the original position on this array
-    // doesn't clobber the first 'counter' positions containing the fitted
-    // values, at least not until each value is shifted to its original place.
-    for (auto i = n; i > 0; --i) {
-        auto j = i - 1;
-        if (!options.mean_filter || mean[j] >= min_mean) {
-            --counter;
-            fitted[j] = (options.transform ? quad(fitted[counter]) : fitted[counter]);
-        } else {
-            fitted[j] = mean[j] / left_x * left_fitted; // draw a y = x line to the origin from the left of the fitted trend.
-        }
-    }
-
-    for (I<decltype(n)> i = 0; i < n; ++i) {
-        residuals[i] = variance[i] - fitted[i];
-    }
-    return;
+    const auto counter = internal::prepare_variance_trend(n, mean, variance, workspace, options, options.num_threads);
+    internal::fit_prepared_variance_trend(n, mean, variance, counter, workspace, fitted, residuals, options, options.num_threads);
 }
 
 /**
@@ -290,6 +446,106 @@ FitVarianceTrendResults<Float_> fit_variance_trend(const std::size_t n, const Fl
     return output;
 }
 
+/**
+ * Fit mean-variance trends for multiple settings of the LOWESS smoother, e.g., when tuning the span or minimum width.
+ * This is equivalent to calling `fit_variance_trend()` separately for each entry of `settings`,
+ * but the filtering, transformation and sorting of the inputs are only performed once and re-used for all settings.
+ * The trend for each setting is then fitted in parallel.
+ *
+ * All entries of `settings` should have the same `FitVarianceTrendOptions::mean_filter`, `FitVarianceTrendOptions::minimum_mean` and `FitVarianceTrendOptions::transform`,
+ * as these determine the prepared inputs; otherwise, an error is thrown.
+ * The other options, i.e., those for the LOWESS smoother, may vary across settings.
+ * `FitVarianceTrendOptions::num_threads` is ignored in each setting as parallelization is instead performed across settings.
+ *
+ * @tparam Float_ Floating-point type of the statistics.
+ *
+ * @param n Number of features.
+ * @param[in] mean Pointer to an array of length `n`, containing the means for all features.
+ * @param[in] variance Pointer to an array of length `n`, containing the variances for all features.
+ * @param settings Vector of options for each trend fit.
+ * @param[out] fitted Vector of length equal to `settings.size()`.
+ * Each entry is a pointer to an array of length `n`, to store the fitted values for the corresponding setting.
+ * @param[out] residuals Vector of length equal to `settings.size()`.
+ * Each entry is a pointer to an array of length `n`, to store the residuals for the corresponding setting.
+ * @param workspace Collection of temporary data structures.
+ * This can be re-used across multiple `fit_variance_trend()` or `fit_variance_trend_sweep()` calls.
+ * @param num_threads Number of threads to use, parallelized across settings.
+ * The parallelization scheme is defined by `WeightedLowess::parallelize()`.
+ */
+template<typename Float_>
+void fit_variance_trend_sweep(
+    const std::size_t n,
+    const Float_* const mean,
+    const Float_* const variance,
+    const std::vector<FitVarianceTrendOptions>& settings,
+    const std::vector<Float_*>& fitted,
+    const std::vector<Float_*>& residuals,
+    FitVarianceTrendWorkspace<Float_>& workspace,
+    const int num_threads
+) {
+    const auto nsettings = settings.size();
+    if (nsettings != fitted.size() || nsettings != residuals.size()) {
+        throw std::runtime_error("'fitted' and 'residuals' should have the same length as 'settings'");
+    }
+    if (nsettings == 0) {
+        return;
+    }
+
+    const auto& first = settings.front();
+    for (const auto& current : settings) {
+        if (current.mean_filter != first.mean_filter || current.transform != first.transform || (first.mean_filter && current.minimum_mean != first.minimum_mean)) {
+            throw std::runtime_error("all settings should have the same filtering and transformation options");
+        }
+    }
+
+    const auto counter = internal::prepare_variance_trend(n, mean, variance, workspace, first, num_threads);
+
+    WeightedLowess::parallelize(num_threads, nsettings, [&](const int, const I<decltype(nsettings)> start, const I<decltype(nsettings)> length) -> void {
+        for (I<decltype(start)> s = start, end = start + length; s < end; ++s) {
+            internal::fit_prepared_variance_trend(n, mean, variance, counter, workspace, fitted[s], residuals[s], settings[s], 1);
+        }
+    });
+}
+
+/**
+ * Overload of `fit_variance_trend_sweep()` that allocates the output vectors.
+ *
+ * @tparam Float_ Floating-point type of the statistics.
+ *
+ * @param n Number of features.
+ * @param[in] mean Pointer to an array of length `n`, containing the means for all features.
+ * @param[in] variance Pointer to an array of length `n`, containing the variances for all features.
+ * @param settings Vector of options for each trend fit, see `fit_variance_trend_sweep()` for details.
+ * @param num_threads Number of threads to use, parallelized across settings.
+ *
+ * @return Vector of length equal to `settings.size()`, containing the result of the trend fit for each setting.
+ */
+template<typename Float_>
+std::vector<FitVarianceTrendResults<Float_> > fit_variance_trend_sweep(
+    const std::size_t n,
+    const Float_* const mean,
+    const Float_* const variance,
+    const std::vector<FitVarianceTrendOptions>& settings,
+    const int num_threads
+) {
+    const auto nsettings = settings.size();
+    std::vector<FitVarianceTrendResults<Float_> > output;
+    output.reserve(nsettings);
+    std::vector<Float_*> fitted, residuals;
+    fitted.reserve(nsettings);
+    residuals.reserve(nsettings);
+
+    for (I<decltype(nsettings)> s = 0; s < nsettings; ++s) {
+        output.emplace_back(n);
+        fitted.push_back(output.back().fitted.data());
+        residuals.push_back(output.back().residuals.data());
+    }
+
+    FitVarianceTrendWorkspace<Float_> work;
+    fit_variance_trend_sweep(n, mean, variance, settings, fitted, residuals, work, num_threads);
+    return output;
+}
+
 }
 
 #endif
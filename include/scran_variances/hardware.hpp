@@ -0,0 +1,61 @@
+#ifndef SCRAN_VARIANCES_HARDWARE_HPP
+#define SCRAN_VARIANCES_HARDWARE_HPP
+
+#include <cstddef>
+#include <thread>
+
+#if defined(__linux__)
+#include <unistd.h>
+#endif
+
+/**
+ * @cond
+ */
+namespace scran_variances {
+
+namespace internal {
+
+/*
+ * Properties of the host that are used to tune the parallelization. These are
+ * only detected once and are assumed to be constant for the lifetime of the
+ * process. If a property cannot be detected, we fall back to conservative
+ * values that are typical of current desktop and server CPUs.
+ */
+struct HardwareInfo {
+    int num_cores = 1;
+    std::size_t l1_cache_size = 32 * 1024;
+    std::size_t l2_cache_size = 256 * 1024;
+};
+
+inline HardwareInfo detect_hardware() {
+    static const HardwareInfo info = []{
+        HardwareInfo output;
+        const auto cores = std::thread::hardware_concurrency();
+        if (cores > 0) {
+            output.num_cores = cores;
+        }
+
+#if defined(__linux__) && defined(_SC_LEVEL1_DCACHE_SIZE) && defined(_SC_LEVEL2_CACHE_SIZE)
+        const auto l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+        if (l1 > 0) {
+            output.l1_cache_size = l1;
+        }
+        const auto l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+        if (l2 > 0) {
+            output.l2_cache_size = l2;
+        }
+#endif
+
+        return output;
+    }();
+    return info;
+}
+
+}
+
+}
+/**
+ * @endcond
+ */
+
+#endif
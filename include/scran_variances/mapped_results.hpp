@@ -0,0 +1,371 @@
+#ifndef SCRAN_VARIANCES_MAPPED_RESULTS_HPP
+#define SCRAN_VARIANCES_MAPPED_RESULTS_HPP
+
+#include <string>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sanisizer/sanisizer.hpp"
+
+#include "model_gene_variances.hpp"
+#include "utils.hpp"
+
+/**
+ * @file mapped_results.hpp
+ * @brief File-backed results for `model_gene_variances_blocked()`.
+ *
+ * This header requires POSIX memory mapping and is not included by `scran_variances.hpp`.
+ */
+
+namespace scran_variances {
+
+/**
+ * @brief File-backed results of `model_gene_variances_blocked()`.
+ *
+ * @tparam Stat_ Floating-point type of the output statistics.
+ *
+ * This stores the same statistics as `ModelGeneVariancesBlockedResults` but in a memory-mapped file,
+ * so that large results do not need to be resident in memory.
+ * The pointers from `ModelGeneVariancesMappedResults::buffers()` can be passed to `model_gene_variances_blocked()` to write the statistics directly into the file.
+ * The file can be re-opened later with `ModelGeneVariancesMappedResults::open()` to access the statistics without any copying.
+ *
+ * The file layout consists of a 64-byte header, containing (in order):
+ *
+ * - The 8-byte magic string `SCRANVAR`.
+ * - A 4-byte unsigned integer containing the format version, currently 1.
+ * - A 4-byte unsigned integer containing `sizeof(Stat_)`.
+ * - An 8-byte unsigned integer containing the number of genes \f$G\f$.
+ * - An 8-byte unsigned integer containing the number of blocks \f$B\f$.
+ * - A 1-byte flag indicating whether the fitted values and residuals are present.
+ * - A 1-byte flag indicating whether the averages across blocks are present.
+ * - Padding with zeros up to 64 bytes.
+ *
+ * All integers are stored in the native byte order.
+ * This is followed by the per-block statistics for each block in order, and then the averaged statistics if present.
+ * Each set of statistics consists of the arrays of means, variances, fitted values (if present) and residuals (if present),
+ * where each array contains \f$G\f$ contiguous values of type `Stat_`.
+ */
+template<typename Stat_>
+class ModelGeneVariancesMappedResults {
+public:
+    /**
+     * Create a new file for storing results, overwriting any existing file at the same path.
+     * The statistics are initialized to zero.
+     *
+     * @param path Path to the file.
+     * @param ngenes Number of genes.
+     * @param nblocks Number of blocks.
+     * @param do_average Whether to store the averages across blocks.
+     * @param do_trend Whether to store the fitted values and residuals.
+     *
+     * @return File-backed results that can be written to via `buffers()`.
+     */
+    static ModelGeneVariancesMappedResults create(const std::string& path, const std::size_t ngenes, const std::size_t nblocks, const bool do_average, const bool do_trend) {
+        ModelGeneVariancesMappedResults output;
+        output.my_num_genes = ngenes;
+        output.my_num_blocks = nblocks;
+        output.my_average = do_average;
+        output.my_trend = do_trend;
+        output.my_size = output.expected_size();
+
+        output.my_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (output.my_fd < 0) {
+            fail("failed to create '" + path + "'");
+        }
+        if (::ftruncate(output.my_fd, output.my_size) != 0) {
+            fail("failed to resize '" + path + "'");
+        }
+        output.map(true, path);
+
+        unsigned char* header = static_cast<unsigned char*>(output.my_data);
+        std::memcpy(header, magic, 8);
+        const std::uint32_t version = 1, stat_size = sizeof(Stat_);
+        std::memcpy(header + 8, &version, 4);
+        std::memcpy(header + 12, &stat_size, 4);
+        const std::uint64_t ng = ngenes, nb = nblocks;
+        std::memcpy(header + 16, &ng, 8);
+        std::memcpy(header + 24, &nb, 8);
+        header[32] = do_trend;
+        header[33] = do_average;
+        return output;
+    }
+
+    /**
+     * Open an existing file containing results.
+     *
+     * @param path Path to the file, typically created by `create()`.
+     * @param writable Whether the file should be opened for writing.
+     * If `false`, the statistics must not be modified through the pointers returned by this object.
+     *
+     * @return File-backed results.
+     */
+    static ModelGeneVariancesMappedResults open(const std::string& path, const bool writable = false) {
+        ModelGeneVariancesMappedResults output;
+        output.my_fd = ::open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+        if (output.my_fd < 0) {
+            fail("failed to open '" + path + "'");
+        }
+
+        struct stat info;
+        if (::fstat(output.my_fd, &info) != 0) {
+            fail("failed to inspect '" + path + "'");
+        }
+        if (info.st_size < static_cast<off_t>(header_size)) {
+            throw std::runtime_error("file at '" + path + "' is too small to contain results");
+        }
+        output.my_size = info.st_size;
+        output.map(writable, path);
+
+        const unsigned char* header = static_cast<const unsigned char*>(output.my_data);
+        if (std::memcmp(header, magic, 8) != 0) {
+            throw std::runtime_error("file at '" + path + "' does not contain results");
+        }
+        std::uint32_t version, stat_size;
+        std::memcpy(&version, header + 8, 4);
+        std::memcpy(&stat_size, header + 12, 4);
+        if (version != 1) {
+            throw std::runtime_error("unsupported format version for results in '" + path + "'");
+        }
+        if (stat_size != sizeof(Stat_)) {
+            throw std::runtime_error("mismatching size of the statistic type for results in '" + path + "'");
+        }
+
+        std::uint64_t ng, nb;
+        std::memcpy(&ng, header + 16, 8);
+        std::memcpy(&nb, header + 24, 8);
+        output.my_num_genes = sanisizer::cast<std::size_t>(ng);
+        output.my_num_blocks = sanisizer::cast<std::size_t>(nb);
+        output.my_trend = header[32];
+        output.my_average = header[33];
+        if (output.my_size != output.expected_size()) {
+            throw std::runtime_error("unexpected file size for results in '" + path + "'");
+        }
+        return output;
+    }
+
+    /**
+     * @cond
+     */
+    ModelGeneVariancesMappedResults(const ModelGeneVariancesMappedResults&) = delete;
+    ModelGeneVariancesMappedResults& operator=(const ModelGeneVariancesMappedResults&) = delete;
+
+    ModelGeneVariancesMappedResults(ModelGeneVariancesMappedResults&& other) noexcept {
+        steal(other);
+    }
+
+    ModelGeneVariancesMappedResults& operator=(ModelGeneVariancesMappedResults&& other) noexcept {
+        if (this != &other) {
+            release();
+            steal(other);
+        }
+        return *this;
+    }
+
+    ~ModelGeneVariancesMappedResults() {
+        release();
+    }
+    /**
+     * @endcond
+     */
+
+private:
+    ModelGeneVariancesMappedResults() = default;
+
+    static constexpr std::size_t header_size = 64;
+    static constexpr const char* magic = "SCRANVAR";
+
+    int my_fd = -1;
+    void* my_data = NULL;
+    std::size_t my_size = 0;
+
+    std::size_t my_num_genes = 0;
+    std::size_t my_num_blocks = 0;
+    bool my_average = false;
+    bool my_trend = false;
+
+    [[noreturn]] static void fail(const std::string& msg) {
+        throw std::runtime_error(msg + " (" + std::strerror(errno) + ")");
+    }
+
+    std::size_t arrays_per_set() const {
+        return my_trend ? 4 : 2;
+    }
+
+    std::size_t expected_size() const {
+        const auto nsets = sanisizer::sum<std::size_t>(my_num_blocks, my_average);
+        const auto narrays = sanisizer::product<std::size_t>(nsets, arrays_per_set());
+        const auto nvalues = sanisizer::product<std::size_t>(narrays, my_num_genes);
+        return sanisizer::sum<std::size_t>(header_size, sanisizer::product<std::size_t>(nvalues, sizeof(Stat_)));
+    }
+
+    void map(const bool writable, const std::string& path) {
+        my_data = ::mmap(NULL, my_size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, my_fd, 0);
+        if (my_data == MAP_FAILED) {
+            my_data = NULL;
+            fail("failed to map '" + path + "'");
+        }
+    }
+
+    void release() {
+        if (my_data) {
+            ::munmap(my_data, my_size);
+            my_data = NULL;
+        }
+        if (my_fd >= 0) {
+            ::close(my_fd);
+            my_fd = -1;
+        }
+    }
+
+    void steal(ModelGeneVariancesMappedResults& other) {
+        my_fd = other.my_fd;
+        my_data = other.my_data;
+        my_size = other.my_size;
+        my_num_genes = other.my_num_genes;
+        my_num_blocks = other.my_num_blocks;
+        my_average = other.my_average;
+        my_trend = other.my_trend;
+        other.my_fd = -1;
+        other.my_data = NULL;
+    }
+
+    ModelGeneVariancesBuffers<Stat_> get_set(const std::size_t i) const {
+        // Header size is a multiple of the alignment of any reasonable floating-point type, and mmap'd memory is page-aligned.
+        Stat_* start = reinterpret_cast<Stat_*>(static_cast<unsigned char*>(my_data) + header_size) + i * arrays_per_set() * my_num_genes;
+        ModelGeneVariancesBuffers<Stat_> output;
+        output.means = start;
+        output.variances = start + my_num_genes;
+        if (my_trend) {
+            output.fitted = start + 2 * my_num_genes;
+            output.residuals = start + 3 * my_num_genes;
+        } else {
+            output.fitted = NULL;
+            output.residuals = NULL;
+        }
+        return output;
+    }
+
+public:
+    /**
+     * @return Number of genes.
+     */
+    std::size_t num_genes() const {
+        return my_num_genes;
+    }
+
+    /**
+     * @return Number of blocks.
+     */
+    std::size_t num_blocks() const {
+        return my_num_blocks;
+    }
+
+    /**
+     * @return Whether the fitted values and residuals are stored.
+     */
+    bool has_trend() const {
+        return my_trend;
+    }
+
+    /**
+     * @return Whether the averages across blocks are stored.
+     */
+    bool has_average() const {
+        return my_average;
+    }
+
+    /**
+     * @param b Index of the block.
+     * @return Pointers to the statistics for block `b`.
+     * `fitted` and `residuals` are `NULL` if `has_trend()` is false.
+     */
+    ModelGeneVariancesBuffers<Stat_> per_block(const std::size_t b) const {
+        return get_set(b);
+    }
+
+    /**
+     * @return Pointers to the averaged statistics.
+     * All pointers are `NULL` if `has_average()` is false,
+     * while `fitted` and `residuals` are `NULL` if `has_trend()` is false.
+     */
+    ModelGeneVariancesBuffers<Stat_> average() const {
+        if (my_average) {
+            return get_set(my_num_blocks);
+        }
+        ModelGeneVariancesBuffers<Stat_> output;
+        output.means = NULL;
+        output.variances = NULL;
+        output.fitted = NULL;
+        output.residuals = NULL;
+        return output;
+    }
+
+    /**
+     * @return Buffers pointing into the file, for use in `model_gene_variances_blocked()`.
+     * This should only be used if the file was created by `create()` or opened with `writable = true`.
+     */
+    ModelGeneVariancesBlockedBuffers<Stat_> buffers() const {
+        ModelGeneVariancesBlockedBuffers<Stat_> output;
+        output.per_block.reserve(my_num_blocks);
+        for (I<decltype(my_num_blocks)> b = 0; b < my_num_blocks; ++b) {
+            output.per_block.push_back(get_set(b));
+        }
+        output.average = average();
+        return output;
+    }
+
+    /**
+     * Flush any modifications to the file.
+     * This is not strictly necessary as modifications are also flushed when this object is destroyed,
+     * but may be useful to guarantee that the file contents are complete before they are read by another process.
+     */
+    void sync() const {
+        if (my_data && ::msync(my_data, my_size, MS_SYNC) != 0) {
+            fail("failed to synchronize the results file");
+        }
+    }
+};
+
+/**
+ * Overload of `model_gene_variances_blocked()` that stores the output statistics in a memory-mapped file.
+ *
+ * @tparam Stat_ Floating-point type of the output statistics.
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam Block_ Integer type of the block IDs.
+ *
+ * @param mat Matrix of expression values, typically after normalization and log-transformation.
+ * Rows should be genes while columns should be cells.
+ * @param[in] block Pointer to an array of length equal to the number of cells, containing 0-based block identifiers.
+ * This may also be a `nullptr` in which case all cells are assumed to belong to the same block.
+ * @param path Path to the file in which to store the results, see `ModelGeneVariancesMappedResults::create()`.
+ * @param options Further options.
+ *
+ * @return Results of the variance modelling in each block, stored in the file at `path`.
+ * An average for each statistic is also computed if `ModelGeneVariancesOptions::average_policy` is not `BlockAveragePolicy::NONE`.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Block_>
+ModelGeneVariancesMappedResults<Stat_> model_gene_variances_blocked_mapped(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const Block_* const block,
+    const std::string& path,
+    const ModelGeneVariancesOptions& options
+) {
+    const auto nblocks = (block ? tatami_stats::total_groups(block, mat.ncol()) : 1);
+    const bool do_average = internal::use_average(options);
+    auto output = ModelGeneVariancesMappedResults<Stat_>::create(path, mat.nrow(), nblocks, do_average, options.trend);
+    model_gene_variances_blocked(mat, block, output.buffers(), options);
+    return output;
+}
+
+}
+
+#endif
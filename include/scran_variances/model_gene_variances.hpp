@@ -5,6 +5,13 @@
 #include <vector>
 #include <limits>
 #include <cstddef>
+#include <cmath>
+#include <numeric>
+#include <array>
+#include <memory>
+#include <memory_resource>
+#include <functional>
+#include <mutex>
 
 #include "tatami/tatami.hpp"
 #include "tatami_stats/tatami_stats.hpp"
@@ -12,6 +19,11 @@
 #include "sanisizer/sanisizer.hpp"
 
 #include "fit_variance_trend.hpp"
+#include "prefetch.hpp"
+#include "simd.hpp"
+#include "weighted_variances.hpp"
+#include "hardware.hpp"
+#include "allocation_tracker.hpp"
 #include "utils.hpp"
 
 /**
@@ -30,6 +42,17 @@ namespace scran_variances {
  */
 enum class BlockAveragePolicy : unsigned char { MEAN, QUANTILE, NONE };
 
+/**
+ * Access pattern for computing the per-gene statistics.
+ *
+ * - `AUTO`: choose the access pattern with the lowest estimated cost, see `plan_model_gene_variances()`.
+ * - `DENSE_ROW`: extract dense rows, computing the statistics for each gene from its row.
+ * - `SPARSE_ROW`: extract sparse rows, computing the statistics for each gene from the non-zero values in its row.
+ * - `DENSE_COLUMN`: extract dense columns, updating running statistics for all genes with each cell.
+ * - `SPARSE_COLUMN`: extract sparse columns, updating running statistics for the genes with non-zero values in each cell.
+ */
+enum class ComputePath : unsigned char { AUTO, DENSE_ROW, SPARSE_ROW, DENSE_COLUMN, SPARSE_COLUMN };
+
 /**
  * @brief Options for `model_gene_variances()` and friends.
  */
@@ -92,8 +115,193 @@ struct ModelGeneVariancesOptions {
     /**
      * Number of threads to use for the variance calculations and trend fitting. 
      * The parallelization scheme is defined by `tatami::parallelize()`. 
+     *
+     * By default, the genes are split across threads.
+     * If there are too few genes to give each thread a worthwhile share, e.g., for small panels of antibody-derived tags,
+     * the cells are split across threads instead, and the per-thread statistics are combined afterwards.
+     * This choice is made automatically from the dimensions and preferred access pattern of the matrix.
+     */
+    int num_threads = 1;
+
+    /**
+     * Whether to automatically choose the number of threads and the work granularity.
+     * If true, `ModelGeneVariancesOptions::num_threads` is ignored and the number of threads is chosen from the estimated cost of the variance calculations,
+     * such that each thread has enough work to offset the overhead of its creation, up to the number of cores on the host.
+     * The number of threads for trend fitting is similarly chosen from the number of genes.
+     *
+     * If `ModelGeneVariancesOptions::column_batch_size` or `ModelGeneVariancesOptions::sparse_column_tile_cache_size` is zero, 
+     * it is also set from the cache sizes of the host when the relevant access pattern is used.
+     * Non-zero values are respected.
+     *
+     * The decisions can be inspected with `plan_model_gene_variances()`.
+     */
+    bool auto_tune = false;
+
+    /**
+     * Size of the prefetch buffer for each thread, in bytes.
+     * If positive, each worker thread uses a separate reader thread to extract the next chunk of rows/columns of the matrix while the current chunk is being processed.
+     * This aims to hide the latency of expensive extraction, e.g., from file-backed matrices, behind the variance calculations.
+     *
+     * The buffer is split into two halves, one of which is being filled by the reader while the other is being processed.
+     * Each half holds as many rows/columns as will fit, with a minimum of one row/column.
+     * For sparse matrices, space is allocated for both the values and indices of each row/column assuming that it is fully dense.
+     *
+     * If zero, extraction is performed in the same thread as the calculations.
+     */
+    std::size_t prefetch_buffer_size = 0;
+
+    /**
+     * Number of columns to process in each batch for dense matrices that prefer column access.
+     * If greater than 1, each thread extracts a batch of columns and then iterates over tiles of genes,
+     * updating each tile's running statistics for all columns in the batch before moving onto the next tile.
+     * Tiles are sized to fit in the L1 cache, so this improves cache locality when each thread is responsible for many genes.
+     * In the blocked case, each tile is updated for each run of consecutive columns from the same block,
+     * so this is most effective when cells are sorted by block.
+     *
+     * Each thread allocates space for this number of columns, containing the values for the genes assigned to that thread.
+     * If 0 or 1, columns are processed one at a time.
+     */
+    std::size_t column_batch_size = 0;
+
+    /**
+     * Size of the cache available to each thread, in bytes, for tiling the genes in sparse matrices that prefer column access.
+     * If positive, each thread splits its assigned genes into tiles and performs a separate pass over all columns for each tile,
+     * extracting only the rows for the genes in that tile.
+     * This ensures that the running statistics for each tile fit in the cache, reducing cache misses when each thread is responsible for many genes.
+     * A good choice is the size of the L2 cache for each core.
+     *
+     * The tile size is chosen automatically from the cache size, the number of blocks and the density of the matrix.
+     * The density is taken from the plan (see `ModelGeneVariancesPlan::density`) or, if not available there, estimated from a sample of columns; it is used to ensure that each column contributes enough non-zero values to each tile,
+     * as the overhead of the extra extraction passes would otherwise outweigh the benefits.
+     * If 0, no tiling is performed and each thread processes all of its genes in a single pass.
+     */
+    std::size_t sparse_column_tile_cache_size = 0;
+
+    /**
+     * Access pattern to use for computing the per-gene statistics.
+     * By default, this is chosen from the estimated cost of each access pattern, see `plan_model_gene_variances()` for details.
+     * Setting this to any other value forces the use of the specified access pattern,
+     * e.g., if the matrix is known to be much cheaper to access in a certain way than is suggested by its hints.
+     */
+    ComputePath compute_path = ComputePath::AUTO;
+
+    /**
+     * Whether to compute extra statistics for each gene in each block, i.e., the number of cells with non-zero values, the sum, and the minimum and maximum.
+     * These are computed in the same pass over the matrix as the means and variances, avoiding the need for a separate pass.
+     * Only relevant to overloads of `model_gene_variances()` and friends that allocate their own output;
+     * for overloads that accept buffers, the extra statistics are computed if the corresponding pointers are not `NULL`.
+     * Ignored by `model_gene_variances_blocked_cached()`, `update_model_gene_variances_blocked()` and `downdate_model_gene_variances_blocked()`.
+     */
+    bool extra_statistics = false;
+
+    /**
+     * Tracker for the memory allocations during variance modelling, see `AllocationTracker` for details.
+     * If `NULL`, allocations are not tracked.
+     * Otherwise, the tracker should not be destroyed until the calculation is complete.
+     */
+    AllocationTracker* allocation_tracker = NULL;
+
+    /**
+     * Memory resource for the temporary buffers used while computing the per-gene statistics (e.g., the extraction buffers and running statistics for each thread).
+     * If `NULL`, the default resource from `std::pmr::get_default_resource()` is used.
+     *
+     * Callers that model the variances for many subsets can supply a pool (e.g., `std::pmr::synchronized_pool_resource`) that persists across calls,
+     * such that repeated calls of similar size do not need to request any new memory from the system once the pool is populated.
+     * If `ModelGeneVariancesOptions::num_threads` is greater than 1, the resource must be thread-safe as it will be used by all workers;
+     * `std::pmr::synchronized_pool_resource` already maintains separate pools for each thread to reduce contention.
+     * The resource should not be destroyed until the calculation is complete.
+     *
+     * This does not affect the output statistics, the workspace for trend fitting, or any memory allocated by the matrix's extractors.
+     */
+    std::pmr::memory_resource* memory_resource = NULL;
+
+    /**
+     * Function to be called once the per-block statistics have been computed for a chunk of consecutive genes.
+     * The first argument is the index of the first gene in the chunk and the second argument is the number of genes in the chunk.
+     * At the time of the call, the means and variances (and any extra statistics) for all genes in the chunk have been stored in the output buffers for each block,
+     * and will not be modified by the rest of the calculation.
+     * This allows callers to process the statistics for each chunk (e.g., writing them to disk or filtering genes) while the remaining genes are being processed.
+     * The fitted values and residuals of the trend are not available, as these require the statistics for all genes.
+     *
+     * Every gene is reported in exactly one chunk.
+     * Calls are serialized such that the callback is never invoked concurrently, even if `ModelGeneVariancesOptions::num_threads` is greater than 1;
+     * however, chunks are reported in the order in which they are completed by the worker threads, which may not be the order of the genes.
+     * For the `ComputePath::DENSE_ROW` and `ComputePath::SPARSE_ROW` access patterns, chunks are reported as soon as they are completed by each thread.
+     * For the other access patterns, or if the cells are split across threads, the statistics are only complete at the end of the calculation,
+     * in which case the callback is invoked once for all genes.
+     *
+     * If empty, no callback is invoked.
+     * Ignored by `model_gene_variances_blocked_cached()`, `update_model_gene_variances_blocked()`, `downdate_model_gene_variances_blocked()`,
+     * `model_pearson_residual_variances_blocked()` and `model_gene_variances_bootstrap_blocked()`.
+     */
+    std::function<void(std::size_t, std::size_t)> gene_chunk_callback;
+
+    /**
+     * Number of genes in each chunk that is reported to `ModelGeneVariancesOptions::gene_chunk_callback`.
+     * Smaller values allow downstream processing to start earlier at the cost of more calls to the callback.
+     * The last chunk for each thread may be smaller.
+     * If 0, each thread reports all of its genes as a single chunk.
+     * Only relevant for the `ComputePath::DENSE_ROW` and `ComputePath::SPARSE_ROW` access patterns.
+     */
+    std::size_t gene_chunk_size = 0;
+};
+
+/**
+ * @brief Plan for computing the per-gene statistics.
+ *
+ * This is returned by `plan_model_gene_variances()` to report how the statistics are computed by `model_gene_variances()` and friends.
+ */
+struct ModelGeneVariancesPlan {
+    /**
+     * Access pattern for computing the statistics.
+     * This is never `ComputePath::AUTO`.
+     */
+    ComputePath path = ComputePath::DENSE_ROW;
+
+    /**
+     * Whether the cells are split across threads, see `ModelGeneVariancesOptions::num_threads`.
+     * If false, the genes are split across threads instead.
+     */
+    bool cell_split = false;
+
+    /**
+     * Estimated cost of each access pattern, in arbitrary units.
+     * Entries correspond to `ComputePath::DENSE_ROW`, `ComputePath::SPARSE_ROW`, `ComputePath::DENSE_COLUMN` and `ComputePath::SPARSE_COLUMN` in that order.
+     * All entries are NaN if the access pattern was forced by `ModelGeneVariancesOptions::compute_path`,
+     * or if the matrix is entirely sparse and uniformly prefers one dimension, i.e., `tatami::Matrix::is_sparse_proportion()` is 1 and `tatami::Matrix::prefer_rows_proportion()` is 0 or 1.
+     * In the latter case, the sparse access pattern along the preferred dimension is used without estimating the costs,
+     * unless `ModelGeneVariancesOptions::auto_tune = true`.
+     */
+    std::array<double, 4> costs;
+
+    /**
+     * Proportion of non-zero values in the matrix, estimated from a sample of rows or columns when computing the costs.
+     * This is re-used to choose the tile size for `ModelGeneVariancesOptions::sparse_column_tile_cache_size`.
+     * NaN if the costs were not estimated.
+     */
+    double density = std::numeric_limits<double>::quiet_NaN();
+
+    /**
+     * Number of threads for computing the statistics.
+     * This is equal to `ModelGeneVariancesOptions::num_threads` unless `ModelGeneVariancesOptions::auto_tune = true`.
      */
     int num_threads = 1;
+
+    /**
+     * Number of threads for fitting the trend.
+     * This is equal to `ModelGeneVariancesOptions::num_threads` unless `ModelGeneVariancesOptions::auto_tune = true`.
+     */
+    int fit_num_threads = 1;
+
+    /**
+     * Column batch size for dense matrices with column access, see `ModelGeneVariancesOptions::column_batch_size`.
+     */
+    std::size_t column_batch_size = 0;
+
+    /**
+     * Cache size for tiling sparse matrices with column access, see `ModelGeneVariancesOptions::sparse_column_tile_cache_size`.
+     */
+    std::size_t sparse_column_tile_cache_size = 0;
 };
 
 /**
@@ -129,6 +337,36 @@ struct ModelGeneVariancesBuffers {
      * If this or `ModelGeneVariancesBuffers::fitted` is `NULL`, no trend is fitted.
      */
     Stat_* residuals;
+
+    /**
+     * Pointer to an array of length equal to the number of genes, to be filled with the number of cells with non-zero values for each gene.
+     * If `NULL`, this statistic is not computed.
+     * Ignored for instances of this class that are used as `ModelGeneVariancesBlockedBuffers::average`.
+     */
+    Stat_* detected = NULL;
+
+    /**
+     * Pointer to an array of length equal to the number of genes, to be filled with the sum of log-expression values for each gene.
+     * If `NULL`, this statistic is not computed.
+     * Ignored for instances of this class that are used as `ModelGeneVariancesBlockedBuffers::average`.
+     */
+    Stat_* sums = NULL;
+
+    /**
+     * Pointer to an array of length equal to the number of genes, to be filled with the minimum log-expression value for each gene.
+     * This is NaN for blocks with no cells.
+     * If `NULL`, this statistic is not computed.
+     * Ignored for instances of this class that are used as `ModelGeneVariancesBlockedBuffers::average`.
+     */
+    Stat_* minimum = NULL;
+
+    /**
+     * Pointer to an array of length equal to the number of genes, to be filled with the maximum log-expression value for each gene.
+     * This is NaN for blocks with no cells.
+     * If `NULL`, this statistic is not computed.
+     * Ignored for instances of this class that are used as `ModelGeneVariancesBlockedBuffers::average`.
+     */
+    Stat_* maximum = NULL;
 };
 
 /**
@@ -142,7 +380,7 @@ struct ModelGeneVariancesResults {
      */
     ModelGeneVariancesResults() = default;
 
-    ModelGeneVariancesResults(const std::size_t ngenes, const bool trend) :
+    ModelGeneVariancesResults(const std::size_t ngenes, const bool trend, const bool extra = false) :
         means(sanisizer::cast<I<decltype(means.size())> >(ngenes)
 #ifdef SCRAN_VARIANCES_TEST_INIT
             , SCRAN_VARIANCES_TEST_INIT
@@ -161,6 +399,26 @@ struct ModelGeneVariancesResults {
         residuals(sanisizer::cast<I<decltype(residuals.size())> >(trend ? ngenes : 0)
 #ifdef SCRAN_VARIANCES_TEST_INIT
             , SCRAN_VARIANCES_TEST_INIT
+#endif
+        ),
+        detected(sanisizer::cast<I<decltype(detected.size())> >(extra ? ngenes : 0)
+#ifdef SCRAN_VARIANCES_TEST_INIT
+            , SCRAN_VARIANCES_TEST_INIT
+#endif
+        ),
+        sums(sanisizer::cast<I<decltype(sums.size())> >(extra ? ngenes : 0)
+#ifdef SCRAN_VARIANCES_TEST_INIT
+            , SCRAN_VARIANCES_TEST_INIT
+#endif
+        ),
+        minimum(sanisizer::cast<I<decltype(minimum.size())> >(extra ? ngenes : 0)
+#ifdef SCRAN_VARIANCES_TEST_INIT
+            , SCRAN_VARIANCES_TEST_INIT
+#endif
+        ),
+        maximum(sanisizer::cast<I<decltype(maximum.size())> >(extra ? ngenes : 0)
+#ifdef SCRAN_VARIANCES_TEST_INIT
+            , SCRAN_VARIANCES_TEST_INIT
 #endif
         )
     {}
@@ -191,6 +449,34 @@ struct ModelGeneVariancesResults {
      * This will be empty if `ModelGeneVariancesOptions::trend = false`.
      */
     std::vector<Stat_> residuals;
+
+    /**
+     * Vector of length equal to the number of genes, containing the number of cells with non-zero values for each gene.
+     *
+     * This will be empty if `ModelGeneVariancesOptions::extra_statistics = false`, or for `ModelGeneVariancesBlockedResults::average`.
+     */
+    std::vector<Stat_> detected;
+
+    /**
+     * Vector of length equal to the number of genes, containing the sum of log-expression values for each gene.
+     *
+     * This will be empty if `ModelGeneVariancesOptions::extra_statistics = false`, or for `ModelGeneVariancesBlockedResults::average`.
+     */
+    std::vector<Stat_> sums;
+
+    /**
+     * Vector of length equal to the number of genes, containing the minimum log-expression value for each gene.
+     *
+     * This will be empty if `ModelGeneVariancesOptions::extra_statistics = false`, or for `ModelGeneVariancesBlockedResults::average`.
+     */
+    std::vector<Stat_> minimum;
+
+    /**
+     * Vector of length equal to the number of genes, containing the maximum log-expression value for each gene.
+     *
+     * This will be empty if `ModelGeneVariancesOptions::extra_statistics = false`, or for `ModelGeneVariancesBlockedResults::average`.
+     */
+    std::vector<Stat_> maximum;
 };
 
 /**
@@ -228,12 +514,12 @@ struct ModelGeneVariancesBlockedResults {
      */
     ModelGeneVariancesBlockedResults() = default;
 
-    ModelGeneVariancesBlockedResults(const std::size_t ngenes, const std::size_t nblocks, const bool do_average, const bool do_trend) :
+    ModelGeneVariancesBlockedResults(const std::size_t ngenes, const std::size_t nblocks, const bool do_average, const bool do_trend, const bool do_extra = false) :
         average(do_average ? ngenes : 0, do_trend)
     {
         per_block.reserve(nblocks);
         for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
-            per_block.emplace_back(ngenes, do_trend);
+            per_block.emplace_back(ngenes, do_trend, do_extra);
         }
     }
     /**
@@ -252,33 +538,313 @@ struct ModelGeneVariancesBlockedResults {
     ModelGeneVariancesResults<Stat_> average;
 };
 
+/**
+ * @brief Reusable workspace for `model_gene_variances()` and `model_gene_variances_blocked()`.
+ *
+ * This holds the temporary data structures that would otherwise be re-created in each call,
+ * i.e., the block sizes, the block weights and buffers for averaging, the trend fitting workspace,
+ * and a memory pool for the per-thread extraction buffers and running statistics (see `ModelGeneVariancesOptions::memory_resource`).
+ * Re-using the same workspace for many calls avoids repeated allocations, which is most beneficial when the matrices are small, e.g., for subsets of cells from a larger dataset.
+ * Matrices do not need to have the same dimensions or number of blocks across calls, though the benefit is greatest if the dimensions are similar.
+ *
+ * The memory pool is only used if `ModelGeneVariancesOptions::memory_resource` is `NULL`.
+ * Memory is never returned to the system until the workspace is destroyed.
+ * A single workspace should not be used in multiple concurrent calls.
+ *
+ * @tparam Stat_ Floating-point type of the output statistics.
+ * @tparam Index_ Integer type of the row/column indices.
+ */
+template<typename Stat_ = double, typename Index_ = int>
+struct ModelGeneVariancesWorkspace {
+    /**
+     * @cond
+     */
+    std::vector<Index_> block_size;
+    std::vector<Stat_> block_weight, tmp_weights;
+    std::vector<Stat_*> tmp_pointers;
+    FitVarianceTrendWorkspace<Stat_> trend;
+
+    // Held by pointer as pool resources cannot be moved.
+    std::unique_ptr<std::pmr::synchronized_pool_resource> pool;
+
+    std::pmr::memory_resource* get_pool() {
+        if (!pool) {
+            std::pmr::pool_options popt;
+            popt.largest_required_pool_block = 64 * 1024 * 1024; // implementations may use a smaller limit, in which case larger buffers are still allocated on each call.
+            pool.reset(new std::pmr::synchronized_pool_resource(popt));
+        }
+        return pool.get();
+    }
+    /**
+     * @endcond
+     */
+};
+
 /**
  * @cond
  */
 namespace internal {
 
-template<typename Value_, typename Index_, typename Stat_, typename Block_> 
+inline std::pmr::memory_resource* get_memory_resource(const ModelGeneVariancesOptions& options) {
+    return (options.memory_resource ? options.memory_resource : std::pmr::get_default_resource());
+}
+
+template<typename Stat_>
+std::size_t results_bytes(const ModelGeneVariancesResults<Stat_>& results) {
+    return container_bytes(results.means, results.variances, results.fitted, results.residuals, results.detected, results.sums, results.minimum, results.maximum);
+}
+
+template<typename Stat_>
+std::size_t results_bytes(const ModelGeneVariancesBlockedResults<Stat_>& results) {
+    std::size_t output = results_bytes(results.average);
+    for (const auto& current : results.per_block) {
+        output += results_bytes(current);
+    }
+    return output;
+}
+
+// The output statistics are returned to the caller, so they are never released.
+template<class Results_>
+void track_results(AllocationTracker* const tracker, const Results_& results) {
+    if (tracker) {
+        tracker->allocate(AllocationPhase::OUTPUT, 0, results_bytes(results));
+    }
+}
+
+/*
+ * Transformations are applied to the extracted values before computing any
+ * statistics. Each transformation should define:
+ *
+ * - 'Output<Value_>', the type of the transformed values.
+ * - 'active', whether the transformation needs its own buffer.
+ * - 'dense(ptr, n, buffer)', for a dense row where the i-th value is from cell i.
+ * - 'sparse(value, index, n, buffer)', for a sparse row where the i-th value is from cell 'index[i]'.
+ * - 'cell(c, ptr, n, buffer)', for values that all come from cell 'c'.
+ *
+ * Each function returns a pointer to the transformed values, which may be the
+ * input pointer itself or 'buffer'. Structural zeros must remain zero after
+ * transformation so that the sparse calculations are still valid.
+ */
+struct IdentityTransform {
+    template<typename Value_>
+    using Output = Value_;
+
+    static constexpr bool active = false;
+
+    template<typename Value_, typename Index_>
+    const Value_* dense(const Value_* ptr, const Index_, Value_*) const {
+        return ptr;
+    }
+
+    template<typename Value_, typename Index_>
+    const Value_* sparse(const Value_* value, const Index_*, const Index_, Value_*) const {
+        return value;
+    }
+
+    template<typename Value_, typename Index_>
+    const Value_* cell(const Index_, const Value_* ptr, const Index_, Value_*) const {
+        return ptr;
+    }
+};
+
+/*
+ * Optional per-cell weights for the means and variances, interpreted as
+ * frequencies (see weighted_variances.hpp). If 'weights' is NULL, all cells
+ * have unit weight and the unweighted calculations are used. Otherwise,
+ * 'totals' should contain the total weight of each block across all cells
+ * processed by the kernel. Extra statistics are not computed with weights.
+ */
+template<typename Stat_>
+struct CellWeights {
+    const Stat_* weights = NULL;
+    const Stat_* totals = NULL;
+};
+
+/*
+ * Extra statistics for a contiguous range of genes in each block. During
+ * accumulation, the minimum and maximum only consider the observed values, so
+ * that partial results from different subsets of cells can be combined with
+ * merge(). Structural zeros and empty blocks are handled in finish() once the
+ * total number of cells in each block is known.
+ */
+template<typename Stat_>
+class ExtraStatistics {
+public:
+    ExtraStatistics() = default;
+
+    ExtraStatistics(const std::size_t nblocks, const std::size_t length, std::pmr::memory_resource* const resource = std::pmr::get_default_resource()) :
+        my_length(length),
+        my_detected(sanisizer::product<I<decltype(my_detected.size())> >(nblocks, length), resource),
+        my_sums(my_detected.size(), resource),
+        my_minimum(my_detected.size(), std::numeric_limits<Stat_>::infinity(), resource),
+        my_maximum(my_detected.size(), -std::numeric_limits<Stat_>::infinity(), resource)
+    {}
+
+    void add(const std::size_t b, const std::size_t g, const Stat_ value) {
+        const auto offset = b * my_length + g;
+        my_detected[offset] += (value != 0);
+        my_sums[offset] += value;
+        my_minimum[offset] = std::min(my_minimum[offset], value);
+        my_maximum[offset] = std::max(my_maximum[offset], value);
+    }
+
+    void reset() {
+        std::fill(my_detected.begin(), my_detected.end(), 0);
+        std::fill(my_sums.begin(), my_sums.end(), 0);
+        std::fill(my_minimum.begin(), my_minimum.end(), std::numeric_limits<Stat_>::infinity());
+        std::fill(my_maximum.begin(), my_maximum.end(), -std::numeric_limits<Stat_>::infinity());
+    }
+
+    void merge(const ExtraStatistics& other) {
+        const auto n = my_detected.size();
+        for (I<decltype(n)> i = 0; i < n; ++i) {
+            my_detected[i] += other.my_detected[i];
+            my_sums[i] += other.my_sums[i];
+            my_minimum[i] = std::min(my_minimum[i], other.my_minimum[i]);
+            my_maximum[i] = std::max(my_maximum[i], other.my_maximum[i]);
+        }
+    }
+
+    template<typename Index_>
+    void finish(const Index_* const block_size) {
+        const auto n = my_detected.size();
+        for (I<decltype(n)> i = 0; i < n; ++i) {
+            const Stat_ count = block_size[i / my_length];
+            if (count == 0) {
+                my_minimum[i] = std::numeric_limits<Stat_>::quiet_NaN();
+                my_maximum[i] = std::numeric_limits<Stat_>::quiet_NaN();
+            } else if (my_detected[i] < count) { // at least one zero.
+                my_minimum[i] = std::min(my_minimum[i], static_cast<Stat_>(0));
+                my_maximum[i] = std::max(my_maximum[i], static_cast<Stat_>(0));
+            }
+        }
+    }
+
+    void transfer(const std::vector<ModelGeneVariancesBuffers<Stat_> >& buffers, const std::size_t start) const {
+        const auto nblocks = buffers.size();
+        for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+            const auto& current = buffers[b];
+            const auto offset = b * my_length;
+            const auto copy = [&](const std::pmr::vector<Stat_>& source, Stat_* const destination) -> void {
+                if (destination) {
+                    std::copy_n(source.begin() + offset, my_length, destination + start);
+                }
+            };
+            copy(my_detected, current.detected);
+            copy(my_sums, current.sums);
+            copy(my_minimum, current.minimum);
+            copy(my_maximum, current.maximum);
+        }
+    }
+
+    std::size_t bytes() const {
+        return container_bytes(my_detected, my_sums, my_minimum, my_maximum);
+    }
+
+private:
+    std::size_t my_length = 0;
+    std::pmr::vector<Stat_> my_detected, my_sums, my_minimum, my_maximum;
+};
+
+// tatami_stats::LocalOutputBuffers only allocates for threads other than the first, which write directly to the output.
+template<typename Stat_>
+std::size_t local_output_bytes(const int thread, const std::size_t nblocks, const std::size_t length) {
+    return (thread > 0 ? nblocks * length * sizeof(Stat_) : 0);
+}
+
+template<typename Stat_>
+bool use_extra_statistics(const std::vector<ModelGeneVariancesBuffers<Stat_> >& buffers) {
+    for (const auto& current : buffers) {
+        if (current.detected || current.sums || current.minimum || current.maximum) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Reports chunks of finished genes to the user-supplied callback. Each worker
+ * thread should have its own instance, which shares a lock with the other
+ * threads to serialize the calls to the callback.
+ */
+template<typename Index_>
+class GeneChunkReporter {
+public:
+    GeneChunkReporter(const ModelGeneVariancesOptions& options, std::mutex& lock, const Index_ start) :
+        my_callback(options.gene_chunk_callback ? &(options.gene_chunk_callback) : NULL),
+        my_chunk_size(options.gene_chunk_size),
+        my_lock(lock),
+        my_start(start)
+    {}
+
+    // To be called after the statistics for gene 'r' have been stored.
+    void finish(const Index_ r, const Index_ end) {
+        if (my_callback == NULL) {
+            return;
+        }
+        const Index_ next = r + 1;
+        const std::size_t length = next - my_start;
+        if (next == end || length == my_chunk_size) {
+            {
+                std::lock_guard<std::mutex> lck(my_lock);
+                (*my_callback)(my_start, length);
+            }
+            my_start = next;
+        }
+    }
+
+private:
+    const std::function<void(std::size_t, std::size_t)>* my_callback;
+    std::size_t my_chunk_size;
+    std::mutex& my_lock;
+    Index_ my_start;
+};
+
+template<typename Value_, typename Index_, typename Stat_, typename Block_, class Transform_> 
 void compute_variances_dense_row(
     const tatami::Matrix<Value_, Index_>& mat,
     const std::vector<ModelGeneVariancesBuffers<Stat_> >& buffers,
     const Block_* const block,
     const std::vector<Index_>& block_size,
-    const int num_threads)
+    const ModelGeneVariancesOptions& options,
+    const Transform_& transform,
+    const CellWeights<Stat_>& weights)
 {
+    const auto resource = get_memory_resource(options);
     const bool blocked = (block != NULL);
+    const bool weighted = (weights.weights != NULL);
     const auto nblocks = block_size.size();
     const auto NR = mat.nrow(), NC = mat.ncol();
+    const bool extra_active = use_extra_statistics(buffers);
+    std::mutex chunk_lock;
 
-    tatami::parallelize([&](const int, const Index_ start, const Index_ length) -> void {
-        auto tmp_means = sanisizer::create<std::vector<Stat_> >(blocked ? nblocks : 0);
-        auto tmp_vars = sanisizer::create<std::vector<Stat_> >(blocked ? nblocks : 0);
-
-        auto buffer = tatami::create_container_of_Index_size<std::vector<Value_> >(NC);
-        auto ext = tatami::consecutive_extractor<false>(mat, true, start, length);
+    tatami::parallelize([&](const int thread, const Index_ start, const Index_ length) -> void {
+        ExtraStatistics<Stat_> extra(extra_active ? nblocks : 0, 1, resource);
+        auto tmp_means = sanisizer::create<std::pmr::vector<Stat_> >(blocked || weighted ? nblocks : 0, resource);
+        auto tmp_vars = sanisizer::create<std::pmr::vector<Stat_> >(blocked || weighted ? nblocks : 0, resource);
+        const TrackedAllocation tracked_stats(options.allocation_tracker, AllocationPhase::STATISTICS, thread, container_bytes(tmp_means, tmp_vars) + extra.bytes());
+
+        auto buffer = tatami::create_container_of_Index_size<std::pmr::vector<Value_> >(NC, resource);
+        auto tbuffer = tatami::create_container_of_Index_size<std::pmr::vector<typename Transform_::template Output<Value_> > >(Transform_::active ? NC : 0, resource);
+        PrefetchExtractor<false, Value_, Index_> ext(
+            [&]() { return tatami::consecutive_extractor<false>(mat, true, start, length); },
+            NC,
+            length,
+            options.prefetch_buffer_size
+        );
+        const TrackedAllocation tracked_extraction(options.allocation_tracker, AllocationPhase::EXTRACTION, thread, container_bytes(buffer, tbuffer) + ext.bytes());
+        GeneChunkReporter<Index_> reporter(options, chunk_lock, start);
         for (Index_ r = start, end = start + length; r < end; ++r) {
-            auto ptr = ext->fetch(buffer.data());
+            auto ptr = transform.dense(ext.fetch(buffer.data()), NC, tbuffer.data());
 
-            if (blocked) {
+            if (weighted) {
+                compute_weighted_row_sums(ptr, static_cast<const Index_*>(NULL), NC, weights.weights, block, weights.totals, nblocks, tmp_means.data(), tmp_vars.data(), static_cast<Stat_*>(NULL));
+                for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+                    finish_weighted_variance(weights.totals[b], tmp_means[b], tmp_vars[b]);
+                    buffers[b].means[r] = tmp_means[b];
+                    buffers[b].variances[r] = tmp_vars[b];
+                }
+            } else if (blocked) {
                 tatami_stats::grouped_variances::direct(
                     ptr,
                     NC,
@@ -295,45 +861,81 @@ void compute_variances_dense_row(
                     buffers[b].variances[r] = tmp_vars[b];
                 }
             } else {
-                const auto stat = tatami_stats::variances::direct(ptr, NC, false);
+                const auto stat = simd::dense_variances(ptr, NC);
                 buffers[0].means[r] = stat.first;
                 buffers[0].variances[r] = stat.second;
             }
+
+            if (extra_active) {
+                extra.reset();
+                for (Index_ c = 0; c < NC; ++c) {
+                    extra.add(blocked ? block[c] : 0, 0, ptr[c]);
+                }
+                extra.finish(block_size.data());
+                extra.transfer(buffers, r);
+            }
+
+            reporter.finish(r, end);
         }
-    }, NR, num_threads);
+    }, NR, options.num_threads);
 }
 
-template<typename Value_, typename Index_, typename Stat_, typename Block_> 
+template<typename Value_, typename Index_, typename Stat_, typename Block_, class Transform_> 
 void compute_variances_sparse_row(
     const tatami::Matrix<Value_, Index_>& mat,
     const std::vector<ModelGeneVariancesBuffers<Stat_> >& buffers,
     const Block_* const block,
     const std::vector<Index_>& block_size,
-    const int num_threads)
+    const ModelGeneVariancesOptions& options,
+    const Transform_& transform,
+    const CellWeights<Stat_>& weights)
 {
+    const auto resource = get_memory_resource(options);
     const bool blocked = (block != NULL);
+    const bool weighted = (weights.weights != NULL);
     const auto nblocks = block_size.size();
     const auto NR = mat.nrow(), NC = mat.ncol();
+    const bool extra_active = use_extra_statistics(buffers);
+    std::mutex chunk_lock;
 
-    tatami::parallelize([&](const int, const Index_ start, const Index_ length) -> void {
-        auto tmp_means = sanisizer::create<std::vector<Stat_> >(nblocks);
-        auto tmp_vars = sanisizer::create<std::vector<Stat_> >(nblocks);
-        auto tmp_nzero = sanisizer::create<std::vector<Index_> >(nblocks);
-
-        auto vbuffer = tatami::create_container_of_Index_size<std::vector<Value_> >(NC);
-        auto ibuffer = tatami::create_container_of_Index_size<std::vector<Index_> >(NC);
-        auto ext = tatami::consecutive_extractor<true>(mat, true, start, length, [&]{
-            tatami::Options opt;
-            opt.sparse_ordered_index = false;
-            return opt;
-        }());
-
+    tatami::parallelize([&](const int thread, const Index_ start, const Index_ length) -> void {
+        ExtraStatistics<Stat_> extra(extra_active ? nblocks : 0, 1, resource);
+        auto tmp_means = sanisizer::create<std::pmr::vector<Stat_> >(nblocks, resource);
+        auto tmp_vars = sanisizer::create<std::pmr::vector<Stat_> >(nblocks, resource);
+        auto tmp_nzero = sanisizer::create<std::pmr::vector<Index_> >(nblocks, resource);
+        auto tmp_nzw = sanisizer::create<std::pmr::vector<Stat_> >(weighted ? nblocks : 0, resource);
+        const TrackedAllocation tracked_stats(options.allocation_tracker, AllocationPhase::STATISTICS, thread, container_bytes(tmp_means, tmp_vars, tmp_nzero, tmp_nzw) + extra.bytes());
+
+        auto vbuffer = tatami::create_container_of_Index_size<std::pmr::vector<Value_> >(NC, resource);
+        auto ibuffer = tatami::create_container_of_Index_size<std::pmr::vector<Index_> >(NC, resource);
+        auto tbuffer = tatami::create_container_of_Index_size<std::pmr::vector<typename Transform_::template Output<Value_> > >(Transform_::active ? NC : 0, resource);
+        PrefetchExtractor<true, Value_, Index_> ext(
+            [&]() {
+                tatami::Options opt;
+                opt.sparse_ordered_index = false;
+                return tatami::consecutive_extractor<true>(mat, true, start, length, opt);
+            },
+            NC,
+            length,
+            options.prefetch_buffer_size
+        );
+        const TrackedAllocation tracked_extraction(options.allocation_tracker, AllocationPhase::EXTRACTION, thread, container_bytes(vbuffer, ibuffer, tbuffer) + ext.bytes());
+
+        GeneChunkReporter<Index_> reporter(options, chunk_lock, start);
         for (Index_ r = start, end = start + length; r < end; ++r) {
-            auto range = ext->fetch(vbuffer.data(), ibuffer.data());
+            auto range = ext.fetch(vbuffer.data(), ibuffer.data());
+            auto vptr = transform.sparse(range.value, range.index, range.number, tbuffer.data());
 
-            if (blocked) {
+            if (weighted) {
+                compute_weighted_row_sums(vptr, range.index, range.number, weights.weights, block, weights.totals, nblocks, tmp_means.data(), tmp_vars.data(), tmp_nzw.data());
+                for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+                    finish_weighted_variance(weights.totals[b], tmp_means[b], tmp_vars[b]);
+                    buffers[b].means[r] = tmp_means[b];
+                    buffers[b].variances[r] = tmp_vars[b];
+                }
+            } else if (blocked) {
                 tatami_stats::grouped_variances::direct(
-                    range.value,
+                    vptr,
                     range.index,
                     range.number,
                     block,
@@ -350,145 +952,1196 @@ void compute_variances_sparse_row(
                     buffers[b].variances[r] = tmp_vars[b];
                 }
             } else {
-                const auto stat = tatami_stats::variances::direct(range.value, range.number, NC, false);
+                const auto stat = simd::sparse_variances(vptr, range.number, NC);
                 buffers[0].means[r] = stat.first;
                 buffers[0].variances[r] = stat.second;
             }
+
+            if (extra_active) {
+                extra.reset();
+                for (Index_ i = 0; i < range.number; ++i) {
+                    extra.add(blocked ? block[range.index[i]] : 0, 0, vptr[i]);
+                }
+                extra.finish(block_size.data());
+                extra.transfer(buffers, r);
+            }
+
+            reporter.finish(r, end);
         }
-    }, NR, num_threads);
+    }, NR, options.num_threads);
 }
 
-template<typename Value_, typename Index_, typename Stat_, typename Block_> 
+template<typename Value_, typename Index_, typename Stat_, typename Block_, class Transform_> 
 void compute_variances_dense_column(
     const tatami::Matrix<Value_, Index_>& mat,
     const std::vector<ModelGeneVariancesBuffers<Stat_> >& buffers,
     const Block_* const block,
     const std::vector<Index_>& block_size,
-    const int num_threads)
+    const ModelGeneVariancesOptions& options,
+    const Transform_& transform,
+    const CellWeights<Stat_>& weights)
 {
+    const auto resource = get_memory_resource(options);
     const bool blocked = (block != NULL);
+    const bool weighted = (weights.weights != NULL);
     const auto nblocks = block_size.size();
     const auto NR = mat.nrow(), NC = mat.ncol();
+    const bool extra_active = use_extra_statistics(buffers);
 
     tatami::parallelize([&](const int thread, const Index_ start, const Index_ length) -> void {
-        auto buffer = tatami::create_container_of_Index_size<std::vector<Value_> >(length);
-        auto ext = tatami::consecutive_extractor<false>(mat, false, static_cast<Index_>(0), NC, start, length);
+        ExtraStatistics<Stat_> extra(extra_active ? nblocks : 0, length, resource);
+        auto buffer = tatami::create_container_of_Index_size<std::pmr::vector<Value_> >(length, resource);
+        typedef typename Transform_::template Output<Value_> Computed;
+        auto tbuffer = tatami::create_container_of_Index_size<std::pmr::vector<Computed> >(Transform_::active ? length : 0, resource);
+        PrefetchExtractor<false, Value_, Index_> ext(
+            [&]() { return tatami::consecutive_extractor<false>(mat, false, static_cast<Index_>(0), NC, start, length); },
+            length,
+            NC,
+            options.prefetch_buffer_size
+        );
+        const TrackedAllocation tracked_extraction(options.allocation_tracker, AllocationPhase::EXTRACTION, thread, container_bytes(buffer, tbuffer) + ext.bytes());
 
         auto get_var = [&](Index_ b) -> Stat_* { return buffers[b].variances; };
         tatami_stats::LocalOutputBuffers<Stat_, decltype(get_var)> local_vars(thread, nblocks, start, length, std::move(get_var));
         auto get_mean = [&](Index_ b) -> Stat_* { return buffers[b].means; };
         tatami_stats::LocalOutputBuffers<Stat_, decltype(get_mean)> local_means(thread, nblocks, start, length, std::move(get_mean));
-
-        std::vector<tatami_stats::variances::RunningDense<Stat_, Value_, Index_> > runners;
-        runners.reserve(nblocks);
-        for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
-            runners.emplace_back(length, local_means.data(b), local_vars.data(b), false);
+        const TrackedAllocation tracked_stats(options.allocation_tracker, AllocationPhase::STATISTICS, thread, 2 * local_output_bytes<Stat_>(thread, nblocks, length) + extra.bytes());
+
+        std::pmr::vector<tatami_stats::variances::RunningDense<Stat_, Computed, Index_> > runners(resource);
+        std::pmr::vector<WeightedRunningDense<Stat_, Computed, Index_> > wrunners(resource);
+        if (weighted) {
+            wrunners.reserve(nblocks);
+            for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+                wrunners.emplace_back(length, local_means.data(b), local_vars.data(b));
+            }
+        } else {
+            runners.reserve(nblocks);
+            for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+                runners.emplace_back(length, local_means.data(b), local_vars.data(b), false);
+            }
         }
 
         if (blocked) {
             for (I<decltype(NC)> c = 0; c < NC; ++c) {
-                auto ptr = ext->fetch(buffer.data());
-                runners[block[c]].add(ptr);
+                auto ptr = transform.cell(c, ext.fetch(buffer.data()), length, tbuffer.data());
+                if (weighted) {
+                    wrunners[block[c]].add(ptr, weights.weights[c]);
+                } else {
+                    runners[block[c]].add(ptr);
+                }
+                if (extra_active) {
+                    for (Index_ g = 0; g < length; ++g) {
+                        extra.add(block[c], g, ptr[g]);
+                    }
+                }
             }
         } else {
             for (I<decltype(NC)> c = 0; c < NC; ++c) {
-                auto ptr = ext->fetch(buffer.data());
-                runners[0].add(ptr);
+                auto ptr = transform.cell(c, ext.fetch(buffer.data()), length, tbuffer.data());
+                if (weighted) {
+                    wrunners[0].add(ptr, weights.weights[c]);
+                } else {
+                    runners[0].add(ptr);
+                }
+                if (extra_active) {
+                    for (Index_ g = 0; g < length; ++g) {
+                        extra.add(0, g, ptr[g]);
+                    }
+                }
             }
         }
 
         for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
-            runners[b].finish();
+            if (weighted) {
+                wrunners[b].finish();
+                const auto mptr = local_means.data(b);
+                const auto vptr = local_vars.data(b);
+                for (Index_ g = 0; g < length; ++g) {
+                    finish_weighted_variance(weights.totals[b], mptr[g], vptr[g]);
+                }
+            } else {
+                runners[b].finish();
+            }
         }
         local_vars.transfer();
         local_means.transfer();
-    }, NR, num_threads);
+        if (extra_active) {
+            extra.finish(block_size.data());
+            extra.transfer(buffers, start);
+        }
+    }, NR, options.num_threads);
 }
 
-template<typename Value_, typename Index_, typename Stat_, typename Block_> 
-void compute_variances_sparse_column(
+// Number of genes in each tile for the batched dense column calculations,
+// chosen so that the running means and variances of a tile fit in L1 cache.
+template<typename Stat_>
+constexpr std::size_t dense_column_tile_size() {
+    return std::max<std::size_t>(1, 32768 / (2 * sizeof(Stat_)));
+}
+
+template<typename Value_, typename Index_, typename Stat_, typename Block_, class Transform_> 
+void compute_variances_dense_column_batched(
     const tatami::Matrix<Value_, Index_>& mat,
     const std::vector<ModelGeneVariancesBuffers<Stat_> >& buffers,
     const Block_* const block,
     const std::vector<Index_>& block_size,
-    const int num_threads) 
+    const ModelGeneVariancesOptions& options,
+    const Transform_& transform,
+    const CellWeights<Stat_>& weights)
 {
-    const bool blocked = (block != NULL);
+    const auto resource = get_memory_resource(options);
+    const bool weighted = (weights.weights != NULL);
     const auto nblocks = block_size.size();
     const auto NR = mat.nrow(), NC = mat.ncol();
-    auto nonzeros = sanisizer::create<std::vector<std::vector<Index_> > >(
-        nblocks,
-        tatami::create_container_of_Index_size<std::vector<Index_> >(NR)
-    );
+    const Index_ batch_size = (options.column_batch_size < static_cast<std::size_t>(NC) ? options.column_batch_size : NC); // cast is safe as any tatami Index_ can fit into a size_t.
+    const auto tile_size = dense_column_tile_size<Stat_>();
+    const bool extra_active = use_extra_statistics(buffers);
 
     tatami::parallelize([&](const int thread, const Index_ start, const Index_ length) -> void {
-        auto vbuffer = tatami::create_container_of_Index_size<std::vector<Value_> >(length);
-        auto ibuffer = tatami::create_container_of_Index_size<std::vector<Index_> >(length);
-        auto ext = tatami::consecutive_extractor<true>(mat, false, static_cast<Index_>(0), NC, start, length, [&]{
-            tatami::Options opt;
-            opt.sparse_ordered_index = false;
-            return opt;
-        }());
+        ExtraStatistics<Stat_> extra(extra_active ? nblocks : 0, length, resource);
+        auto buffer = tatami::create_container_of_Index_size<std::pmr::vector<Value_> >(Transform_::active ? length : 0, resource);
+        typedef typename Transform_::template Output<Value_> Computed;
+        auto batch = sanisizer::create<std::pmr::vector<Computed> >(sanisizer::product<typename std::vector<Computed>::size_type>(batch_size, length), resource);
+        PrefetchExtractor<false, Value_, Index_> ext(
+            [&]() { return tatami::consecutive_extractor<false>(mat, false, static_cast<Index_>(0), NC, start, length); },
+            length,
+            NC,
+            options.prefetch_buffer_size
+        );
+        const TrackedAllocation tracked_extraction(options.allocation_tracker, AllocationPhase::EXTRACTION, thread, container_bytes(buffer, batch) + ext.bytes());
 
         auto get_var = [&](Index_ b) -> Stat_* { return buffers[b].variances; };
         tatami_stats::LocalOutputBuffers<Stat_, decltype(get_var)> local_vars(thread, nblocks, start, length, std::move(get_var));
         auto get_mean = [&](Index_ b) -> Stat_* { return buffers[b].means; };
         tatami_stats::LocalOutputBuffers<Stat_, decltype(get_mean)> local_means(thread, nblocks, start, length, std::move(get_mean));
+        auto counts = sanisizer::create<std::pmr::vector<Index_> >(nblocks, resource);
+        auto running_weights = sanisizer::create<std::pmr::vector<Stat_> >(weighted ? nblocks : 0, resource);
+        const TrackedAllocation tracked_stats(options.allocation_tracker, AllocationPhase::STATISTICS, thread, 2 * local_output_bytes<Stat_>(thread, nblocks, length) + container_bytes(counts, running_weights) + extra.bytes());
+
+        for (Index_ batch_start = 0; batch_start < NC; batch_start += batch_size) {
+            const Index_ batch_end = batch_start + std::min(batch_size, static_cast<Index_>(NC - batch_start));
+            for (Index_ c = batch_start; c < batch_end; ++c) {
+                auto slot = batch.data() + static_cast<std::size_t>(c - batch_start) * static_cast<std::size_t>(length); // cast is safe as the product was already checked above.
+                if constexpr(Transform_::active) {
+                    transform.cell(c, ext.fetch(buffer.data()), length, slot);
+                } else {
+                    tatami::copy_n(ext.fetch(slot), length, slot);
+                }
+            }
+
+            // Processing runs of consecutive columns from the same block, so
+            // that each gene tile's running statistics stay in cache across
+            // all columns of the run. This uses the same Welford updates as
+            // tatami_stats::variances::RunningDense, except that we multiply
+            // by the reciprocal of the count to avoid a division per value.
+            // With weights, we use the same updates as WeightedRunningDense.
+            Index_ run_start = batch_start;
+            while (run_start < batch_end) {
+                const auto b = (block ? block[run_start] : 0);
+                Index_ run_end = run_start + 1;
+                if (block) {
+                    while (run_end < batch_end && block[run_end] == b) {
+                        ++run_end;
+                    }
+                }
+
+                const auto mptr = local_means.data(b);
+                const auto vptr = local_vars.data(b);
+                const Index_ base = counts[b];
+                Index_ tile_start = 0;
+                while (tile_start < length) {
+                    const Index_ tile_end = tile_start + static_cast<Index_>(std::min<std::size_t>(tile_size, length - tile_start)); // cast is safe as the result is no greater than 'length'.
+                    if (weighted) {
+                        Stat_ running = running_weights[b];
+                        for (Index_ c = run_start; c < run_end; ++c) {
+                            const Stat_ w = weights.weights[c];
+                            if (!(w > 0)) {
+                                continue;
+                            }
+                            running += w;
+                            const Stat_ ratio = w / running;
+                            const auto slot = batch.data() + static_cast<std::size_t>(c - batch_start) * static_cast<std::size_t>(length);
+                            for (Index_ g = tile_start; g < tile_end; ++g) {
+                                const Stat_ val = slot[g];
+                                const Stat_ delta = val - mptr[g];
+                                mptr[g] += delta * ratio;
+                                vptr[g] += w * delta * (val - mptr[g]);
+                            }
+                        }
+                    } else {
+                        for (Index_ c = run_start; c < run_end; ++c) {
+                            const Stat_ inv_count = static_cast<Stat_>(1) / (base + (c - run_start) + 1);
+                            const auto slot = batch.data() + static_cast<std::size_t>(c - batch_start) * static_cast<std::size_t>(length);
+                            for (Index_ g = tile_start; g < tile_end; ++g) {
+                                const Stat_ val = slot[g];
+                                const Stat_ delta = val - mptr[g];
+                                mptr[g] += delta * inv_count;
+                                vptr[g] += delta * (val - mptr[g]);
+                            }
+                            if (extra_active) {
+                                for (Index_ g = tile_start; g < tile_end; ++g) {
+                                    extra.add(b, g, slot[g]);
+                                }
+                            }
+                        }
+                    }
+                    tile_start = tile_end;
+                }
+
+                counts[b] += run_end - run_start;
+                if (weighted) {
+                    for (Index_ c = run_start; c < run_end; ++c) {
+                        const Stat_ w = weights.weights[c];
+                        if (w > 0) {
+                            running_weights[b] += w;
+                        }
+                    }
+                }
+                run_start = run_end;
+            }
+        }
 
-        std::vector<tatami_stats::variances::RunningSparse<Stat_, Value_, Index_> > runners;
-        runners.reserve(nblocks);
         for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
-            runners.emplace_back(length, local_means.data(b), local_vars.data(b), false, start);
+            const auto mptr = local_means.data(b);
+            const auto vptr = local_vars.data(b);
+            if (weighted) {
+                for (Index_ g = 0; g < length; ++g) {
+                    finish_weighted_variance(weights.totals[b], mptr[g], vptr[g]);
+                }
+                continue;
+            }
+
+            const auto count = counts[b];
+            for (Index_ g = 0; g < length; ++g) {
+                if (count > 1) {
+                    vptr[g] /= count - 1;
+                } else {
+                    vptr[g] = std::numeric_limits<Stat_>::quiet_NaN();
+                    if (count == 0) {
+                        mptr[g] = std::numeric_limits<Stat_>::quiet_NaN();
+                    }
+                }
+            }
         }
+        local_vars.transfer();
+        local_means.transfer();
+        if (extra_active) {
+            extra.finish(block_size.data());
+            extra.transfer(buffers, start);
+        }
+    }, NR, options.num_threads);
+}
 
-        if (blocked) {
-            for (I<decltype(NC)> c = 0; c < NC; ++c) {
-                auto range = ext->fetch(vbuffer.data(), ibuffer.data());
-                runners[block[c]].add(range.value, range.index, range.number);
+template<typename Value_, typename Index_>
+double estimate_density(const tatami::Matrix<Value_, Index_>& mat, const bool row, const Index_ num_sampled) {
+    const Index_ primary = (row ? mat.nrow() : mat.ncol()), secondary = (row ? mat.ncol() : mat.nrow());
+    const Index_ nsamples = std::min(num_sampled, primary);
+    if (nsamples == 0 || secondary == 0) {
+        return 0;
+    }
+
+    tatami::Options opt;
+    opt.sparse_extract_value = false;
+    opt.sparse_ordered_index = false;
+    auto ext = mat.sparse(row, opt);
+    auto ibuffer = tatami::create_container_of_Index_size<std::vector<Index_> >(secondary);
+
+    double total = 0;
+    for (Index_ s = 0; s < nsamples; ++s) {
+        // Evenly spaced samples, always including the first row/column.
+        const Index_ i = static_cast<std::size_t>(s) * static_cast<std::size_t>(primary) / static_cast<std::size_t>(nsamples); // cast is safe as any tatami Index_ can fit into a size_t.
+        total += ext->fetch(i, NULL, ibuffer.data()).number;
+    }
+    return total / (static_cast<double>(nsamples) * static_cast<double>(secondary));
+}
+
+/*
+ * Each tile should contain enough genes for the running statistics to fill
+ * the cache, but not so few that each column only contributes a handful of
+ * non-zero values per tile, as the per-column extraction overhead would then
+ * dominate. We use the density to enforce a minimum number of expected
+ * non-zero values per column in each tile.
+ */
+template<typename Stat_, typename Index_>
+Index_ choose_sparse_column_tile_size(const Index_ length, const std::size_t nblocks, const std::size_t cache_size, const double density) {
+    const std::size_t per_gene = std::max<std::size_t>(1, nblocks) * (2 * sizeof(Stat_) + sizeof(Index_));
+    double tile = std::max<std::size_t>(1, cache_size / per_gene);
+    constexpr double minimum_nonzeros = 16;
+    if (density > 0) {
+        tile = std::max(tile, std::ceil(minimum_nonzeros / density));
+    } else {
+        tile = length;
+    }
+    return (tile < static_cast<double>(length) ? static_cast<Index_>(tile) : length);
+}
+
+template<typename Value_, typename Index_, typename Stat_, typename Block_, class Transform_> 
+void compute_variances_sparse_column(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const std::vector<ModelGeneVariancesBuffers<Stat_> >& buffers,
+    const Block_* const block,
+    const std::vector<Index_>& block_size,
+    const ModelGeneVariancesOptions& options,
+    const Transform_& transform,
+    const CellWeights<Stat_>& weights,
+    const double planned_density)
+{
+    const auto resource = get_memory_resource(options);
+    const bool blocked = (block != NULL);
+    const bool weighted = (weights.weights != NULL);
+    const auto nblocks = block_size.size();
+    const auto NR = mat.nrow(), NC = mat.ncol();
+
+    // Re-using the density from the plan if it was already estimated.
+    const bool tiled = (options.sparse_column_tile_cache_size > 0);
+    double density = 0;
+    if (tiled) {
+        density = (std::isnan(planned_density) ? estimate_density(mat, false, static_cast<Index_>(20)) : planned_density);
+    }
+    const bool extra_active = use_extra_statistics(buffers);
+
+    tatami::parallelize([&](const int thread, const Index_ start, const Index_ length) -> void {
+        ExtraStatistics<Stat_> extra(extra_active ? nblocks : 0, length, resource);
+        auto get_var = [&](Index_ b) -> Stat_* { return buffers[b].variances; };
+        tatami_stats::LocalOutputBuffers<Stat_, decltype(get_var)> local_vars(thread, nblocks, start, length, std::move(get_var));
+        auto get_mean = [&](Index_ b) -> Stat_* { return buffers[b].means; };
+        tatami_stats::LocalOutputBuffers<Stat_, decltype(get_mean)> local_means(thread, nblocks, start, length, std::move(get_mean));
+        const TrackedAllocation tracked_stats(options.allocation_tracker, AllocationPhase::STATISTICS, thread, 2 * local_output_bytes<Stat_>(thread, nblocks, length) + extra.bytes());
+
+        const Index_ tile_size = (tiled ? choose_sparse_column_tile_size<Stat_>(length, nblocks, options.sparse_column_tile_cache_size, density) : length);
+        auto vbuffer = tatami::create_container_of_Index_size<std::pmr::vector<Value_> >(tile_size, resource);
+        auto ibuffer = tatami::create_container_of_Index_size<std::pmr::vector<Index_> >(tile_size, resource);
+        typedef typename Transform_::template Output<Value_> Computed;
+        auto tbuffer = tatami::create_container_of_Index_size<std::pmr::vector<Computed> >(Transform_::active ? tile_size : 0, resource);
+        const TrackedAllocation tracked_extraction(options.allocation_tracker, AllocationPhase::EXTRACTION, thread, container_bytes(vbuffer, ibuffer, tbuffer));
+
+        // Each tile requires a separate pass over all columns, restricted to the genes in that tile.
+        Index_ tile_start = 0;
+        while (tile_start < length) {
+            const Index_ tile_length = std::min(tile_size, static_cast<Index_>(length - tile_start));
+            const Index_ tile_first = start + tile_start;
+            PrefetchExtractor<true, Value_, Index_> ext(
+                [&]() {
+                    tatami::Options opt;
+                    opt.sparse_ordered_index = false;
+                    return tatami::consecutive_extractor<true>(mat, false, static_cast<Index_>(0), NC, tile_first, tile_length, opt);
+                },
+                tile_length,
+                NC,
+                options.prefetch_buffer_size
+            );
+            const TrackedAllocation tracked_prefetch(options.allocation_tracker, AllocationPhase::EXTRACTION, thread, ext.bytes());
+
+            std::pmr::vector<tatami_stats::variances::RunningSparse<Stat_, Computed, Index_> > runners(resource);
+            std::pmr::vector<WeightedRunningSparse<Stat_, Computed, Index_> > wrunners(resource);
+            if (weighted) {
+                wrunners.reserve(nblocks);
+                for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+                    wrunners.emplace_back(tile_length, local_means.data(b) + tile_start, local_vars.data(b) + tile_start, tile_first, resource);
+                }
+            } else {
+                runners.reserve(nblocks);
+                for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+                    runners.emplace_back(tile_length, local_means.data(b) + tile_start, local_vars.data(b) + tile_start, false, tile_first);
+                }
+            }
+            const TrackedAllocation tracked_runners(options.allocation_tracker, AllocationPhase::STATISTICS, thread, nblocks * static_cast<std::size_t>(tile_length) * (weighted ? sizeof(Stat_) : sizeof(Index_))); // for the non-zero counts or weights in each runner.
+
+            if (blocked) {
+                for (I<decltype(NC)> c = 0; c < NC; ++c) {
+                    auto range = ext.fetch(vbuffer.data(), ibuffer.data());
+                    auto vptr = transform.cell(c, range.value, range.number, tbuffer.data());
+                    if (weighted) {
+                        wrunners[block[c]].add(vptr, range.index, range.number, weights.weights[c]);
+                    } else {
+                        runners[block[c]].add(vptr, range.index, range.number);
+                    }
+                    if (extra_active) {
+                        for (Index_ i = 0; i < range.number; ++i) {
+                            extra.add(block[c], range.index[i] - start, vptr[i]);
+                        }
+                    }
+                }
+            } else {
+                for (I<decltype(NC)> c = 0; c < NC; ++c) {
+                    auto range = ext.fetch(vbuffer.data(), ibuffer.data());
+                    auto vptr = transform.cell(c, range.value, range.number, tbuffer.data());
+                    if (weighted) {
+                        wrunners[0].add(vptr, range.index, range.number, weights.weights[c]);
+                    } else {
+                        runners[0].add(vptr, range.index, range.number);
+                    }
+                    if (extra_active) {
+                        for (Index_ i = 0; i < range.number; ++i) {
+                            extra.add(0, range.index[i] - start, vptr[i]);
+                        }
+                    }
+                }
+            }
+
+            for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+                if (weighted) {
+                    wrunners[b].finish();
+                    const auto mptr = local_means.data(b) + tile_start;
+                    const auto vptr = local_vars.data(b) + tile_start;
+                    for (Index_ g = 0; g < tile_length; ++g) {
+                        finish_weighted_variance(weights.totals[b], mptr[g], vptr[g]);
+                    }
+                } else {
+                    runners[b].finish();
+                }
+            }
+            tile_start += tile_length;
+        }
+
+        local_vars.transfer();
+        local_means.transfer();
+        if (extra_active) {
+            extra.finish(block_size.data());
+            extra.transfer(buffers, start);
+        }
+    }, NR, options.num_threads);
+}
+
+/*
+ * Splitting the cells across threads is only worthwhile when there are too
+ * few genes to go around. For row-based access, this is when some threads
+ * would otherwise be idle. For column-based access, we also split the cells
+ * when each thread would be assigned so few genes that the per-column
+ * extraction overhead dominates, as every thread has to visit every column.
+ */
+constexpr std::size_t cell_split_genes_per_thread = 32;
+
+inline bool use_cell_split(const std::size_t NR, const std::size_t NC, const bool row, const int num_threads) {
+    if (num_threads <= 1) {
+        return false;
+    }
+    const std::size_t nthreads = num_threads;
+    if (NC < nthreads) {
+        return false;
+    }
+    if (row) {
+        return NR < nthreads;
+    } else {
+        return NR / nthreads < cell_split_genes_per_thread;
+    }
+}
+
+template<typename Value_, typename Index_>
+bool use_cell_split(const tatami::Matrix<Value_, Index_>& mat, const int num_threads) {
+    return use_cell_split(mat.nrow(), mat.ncol(), mat.prefer_rows(), num_threads); // cast is safe as any tatami Index_ can fit into a size_t.
+}
+
+template<typename Value_, typename Index_, typename Stat_, typename Block_, class Transform_>
+void compute_partial_variances_row(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const Block_* const block,
+    const Index_* const block_size,
+    const std::size_t nblocks,
+    const bool sparse,
+    const int thread,
+    const Index_ start,
+    const Index_ length,
+    Stat_* const means,
+    Stat_* const variances,
+    ExtraStatistics<Stat_>* const extra,
+    const ModelGeneVariancesOptions& options,
+    const Transform_& transform,
+    const CellWeights<Stat_>& weights)
+{
+    const auto resource = get_memory_resource(options);
+    const auto NR = mat.nrow();
+    auto tmp_means = sanisizer::create<std::pmr::vector<Stat_> >(nblocks, resource);
+    auto tmp_vars = sanisizer::create<std::pmr::vector<Stat_> >(nblocks, resource);
+    auto store = [&](const Index_ r) -> void {
+        for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+            const auto offset = b * static_cast<std::size_t>(NR) + static_cast<std::size_t>(r); // cast is safe as the product was already checked by the caller.
+            means[offset] = tmp_means[b];
+            variances[offset] = tmp_vars[b];
+        }
+    };
+
+    auto vbuffer = tatami::create_container_of_Index_size<std::pmr::vector<Value_> >(length, resource);
+    typedef typename Transform_::template Output<Value_> Computed;
+    auto tbuffer = tatami::create_container_of_Index_size<std::pmr::vector<Computed> >(Transform_::active ? length : 0, resource);
+    const TrackedAllocation tracked_stats(options.allocation_tracker, AllocationPhase::STATISTICS, thread, container_bytes(tmp_means, tmp_vars));
+    const TrackedAllocation tracked_extraction(options.allocation_tracker, AllocationPhase::EXTRACTION, thread, container_bytes(vbuffer, tbuffer));
+
+    if (sparse) {
+        auto ibuffer = tatami::create_container_of_Index_size<std::pmr::vector<Index_> >(length, resource);
+        auto tmp_nzero = sanisizer::create<std::pmr::vector<Index_> >(nblocks, resource);
+        auto tmp_nzw = sanisizer::create<std::pmr::vector<Stat_> >(weights.weights ? nblocks : 0, resource);
+        PrefetchExtractor<true, Value_, Index_> ext(
+            [&]() {
+                tatami::Options opt;
+                opt.sparse_ordered_index = false;
+                return tatami::consecutive_extractor<true>(mat, true, static_cast<Index_>(0), NR, start, length, opt);
+            },
+            length,
+            NR,
+            options.prefetch_buffer_size
+        );
+        const TrackedAllocation tracked_sparse_extraction(options.allocation_tracker, AllocationPhase::EXTRACTION, thread, container_bytes(ibuffer) + ext.bytes());
+        const TrackedAllocation tracked_sparse_stats(options.allocation_tracker, AllocationPhase::STATISTICS, thread, container_bytes(tmp_nzero, tmp_nzw));
+
+        for (Index_ r = 0; r < NR; ++r) {
+            auto range = ext.fetch(vbuffer.data(), ibuffer.data());
+            auto vptr = transform.sparse(range.value, range.index, range.number, tbuffer.data());
+            if (weights.weights) {
+                compute_weighted_row_sums(vptr, range.index, range.number, weights.weights, block, weights.totals, nblocks, tmp_means.data(), tmp_vars.data(), tmp_nzw.data());
+            } else if (block) {
+                // Indices refer to the full set of cells, so we can use 'block' directly.
+                tatami_stats::grouped_variances::direct(
+                    vptr,
+                    range.index,
+                    range.number,
+                    block,
+                    nblocks,
+                    block_size,
+                    tmp_means.data(),
+                    tmp_vars.data(),
+                    tmp_nzero.data(),
+                    false,
+                    static_cast<Index_*>(NULL)
+                );
+            } else {
+                const auto stat = simd::sparse_variances(vptr, range.number, length);
+                tmp_means[0] = stat.first;
+                tmp_vars[0] = stat.second;
+            }
+            store(r);
+
+            if (extra) {
+                for (Index_ i = 0; i < range.number; ++i) {
+                    extra->add(block ? block[range.index[i]] : 0, r, vptr[i]);
+                }
             }
+        }
+
+    } else {
+        // Transformations assume that the i-th value of a dense row comes from
+        // cell i, so we pass the cell indices explicitly via the sparse form.
+        auto cells = tatami::create_container_of_Index_size<std::pmr::vector<Index_> >(Transform_::active ? length : 0, resource);
+        std::iota(cells.begin(), cells.end(), start);
+        PrefetchExtractor<false, Value_, Index_> ext(
+            [&]() { return tatami::consecutive_extractor<false>(mat, true, static_cast<Index_>(0), NR, start, length); },
+            length,
+            NR,
+            options.prefetch_buffer_size
+        );
+        const TrackedAllocation tracked_dense_extraction(options.allocation_tracker, AllocationPhase::EXTRACTION, thread, container_bytes(cells) + ext.bytes());
+
+        for (Index_ r = 0; r < NR; ++r) {
+            auto ptr = ext.fetch(vbuffer.data());
+            auto vptr = (Transform_::active ? transform.sparse(ptr, cells.data(), length, tbuffer.data()) : transform.dense(ptr, length, tbuffer.data()));
+            if (weights.weights) {
+                compute_weighted_row_sums(vptr, static_cast<const Index_*>(NULL), length, weights.weights + start, (block ? block + start : block), weights.totals, nblocks, tmp_means.data(), tmp_vars.data(), static_cast<Stat_*>(NULL));
+            } else if (block) {
+                tatami_stats::grouped_variances::direct(
+                    vptr,
+                    length,
+                    block + start,
+                    nblocks,
+                    block_size,
+                    tmp_means.data(),
+                    tmp_vars.data(),
+                    false,
+                    static_cast<Index_*>(NULL)
+                );
+            } else {
+                const auto stat = simd::dense_variances(vptr, length);
+                tmp_means[0] = stat.first;
+                tmp_vars[0] = stat.second;
+            }
+            store(r);
+
+            if (extra) {
+                for (Index_ i = 0; i < length; ++i) {
+                    extra->add(block ? block[start + i] : 0, r, vptr[i]);
+                }
+            }
+        }
+    }
+}
+
+template<typename Value_, typename Index_, typename Stat_, typename Block_, class Transform_>
+void compute_partial_variances_column(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const Block_* const block,
+    const std::size_t nblocks,
+    const bool sparse,
+    const int thread,
+    const Index_ start,
+    const Index_ length,
+    Stat_* const means,
+    Stat_* const variances,
+    ExtraStatistics<Stat_>* const extra,
+    const ModelGeneVariancesOptions& options,
+    const Transform_& transform,
+    const CellWeights<Stat_>& weights)
+{
+    const auto resource = get_memory_resource(options);
+    const auto NR = mat.nrow();
+    auto vbuffer = tatami::create_container_of_Index_size<std::pmr::vector<Value_> >(NR, resource);
+    typedef typename Transform_::template Output<Value_> Computed;
+    auto tbuffer = tatami::create_container_of_Index_size<std::pmr::vector<Computed> >(Transform_::active ? NR : 0, resource);
+    const TrackedAllocation tracked_extraction(options.allocation_tracker, AllocationPhase::EXTRACTION, thread, container_bytes(vbuffer, tbuffer));
+
+    if (sparse) {
+        auto ibuffer = tatami::create_container_of_Index_size<std::pmr::vector<Index_> >(NR, resource);
+        PrefetchExtractor<true, Value_, Index_> ext(
+            [&]() {
+                tatami::Options opt;
+                opt.sparse_ordered_index = false;
+                return tatami::consecutive_extractor<true>(mat, false, start, length, opt);
+            },
+            NR,
+            length,
+            options.prefetch_buffer_size
+        );
+        const TrackedAllocation tracked_sparse_extraction(options.allocation_tracker, AllocationPhase::EXTRACTION, thread, container_bytes(ibuffer) + ext.bytes());
+
+        // Each running calculation holds a count (or weight) of non-zero values for each gene.
+        const TrackedAllocation tracked_runners(options.allocation_tracker, AllocationPhase::STATISTICS, thread, (weights.weights ? sizeof(Stat_) : sizeof(Index_)) * nblocks * static_cast<std::size_t>(NR));
+
+        std::pmr::vector<tatami_stats::variances::RunningSparse<Stat_, Computed, Index_> > runners(resource);
+        std::pmr::vector<WeightedRunningSparse<Stat_, Computed, Index_> > wrunners(resource);
+        if (weights.weights) {
+            wrunners.reserve(nblocks);
         } else {
-            for (I<decltype(NC)> c = 0; c < NC; ++c) {
-                auto range = ext->fetch(vbuffer.data(), ibuffer.data());
-                runners[0].add(range.value, range.index, range.number);
+            runners.reserve(nblocks);
+        }
+        for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+            if (weights.weights) {
+                wrunners.emplace_back(NR, means + b * static_cast<std::size_t>(NR), variances + b * static_cast<std::size_t>(NR), static_cast<Index_>(0), resource);
+            } else {
+                runners.emplace_back(NR, means + b * static_cast<std::size_t>(NR), variances + b * static_cast<std::size_t>(NR), false);
+            }
+        }
+        for (Index_ c = start, end = start + length; c < end; ++c) {
+            auto range = ext.fetch(vbuffer.data(), ibuffer.data());
+            auto vptr = transform.cell(c, range.value, range.number, tbuffer.data());
+            const auto b = (block ? block[c] : 0);
+            if (weights.weights) {
+                wrunners[b].add(vptr, range.index, range.number, weights.weights[c]);
+            } else {
+                runners[b].add(vptr, range.index, range.number);
+            }
+            if (extra) {
+                for (Index_ i = 0; i < range.number; ++i) {
+                    extra->add(b, range.index[i], vptr[i]);
+                }
+            }
+        }
+        for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+            if (weights.weights) {
+                wrunners[b].finish(); // sums of squares are retained for merging.
+            } else {
+                runners[b].finish();
             }
         }
 
+    } else {
+        PrefetchExtractor<false, Value_, Index_> ext(
+            [&]() { return tatami::consecutive_extractor<false>(mat, false, start, length); },
+            NR,
+            length,
+            options.prefetch_buffer_size
+        );
+        const TrackedAllocation tracked_dense_extraction(options.allocation_tracker, AllocationPhase::EXTRACTION, thread, ext.bytes());
+
+        std::pmr::vector<tatami_stats::variances::RunningDense<Stat_, Computed, Index_> > runners(resource);
+        std::pmr::vector<WeightedRunningDense<Stat_, Computed, Index_> > wrunners(resource);
+        if (weights.weights) {
+            wrunners.reserve(nblocks);
+        } else {
+            runners.reserve(nblocks);
+        }
         for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
-            runners[b].finish();
+            if (weights.weights) {
+                wrunners.emplace_back(NR, means + b * static_cast<std::size_t>(NR), variances + b * static_cast<std::size_t>(NR));
+            } else {
+                runners.emplace_back(NR, means + b * static_cast<std::size_t>(NR), variances + b * static_cast<std::size_t>(NR), false);
+            }
         }
-        local_vars.transfer();
-        local_means.transfer();
-    }, NR, num_threads);
+        for (Index_ c = start, end = start + length; c < end; ++c) {
+            auto ptr = transform.cell(c, ext.fetch(vbuffer.data()), NR, tbuffer.data());
+            const auto b = (block ? block[c] : 0);
+            if (weights.weights) {
+                wrunners[b].add(ptr, weights.weights[c]);
+            } else {
+                runners[b].add(ptr);
+            }
+            if (extra) {
+                for (Index_ g = 0; g < NR; ++g) {
+                    extra->add(b, g, ptr[g]);
+                }
+            }
+        }
+        for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+            if (weights.weights) {
+                wrunners[b].finish();
+            } else {
+                runners[b].finish();
+            }
+        }
+    }
 }
 
-template<typename Value_, typename Index_, typename Stat_, typename Block_> 
-void compute_variances(
+/*
+ * Each thread computes the means and variances for all genes across its own
+ * subset of cells. These partial statistics are then combined across threads
+ * with the pairwise update of Chan et al. (1979), which is exact up to
+ * floating-point error. Partial results are always merged in order of the
+ * cell subsets, so the output does not depend on thread scheduling.
+ */
+template<typename Value_, typename Index_, typename Stat_, typename Block_, class Transform_>
+void compute_variances_cell_split(
     const tatami::Matrix<Value_, Index_>& mat,
     const std::vector<ModelGeneVariancesBuffers<Stat_> >& buffers,
     const Block_* const block,
     const std::vector<Index_>& block_size,
-    const int num_threads) 
+    const ModelGeneVariancesOptions& options,
+    const Transform_& transform,
+    const CellWeights<Stat_>& weights,
+    const ComputePath path)
 {
-    if (mat.prefer_rows()) {
-        if (mat.sparse()) {
-            compute_variances_sparse_row(mat, buffers, block, block_size, num_threads);
+    const auto resource = get_memory_resource(options);
+    const auto nblocks = block_size.size();
+    const auto NR = mat.nrow(), NC = mat.ncol();
+    const std::size_t nthreads = options.num_threads;
+    const bool sparse = (path == ComputePath::SPARSE_ROW || path == ComputePath::SPARSE_COLUMN);
+
+    const auto stride = sanisizer::product<std::size_t>(NR, nblocks);
+    const auto total = sanisizer::product<typename std::vector<Stat_>::size_type>(stride, nthreads);
+    auto partial_means = sanisizer::create<std::pmr::vector<Stat_> >(total, resource);
+    auto partial_vars = sanisizer::create<std::pmr::vector<Stat_> >(total, resource);
+    auto partial_counts = sanisizer::create<std::pmr::vector<Index_> >(sanisizer::product<typename std::vector<Index_>::size_type>(nblocks, nthreads), resource);
+    auto partial_weights = sanisizer::create<std::pmr::vector<Stat_> >(weights.weights ? partial_counts.size() : 0, resource);
+
+    const bool extra_active = use_extra_statistics(buffers);
+    std::pmr::vector<ExtraStatistics<Stat_> > partial_extra(resource);
+    if (extra_active) {
+        partial_extra.reserve(nthreads);
+        for (std::size_t t = 0; t < nthreads; ++t) {
+            partial_extra.emplace_back(nblocks, NR, resource);
+        }
+    }
+
+    std::size_t partial_bytes = container_bytes(partial_means, partial_vars, partial_counts, partial_weights);
+    for (const auto& current : partial_extra) {
+        partial_bytes += current.bytes();
+    }
+    const TrackedAllocation tracked_partial(options.allocation_tracker, AllocationPhase::STATISTICS, 0, partial_bytes);
+
+    tatami::parallelize([&](const int thread, const Index_ start, const Index_ length) -> void {
+        const auto offset = stride * static_cast<std::size_t>(thread);
+        const auto means = partial_means.data() + offset;
+        const auto variances = partial_vars.data() + offset;
+        const auto counts = partial_counts.data() + nblocks * static_cast<std::size_t>(thread);
+        if (block) {
+            for (Index_ c = start, end = start + length; c < end; ++c) {
+                ++counts[block[c]];
+            }
         } else {
-            compute_variances_dense_row(mat, buffers, block, block_size, num_threads);
+            counts[0] = length;
         }
-    } else {
-        if (mat.sparse()) {
-            compute_variances_sparse_column(mat, buffers, block, block_size, num_threads);
+
+        // With weights, the partial statistics contain the sums of squares rather than the variances, see weighted_variances.hpp.
+        CellWeights<Stat_> partial;
+        if (weights.weights) {
+            const auto totals = partial_weights.data() + nblocks * static_cast<std::size_t>(thread);
+            for (Index_ c = start, end = start + length; c < end; ++c) {
+                totals[block ? block[c] : 0] += weights.weights[c];
+            }
+            partial.weights = weights.weights;
+            partial.totals = totals;
+        }
+
+        const auto extra = (extra_active ? partial_extra.data() + thread : static_cast<ExtraStatistics<Stat_>*>(NULL));
+        if (path == ComputePath::DENSE_ROW || path == ComputePath::SPARSE_ROW) {
+            compute_partial_variances_row(mat, block, counts, nblocks, sparse, thread, start, length, means, variances, extra, options, transform, partial);
         } else {
-            compute_variances_dense_column(mat, buffers, block, block_size, num_threads);
+            compute_partial_variances_column(mat, block, nblocks, sparse, thread, start, length, means, variances, extra, options, transform, partial);
         }
+    }, NC, options.num_threads);
+
+    tatami::parallelize([&](const int, const Index_ start, const Index_ length) -> void {
+        for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+            for (Index_ r = start, end = start + length; r < end; ++r) {
+                Stat_ count = 0, mean = 0, sum_squares = 0;
+
+                for (std::size_t t = 0; t < nthreads; ++t) {
+                    const Stat_ other_count = (weights.weights ? partial_weights[t * nblocks + b] : partial_counts[t * nblocks + b]);
+                    if (!(other_count > 0)) {
+                        continue;
+                    }
+                    const auto offset = stride * t + b * static_cast<std::size_t>(NR) + static_cast<std::size_t>(r);
+                    const Stat_ other_mean = partial_means[offset];
+                    Stat_ other_sum_squares = 0;
+                    if (weights.weights) {
+                        other_sum_squares = partial_vars[offset];
+                    } else if (other_count > 1) {
+                        other_sum_squares = partial_vars[offset] * (other_count - 1);
+                    }
+
+                    if (count == 0) {
+                        count = other_count;
+                        mean = other_mean;
+                        sum_squares = other_sum_squares;
+                    } else {
+                        const Stat_ combined = count + other_count;
+                        const Stat_ delta = other_mean - mean;
+                        mean += delta * (other_count / combined);
+                        sum_squares += other_sum_squares + delta * delta * (count * other_count / combined);
+                        count = combined;
+                    }
+                }
+
+                buffers[b].means[r] = (count > 0 ? mean : std::numeric_limits<Stat_>::quiet_NaN());
+                buffers[b].variances[r] = (count > 1 ? sum_squares / (count - 1) : std::numeric_limits<Stat_>::quiet_NaN());
+            }
+        }
+    }, NR, options.num_threads);
+
+    if (extra_active) {
+        for (std::size_t t = 1; t < nthreads; ++t) {
+            partial_extra.front().merge(partial_extra[t]);
+        }
+        partial_extra.front().finish(block_size.data());
+        partial_extra.front().transfer(buffers, 0);
     }
 }
 
-template<typename Stat_, typename Index_>
+/*
+ * Rough cost model for each access pattern, in units of a single in-cache
+ * floating-point operation. This is not intended to predict the run time,
+ * only to rank the access patterns, so only the dominant terms are included:
+ *
+ * - Extraction along the preferred dimension costs 1 per value for dense
+ *   extraction or 2 per non-zero value for sparse extraction (value and
+ *   index). Extraction along the other dimension has an additional cost per
+ *   value in the full matrix, i.e., 3 for the strided access of dense
+ *   matrices or 2 to check every primary vector of sparse matrices.
+ * - Each extracted row/column has a fixed overhead of 16. With gene-based
+ *   parallelization, every thread extracts every column for column access;
+ *   with cell-based parallelization, every thread extracts every row.
+ * - The two-pass variance calculation for row access costs 2 per value.
+ *   The running calculation for column access costs 4 per value, with an
+ *   extra 2 per non-zero value for the scattered updates in the sparse case.
+ * - Combining the statistics from each thread costs 4 per gene and block.
+ *
+ * Matrices with mixed preferences (e.g., from combining several matrices)
+ * are handled by interpolating with the reported proportions. The total
+ * cost is then divided by the number of threads that have work to do.
+ */
+constexpr std::array<ComputePath, 4> all_compute_paths { ComputePath::DENSE_ROW, ComputePath::SPARSE_ROW, ComputePath::DENSE_COLUMN, ComputePath::SPARSE_COLUMN };
+
+inline bool is_row_path(const ComputePath path) {
+    return path == ComputePath::DENSE_ROW || path == ComputePath::SPARSE_ROW;
+}
+
+class AccessCostModel {
+public:
+    template<typename Value_, typename Index_>
+    AccessCostModel(const tatami::Matrix<Value_, Index_>& mat, const std::size_t nblocks) : 
+        my_NR(mat.nrow()), // cast is safe as any tatami Index_ can fit into a size_t.
+        my_NC(mat.ncol()),
+        my_nblocks(nblocks),
+        my_row_proportion(mat.prefer_rows_proportion())
+    {
+        const double sparse_proportion = mat.is_sparse_proportion();
+        const double density = (sparse_proportion > 0 ? estimate_density(mat, mat.prefer_rows(), static_cast<Index_>(20)) : 1);
+        initialize(sparse_proportion, density);
+    }
+
+    AccessCostModel(const std::size_t NR, const std::size_t NC, const std::size_t nblocks, const double row_proportion, const double sparse_proportion, const double density) :
+        my_NR(NR),
+        my_NC(NC),
+        my_nblocks(nblocks),
+        my_row_proportion(row_proportion)
+    {
+        initialize(sparse_proportion, density);
+    }
+
+    double compute(const ComputePath path, const int num_threads) const {
+        const bool row = is_row_path(path);
+        const bool sparse = (path == ComputePath::SPARSE_ROW || path == ComputePath::SPARSE_COLUMN);
+        const bool cell_split = use_cell_split(my_NR, my_NC, row, num_threads);
+        const double nthreads = std::max(1, num_threads);
+        const double dNR = my_NR, dNC = my_NC;
+
+        double cost = (sparse ? 2 * my_nonzeros : my_total);
+        cost += (row ? 1 - my_row_proportion : my_row_proportion) * my_secondary_penalty;
+        if (row) {
+            cost += 2 * (sparse ? my_nonzeros : my_total);
+            cost += 16 * dNR * (cell_split ? nthreads : 1);
+        } else {
+            cost += 4 * (sparse ? my_nonzeros : my_total) + (sparse ? 2 * my_nonzeros : 0);
+            cost += 16 * dNC * (cell_split ? 1 : nthreads);
+        }
+
+        double workers = nthreads;
+        if (cell_split) {
+            cost += 4 * dNR * static_cast<double>(my_nblocks) * nthreads;
+            workers = std::min(workers, dNC);
+        } else {
+            workers = std::min(workers, dNR);
+        }
+        return cost / std::max(1.0, workers);
+    }
+
+    std::array<double, 4> compute(const int num_threads) const {
+        std::array<double, 4> output;
+        for (I<decltype(output.size())> p = 0; p < output.size(); ++p) {
+            output[p] = compute(all_compute_paths[p], num_threads);
+        }
+        return output;
+    }
+
+    double density() const {
+        return my_density;
+    }
+
+private:
+    void initialize(const double sparse_proportion, const double density) {
+        my_density = density;
+        my_total = static_cast<double>(my_NR) * static_cast<double>(my_NC);
+        my_nonzeros = my_total * density;
+        my_secondary_penalty = my_total * (sparse_proportion * 2 + (1 - sparse_proportion) * 3);
+    }
+
+    std::size_t my_NR, my_NC, my_nblocks;
+    double my_row_proportion;
+    double my_density, my_total, my_nonzeros, my_secondary_penalty;
+};
+
+/*
+ * If the matrix is entirely sparse and uniformly prefers one dimension, we
+ * use the sparse path along that dimension without estimating the density,
+ * as the estimate requires extra (possibly expensive) accesses to the matrix.
+ * Otherwise, AUTO is returned to indicate that the cost model should be used.
+ */
+inline ComputePath hinted_compute_path(const double sparse_proportion, const double row_proportion) {
+    if (sparse_proportion == 1) {
+        if (row_proportion == 1) {
+            return ComputePath::SPARSE_ROW;
+        } else if (row_proportion == 0) {
+            return ComputePath::SPARSE_COLUMN;
+        }
+    }
+    return ComputePath::AUTO;
+}
+
+/*
+ * For automatic tuning, each thread should be given enough work to amortize
+ * the cost of its creation and the imbalance between threads. The creation
+ * of a thread costs tens of microseconds, which is roughly 10^5 units in our
+ * cost model, so we require several times that per thread. Similarly, trend
+ * fitting costs a few hundred units per gene, so we require a few thousand
+ * genes per thread before splitting it.
+ */
+constexpr double auto_tune_cost_per_thread = 1 << 19;
+
+constexpr std::size_t auto_tune_genes_per_fit_thread = 2000;
+
+inline int choose_fit_num_threads(const std::size_t NR, const ModelGeneVariancesOptions& options) {
+    if (!options.auto_tune) {
+        return options.num_threads;
+    }
+    const auto hw = detect_hardware();
+    return std::max<std::size_t>(1, std::min<std::size_t>(hw.num_cores, NR / auto_tune_genes_per_fit_thread));
+}
+
+template<typename Value_>
+void tune_granularity(const std::size_t NR, const std::size_t nblocks, const HardwareInfo& hw, ModelGeneVariancesPlan& plan) {
+    if (plan.cell_split) {
+        return;
+    }
+    const std::size_t genes_per_thread = NR / static_cast<std::size_t>(plan.num_threads) + 1;
+
+    if (plan.path == ComputePath::DENSE_COLUMN && plan.column_batch_size == 0) {
+        // Batching is only useful if the running statistics for each thread do not already fit in the L1 cache.
+        // If so, each batch should fit in the L2 cache alongside the statistics for the current tile.
+        const double stat_bytes = static_cast<double>(genes_per_thread) * static_cast<double>(nblocks) * 2 * sizeof(double);
+        if (stat_bytes > static_cast<double>(hw.l1_cache_size)) {
+            const std::size_t per_column = genes_per_thread * std::max(sizeof(Value_), sizeof(double));
+            plan.column_batch_size = std::max<std::size_t>(2, std::min<std::size_t>(256, hw.l2_cache_size / 2 / per_column));
+        }
+    }
+
+    if (plan.path == ComputePath::SPARSE_COLUMN && plan.sparse_column_tile_cache_size == 0) {
+        // The tile size itself is chosen from the density, see compute_variances_sparse_column().
+        plan.sparse_column_tile_cache_size = hw.l2_cache_size;
+    }
+}
+
+// The cost model is only created if needed, as estimating the density requires a pass over some of the matrix.
+template<typename Value_, class CreateModel_>
+ModelGeneVariancesPlan plan_compute_variances(
+    const std::size_t NR,
+    const std::size_t NC,
+    const std::size_t nblocks,
+    CreateModel_ create_model,
+    const ComputePath hinted,
+    const ModelGeneVariancesOptions& options
+) {
+    ModelGeneVariancesPlan plan;
+    plan.num_threads = options.num_threads;
+    plan.column_batch_size = options.column_batch_size;
+    plan.sparse_column_tile_cache_size = options.sparse_column_tile_cache_size;
+    plan.fit_num_threads = choose_fit_num_threads(NR, options);
+
+    if (options.compute_path != ComputePath::AUTO && !options.auto_tune) {
+        plan.path = options.compute_path;
+        plan.costs.fill(std::numeric_limits<double>::quiet_NaN());
+        plan.cell_split = use_cell_split(NR, NC, is_row_path(plan.path), plan.num_threads);
+        return plan;
+    }
+
+    if (options.compute_path == ComputePath::AUTO && hinted != ComputePath::AUTO && !options.auto_tune) {
+        plan.path = hinted;
+        plan.costs.fill(std::numeric_limits<double>::quiet_NaN());
+        plan.cell_split = use_cell_split(NR, NC, is_row_path(plan.path), plan.num_threads);
+        return plan;
+    }
+
+    const AccessCostModel model = create_model();
+    plan.density = model.density();
+    HardwareInfo hw;
+    if (options.auto_tune) {
+        // Using the serial cost of the cheapest path to decide how many threads are worthwhile.
+        hw = detect_hardware();
+        double serial = 0;
+        if (options.compute_path != ComputePath::AUTO) {
+            serial = model.compute(options.compute_path, 1);
+        } else {
+            const auto serial_costs = model.compute(1);
+            serial = *std::min_element(serial_costs.begin(), serial_costs.end());
+        }
+        const double desired = std::floor(serial / auto_tune_cost_per_thread);
+        plan.num_threads = std::max(1.0, std::min(static_cast<double>(hw.num_cores), desired));
+    }
+
+    if (options.compute_path != ComputePath::AUTO) {
+        plan.path = options.compute_path;
+        plan.costs.fill(std::numeric_limits<double>::quiet_NaN());
+    } else {
+        plan.costs = model.compute(plan.num_threads);
+        const auto chosen = std::min_element(plan.costs.begin(), plan.costs.end()) - plan.costs.begin();
+        plan.path = all_compute_paths[chosen];
+    }
+
+    plan.cell_split = use_cell_split(NR, NC, is_row_path(plan.path), plan.num_threads);
+    if (options.auto_tune) {
+        tune_granularity<Value_>(NR, nblocks, hw, plan);
+    }
+    return plan;
+}
+
+template<typename Value_, typename Index_>
+ModelGeneVariancesPlan plan_compute_variances(const tatami::Matrix<Value_, Index_>& mat, const std::size_t nblocks, const ModelGeneVariancesOptions& options) {
+    return plan_compute_variances<Value_>(
+        mat.nrow(), // cast is safe as any tatami Index_ can fit into a size_t.
+        mat.ncol(),
+        nblocks,
+        [&]() -> AccessCostModel { return AccessCostModel(mat, nblocks); },
+        hinted_compute_path(mat.is_sparse_proportion(), mat.prefer_rows_proportion()),
+        options
+    );
+}
+
+inline ModelGeneVariancesOptions apply_plan(const ModelGeneVariancesOptions& options, const ModelGeneVariancesPlan& plan) {
+    auto copy = options;
+    copy.num_threads = plan.num_threads;
+    copy.column_batch_size = plan.column_batch_size;
+    copy.sparse_column_tile_cache_size = plan.sparse_column_tile_cache_size;
+    return copy;
+}
+
+template<typename Value_, typename Index_, typename Stat_, typename Block_, class Transform_>
+void compute_variances(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const std::vector<ModelGeneVariancesBuffers<Stat_> >& buffers,
+    const Block_* const block,
+    const std::vector<Index_>& block_size,
+    const ModelGeneVariancesOptions& options,
+    const Transform_& transform,
+    const CellWeights<Stat_>& weights)
+{
+    const auto plan = plan_compute_variances(mat, block_size.size(), options);
+    const auto tuned = apply_plan(options, plan);
+
+    // Statistics are only complete at the end for the column access patterns or when splitting cells.
+    const auto report_all = [&]() -> void {
+        const Index_ NR = mat.nrow();
+        if (options.gene_chunk_callback && NR > 0) {
+            options.gene_chunk_callback(0, NR);
+        }
+    };
+
+    if (plan.cell_split) {
+        compute_variances_cell_split(mat, buffers, block, block_size, tuned, transform, weights, plan.path);
+        report_all();
+        return;
+    }
+
+    switch (plan.path) {
+        case ComputePath::SPARSE_ROW:
+            compute_variances_sparse_row(mat, buffers, block, block_size, tuned, transform, weights);
+            break;
+        case ComputePath::DENSE_ROW:
+            compute_variances_dense_row(mat, buffers, block, block_size, tuned, transform, weights);
+            break;
+        case ComputePath::SPARSE_COLUMN:
+            compute_variances_sparse_column(mat, buffers, block, block_size, tuned, transform, weights, plan.density);
+            report_all();
+            break;
+        default:
+            if (tuned.column_batch_size > 1) {
+                compute_variances_dense_column_batched(mat, buffers, block, block_size, tuned, transform, weights);
+            } else {
+                compute_variances_dense_column(mat, buffers, block, block_size, tuned, transform, weights);
+            }
+            report_all();
+            break;
+    }
+}
+
+template<typename Value_, typename Index_, typename Stat_, typename Block_, class Transform_>
+void compute_variances(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const std::vector<ModelGeneVariancesBuffers<Stat_> >& buffers,
+    const Block_* const block,
+    const std::vector<Index_>& block_size,
+    const ModelGeneVariancesOptions& options,
+    const Transform_& transform)
+{
+    compute_variances(mat, buffers, block, block_size, options, transform, CellWeights<Stat_>());
+}
+
+inline ModelGeneVariancesOptions drop_gene_chunk_callback(const ModelGeneVariancesOptions& options) {
+    auto copy = options;
+    copy.gene_chunk_callback = nullptr;
+    return copy;
+}
+
+template<typename Value_, typename Index_, typename Stat_, typename Block_> 
+void compute_variances(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const std::vector<ModelGeneVariancesBuffers<Stat_> >& buffers,
+    const Block_* const block,
+    const std::vector<Index_>& block_size,
+    const ModelGeneVariancesOptions& options) 
+{
+    compute_variances(mat, buffers, block, block_size, options, IdentityTransform());
+}
+
+template<typename Stat_, typename BlockSize_>
 void extract_weights(
     const std::vector<Stat_>& block_weights,
-    const std::vector<Index_>& block_size,
-    const Index_ min_size,
+    const std::vector<BlockSize_>& block_size,
+    const BlockSize_ min_size,
     std::vector<Stat_>& tmp_weights
 ) {
     const auto nblocks = block_weights.size();
@@ -501,11 +2154,11 @@ void extract_weights(
     }
 }
 
-template<typename Stat_, typename Index_, class Function_>
+template<typename Stat_, typename BlockSize_, class Function_>
 void extract_pointers(
     const std::vector<ModelGeneVariancesBuffers<Stat_> >& per_block, 
-    const std::vector<Index_>& block_size,
-    const Index_ min_size,
+    const std::vector<BlockSize_>& block_size,
+    const BlockSize_ min_size,
     const Function_ fun,
     std::vector<Stat_*>& tmp_pointers
 ) {
@@ -515,75 +2168,43 @@ void extract_pointers(
         if (block_size[b] < min_size) { // skip blocks with insufficient cells.
             continue;
         }
-        tmp_pointers.push_back(fun(per_block[b]));
-    }
-}
-
-}
-/**
- * @endcond
- */
-
-/** 
- * Model the per-feature variances from a log-expression matrix with blocking.
- * The mean and variance of each gene is computed separately for all cells in each block,
- * and a separate trend is fitted to each block to obtain residuals (see `model_gene_variances()`).
- * This ensures that sample and batch effects do not confound the variance estimates.
- *
- * We also compute the average of each statistic across blocks, using the policy described in `ModelGeneVariancesOptions::average_policy`.
- * This is either a quantile (i.e., median, by default) or weighted mean of values for each gene.
- * Weights are determined by `ModelGeneVariancesOptions::block_weight_policy` and are based on the size of each block.
- * The average residual is particularly useful for feature selection with `choose_highly_variable_genes()`.
- *
- * @tparam Value_ Data type of the matrix.
- * @tparam Index_ Integer type of the row/column indices.
- * @tparam Block_ Integer type of the block IDs.
- * @tparam Stat_ Floating-point type of the output statistics.
- *
- * @param mat Matrix of expression values, typically after normalization and log-transformation.
- * Rows should be genes while columns should be cells.
- * @param[in] block Pointer to an array of length equal to the number of cells.
- * Each entry should be a 0-based block identifier in \f$[0, B)\f$ where \f$B\f$ is the total number of blocks.
- * `block` can also be a `nullptr`, in which case all cells are assumed to belong to the same block.
- * @param[out] buffers Collection of pointers of arrays in which to store the output statistics.
- * The length of `ModelGeneVariancesBlockedResults::per_block` should be equal to the number of blocks.
- * @param options Further options.
- */
-template<typename Value_, typename Index_, typename Block_, typename Stat_>
-void model_gene_variances_blocked(
-    const tatami::Matrix<Value_, Index_>& mat, 
-    const Block_* const block, 
-    const ModelGeneVariancesBlockedBuffers<Stat_>& buffers,
-    const ModelGeneVariancesOptions& options
-) {
-    const Index_ NR = mat.nrow(), NC = mat.ncol();
-    std::vector<Index_> block_size;
+        tmp_pointers.push_back(fun(per_block[b]));
+    }
+}
 
-    if (block) {
-        block_size = tatami_stats::tabulate_groups(block, NC);
-        internal::compute_variances(mat, buffers.per_block, block, block_size, options.num_threads);
+
+template<typename Index_, typename BlockSize_, typename Stat_>
+void fit_block_trend(
+    const Index_ NR,
+    const BlockSize_ block_size,
+    const ModelGeneVariancesBuffers<Stat_>& current,
+    FitVarianceTrendWorkspace<Stat_>& work,
+    const FitVarianceTrendOptions& fopt
+) {
+    if (current.fitted == NULL || current.residuals == NULL) {
+        return;
+    }
+    if (block_size >= 2) {
+        fit_variance_trend(NR, current.means, current.variances, current.fitted, current.residuals, work, fopt);
     } else {
-        block_size.push_back(NC); // everything is one big block.
-        internal::compute_variances(mat, buffers.per_block, block, block_size, options.num_threads);
+        std::fill_n(current.fitted, NR, std::numeric_limits<double>::quiet_NaN());
+        std::fill_n(current.residuals, NR, std::numeric_limits<double>::quiet_NaN());
     }
-    const auto nblocks = block_size.size();
+}
 
-    FitVarianceTrendWorkspace<Stat_> work;
-    auto fopt = options.fit_variance_trend_options;
-    fopt.num_threads = options.num_threads;
+template<typename Index_, typename BlockSize_, typename Stat_>
+void average_blocks(
+    const Index_ NR,
+    const std::vector<BlockSize_>& block_size,
+    const ModelGeneVariancesBlockedBuffers<Stat_>& buffers,
+    const ModelGeneVariancesOptions& options,
+    ModelGeneVariancesWorkspace<Stat_, Index_>& workspace
+) {
+    const auto nblocks = block_size.size();
     bool all_trends_fitted = true;
-
-    for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
-        const auto& current = buffers.per_block[b];
+    for (const auto& current : buffers.per_block) {
         if (current.fitted == NULL || current.residuals == NULL) {
             all_trends_fitted = false;
-            continue;
-        }
-        if (block_size[b] >= 2) {
-            fit_variance_trend(NR, current.means, current.variances, current.fitted, current.residuals, work, fopt);
-        } else {
-            std::fill_n(current.fitted, NR, std::numeric_limits<double>::quiet_NaN());
-            std::fill_n(current.residuals, NR, std::numeric_limits<double>::quiet_NaN());
         }
     }
 
@@ -596,63 +2217,316 @@ void model_gene_variances_blocked(
         throw std::runtime_error("cannot compute average fitted values/residuals without per-block trend fits");
     }
 
-    std::vector<Stat_*> tmp_pointers;
+    auto& tmp_pointers = workspace.tmp_pointers;
     tmp_pointers.reserve(nblocks);
+    const TrackedAllocation tracked_pointers(options.allocation_tracker, AllocationPhase::AVERAGE, 0, container_bytes(tmp_pointers));
 
     if (options.block_average_policy == BlockAveragePolicy::MEAN) {
-        const auto block_weight = scran_blocks::compute_weights<Stat_>(block_size, options.block_weight_policy, options.variable_block_weight_parameters);
-        std::vector<Stat_> tmp_weights;
+        auto& block_weight = workspace.block_weight;
+        sanisizer::resize(block_weight, nblocks);
+        scran_blocks::compute_weights(nblocks, block_size.data(), options.block_weight_policy, options.variable_block_weight_parameters, block_weight.data());
+        auto& tmp_weights = workspace.tmp_weights;
         tmp_weights.reserve(nblocks);
+        const TrackedAllocation tracked_weights(options.allocation_tracker, AllocationPhase::AVERAGE, 0, container_bytes(block_weight, tmp_weights));
 
         if (ave_means) {
-            internal::extract_weights(block_weight, block_size, static_cast<Index_>(1), tmp_weights);
-            internal::extract_pointers(buffers.per_block, block_size, static_cast<Index_>(1), [](const auto& x) -> Stat_* { return x.means; }, tmp_pointers);
+            extract_weights(block_weight, block_size, static_cast<BlockSize_>(1), tmp_weights);
+            extract_pointers(buffers.per_block, block_size, static_cast<BlockSize_>(1), [](const auto& x) -> Stat_* { return x.means; }, tmp_pointers);
             scran_blocks::parallel_weighted_means(NR, tmp_pointers, tmp_weights.data(), ave_means, /* skip_nan = */ false);
         }
 
         // Skip blocks without enough cells to compute the variance.
-        internal::extract_weights(block_weight, block_size, static_cast<Index_>(2), tmp_weights);
+        extract_weights(block_weight, block_size, static_cast<BlockSize_>(2), tmp_weights);
 
         if (ave_variances) {
-            internal::extract_pointers(buffers.per_block, block_size, static_cast<Index_>(2), [](const auto& x) -> Stat_* { return x.variances; }, tmp_pointers);
+            extract_pointers(buffers.per_block, block_size, static_cast<BlockSize_>(2), [](const auto& x) -> Stat_* { return x.variances; }, tmp_pointers);
             scran_blocks::parallel_weighted_means(NR, tmp_pointers, tmp_weights.data(), ave_variances, /* skip_nan = */ false);
         }
 
         if (ave_fitted) {
-            internal::extract_pointers(buffers.per_block, block_size, static_cast<Index_>(2), [](const auto& x) -> Stat_* { return x.fitted; }, tmp_pointers);
+            extract_pointers(buffers.per_block, block_size, static_cast<BlockSize_>(2), [](const auto& x) -> Stat_* { return x.fitted; }, tmp_pointers);
             scran_blocks::parallel_weighted_means(NR, tmp_pointers, tmp_weights.data(), ave_fitted, /* skip_nan = */ false);
         }
 
         if (ave_residuals) {
-            internal::extract_pointers(buffers.per_block, block_size, static_cast<Index_>(2), [](const auto& x) -> Stat_* { return x.residuals; }, tmp_pointers);
+            extract_pointers(buffers.per_block, block_size, static_cast<BlockSize_>(2), [](const auto& x) -> Stat_* { return x.residuals; }, tmp_pointers);
             scran_blocks::parallel_weighted_means(NR, tmp_pointers, tmp_weights.data(), ave_residuals, /* skip_nan = */ false);
         }
 
     } else if (options.block_average_policy == BlockAveragePolicy::QUANTILE) {
         if (ave_means) {
-            internal::extract_pointers(buffers.per_block, block_size, static_cast<Index_>(1), [](const auto& x) -> Stat_* { return x.means; }, tmp_pointers);
+            extract_pointers(buffers.per_block, block_size, static_cast<BlockSize_>(1), [](const auto& x) -> Stat_* { return x.means; }, tmp_pointers);
             scran_blocks::parallel_quantiles(NR, tmp_pointers, options.block_quantile, ave_means, /* skip_nan = */ false);
         }
 
         // Skip blocks without enough cells to compute the variance.
 
         if (ave_variances) {
-            internal::extract_pointers(buffers.per_block, block_size, static_cast<Index_>(2), [](const auto& x) -> Stat_* { return x.variances; }, tmp_pointers);
+            extract_pointers(buffers.per_block, block_size, static_cast<BlockSize_>(2), [](const auto& x) -> Stat_* { return x.variances; }, tmp_pointers);
             scran_blocks::parallel_quantiles(NR, tmp_pointers, options.block_quantile, ave_variances, /* skip_nan = */ false);
         }
 
         if (ave_fitted) {
-            internal::extract_pointers(buffers.per_block, block_size, static_cast<Index_>(2), [](const auto& x) -> Stat_* { return x.fitted; }, tmp_pointers);
+            extract_pointers(buffers.per_block, block_size, static_cast<BlockSize_>(2), [](const auto& x) -> Stat_* { return x.fitted; }, tmp_pointers);
             scran_blocks::parallel_quantiles(NR, tmp_pointers, options.block_quantile, ave_fitted, /* skip_nan = */ false);
         }
 
         if (ave_residuals) {
-            internal::extract_pointers(buffers.per_block, block_size, static_cast<Index_>(2), [](const auto& x) -> Stat_* { return x.residuals; }, tmp_pointers);
+            extract_pointers(buffers.per_block, block_size, static_cast<BlockSize_>(2), [](const auto& x) -> Stat_* { return x.residuals; }, tmp_pointers);
             scran_blocks::parallel_quantiles(NR, tmp_pointers, options.block_quantile, ave_residuals, /* skip_nan = */ false);
         }
     }
 }
 
+template<typename Index_, typename BlockSize_, typename Stat_>
+void average_blocks(
+    const Index_ NR,
+    const std::vector<BlockSize_>& block_size,
+    const ModelGeneVariancesBlockedBuffers<Stat_>& buffers,
+    const ModelGeneVariancesOptions& options
+) {
+    ModelGeneVariancesWorkspace<Stat_, Index_> workspace;
+    average_blocks(NR, block_size, buffers, options, workspace);
+}
+
+template<typename Index_, typename BlockSize_, typename Stat_>
+void fit_and_average(
+    const Index_ NR,
+    const std::vector<BlockSize_>& block_size,
+    const ModelGeneVariancesBlockedBuffers<Stat_>& buffers,
+    const ModelGeneVariancesOptions& options,
+    ModelGeneVariancesWorkspace<Stat_, Index_>& workspace
+) {
+    auto& work = workspace.trend;
+    auto fopt = options.fit_variance_trend_options;
+    fopt.num_threads = choose_fit_num_threads(NR, options); // cast is safe as any tatami Index_ can fit into a size_t.
+
+    // The workspace only grows as it is re-used across blocks, so its final size is the high-water mark.
+    TrackedAllocation tracked_work(options.allocation_tracker, AllocationPhase::TREND, 0, 0);
+    const auto nblocks = block_size.size();
+    for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+        fit_block_trend(NR, block_size[b], buffers.per_block[b], work, fopt);
+        tracked_work.update(container_bytes(work.kept, work.sort_buffer, work.chunk_counts, work.xbuffer, work.ybuffer));
+    }
+
+    average_blocks(NR, block_size, buffers, options, workspace);
+}
+
+template<typename Index_, typename BlockSize_, typename Stat_>
+void fit_and_average(
+    const Index_ NR,
+    const std::vector<BlockSize_>& block_size,
+    const ModelGeneVariancesBlockedBuffers<Stat_>& buffers,
+    const ModelGeneVariancesOptions& options
+) {
+    ModelGeneVariancesWorkspace<Stat_, Index_> workspace;
+    fit_and_average(NR, block_size, buffers, options, workspace);
+}
+
+// Same as tatami_stats::tabulate_groups(), but re-using the existing allocation.
+template<typename Block_, typename Index_>
+void tabulate_blocks(const Block_* const block, const Index_ NC, std::vector<Index_>& block_size) {
+    block_size.clear();
+    for (Index_ c = 0; c < NC; ++c) {
+        const std::size_t b = block[c];
+        if (b >= block_size.size()) {
+            sanisizer::resize(block_size, sanisizer::sum<std::size_t>(b, 1));
+        }
+        ++block_size[b];
+    }
+}
+
+template<typename Value_, typename Index_, typename Block_, typename Stat_>
+void compute_blocked_variances(
+    const tatami::Matrix<Value_, Index_>& mat, 
+    const Block_* const block, 
+    const ModelGeneVariancesBlockedBuffers<Stat_>& buffers,
+    const ModelGeneVariancesOptions& options,
+    ModelGeneVariancesWorkspace<Stat_, Index_>& workspace
+) {
+    const Index_ NC = mat.ncol();
+    auto& block_size = workspace.block_size;
+    if (block) {
+        tabulate_blocks(block, NC, block_size);
+    } else {
+        block_size.clear();
+        block_size.push_back(NC); // everything is one big block.
+    }
+
+    if (options.memory_resource) {
+        compute_variances(mat, buffers.per_block, block, block_size, options);
+    } else {
+        auto copy = options;
+        copy.memory_resource = workspace.get_pool();
+        compute_variances(mat, buffers.per_block, block, block_size, copy);
+    }
+}
+
+template<typename Value_, typename Index_, typename Block_, typename Stat_>
+std::vector<Index_> compute_blocked_variances(
+    const tatami::Matrix<Value_, Index_>& mat, 
+    const Block_* const block, 
+    const ModelGeneVariancesBlockedBuffers<Stat_>& buffers,
+    const ModelGeneVariancesOptions& options
+) {
+    const Index_ NC = mat.ncol();
+    std::vector<Index_> block_size;
+    if (block) {
+        block_size = tatami_stats::tabulate_groups(block, NC);
+    } else {
+        block_size.push_back(NC); // everything is one big block.
+    }
+    compute_variances(mat, buffers.per_block, block, block_size, options);
+    return block_size;
+}
+
+inline bool use_average(const ModelGeneVariancesOptions& options) {
+    return options.compute_average /* for back-compatibility */ && options.block_average_policy != BlockAveragePolicy::NONE;
+}
+
+template<typename Stat_>
+ModelGeneVariancesBuffers<Stat_> get_buffers(ModelGeneVariancesResults<Stat_>& results, const bool present, const bool trend) {
+    ModelGeneVariancesBuffers<Stat_> buffers;
+    if (!present) {
+        buffers.means = NULL;
+        buffers.variances = NULL;
+        buffers.fitted = NULL;
+        buffers.residuals = NULL;
+        return buffers;
+    }
+
+    buffers.means = results.means.data();
+    buffers.variances = results.variances.data();
+    if (trend) {
+        buffers.fitted = results.fitted.data();
+        buffers.residuals = results.residuals.data();
+    } else {
+        buffers.fitted = NULL;
+        buffers.residuals = NULL;
+    }
+
+    if (!results.detected.empty()) {
+        buffers.detected = results.detected.data();
+        buffers.sums = results.sums.data();
+        buffers.minimum = results.minimum.data();
+        buffers.maximum = results.maximum.data();
+    }
+    return buffers;
+}
+
+template<typename Stat_>
+ModelGeneVariancesBlockedBuffers<Stat_> get_blocked_buffers(ModelGeneVariancesBlockedResults<Stat_>& results, const bool do_average, const bool trend) {
+    ModelGeneVariancesBlockedBuffers<Stat_> buffers;
+    const auto nblocks = results.per_block.size();
+    sanisizer::resize(buffers.per_block, nblocks);
+    for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+        buffers.per_block[b] = get_buffers(results.per_block[b], true, trend);
+    }
+    buffers.average = get_buffers(results.average, do_average, trend);
+    return buffers;
+}
+
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Plan the calculation of the per-gene statistics in `model_gene_variances()` and friends.
+ * This estimates the cost of each access pattern from the dimensions of the matrix, the number of blocks and threads,
+ * the sparsity of the matrix (estimated from a sample of rows or columns),
+ * and the hints about the preferred access pattern and sparsity from `tatami::Matrix::prefer_rows_proportion()` and `tatami::Matrix::is_sparse_proportion()`.
+ * The access pattern with the lowest estimated cost is chosen, unless a specific pattern is forced via `ModelGeneVariancesOptions::compute_path`.
+ * If the matrix is entirely sparse and uniformly prefers one dimension, the sparse access pattern along that dimension is chosen without estimating the sparsity,
+ * see `ModelGeneVariancesPlan::costs` for details.
+ * If `ModelGeneVariancesOptions::auto_tune = true`, the plan also contains the automatically chosen number of threads and work granularity.
+ *
+ * For the same matrix, number of blocks and options, the returned plan is the one used by `model_gene_variances()`, `model_gene_variances_blocked()` and `model_gene_variances_from_counts()`.
+ * This can be used to check how the statistics are computed in practice, e.g., to decide whether `ModelGeneVariancesOptions::compute_path` should be set.
+ *
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ *
+ * @param mat Matrix of expression values.
+ * Rows should be genes while columns should be cells.
+ * @param num_blocks Number of blocks, i.e., one plus the largest block identifier.
+ * This should be 1 if no blocking is performed.
+ * @param options Further options.
+ *
+ * @return Plan for computing the per-gene statistics.
+ */
+template<typename Value_, typename Index_>
+ModelGeneVariancesPlan plan_model_gene_variances(const tatami::Matrix<Value_, Index_>& mat, const std::size_t num_blocks, const ModelGeneVariancesOptions& options) {
+    return internal::plan_compute_variances(mat, num_blocks, options);
+}
+
+/** 
+ * Model the per-feature variances from a log-expression matrix with blocking.
+ * The mean and variance of each gene is computed separately for all cells in each block,
+ * and a separate trend is fitted to each block to obtain residuals (see `model_gene_variances()`).
+ * This ensures that sample and batch effects do not confound the variance estimates.
+ *
+ * We also compute the average of each statistic across blocks, using the policy described in `ModelGeneVariancesOptions::average_policy`.
+ * This is either a quantile (i.e., median, by default) or weighted mean of values for each gene.
+ * Weights are determined by `ModelGeneVariancesOptions::block_weight_policy` and are based on the size of each block.
+ * The average residual is particularly useful for feature selection with `choose_highly_variable_genes()`.
+ *
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam Block_ Integer type of the block IDs.
+ * @tparam Stat_ Floating-point type of the output statistics.
+ *
+ * @param mat Matrix of expression values, typically after normalization and log-transformation.
+ * Rows should be genes while columns should be cells.
+ * @param[in] block Pointer to an array of length equal to the number of cells.
+ * Each entry should be a 0-based block identifier in \f$[0, B)\f$ where \f$B\f$ is the total number of blocks.
+ * `block` can also be a `nullptr`, in which case all cells are assumed to belong to the same block.
+ * @param[out] buffers Collection of pointers of arrays in which to store the output statistics.
+ * The length of `ModelGeneVariancesBlockedResults::per_block` should be equal to the number of blocks.
+ * @param options Further options.
+ */
+template<typename Value_, typename Index_, typename Block_, typename Stat_>
+void model_gene_variances_blocked(
+    const tatami::Matrix<Value_, Index_>& mat, 
+    const Block_* const block, 
+    const ModelGeneVariancesBlockedBuffers<Stat_>& buffers,
+    const ModelGeneVariancesOptions& options
+) {
+    const auto block_size = internal::compute_blocked_variances(mat, block, buffers, options);
+    internal::fit_and_average(mat.nrow(), block_size, buffers, options);
+}
+
+/** 
+ * Overload of `model_gene_variances_blocked()` that re-uses a workspace across calls.
+ * This is useful for reducing the overhead of many calls on small matrices, e.g., subsets of cells.
+ *
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam Block_ Integer type of the block IDs.
+ * @tparam Stat_ Floating-point type of the output statistics.
+ *
+ * @param mat Matrix of expression values, typically after normalization and log-transformation.
+ * Rows should be genes while columns should be cells.
+ * @param[in] block Pointer to an array of length equal to the number of cells, containing 0-based block identifiers.
+ * This may also be a `nullptr` in which case all cells are assumed to belong to the same block.
+ * @param[out] buffers Collection of pointers of arrays in which to store the output statistics.
+ * The length of `ModelGeneVariancesBlockedResults::per_block` should be equal to the number of blocks.
+ * @param options Further options.
+ * @param workspace Workspace for temporary data structures.
+ * This may be re-used across calls with different matrices.
+ */
+template<typename Value_, typename Index_, typename Block_, typename Stat_>
+void model_gene_variances_blocked(
+    const tatami::Matrix<Value_, Index_>& mat, 
+    const Block_* const block, 
+    const ModelGeneVariancesBlockedBuffers<Stat_>& buffers,
+    const ModelGeneVariancesOptions& options,
+    ModelGeneVariancesWorkspace<Stat_, Index_>& workspace
+) {
+    internal::compute_blocked_variances(mat, block, buffers, options, workspace);
+    internal::fit_and_average(mat.nrow(), workspace.block_size, buffers, options, workspace);
+}
+
 /** 
  * Model the per-gene variances as a function of the mean in single-cell expression data.
  * We compute the mean and variance for each gene and fit a trend to the variances with respect to the means using `fit_variance_trend()`.
@@ -687,6 +2561,39 @@ void model_gene_variances(
     model_gene_variances_blocked(mat, static_cast<Index_*>(NULL), bbuffers, options);
 }
 
+/** 
+ * Overload of `model_gene_variances()` that re-uses a workspace across calls.
+ * This is useful for reducing the overhead of many calls on small matrices, e.g., subsets of cells.
+ *
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam Stat_ Floating-point type of the output statistics.
+ *
+ * @param mat Matrix of expression values, typically after normalization and log-transformation.
+ * Rows should be genes while columns should be cells.
+ * @param buffers Collection of buffers in which to store the computed statistics.
+ * @param options Further options.
+ * @param workspace Workspace for temporary data structures.
+ * This may be re-used across calls with different matrices.
+ */
+template<typename Value_, typename Index_, typename Stat_> 
+void model_gene_variances(
+    const tatami::Matrix<Value_, Index_>& mat, 
+    ModelGeneVariancesBuffers<Stat_> buffers,
+    const ModelGeneVariancesOptions& options,
+    ModelGeneVariancesWorkspace<Stat_, Index_>& workspace)
+{
+    ModelGeneVariancesBlockedBuffers<Stat_> bbuffers;
+    bbuffers.per_block.emplace_back(std::move(buffers));
+
+    bbuffers.average.means = NULL;
+    bbuffers.average.variances = NULL;
+    bbuffers.average.fitted = NULL;
+    bbuffers.average.residuals = NULL;
+
+    model_gene_variances_blocked(mat, static_cast<Index_*>(NULL), bbuffers, options, workspace);
+}
+
 /** 
  * Overload of `model_gene_variances()` that allocates space for the output statistics.
  *
@@ -702,21 +2609,32 @@ void model_gene_variances(
  */
 template<typename Stat_ = double, typename Value_, typename Index_>
 ModelGeneVariancesResults<Stat_> model_gene_variances(const tatami::Matrix<Value_, Index_>& mat, const ModelGeneVariancesOptions& options) {
-    ModelGeneVariancesResults<Stat_> output(mat.nrow(), options.trend); // cast is safe, as any tatami Index_ can always fit into a size_t.
-
-    ModelGeneVariancesBuffers<Stat_> buffers;
-    buffers.means = output.means.data();
-    buffers.variances = output.variances.data();
-
-    if (options.trend) {
-        buffers.fitted = output.fitted.data();
-        buffers.residuals = output.residuals.data();
-    } else {
-        buffers.fitted = NULL;
-        buffers.residuals = NULL;
-    }
+    ModelGeneVariancesResults<Stat_> output(mat.nrow(), options.trend, options.extra_statistics); // cast is safe, as any tatami Index_ can always fit into a size_t.
+    internal::track_results(options.allocation_tracker, output);
+    model_gene_variances(mat, internal::get_buffers(output, true, options.trend), options);
+    return output;
+}
 
-    model_gene_variances(mat, std::move(buffers), options);
+/** 
+ * Overload of `model_gene_variances()` that allocates space for the output statistics and re-uses a workspace across calls.
+ *
+ * @tparam Stat_ Floating-point type of the output statistics.
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ *
+ * @param mat Matrix of expression values, typically after normalization and log-transformation.
+ * Rows should be genes while columns should be cells.
+ * @param options Further options.
+ * @param workspace Workspace for temporary data structures.
+ * This may be re-used across calls with different matrices.
+ *
+ * @return Results of the variance modelling.
+ */
+template<typename Stat_, typename Value_, typename Index_>
+ModelGeneVariancesResults<Stat_> model_gene_variances(const tatami::Matrix<Value_, Index_>& mat, const ModelGeneVariancesOptions& options, ModelGeneVariancesWorkspace<Stat_, Index_>& workspace) {
+    ModelGeneVariancesResults<Stat_> output(mat.nrow(), options.trend, options.extra_statistics); // cast is safe, as any tatami Index_ can always fit into a size_t.
+    internal::track_results(options.allocation_tracker, output);
+    model_gene_variances(mat, internal::get_buffers(output, true, options.trend), options, workspace);
     return output;
 }
 
@@ -741,49 +2659,61 @@ template<typename Stat_ = double, typename Value_, typename Index_, typename Blo
 ModelGeneVariancesBlockedResults<Stat_> model_gene_variances_blocked(const tatami::Matrix<Value_, Index_>& mat, const Block_* const block, const ModelGeneVariancesOptions& options) {
     const auto nblocks = (block ? tatami_stats::total_groups(block, mat.ncol()) : 1);
 
-    const bool do_average = options.compute_average /* for back-compatibility */ && options.block_average_policy != BlockAveragePolicy::NONE;
+    const bool do_average = internal::use_average(options);
     ModelGeneVariancesBlockedResults<Stat_> output(
         mat.nrow(), // cast is safe, any tatami Index_ can always fit into a size_t.
         nblocks,
         do_average,
-        options.trend
+        options.trend,
+        options.extra_statistics
     );
+    internal::track_results(options.allocation_tracker, output);
 
-    ModelGeneVariancesBlockedBuffers<Stat_> buffers;
-    sanisizer::resize(buffers.per_block, nblocks);
-    for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
-        auto& current = buffers.per_block[b];
-        current.means = output.per_block[b].means.data();
-        current.variances = output.per_block[b].variances.data();
-
-        if (options.trend) {
-            current.fitted = output.per_block[b].fitted.data();
-            current.residuals = output.per_block[b].residuals.data();
-        } else {
-            current.fitted = NULL;
-            current.residuals = NULL;
-        }
-    }
+    const auto buffers = internal::get_blocked_buffers(output, do_average, options.trend);
+    model_gene_variances_blocked(mat, block, buffers, options);
+    return output;
+}
 
-    if (!do_average) {
-        buffers.average.means = NULL;
-        buffers.average.variances = NULL;
-        buffers.average.fitted = NULL;
-        buffers.average.residuals = NULL;
-    } else {
-        buffers.average.means = output.average.means.data();
-        buffers.average.variances = output.average.variances.data();
+/** 
+ * Overload of `model_gene_variances_blocked()` that allocates space for the output statistics and re-uses a workspace across calls.
+ *
+ * @tparam Stat_ Floating-point type of the output statistics.
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam Block_ Integer type of the block IDs.
+ *
+ * @param mat Matrix of expression values, typically after normalization and log-transformation.
+ * Rows should be genes while columns should be cells.
+ * @param[in] block Pointer to an array of length equal to the number of cells, containing 0-based block identifiers.
+ * This may also be a `nullptr` in which case all cells are assumed to belong to the same block.
+ * @param options Further options.
+ * @param workspace Workspace for temporary data structures.
+ * This may be re-used across calls with different matrices.
+ *
+ * @return Results of the variance modelling in each block.
+ * An average for each statistic is also computed if `ModelGeneVariancesOptions::average_policy` is not `BlockAveragePolicy::NONE`.
+ */
+template<typename Stat_, typename Value_, typename Index_, typename Block_>
+ModelGeneVariancesBlockedResults<Stat_> model_gene_variances_blocked(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const Block_* const block,
+    const ModelGeneVariancesOptions& options,
+    ModelGeneVariancesWorkspace<Stat_, Index_>& workspace
+) {
+    const auto nblocks = (block ? tatami_stats::total_groups(block, mat.ncol()) : 1);
 
-        if (options.trend) {
-            buffers.average.fitted = output.average.fitted.data();
-            buffers.average.residuals = output.average.residuals.data();
-        } else {
-            buffers.average.fitted = NULL;
-            buffers.average.residuals = NULL;
-        }
-    }
+    const bool do_average = internal::use_average(options);
+    ModelGeneVariancesBlockedResults<Stat_> output(
+        mat.nrow(), // cast is safe, any tatami Index_ can always fit into a size_t.
+        nblocks,
+        do_average,
+        options.trend,
+        options.extra_statistics
+    );
+    internal::track_results(options.allocation_tracker, output);
 
-    model_gene_variances_blocked(mat, block, buffers, options);
+    const auto buffers = internal::get_blocked_buffers(output, do_average, options.trend);
+    model_gene_variances_blocked(mat, block, buffers, options, workspace);
     return output;
 }
 
@@ -0,0 +1,273 @@
+#ifndef SCRAN_VARIANCES_MODEL_GENE_VARIANCES_ASYNC_HPP
+#define SCRAN_VARIANCES_MODEL_GENE_VARIANCES_ASYNC_HPP
+
+#include <future>
+#include <memory>
+#include <exception>
+#include <functional>
+#include <utility>
+
+#include "tatami/tatami.hpp"
+#include "tatami_stats/tatami_stats.hpp"
+
+#include "model_gene_variances.hpp"
+
+/**
+ * @file model_gene_variances_async.hpp
+ * @brief Model the per-gene variances asynchronously.
+ */
+
+namespace scran_variances {
+
+/**
+ * @brief Progress of an asynchronous call to `model_gene_variances_blocked_async()`.
+ *
+ * The two stages are reported separately so that downstream steps that only need the per-block means and variances
+ * (e.g., filtering on mean abundance) can start while the trends are still being fitted and averaged.
+ */
+struct ModelGeneVariancesAsyncStages {
+    /**
+     * Becomes ready once the per-block means and variances have been stored,
+     * along with the other statistics in `ModelGeneVariancesOptions::extra_statistics`.
+     * If their calculation throws, the exception is stored in this future.
+     */
+    std::shared_future<void> statistics;
+
+    /**
+     * Becomes ready once all statistics (including the fitted values, residuals and averages across blocks) have been stored.
+     * If any step throws, the exception is stored in this future.
+     */
+    std::shared_future<void> finished;
+};
+
+/**
+ * @brief Handle to the results of an asynchronous variance modelling call.
+ *
+ * @tparam Results_ Type of the results, either `ModelGeneVariancesResults` or `ModelGeneVariancesBlockedResults`.
+ */
+template<class Results_>
+class ModelGeneVariancesFuture {
+public:
+    /**
+     * @cond
+     */
+    ModelGeneVariancesFuture(std::shared_ptr<Results_> results, ModelGeneVariancesAsyncStages stages) :
+        my_results(std::move(results)), my_stages(std::move(stages)) {}
+    /**
+     * @endcond
+     */
+
+    /**
+     * Wait for the means and variances to be computed.
+     * This rethrows any exception from their calculation.
+     *
+     * @return Results of the variance modelling.
+     * Only the means, variances and extra statistics (per block, for `ModelGeneVariancesBlockedResults`) should be used,
+     * as the other statistics may still be in the process of being computed.
+     */
+    const Results_& statistics() const {
+        my_stages.statistics.get();
+        return *my_results;
+    }
+
+    /**
+     * Wait for all statistics to be computed.
+     * This rethrows any exception from their calculation.
+     *
+     * @return Results of the variance modelling.
+     */
+    Results_& get() {
+        my_stages.finished.get();
+        return *my_results;
+    }
+
+    /**
+     * @return Futures for each stage of the calculation.
+     */
+    const ModelGeneVariancesAsyncStages& stages() const {
+        return my_stages;
+    }
+
+private:
+    std::shared_ptr<Results_> my_results;
+    ModelGeneVariancesAsyncStages my_stages;
+};
+
+/**
+ * Asynchronous version of `model_gene_variances_blocked()`.
+ * The calculation is submitted as a single task to `executor`, and this function returns immediately.
+ * Within the task, the per-block means and variances are computed first and reported via `ModelGeneVariancesAsyncStages::statistics`,
+ * after which the trends are fitted and the statistics are averaged across blocks.
+ *
+ * The task uses `ModelGeneVariancesOptions::num_threads` threads for its own calculations, in addition to the thread that runs the task.
+ * The orchestrating thread is free to prepare other stages of the analysis in the meantime.
+ *
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam Block_ Integer type of the block IDs.
+ * @tparam Stat_ Floating-point type of the output statistics.
+ * @tparam Executor_ Callable that accepts a `std::function<void()>` and arranges for it to be called exactly once, e.g., on a thread pool.
+ *
+ * @param mat Matrix of expression values, typically after normalization and log-transformation.
+ * Rows should be genes while columns should be cells.
+ * This should not be destroyed until `ModelGeneVariancesAsyncStages::finished` is ready.
+ * @param[in] block Pointer to an array of length equal to the number of cells, see `model_gene_variances_blocked()` for details.
+ * This should not be modified or destroyed until `ModelGeneVariancesAsyncStages::finished` is ready.
+ * @param[out] buffers Collection of pointers of arrays in which to store the output statistics.
+ * The arrays should not be accessed until the corresponding stage is ready.
+ * @param options Further options.
+ * These are copied and can be safely destroyed once this function returns.
+ * @param executor Executor to run the task.
+ *
+ * @return Futures for each stage of the calculation.
+ */
+template<typename Value_, typename Index_, typename Block_, typename Stat_, class Executor_>
+ModelGeneVariancesAsyncStages model_gene_variances_blocked_async(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const Block_* const block,
+    ModelGeneVariancesBlockedBuffers<Stat_> buffers,
+    const ModelGeneVariancesOptions& options,
+    Executor_&& executor
+) {
+    struct State {
+        std::promise<void> statistics, finished;
+    };
+    auto state = std::make_shared<State>();
+
+    ModelGeneVariancesAsyncStages stages;
+    stages.statistics = state->statistics.get_future().share();
+    stages.finished = state->finished.get_future().share();
+
+    std::function<void()> task = [&mat, block, buffers = std::move(buffers), options, state]() -> void {
+        bool computed = false;
+        try {
+            const auto block_size = internal::compute_blocked_variances(mat, block, buffers, options);
+            computed = true;
+            state->statistics.set_value();
+            internal::fit_and_average(mat.nrow(), block_size, buffers, options);
+            state->finished.set_value();
+        } catch (...) {
+            auto err = std::current_exception();
+            if (!computed) {
+                state->statistics.set_exception(err);
+            }
+            state->finished.set_exception(err);
+        }
+    };
+
+    executor(std::move(task));
+    return stages;
+}
+
+/**
+ * Asynchronous version of `model_gene_variances()`.
+ * See `model_gene_variances_blocked_async()` for details.
+ *
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam Stat_ Floating-point type of the output statistics.
+ * @tparam Executor_ Callable that accepts a `std::function<void()>` and arranges for it to be called exactly once.
+ *
+ * @param mat Matrix of expression values, typically after normalization and log-transformation.
+ * Rows should be genes while columns should be cells.
+ * This should not be destroyed until `ModelGeneVariancesAsyncStages::finished` is ready.
+ * @param buffers Collection of buffers in which to store the computed statistics.
+ * The arrays should not be accessed until the corresponding stage is ready.
+ * @param options Further options.
+ * @param executor Executor to run the task.
+ *
+ * @return Futures for each stage of the calculation.
+ */
+template<typename Value_, typename Index_, typename Stat_, class Executor_>
+ModelGeneVariancesAsyncStages model_gene_variances_async(
+    const tatami::Matrix<Value_, Index_>& mat,
+    ModelGeneVariancesBuffers<Stat_> buffers,
+    const ModelGeneVariancesOptions& options,
+    Executor_&& executor
+) {
+    ModelGeneVariancesBlockedBuffers<Stat_> bbuffers;
+    bbuffers.per_block.emplace_back(std::move(buffers));
+
+    bbuffers.average.means = NULL;
+    bbuffers.average.variances = NULL;
+    bbuffers.average.fitted = NULL;
+    bbuffers.average.residuals = NULL;
+
+    return model_gene_variances_blocked_async(mat, static_cast<Index_*>(NULL), std::move(bbuffers), options, std::forward<Executor_>(executor));
+}
+
+/**
+ * Overload of `model_gene_variances_async()` that allocates space for the output statistics.
+ *
+ * @tparam Stat_ Floating-point type of the output statistics.
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam Executor_ Callable that accepts a `std::function<void()>` and arranges for it to be called exactly once.
+ *
+ * @param mat Matrix of expression values, typically after normalization and log-transformation.
+ * Rows should be genes while columns should be cells.
+ * This should not be destroyed until the calculation is finished.
+ * @param options Further options.
+ * @param executor Executor to run the task.
+ *
+ * @return Handle to the results of the variance modelling.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, class Executor_>
+ModelGeneVariancesFuture<ModelGeneVariancesResults<Stat_> > model_gene_variances_async(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const ModelGeneVariancesOptions& options,
+    Executor_&& executor
+) {
+    auto output = std::make_shared<ModelGeneVariancesResults<Stat_> >(mat.nrow(), options.trend, options.extra_statistics); // cast is safe, as any tatami Index_ can always fit into a size_t.
+    internal::track_results(options.allocation_tracker, *output);
+    auto stages = model_gene_variances_async(mat, internal::get_buffers(*output, true, options.trend), options, std::forward<Executor_>(executor));
+    return ModelGeneVariancesFuture<ModelGeneVariancesResults<Stat_> >(std::move(output), std::move(stages));
+}
+
+/**
+ * Overload of `model_gene_variances_blocked_async()` that allocates space for the output statistics.
+ *
+ * @tparam Stat_ Floating-point type of the output statistics.
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam Block_ Integer type of the block IDs.
+ * @tparam Executor_ Callable that accepts a `std::function<void()>` and arranges for it to be called exactly once.
+ *
+ * @param mat Matrix of expression values, typically after normalization and log-transformation.
+ * Rows should be genes while columns should be cells.
+ * This should not be destroyed until the calculation is finished.
+ * @param[in] block Pointer to an array of length equal to the number of cells, containing 0-based block identifiers.
+ * This may also be a `nullptr` in which case all cells are assumed to belong to the same block.
+ * This should not be modified or destroyed until the calculation is finished.
+ * @param options Further options.
+ * @param executor Executor to run the task.
+ *
+ * @return Handle to the results of the variance modelling in each block.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Block_, class Executor_>
+ModelGeneVariancesFuture<ModelGeneVariancesBlockedResults<Stat_> > model_gene_variances_blocked_async(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const Block_* const block,
+    const ModelGeneVariancesOptions& options,
+    Executor_&& executor
+) {
+    const auto nblocks = (block ? tatami_stats::total_groups(block, mat.ncol()) : 1);
+
+    const bool do_average = internal::use_average(options);
+    auto output = std::make_shared<ModelGeneVariancesBlockedResults<Stat_> >(
+        mat.nrow(), // cast is safe, any tatami Index_ can always fit into a size_t.
+        nblocks,
+        do_average,
+        options.trend,
+        options.extra_statistics
+    );
+    internal::track_results(options.allocation_tracker, *output);
+
+    auto buffers = internal::get_blocked_buffers(*output, do_average, options.trend);
+    auto stages = model_gene_variances_blocked_async(mat, block, std::move(buffers), options, std::forward<Executor_>(executor));
+    return ModelGeneVariancesFuture<ModelGeneVariancesBlockedResults<Stat_> >(std::move(output), std::move(stages));
+}
+
+}
+
+#endif
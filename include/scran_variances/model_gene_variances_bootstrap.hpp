@@ -0,0 +1,442 @@
+#ifndef SCRAN_VARIANCES_MODEL_GENE_VARIANCES_BOOTSTRAP_HPP
+#define SCRAN_VARIANCES_MODEL_GENE_VARIANCES_BOOTSTRAP_HPP
+
+#include <vector>
+#include <stdexcept>
+#include <cmath>
+#include <limits>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <memory>
+#include <memory_resource>
+
+#include "tatami/tatami.hpp"
+#include "tatami_stats/tatami_stats.hpp"
+#include "sanisizer/sanisizer.hpp"
+
+#include "model_gene_variances.hpp"
+#include "choose_highly_variable_genes.hpp"
+#include "weighted_variances.hpp"
+#include "prefetch.hpp"
+#include "allocation_tracker.hpp"
+#include "utils.hpp"
+
+/**
+ * @file model_gene_variances_bootstrap.hpp
+ * @brief Model the per-gene variances in bootstrap replicates of the cells.
+ */
+
+namespace scran_variances {
+
+/**
+ * @brief Options for `model_gene_variances_bootstrap()` and friends.
+ */
+struct ModelGeneVariancesBootstrapOptions {
+    /**
+     * Number of bootstrap replicates.
+     */
+    std::size_t num_replicates = 50;
+
+    /**
+     * Seed for the bootstrap multiplicities.
+     * Each cell's multiplicity in each replicate is a deterministic function of the seed, the replicate index and the cell index,
+     * so the results do not depend on the number of threads.
+     */
+    std::uint64_t seed = 123456789;
+
+    /**
+     * Options for choosing highly variable genes in each replicate, see `choose_highly_variable_genes()`.
+     */
+    ChooseHighlyVariableGenesOptions choose_highly_variable_genes_options;
+};
+
+/**
+ * @brief Results of `model_gene_variances_bootstrap_blocked()`.
+ * @tparam Stat_ Floating-point type of the output statistics.
+ */
+template<typename Stat_>
+struct ModelGeneVariancesBootstrapResults {
+    /**
+     * Results of the variance modelling in each replicate.
+     * The extra statistics (see `ModelGeneVariancesOptions::extra_statistics`) are never computed.
+     */
+    std::vector<ModelGeneVariancesBlockedResults<Stat_> > replicates;
+
+    /**
+     * Proportion of replicates in which each gene was chosen as highly variable by `choose_highly_variable_genes()`.
+     * For each replicate, genes are chosen based on the average residuals across blocks, or the residuals of the only block if there is no blocking;
+     * if `ModelGeneVariancesOptions::trend = false`, the variances are used instead.
+     */
+    std::vector<Stat_> selection_frequency;
+};
+
+/**
+ * @cond
+ */
+namespace internal {
+
+// SplitMix64 finalizer, see Steele et al. (2014).
+inline std::uint64_t mix_bits(std::uint64_t x) {
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+/*
+ * Counter-based Poisson(1) draw for cell 'c' in replicate 'r'. Each draw
+ * only depends on (seed, r, c), so the multiplicities can be generated in any
+ * order and in parallel. We use the inverse CDF as the mean is small; the
+ * cap is only reached for uniforms that are indistinguishable from 1.
+ */
+inline unsigned char bootstrap_multiplicity(const std::uint64_t seed, const std::uint64_t r, const std::uint64_t c) {
+    const auto bits = mix_bits(mix_bits(mix_bits(seed) ^ r) ^ c);
+    const double u = static_cast<double>(bits >> 11) * 0x1.0p-53;
+
+    double prob = std::exp(-1.0), cumulative = prob;
+    unsigned char k = 0;
+    while (u >= cumulative && k < 255) {
+        ++k;
+        prob /= k;
+        cumulative += prob;
+        if (prob == 0) {
+            break;
+        }
+    }
+    return k;
+}
+
+template<typename Stat_, typename Value_, typename Index_, typename Block_>
+void compute_bootstrap_variances_row(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const bool sparse,
+    const Block_* const block,
+    const std::size_t nblocks,
+    const std::vector<unsigned char>& multiplicity,
+    const std::vector<std::vector<Index_> >& totals,
+    const std::vector<ModelGeneVariancesBlockedBuffers<Stat_> >& buffers,
+    const ModelGeneVariancesOptions& options)
+{
+    const auto resource = get_memory_resource(options);
+    const Index_ NR = mat.nrow(), NC = mat.ncol();
+    const auto nreps = buffers.size();
+
+    tatami::parallelize([&](const int thread, const Index_ start, const Index_ length) -> void {
+        auto vbuffer = tatami::create_container_of_Index_size<std::pmr::vector<Value_> >(NC, resource);
+        auto ibuffer = tatami::create_container_of_Index_size<std::pmr::vector<Index_> >(sparse ? NC : 0, resource);
+        auto tmp_means = sanisizer::create<std::pmr::vector<Stat_> >(nblocks, resource);
+        auto tmp_vars = sanisizer::create<std::pmr::vector<Stat_> >(nblocks, resource);
+        auto tmp_nzw = sanisizer::create<std::pmr::vector<Stat_> >(sparse ? nblocks : 0, resource);
+        const TrackedAllocation tracked_stats(options.allocation_tracker, AllocationPhase::STATISTICS, thread, container_bytes(tmp_means, tmp_vars, tmp_nzw));
+
+        PrefetchExtractor<false, Value_, Index_> dext(
+            [&]() { return (sparse ? nullptr : tatami::consecutive_extractor<false>(mat, true, start, length)); },
+            NC,
+            (sparse ? 0 : length),
+            options.prefetch_buffer_size
+        );
+        PrefetchExtractor<true, Value_, Index_> sext(
+            [&]() { return (sparse ? tatami::consecutive_extractor<true>(mat, true, start, length) : nullptr); },
+            NC,
+            (sparse ? length : 0),
+            options.prefetch_buffer_size
+        );
+        const TrackedAllocation tracked_extraction(options.allocation_tracker, AllocationPhase::EXTRACTION, thread, container_bytes(vbuffer, ibuffer) + dext.bytes() + sext.bytes());
+
+        for (Index_ g = start, end = start + length; g < end; ++g) {
+            const Value_* values;
+            const Index_* indices = NULL;
+            Index_ number = NC;
+            if (sparse) {
+                const auto range = sext.fetch(vbuffer.data(), ibuffer.data());
+                values = range.value;
+                indices = range.index;
+                number = range.number;
+            } else {
+                values = dext.fetch(vbuffer.data());
+            }
+
+            // Each row is extracted once and used for all replicates.
+            for (I<decltype(nreps)> r = 0; r < nreps; ++r) {
+                const auto mult = multiplicity.data() + static_cast<std::size_t>(r) * static_cast<std::size_t>(NC);
+                const auto& cur_totals = totals[r];
+                compute_weighted_row_sums(values, indices, number, mult, block, cur_totals.data(), nblocks, tmp_means.data(), tmp_vars.data(), tmp_nzw.data());
+
+                auto& cur_buffers = buffers[r].per_block;
+                for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+                    finish_weighted_variance(cur_totals[b], tmp_means[b], tmp_vars[b]);
+                    cur_buffers[b].means[g] = tmp_means[b];
+                    cur_buffers[b].variances[g] = tmp_vars[b];
+                }
+            }
+        }
+    }, NR, options.num_threads);
+}
+
+/*
+ * For column access, each thread holds running statistics for its genes in
+ * every block of every replicate, which are stored directly in the output
+ * buffers. Each column is extracted once and added to the running statistics
+ * of each replicate in which it has a non-zero multiplicity.
+ */
+template<typename Stat_, typename Value_, typename Index_, typename Block_>
+void compute_bootstrap_variances_column(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const bool sparse,
+    const Block_* const block,
+    const std::size_t nblocks,
+    const std::vector<unsigned char>& multiplicity,
+    const std::vector<std::vector<Index_> >& totals,
+    const std::vector<ModelGeneVariancesBlockedBuffers<Stat_> >& buffers,
+    const ModelGeneVariancesOptions& options)
+{
+    const auto resource = get_memory_resource(options);
+    const Index_ NR = mat.nrow(), NC = mat.ncol();
+    const auto nreps = buffers.size();
+
+    tatami::parallelize([&](const int thread, const Index_ start, const Index_ length) -> void {
+        auto vbuffer = tatami::create_container_of_Index_size<std::pmr::vector<Value_> >(length, resource);
+        auto ibuffer = tatami::create_container_of_Index_size<std::pmr::vector<Index_> >(sparse ? length : 0, resource);
+        PrefetchExtractor<false, Value_, Index_> dext(
+            [&]() { return (sparse ? nullptr : tatami::consecutive_extractor<false>(mat, false, static_cast<Index_>(0), NC, start, length)); },
+            length,
+            (sparse ? 0 : NC),
+            options.prefetch_buffer_size
+        );
+        PrefetchExtractor<true, Value_, Index_> sext(
+            [&]() {
+                if (!sparse) {
+                    return std::unique_ptr<tatami::OracularSparseExtractor<Value_, Index_> >();
+                }
+                tatami::Options opt;
+                opt.sparse_ordered_index = false;
+                return tatami::consecutive_extractor<true>(mat, false, static_cast<Index_>(0), NC, start, length, opt);
+            },
+            length,
+            (sparse ? NC : 0),
+            options.prefetch_buffer_size
+        );
+        const TrackedAllocation tracked_extraction(options.allocation_tracker, AllocationPhase::EXTRACTION, thread, container_bytes(vbuffer, ibuffer) + dext.bytes() + sext.bytes());
+
+        const auto nrunners = sanisizer::product<std::size_t>(nreps, nblocks);
+        std::pmr::vector<WeightedRunningDense<Stat_, Value_, Index_> > drunners(resource);
+        std::pmr::vector<WeightedRunningSparse<Stat_, Value_, Index_> > srunners(resource);
+        if (sparse) {
+            srunners.reserve(nrunners);
+        } else {
+            drunners.reserve(nrunners);
+        }
+        for (I<decltype(nreps)> r = 0; r < nreps; ++r) {
+            for (const auto& current : buffers[r].per_block) {
+                if (sparse) {
+                    srunners.emplace_back(length, current.means + start, current.variances + start, start, resource);
+                } else {
+                    drunners.emplace_back(length, current.means + start, current.variances + start);
+                }
+            }
+        }
+        const TrackedAllocation tracked_stats(options.allocation_tracker, AllocationPhase::STATISTICS, thread, nrunners * static_cast<std::size_t>(sparse ? length : 0) * sizeof(Stat_)); // for the non-zero weights in each runner.
+
+        for (Index_ c = 0; c < NC; ++c) {
+            const auto b = (block ? block[c] : 0);
+            if (sparse) {
+                const auto range = sext.fetch(vbuffer.data(), ibuffer.data());
+                for (I<decltype(nreps)> r = 0; r < nreps; ++r) {
+                    const auto w = multiplicity[static_cast<std::size_t>(r) * static_cast<std::size_t>(NC) + static_cast<std::size_t>(c)];
+                    if (w) {
+                        srunners[r * nblocks + b].add(range.value, range.index, range.number, w);
+                    }
+                }
+            } else {
+                const auto ptr = dext.fetch(vbuffer.data());
+                for (I<decltype(nreps)> r = 0; r < nreps; ++r) {
+                    const auto w = multiplicity[static_cast<std::size_t>(r) * static_cast<std::size_t>(NC) + static_cast<std::size_t>(c)];
+                    if (w) {
+                        drunners[r * nblocks + b].add(ptr, w);
+                    }
+                }
+            }
+        }
+
+        for (I<decltype(nreps)> r = 0; r < nreps; ++r) {
+            for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+                if (sparse) {
+                    srunners[r * nblocks + b].finish();
+                } else {
+                    drunners[r * nblocks + b].finish();
+                }
+                const auto& current = buffers[r].per_block[b];
+                const auto total = totals[r][b];
+                for (Index_ g = start, end = start + length; g < end; ++g) {
+                    finish_weighted_variance(total, current.means[g], current.variances[g]);
+                }
+            }
+        }
+    }, NR, options.num_threads);
+}
+
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Model the per-gene variances in bootstrap replicates of the cells, e.g., to assess the stability of the chosen highly variable genes.
+ * In each replicate, each cell is assigned a multiplicity from a Poisson distribution with a mean of 1, which approximates resampling of the cells with replacement.
+ * The per-gene means and variances in each block are then computed with the cells weighted by their multiplicities,
+ * and a trend is fitted to each block and averaged across blocks as described in `model_gene_variances_blocked()`.
+ *
+ * All replicates are computed in a single pass over the matrix, where each row or column is extracted once and used for all replicates.
+ * This is much cheaper than separate calls to `model_gene_variances_blocked()` when extraction is expensive, e.g., for file-backed matrices.
+ * The access pattern is chosen as described in `plan_model_gene_variances()`, so `ModelGeneVariancesOptions::compute_path` is respected.
+ * For row access, each thread needs \f$O(RN)\f$ time per gene for \f$R\f$ replicates and \f$N\f$ cells (or non-zero values for sparse matrices).
+ * For column access, each thread holds running statistics for its genes in every block of every replicate,
+ * which requires an extra \f$O(RG)\f$ memory for sparse matrices with \f$G\f$ genes.
+ * An array of the multiplicities for all replicates is also held in memory, requiring \f$RN\f$ bytes.
+ * Trend fitting and the choice of highly variable genes are then parallelized across replicates.
+ *
+ * The size of each block in each replicate is defined as the sum of multiplicities for its cells,
+ * and is used in place of the number of cells for weighting blocks (see `ModelGeneVariancesOptions::block_weight_policy`).
+ * Cells are never split across threads, and `ModelGeneVariancesOptions::extra_statistics`, `ModelGeneVariancesOptions::column_batch_size` and `ModelGeneVariancesOptions::sparse_column_tile_cache_size` are ignored.
+ *
+ * If there are multiple blocks, genes are chosen from the average across blocks in each replicate,
+ * so an error is raised if `ModelGeneVariancesOptions::block_average_policy` is `BlockAveragePolicy::NONE`.
+ *
+ * @tparam Stat_ Floating-point type of the output statistics.
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam Block_ Integer type of the block IDs.
+ *
+ * @param mat Matrix of expression values, typically after normalization and log-transformation.
+ * Rows should be genes while columns should be cells.
+ * @param[in] block Pointer to an array of length equal to the number of cells, containing 0-based block identifiers.
+ * This may also be a `nullptr` in which case all cells are assumed to belong to the same block.
+ * @param options Further options for variance modelling.
+ * @param bootstrap_options Further options for the bootstrap.
+ *
+ * @return Results of the variance modelling in each replicate, along with the frequency with which each gene is chosen as highly variable.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Block_>
+ModelGeneVariancesBootstrapResults<Stat_> model_gene_variances_bootstrap_blocked(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const Block_* const block,
+    const ModelGeneVariancesOptions& options,
+    const ModelGeneVariancesBootstrapOptions& bootstrap_options)
+{
+    const Index_ NR = mat.nrow(), NC = mat.ncol();
+    const std::size_t nblocks = (block ? tatami_stats::total_groups(block, NC) : 1);
+    const auto nreps = bootstrap_options.num_replicates;
+    const bool do_average = internal::use_average(options);
+    if (nblocks > 1 && !do_average) {
+        throw std::runtime_error("an average across blocks is required to choose genes from multiple blocks");
+    }
+
+    // Generating multiplicities and the total multiplicity of each block in each replicate.
+    auto multiplicity = sanisizer::create<std::vector<unsigned char> >(sanisizer::product<typename std::vector<unsigned char>::size_type>(nreps, NC));
+    std::vector<std::vector<Index_> > totals;
+    totals.reserve(nreps);
+    for (I<decltype(nreps)> r = 0; r < nreps; ++r) {
+        totals.emplace_back(sanisizer::cast<typename std::vector<Index_>::size_type>(nblocks));
+    }
+
+    tatami::parallelize([&](const int, const std::size_t start, const std::size_t length) -> void {
+        std::vector<std::size_t> block_total(nblocks);
+        for (std::size_t r = start, end = start + length; r < end; ++r) {
+            const auto mult = multiplicity.data() + static_cast<std::size_t>(r) * static_cast<std::size_t>(NC);
+            std::fill(block_total.begin(), block_total.end(), 0);
+            for (Index_ c = 0; c < NC; ++c) {
+                mult[c] = internal::bootstrap_multiplicity(bootstrap_options.seed, r, c);
+                block_total[block ? block[c] : 0] += mult[c];
+            }
+            for (std::size_t b = 0; b < nblocks; ++b) {
+                totals[r][b] = sanisizer::cast<Index_>(block_total[b]);
+            }
+        }
+    }, nreps, options.num_threads);
+
+    ModelGeneVariancesBootstrapResults<Stat_> output;
+    output.replicates.reserve(nreps);
+    std::vector<ModelGeneVariancesBlockedBuffers<Stat_> > buffers;
+    buffers.reserve(nreps);
+    for (I<decltype(nreps)> r = 0; r < nreps; ++r) {
+        output.replicates.emplace_back(NR, nblocks, do_average, options.trend);
+        internal::track_results(options.allocation_tracker, output.replicates.back());
+        buffers.push_back(internal::get_blocked_buffers(output.replicates.back(), do_average, options.trend));
+    }
+
+    // The access pattern is chosen by the same planner as model_gene_variances_blocked(), but cells are never split across threads.
+    const auto plan = internal::plan_compute_variances(mat, nblocks, options);
+    auto copt = options;
+    copt.num_threads = plan.num_threads;
+    const bool sparse = (plan.path == ComputePath::SPARSE_ROW || plan.path == ComputePath::SPARSE_COLUMN);
+    if (internal::is_row_path(plan.path)) {
+        internal::compute_bootstrap_variances_row(mat, sparse, block, nblocks, multiplicity, totals, buffers, copt);
+    } else {
+        internal::compute_bootstrap_variances_column(mat, sparse, block, nblocks, multiplicity, totals, buffers, copt);
+    }
+
+    // Each replicate is processed by a single thread, so the trend fitting itself is not parallelized.
+    auto ropt = options;
+    ropt.num_threads = 1;
+    ropt.auto_tune = false;
+    ropt.allocation_tracker = NULL;
+    auto chosen = sanisizer::create<std::vector<unsigned char> >(sanisizer::product<typename std::vector<unsigned char>::size_type>(nreps, NR));
+
+    tatami::parallelize([&](const int, const std::size_t start, const std::size_t length) -> void {
+        for (std::size_t r = start, end = start + length; r < end; ++r) {
+            internal::fit_and_average(NR, totals[r], buffers[r], ropt);
+
+            const auto& current = output.replicates[r];
+            const auto& source = (do_average ? current.average : current.per_block.front()); // only one block if there is no average, see above.
+            const auto& statistic = (options.trend ? source.residuals : source.variances);
+            choose_highly_variable_genes(NR, statistic.data(), chosen.data() + static_cast<std::size_t>(r) * static_cast<std::size_t>(NR), bootstrap_options.choose_highly_variable_genes_options);
+        }
+    }, nreps, options.num_threads);
+
+    output.selection_frequency.resize(NR);
+    for (I<decltype(nreps)> r = 0; r < nreps; ++r) {
+        const auto current = chosen.data() + static_cast<std::size_t>(r) * static_cast<std::size_t>(NR);
+        for (Index_ g = 0; g < NR; ++g) {
+            output.selection_frequency[g] += current[g];
+        }
+    }
+    if (nreps) {
+        for (auto& f : output.selection_frequency) {
+            f /= nreps;
+        }
+    }
+
+    return output;
+}
+
+/**
+ * Model the per-gene variances in bootstrap replicates of the cells without blocking.
+ * This is equivalent to calling `model_gene_variances_bootstrap_blocked()` with a `nullptr` for the block assignments.
+ *
+ * @tparam Stat_ Floating-point type of the output statistics.
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ *
+ * @param mat Matrix of expression values, typically after normalization and log-transformation.
+ * Rows should be genes while columns should be cells.
+ * @param options Further options for variance modelling.
+ * @param bootstrap_options Further options for the bootstrap.
+ *
+ * @return Results of the variance modelling in each replicate, along with the frequency with which each gene is chosen as highly variable.
+ * Each entry of `ModelGeneVariancesBootstrapResults::replicates` contains a single block.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_>
+ModelGeneVariancesBootstrapResults<Stat_> model_gene_variances_bootstrap(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const ModelGeneVariancesOptions& options,
+    const ModelGeneVariancesBootstrapOptions& bootstrap_options)
+{
+    auto copy = options;
+    copy.block_average_policy = BlockAveragePolicy::NONE; // no need to average a single block.
+    return model_gene_variances_bootstrap_blocked<Stat_>(mat, static_cast<const Index_*>(NULL), copy, bootstrap_options);
+}
+
+}
+
+#endif
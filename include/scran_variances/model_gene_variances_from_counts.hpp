@@ -0,0 +1,405 @@
+#ifndef SCRAN_VARIANCES_MODEL_GENE_VARIANCES_FROM_COUNTS_HPP
+#define SCRAN_VARIANCES_MODEL_GENE_VARIANCES_FROM_COUNTS_HPP
+
+#include <vector>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <type_traits>
+#include <memory_resource>
+#include <algorithm>
+
+#include "tatami/tatami.hpp"
+#include "tatami_stats/tatami_stats.hpp"
+#include "sanisizer/sanisizer.hpp"
+
+#include "model_gene_variances.hpp"
+#include "estimate_model_gene_variances_resources.hpp"
+#include "allocation_tracker.hpp"
+#include "utils.hpp"
+
+/**
+ * @file model_gene_variances_from_counts.hpp
+ * @brief Model the per-gene variances directly from a count matrix.
+ */
+
+namespace scran_variances {
+
+/**
+ * @brief Options for log-normalization in `model_gene_variances_from_counts()` and friends.
+ */
+struct LogNormalizeOptions {
+    /**
+     * Pseudo-count to add to the normalized expression values before log-transformation.
+     * This should be positive.
+     */
+    double pseudo_count = 1;
+
+    /**
+     * Size of the per-cell lookup tables for small integer counts.
+     * If positive, the log-normalized values for counts in \f$[0, T)\f$ are precomputed for each cell, where \f$T\f$ is this size,
+     * such that the log-transformation is only performed for larger or non-integer counts.
+     * This may reduce the time spent in the log-transformation if most counts are small integers,
+     * but requires \f$T\f$ floating-point values per cell, e.g., 1.3 GB for \f$T = 16\f$ with 10 million cells and double-precision statistics.
+     * The tables are allocated from `ModelGeneVariancesOptions::memory_resource`
+     * and are included in the `AllocationPhase::EXTRACTION` phase of `ModelGeneVariancesOptions::allocation_tracker`.
+     * By default, no lookup tables are used.
+     */
+    std::size_t lookup_table_size = 0;
+};
+
+/**
+ * @cond
+ */
+namespace internal {
+
+/*
+ * Computes log2(x / s + p) - log2(p) == log2(x / (s * p) + 1) so that zeros
+ * remain zero after transformation. The constant offset of log2(p) only
+ * affects the means and is added back afterwards.
+ */
+template<typename Stat_>
+class LogNormalizeTransform {
+public:
+    template<typename Index_, typename SizeFactor_>
+    LogNormalizeTransform(const Index_ NC, const SizeFactor_* const size_factors, const LogNormalizeOptions& log_options, const ModelGeneVariancesOptions& options) :
+        my_scale(tatami::create_container_of_Index_size<std::pmr::vector<Stat_> >(NC, get_memory_resource(options))),
+        my_table_size(log_options.lookup_table_size),
+        my_table(sanisizer::create<std::pmr::vector<Stat_> >(sanisizer::product<typename std::pmr::vector<Stat_>::size_type>(NC, my_table_size), get_memory_resource(options))),
+        my_tracked(options.allocation_tracker, AllocationPhase::EXTRACTION, 0, container_bytes(my_scale, my_table))
+    {
+        if (!(log_options.pseudo_count > 0) || !std::isfinite(log_options.pseudo_count)) {
+            throw std::runtime_error("pseudo-count should be positive and finite");
+        }
+
+        for (Index_ c = 0; c < NC; ++c) {
+            const auto sf = size_factors[c];
+            if (!(sf > 0) || !std::isfinite(sf)) {
+                throw std::runtime_error("size factors should be positive and finite");
+            }
+            my_scale[c] = 1 / (static_cast<Stat_>(sf) * static_cast<Stat_>(log_options.pseudo_count));
+        }
+
+        if (my_table_size) {
+            tatami::parallelize([&](const int, const Index_ start, const Index_ length) -> void {
+                for (Index_ c = start, end = start + length; c < end; ++c) {
+                    const auto offset = static_cast<std::size_t>(c) * my_table_size; // cast is safe as the product was already checked above.
+                    for (std::size_t t = 0; t < my_table_size; ++t) {
+                        my_table[offset + t] = compute(static_cast<Stat_>(t), my_scale[c]);
+                    }
+                }
+            }, NC, options.num_threads);
+        }
+    }
+
+private:
+    std::pmr::vector<Stat_> my_scale;
+    std::size_t my_table_size;
+    std::pmr::vector<Stat_> my_table;
+    TrackedAllocation my_tracked;
+
+    static Stat_ compute(const Stat_ x, const Stat_ scale) {
+        return std::log1p(x * scale) / std::log(static_cast<Stat_>(2));
+    }
+
+    template<typename Value_, typename Index_>
+    Stat_ transform(const Value_ x, const Index_ c) const {
+        if (my_table_size) {
+            bool small_integer;
+            if constexpr(std::is_integral<Value_>::value) {
+                if constexpr(std::is_signed<Value_>::value) {
+                    small_integer = (x >= 0 && static_cast<std::size_t>(x) < my_table_size);
+                } else {
+                    small_integer = (static_cast<std::size_t>(x) < my_table_size);
+                }
+            } else {
+                small_integer = (x >= 0 && x < static_cast<Value_>(my_table_size) && x == std::floor(x));
+            }
+            if (small_integer) {
+                return my_table[static_cast<std::size_t>(c) * my_table_size + static_cast<std::size_t>(x)];
+            }
+        }
+        return compute(x, my_scale[c]);
+    }
+
+public:
+    template<typename Value_>
+    using Output = Stat_;
+
+    static constexpr bool active = true;
+
+    template<typename Value_, typename Index_>
+    const Stat_* dense(const Value_* ptr, const Index_ n, Stat_* buffer) const {
+        for (Index_ i = 0; i < n; ++i) {
+            buffer[i] = transform(ptr[i], i);
+        }
+        return buffer;
+    }
+
+    template<typename Value_, typename Index_>
+    const Stat_* sparse(const Value_* value, const Index_* index, const Index_ n, Stat_* buffer) const {
+        for (Index_ i = 0; i < n; ++i) {
+            buffer[i] = transform(value[i], index[i]);
+        }
+        return buffer;
+    }
+
+    template<typename Value_, typename Index_>
+    const Stat_* cell(const Index_ c, const Value_* ptr, const Index_ n, Stat_* buffer) const {
+        for (Index_ i = 0; i < n; ++i) {
+            buffer[i] = transform(ptr[i], c);
+        }
+        return buffer;
+    }
+};
+
+template<typename Value_, typename Index_, typename SizeFactor_, typename Block_, typename Stat_>
+void compute_variances_from_counts(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const SizeFactor_* const size_factors,
+    const Block_* const block,
+    const std::vector<Index_>& block_size,
+    const ModelGeneVariancesBlockedBuffers<Stat_>& buffers,
+    const ModelGeneVariancesOptions& options,
+    const LogNormalizeOptions& log_options)
+{
+    const LogNormalizeTransform<Stat_> transform(mat.ncol(), size_factors, log_options, options);
+    if (log_options.pseudo_count == 1) {
+        compute_variances(mat, buffers.per_block, block, block_size, options, transform);
+    } else {
+        // Adding back the offset that was subtracted to preserve sparsity. This
+        // is done for each chunk of genes before it is reported to the user's
+        // callback, so that the reported statistics are already final. Every
+        // gene is reported in exactly one chunk, so we always install our own
+        // callback to apply the offset, even if the user didn't supply one.
+        const Stat_ offset = std::log2(static_cast<Stat_>(log_options.pseudo_count));
+        const auto nblocks = block_size.size();
+        auto copy = options;
+        copy.gene_chunk_callback = [&](const std::size_t start, const std::size_t length) -> void {
+            const std::size_t end = start + length;
+            for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+                const auto& current = buffers.per_block[b];
+
+                // Zero counts are still reported as undetected, but all other statistics need to be shifted.
+                const auto shift = [&](Stat_* const ptr, const Stat_ by) -> void {
+                    if (ptr) {
+                        for (std::size_t r = start; r < end; ++r) {
+                            ptr[r] += by;
+                        }
+                    }
+                };
+                shift(current.means, offset);
+                shift(current.sums, offset * static_cast<Stat_>(block_size[b]));
+                shift(current.minimum, offset);
+                shift(current.maximum, offset);
+            }
+
+            if (options.gene_chunk_callback) {
+                options.gene_chunk_callback(start, length);
+            }
+        };
+        compute_variances(mat, buffers.per_block, block, block_size, copy, transform);
+    }
+}
+
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Variant of `model_gene_variances_blocked()` that computes statistics from a count matrix.
+ * This is equivalent to calling `model_gene_variances_blocked()` on a matrix of log-normalized expression values,
+ * defined as \f$\log_2(x / s + p)\f$ for count \f$x\f$, size factor \f$s\f$ and pseudo-count \f$p\f$,
+ * but avoids the overhead of a delayed transformation on the count matrix.
+ *
+ * Normalization and log-transformation are applied to each extracted row/column inside the variance calculations.
+ * Zero counts are not transformed so sparse count matrices remain sparse, even if \f$p \ne 1\f$.
+ * For small integer counts, the transformed values can optionally be obtained from per-cell lookup tables (see `LogNormalizeOptions::lookup_table_size`).
+ *
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam SizeFactor_ Floating-point type of the size factors.
+ * @tparam Block_ Integer type of the block IDs.
+ * @tparam Stat_ Floating-point type of the output statistics.
+ *
+ * @param mat Matrix of non-negative counts.
+ * Rows should be genes while columns should be cells.
+ * @param[in] size_factors Pointer to an array of length equal to the number of cells, containing the size factor for each cell.
+ * All size factors should be positive and finite.
+ * @param[in] block Pointer to an array of length equal to the number of cells.
+ * Each entry should be a 0-based block identifier in \f$[0, B)\f$ where \f$B\f$ is the total number of blocks.
+ * `block` can also be a `nullptr`, in which case all cells are assumed to belong to the same block.
+ * @param[out] buffers Collection of pointers of arrays in which to store the output statistics.
+ * The length of `ModelGeneVariancesBlockedResults::per_block` should be equal to the number of blocks.
+ * @param options Further options.
+ * @param log_options Options for log-normalization.
+ */
+template<typename Value_, typename Index_, typename SizeFactor_, typename Block_, typename Stat_>
+void model_gene_variances_blocked_from_counts(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const SizeFactor_* const size_factors,
+    const Block_* const block,
+    const ModelGeneVariancesBlockedBuffers<Stat_>& buffers,
+    const ModelGeneVariancesOptions& options,
+    const LogNormalizeOptions& log_options
+) {
+    const Index_ NR = mat.nrow(), NC = mat.ncol();
+    std::vector<Index_> block_size;
+    if (block) {
+        block_size = tatami_stats::tabulate_groups(block, NC);
+    } else {
+        block_size.push_back(NC); // everything is one big block.
+    }
+
+    // The scaling factors and lookup tables are released before trend fitting.
+    internal::compute_variances_from_counts(mat, size_factors, block, block_size, buffers, options, log_options);
+
+    internal::fit_and_average(NR, block_size, buffers, options);
+}
+
+/**
+ * Variant of `model_gene_variances()` that computes statistics from a count matrix.
+ * See `model_gene_variances_blocked_from_counts()` for details.
+ *
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam SizeFactor_ Floating-point type of the size factors.
+ * @tparam Stat_ Floating-point type of the output statistics.
+ *
+ * @param mat Matrix of non-negative counts.
+ * Rows should be genes while columns should be cells.
+ * @param[in] size_factors Pointer to an array of length equal to the number of cells, containing the size factor for each cell.
+ * @param buffers Collection of buffers in which to store the computed statistics.
+ * @param options Further options.
+ * @param log_options Options for log-normalization.
+ */
+template<typename Value_, typename Index_, typename SizeFactor_, typename Stat_>
+void model_gene_variances_from_counts(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const SizeFactor_* const size_factors,
+    ModelGeneVariancesBuffers<Stat_> buffers,
+    const ModelGeneVariancesOptions& options,
+    const LogNormalizeOptions& log_options
+) {
+    ModelGeneVariancesBlockedBuffers<Stat_> bbuffers;
+    bbuffers.per_block.emplace_back(std::move(buffers));
+
+    bbuffers.average.means = NULL;
+    bbuffers.average.variances = NULL;
+    bbuffers.average.fitted = NULL;
+    bbuffers.average.residuals = NULL;
+
+    model_gene_variances_blocked_from_counts(mat, size_factors, static_cast<Index_*>(NULL), bbuffers, options, log_options);
+}
+
+/**
+ * Overload of `model_gene_variances_from_counts()` that allocates space for the output statistics.
+ *
+ * @tparam Stat_ Floating-point type of the output statistics.
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam SizeFactor_ Floating-point type of the size factors.
+ *
+ * @param mat Matrix of non-negative counts.
+ * Rows should be genes while columns should be cells.
+ * @param[in] size_factors Pointer to an array of length equal to the number of cells, containing the size factor for each cell.
+ * @param options Further options.
+ * @param log_options Options for log-normalization.
+ *
+ * @return Results of the variance modelling.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename SizeFactor_>
+ModelGeneVariancesResults<Stat_> model_gene_variances_from_counts(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const SizeFactor_* const size_factors,
+    const ModelGeneVariancesOptions& options,
+    const LogNormalizeOptions& log_options
+) {
+    ModelGeneVariancesResults<Stat_> output(mat.nrow(), options.trend, options.extra_statistics); // cast is safe, as any tatami Index_ can always fit into a size_t.
+    internal::track_results(options.allocation_tracker, output);
+    model_gene_variances_from_counts(mat, size_factors, internal::get_buffers(output, true, options.trend), options, log_options);
+    return output;
+}
+
+/**
+ * Overload of `model_gene_variances_blocked_from_counts()` that allocates space for the output statistics.
+ *
+ * @tparam Stat_ Floating-point type of the output statistics.
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam SizeFactor_ Floating-point type of the size factors.
+ * @tparam Block_ Integer type of the block IDs.
+ *
+ * @param mat Matrix of non-negative counts.
+ * Rows should be genes while columns should be cells.
+ * @param[in] size_factors Pointer to an array of length equal to the number of cells, containing the size factor for each cell.
+ * @param[in] block Pointer to an array of length equal to the number of cells, containing 0-based block identifiers.
+ * This may also be a `nullptr` in which case all cells are assumed to belong to the same block.
+ * @param options Further options.
+ * @param log_options Options for log-normalization.
+ *
+ * @return Results of the variance modelling in each block.
+ * An average for each statistic is also computed if `ModelGeneVariancesOptions::average_policy` is not `BlockAveragePolicy::NONE`.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename SizeFactor_, typename Block_>
+ModelGeneVariancesBlockedResults<Stat_> model_gene_variances_blocked_from_counts(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const SizeFactor_* const size_factors,
+    const Block_* const block,
+    const ModelGeneVariancesOptions& options,
+    const LogNormalizeOptions& log_options
+) {
+    const auto nblocks = (block ? tatami_stats::total_groups(block, mat.ncol()) : 1);
+
+    const bool do_average = internal::use_average(options);
+    ModelGeneVariancesBlockedResults<Stat_> output(
+        mat.nrow(), // cast is safe, any tatami Index_ can always fit into a size_t.
+        nblocks,
+        do_average,
+        options.trend,
+        options.extra_statistics
+    );
+    internal::track_results(options.allocation_tracker, output);
+
+    const auto buffers = internal::get_blocked_buffers(output, do_average, options.trend);
+    model_gene_variances_blocked_from_counts(mat, size_factors, block, buffers, options, log_options);
+    return output;
+}
+
+/**
+ * Estimate the memory usage and work of `model_gene_variances_blocked_from_counts()` before running it.
+ * This is the same as `estimate_model_gene_variances_resources()`, with the addition of the per-thread buffers for the log-normalized values,
+ * the per-cell scaling factors and any lookup tables from `LogNormalizeOptions::lookup_table_size`.
+ *
+ * @tparam Stat_ Floating-point type of the output statistics.
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ *
+ * @param summary Summary of the count matrix.
+ * @param num_blocks Number of blocks, i.e., one plus the largest block identifier.
+ * This should be 1 if no blocking is performed.
+ * @param options Further options, including the number of threads.
+ * @param log_options Options for log-normalization.
+ *
+ * @return Estimated resources.
+ */
+template<typename Stat_ = double, typename Value_ = double, typename Index_ = int>
+ModelGeneVariancesResourceEstimate estimate_model_gene_variances_from_counts_resources(
+    const ModelGeneVariancesMatrixSummary& summary,
+    const std::size_t num_blocks,
+    const ModelGeneVariancesOptions& options,
+    const LogNormalizeOptions& log_options
+) {
+    auto output = internal::estimate_resources<Stat_, Value_, Index_>(summary, num_blocks, options, true);
+
+    // Scaling factors and lookup tables for all cells, which are released before trend fitting.
+    output.compute_bytes += summary.num_cells * (log_options.lookup_table_size + 1) * sizeof(Stat_);
+
+    output.peak_bytes = output.output_bytes + std::max(output.compute_bytes, output.fit_bytes);
+    return output;
+}
+
+}
+
+#endif
@@ -0,0 +1,198 @@
+#ifndef SCRAN_VARIANCES_MODEL_GENE_VARIANCES_WEIGHTED_HPP
+#define SCRAN_VARIANCES_MODEL_GENE_VARIANCES_WEIGHTED_HPP
+
+#include <vector>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+
+#include "tatami/tatami.hpp"
+#include "tatami_stats/tatami_stats.hpp"
+#include "sanisizer/sanisizer.hpp"
+
+#include "model_gene_variances.hpp"
+#include "utils.hpp"
+
+/**
+ * @file model_gene_variances_weighted.hpp
+ * @brief Model the per-gene variances with per-cell weights.
+ */
+
+namespace scran_variances {
+
+/**
+ * Model the per-gene variances from a log-expression matrix with blocking, where each cell is weighted in the calculation of the mean and variance.
+ * This is useful when each column of the matrix represents multiple cells, e.g., for metacells or for sketches with importance weights.
+ * Otherwise, the procedure is the same as that described for `model_gene_variances_blocked()`.
+ *
+ * Weights are interpreted as frequencies, i.e., a cell with a weight of \f$w\f$ is treated as \f$w\f$ copies of that cell.
+ * Thus, integer weights yield the same means and variances as a matrix where each column is duplicated according to its weight.
+ * Weights should be scaled such that their sum for each block is equal to the effective number of cells in that block,
+ * as the variance is computed by dividing the weighted sum of squares by the total weight minus 1.
+ * The total weight of each block is used in place of the number of cells when computing the block weights for `ModelGeneVariancesOptions::block_weight_policy`,
+ * and when deciding whether a block has enough cells for trend fitting and averaging.
+ *
+ * The per-gene statistics are computed with the same access pattern, parallelization and tuning options as `model_gene_variances_blocked()` (see `plan_model_gene_variances()`),
+ * except that the explicitly vectorized calculations for a single block are not used.
+ * The extra statistics in `buffers` are not computed and are ignored.
+ *
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam Block_ Integer type of the block IDs.
+ * @tparam Weight_ Numeric type of the weights.
+ * @tparam Stat_ Floating-point type of the output statistics.
+ *
+ * @param mat Matrix of expression values, typically after normalization and log-transformation.
+ * Rows should be genes while columns should be cells.
+ * @param[in] block Pointer to an array of length equal to the number of cells, containing 0-based block identifiers.
+ * This may also be a `nullptr` in which case all cells are assumed to belong to the same block.
+ * @param[in] weights Pointer to an array of length equal to the number of cells, containing the non-negative weight for each cell.
+ * @param[out] buffers Collection of pointers of arrays in which to store the output statistics.
+ * The length of `ModelGeneVariancesBlockedResults::per_block` should be equal to the number of blocks.
+ * @param options Further options.
+ */
+template<typename Value_, typename Index_, typename Block_, typename Weight_, typename Stat_>
+void model_gene_variances_blocked_weighted(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const Block_* const block,
+    const Weight_* const weights,
+    const ModelGeneVariancesBlockedBuffers<Stat_>& buffers,
+    const ModelGeneVariancesOptions& options)
+{
+    const Index_ NC = mat.ncol();
+    const auto nblocks = buffers.per_block.size();
+    auto converted = tatami::create_container_of_Index_size<std::vector<Stat_> >(NC);
+    auto totals = sanisizer::create<std::vector<Stat_> >(nblocks);
+    auto block_size = sanisizer::create<std::vector<Index_> >(nblocks);
+    for (Index_ c = 0; c < NC; ++c) {
+        const Stat_ w = weights[c];
+        if (!(w >= 0) || !std::isfinite(w)) {
+            throw std::runtime_error("weights should be non-negative and finite");
+        }
+        converted[c] = w;
+        const auto b = (block ? block[c] : 0);
+        totals[b] += w;
+        ++block_size[b];
+    }
+
+    // Extra statistics are not defined for weighted cells.
+    auto per_block = buffers.per_block;
+    for (auto& current : per_block) {
+        current.detected = NULL;
+        current.sums = NULL;
+        current.minimum = NULL;
+        current.maximum = NULL;
+    }
+
+    internal::CellWeights<Stat_> cell_weights;
+    cell_weights.weights = converted.data();
+    cell_weights.totals = totals.data();
+    internal::compute_variances(mat, per_block, block, block_size, options, internal::IdentityTransform(), cell_weights);
+    internal::fit_and_average(mat.nrow(), totals, buffers, options);
+}
+
+/**
+ * Model the per-gene variances from a log-expression matrix, where each cell is weighted in the calculation of the mean and variance.
+ * See `model_gene_variances_blocked_weighted()` for details.
+ *
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam Weight_ Numeric type of the weights.
+ * @tparam Stat_ Floating-point type of the output statistics.
+ *
+ * @param mat Matrix of expression values, typically after normalization and log-transformation.
+ * Rows should be genes while columns should be cells.
+ * @param[in] weights Pointer to an array of length equal to the number of cells, containing the non-negative weight for each cell.
+ * @param buffers Collection of buffers in which to store the computed statistics.
+ * @param options Further options.
+ */
+template<typename Value_, typename Index_, typename Weight_, typename Stat_>
+void model_gene_variances_weighted(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const Weight_* const weights,
+    ModelGeneVariancesBuffers<Stat_> buffers,
+    const ModelGeneVariancesOptions& options)
+{
+    ModelGeneVariancesBlockedBuffers<Stat_> bbuffers;
+    bbuffers.per_block.emplace_back(std::move(buffers));
+
+    bbuffers.average.means = NULL;
+    bbuffers.average.variances = NULL;
+    bbuffers.average.fitted = NULL;
+    bbuffers.average.residuals = NULL;
+
+    model_gene_variances_blocked_weighted(mat, static_cast<Index_*>(NULL), weights, bbuffers, options);
+}
+
+/**
+ * Overload of `model_gene_variances_weighted()` that allocates space for the output statistics.
+ *
+ * @tparam Stat_ Floating-point type of the output statistics.
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam Weight_ Numeric type of the weights.
+ *
+ * @param mat Matrix of expression values, typically after normalization and log-transformation.
+ * Rows should be genes while columns should be cells.
+ * @param[in] weights Pointer to an array of length equal to the number of cells, containing the non-negative weight for each cell.
+ * @param options Further options.
+ *
+ * @return Results of the variance modelling.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Weight_>
+ModelGeneVariancesResults<Stat_> model_gene_variances_weighted(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const Weight_* const weights,
+    const ModelGeneVariancesOptions& options)
+{
+    ModelGeneVariancesResults<Stat_> output(mat.nrow(), options.trend); // cast is safe, as any tatami Index_ can always fit into a size_t.
+    internal::track_results(options.allocation_tracker, output);
+    model_gene_variances_weighted(mat, weights, internal::get_buffers(output, true, options.trend), options);
+    return output;
+}
+
+/**
+ * Overload of `model_gene_variances_blocked_weighted()` that allocates space for the output statistics.
+ *
+ * @tparam Stat_ Floating-point type of the output statistics.
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam Block_ Integer type of the block IDs.
+ * @tparam Weight_ Numeric type of the weights.
+ *
+ * @param mat Matrix of expression values, typically after normalization and log-transformation.
+ * Rows should be genes while columns should be cells.
+ * @param[in] block Pointer to an array of length equal to the number of cells, containing 0-based block identifiers.
+ * This may also be a `nullptr` in which case all cells are assumed to belong to the same block.
+ * @param[in] weights Pointer to an array of length equal to the number of cells, containing the non-negative weight for each cell.
+ * @param options Further options.
+ *
+ * @return Results of the variance modelling in each block.
+ * An average for each statistic is also computed if `ModelGeneVariancesOptions::average_policy` is not `BlockAveragePolicy::NONE`.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename Block_, typename Weight_>
+ModelGeneVariancesBlockedResults<Stat_> model_gene_variances_blocked_weighted(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const Block_* const block,
+    const Weight_* const weights,
+    const ModelGeneVariancesOptions& options)
+{
+    const auto nblocks = (block ? tatami_stats::total_groups(block, mat.ncol()) : 1);
+
+    const bool do_average = internal::use_average(options);
+    ModelGeneVariancesBlockedResults<Stat_> output(
+        mat.nrow(), // cast is safe, any tatami Index_ can always fit into a size_t.
+        nblocks,
+        do_average,
+        options.trend
+    );
+    internal::track_results(options.allocation_tracker, output);
+
+    const auto buffers = internal::get_blocked_buffers(output, do_average, options.trend);
+    model_gene_variances_blocked_weighted(mat, block, weights, buffers, options);
+    return output;
+}
+
+}
+
+#endif
@@ -0,0 +1,559 @@
+#ifndef SCRAN_VARIANCES_PEARSON_RESIDUAL_VARIANCES_HPP
+#define SCRAN_VARIANCES_PEARSON_RESIDUAL_VARIANCES_HPP
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <cstddef>
+#include <algorithm>
+#include <stdexcept>
+#include <memory_resource>
+
+#include "tatami/tatami.hpp"
+#include "tatami_stats/tatami_stats.hpp"
+#include "sanisizer/sanisizer.hpp"
+
+#include "model_gene_variances.hpp"
+#include "utils.hpp"
+
+/**
+ * @file pearson_residual_variances.hpp
+ * @brief Compute the variance of analytic Pearson residuals from a count matrix.
+ */
+
+namespace scran_variances {
+
+/**
+ * @brief Options for `model_pearson_residual_variances()` and friends.
+ */
+struct PearsonResidualOptions {
+    /**
+     * Overdispersion parameter \f$\theta\f$ of the negative binomial model.
+     * This should be positive, and may be infinite to use a Poisson model.
+     */
+    double theta = 100;
+
+    /**
+     * Residuals are clipped to \f$[-k, k]\f$ where \f$k\f$ is the value of this parameter.
+     * If negative, this defaults to the square root of the number of cells.
+     * This may be infinite to disable clipping.
+     */
+    double clip = -1;
+};
+
+/**
+ * @cond
+ */
+namespace internal {
+
+/*
+ * Calls 'fun(r, c, x)' for each non-zero count 'x' in row 'r' and column 'c'.
+ * Genes are split across threads, so calls for a given gene are always made
+ * from the same thread.
+ */
+template<typename Value_, typename Index_, class Function_>
+void traverse_nonzeros(const tatami::Matrix<Value_, Index_>& mat, const int num_threads, std::pmr::memory_resource* const resource, Function_ fun) {
+    const auto NR = mat.nrow(), NC = mat.ncol();
+    tatami::Options opt;
+    opt.sparse_ordered_index = false;
+
+    tatami::parallelize([&](const int, const Index_ start, const Index_ length) -> void {
+        if (mat.prefer_rows()) {
+            auto vbuffer = tatami::create_container_of_Index_size<std::pmr::vector<Value_> >(NC, resource);
+            auto ibuffer = tatami::create_container_of_Index_size<std::pmr::vector<Index_> >(NC, resource);
+            auto ext = tatami::consecutive_extractor<true>(mat, true, start, length, opt);
+            for (Index_ r = start, end = start + length; r < end; ++r) {
+                const auto range = ext->fetch(vbuffer.data(), ibuffer.data());
+                for (Index_ i = 0; i < range.number; ++i) {
+                    fun(r, range.index[i], range.value[i]);
+                }
+            }
+        } else {
+            auto vbuffer = tatami::create_container_of_Index_size<std::pmr::vector<Value_> >(length, resource);
+            auto ibuffer = tatami::create_container_of_Index_size<std::pmr::vector<Index_> >(length, resource);
+            auto ext = tatami::consecutive_extractor<true>(mat, false, static_cast<Index_>(0), NC, start, length, opt);
+            for (Index_ c = 0; c < NC; ++c) {
+                const auto range = ext->fetch(vbuffer.data(), ibuffer.data());
+                for (Index_ i = 0; i < range.number; ++i) {
+                    fun(range.index[i], c, range.value[i]);
+                }
+            }
+        }
+    }, NR, num_threads);
+}
+
+/*
+ * Pearson residual for count 'x' with mean 'mu', i.e., (x - mu) / sqrt(mu + mu^2 / theta).
+ * For x = 0, the squared residual is mu / (1 + mu / theta), which is bounded by theta.
+ */
+template<typename Stat_>
+class PearsonResidual {
+public:
+    PearsonResidual(const Stat_ theta, const Stat_ clip) : my_inv_theta(1 / theta), my_clip(clip) {}
+
+    Stat_ compute(const Stat_ x, const Stat_ mu) const {
+        if (mu == 0) {
+            return 0;
+        }
+        const Stat_ z = (x - mu) / std::sqrt(mu * (1 + mu * my_inv_theta));
+        return std::max(-my_clip, std::min(my_clip, z));
+    }
+
+    Stat_ zero_squared(const Stat_ mu) const {
+        return mu / (1 + mu * my_inv_theta);
+    }
+
+    // Derivatives of zero_squared(mu) and sqrt(zero_squared(mu)) with respect to log(mu).
+    Stat_ zero_squared_slope(const Stat_ mu) const {
+        const Stat_ denom = 1 + mu * my_inv_theta;
+        return mu / (denom * denom);
+    }
+
+    Stat_ zero_absolute_slope(const Stat_ mu) const {
+        const Stat_ denom = 1 + mu * my_inv_theta;
+        return std::sqrt(mu) / (2 * denom * std::sqrt(denom));
+    }
+
+    // Smallest mean at which a zero count would be clipped.
+    Stat_ zero_clip_threshold() const {
+        const Stat_ clip2 = my_clip * my_clip;
+        const Stat_ remaining = 1 - clip2 * my_inv_theta;
+        if (remaining <= 0) {
+            return std::numeric_limits<Stat_>::infinity();
+        }
+        return clip2 / remaining;
+    }
+
+private:
+    Stat_ my_inv_theta, my_clip;
+};
+
+/*
+ * Mean of z and the sum of squared deviations of z from its mean, for a zero
+ * count in each cell with the specified size factors. This uses two passes
+ * for numerical stability, see tatami_stats::variances.
+ */
+template<typename Stat_>
+std::pair<Stat_, Stat_> compute_zero_moments(const std::vector<Stat_>& size_factors, const PearsonResidual<Stat_>& residual, const Stat_ rate) {
+    if (size_factors.empty()) {
+        return std::make_pair(0, 0);
+    }
+    Stat_ mean = 0;
+    for (const auto s : size_factors) {
+        mean += residual.compute(0, s * rate);
+    }
+    mean /= size_factors.size();
+    Stat_ deviation = 0;
+    for (const auto s : size_factors) {
+        const Stat_ delta = residual.compute(0, s * rate) - mean;
+        deviation += delta * delta;
+    }
+    return std::make_pair(mean, deviation);
+}
+
+/*
+ * Sum of z and the sum of squared deviations of z from its mean, for a zero
+ * count in every cell of a block, as a function of the gene's rate 'beta'
+ * such that the mean for cell 'c' is s_c * beta. These are not separable in
+ * beta and s_c, so we tabulate them on a grid of log(beta) and use cubic
+ * Hermite interpolation with the exact derivatives. The interpolation error is
+ * of order h^4 / 384 relative to the sums, where h is the grid spacing; this
+ * is well below 1e-7 for our choice of h.
+ *
+ * This is only valid for rates where no zero count is clipped, otherwise the
+ * sums are no longer smooth in log(beta).
+ */
+template<typename Stat_>
+class ZeroResidualTable {
+public:
+    static constexpr Stat_ spacing = 0.05;
+
+    ZeroResidualTable(const std::vector<Stat_>& size_factors, const PearsonResidual<Stat_>& residual, const Stat_ min_rate, const Stat_ max_rate, const int num_threads) :
+        my_start(std::log(min_rate))
+    {
+        const Stat_ range = std::log(max_rate) - my_start;
+        const auto npoints = sanisizer::sum<std::size_t>(static_cast<std::size_t>(std::ceil(range / spacing)), 1);
+        sanisizer::resize(my_absolute, npoints);
+        sanisizer::resize(my_absolute_slope, npoints);
+        sanisizer::resize(my_deviation, npoints);
+        sanisizer::resize(my_deviation_slope, npoints);
+
+        tatami::parallelize([&](const int, const std::size_t start, const std::size_t length) -> void {
+            for (std::size_t p = start, end = start + length; p < end; ++p) {
+                const Stat_ rate = std::exp(my_start + p * spacing);
+
+                // Using the unclipped residuals, as the last grid point may lie beyond the clipping threshold.
+                Stat_ absolute = 0;
+                for (const auto s : size_factors) {
+                    absolute += std::sqrt(residual.zero_squared(s * rate));
+                }
+                const Stat_ mean = absolute / size_factors.size();
+
+                // Second pass for numerical stability, see tatami_stats::variances. The derivative
+                // of sum((|z| - mean)^2) is 2 * sum((|z| - mean) * d|z|), as the deviations sum to zero.
+                Stat_ absolute_slope = 0, deviation = 0, deviation_slope = 0;
+                for (const auto s : size_factors) {
+                    const Stat_ mu = s * rate;
+                    const Stat_ delta = std::sqrt(residual.zero_squared(mu)) - mean;
+                    const Stat_ slope = residual.zero_absolute_slope(mu);
+                    absolute_slope += slope;
+                    deviation += delta * delta;
+                    deviation_slope += 2 * delta * slope;
+                }
+                my_absolute[p] = absolute;
+                my_deviation[p] = deviation;
+                my_absolute_slope[p] = absolute_slope;
+                my_deviation_slope[p] = deviation_slope;
+            }
+        }, npoints, num_threads);
+    }
+
+    // Returns the sum of |z| and the sum of squared deviations, noting that z is always negative for zero counts.
+    std::pair<Stat_, Stat_> get(const Stat_ rate) const {
+        const Stat_ t = (std::log(rate) - my_start) / spacing;
+        const std::size_t last = my_deviation.size() - 1;
+        std::size_t i = (t <= 0 ? 0 : std::min(static_cast<std::size_t>(t), last));
+        if (i == last) {
+            if (last == 0) {
+                return std::make_pair(my_absolute[0], my_deviation[0]);
+            }
+            --i;
+        }
+        const Stat_ u = std::max(static_cast<Stat_>(0), std::min(static_cast<Stat_>(1), t - i));
+        return std::make_pair(
+            interpolate(my_absolute, my_absolute_slope, i, u),
+            std::max(static_cast<Stat_>(0), interpolate(my_deviation, my_deviation_slope, i, u))
+        );
+    }
+
+private:
+    Stat_ my_start;
+    std::vector<Stat_> my_absolute, my_absolute_slope, my_deviation, my_deviation_slope;
+
+    static Stat_ interpolate(const std::vector<Stat_>& value, const std::vector<Stat_>& slope, const std::size_t i, const Stat_ u) {
+        const Stat_ u2 = u * u, u3 = u2 * u;
+        return (2 * u3 - 3 * u2 + 1) * value[i]
+            + (u3 - 2 * u2 + u) * spacing * slope[i]
+            + (-2 * u3 + 3 * u2) * value[i + 1]
+            + (u3 - u2) * spacing * slope[i + 1];
+    }
+};
+
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Compute the mean and variance of the analytic Pearson residuals for each gene in each block, as described by Lause et al. (2021).
+ * For gene \f$g\f$ and cell \f$c\f$ in block \f$b\f$, the expected count is defined as \f$\mu_{gc} = s_c \beta_{gb}\f$
+ * where \f$s_c\f$ is the size factor for cell \f$c\f$ and \f$\beta_{gb}\f$ is the sum of counts for \f$g\f$ in \f$b\f$ divided by the sum of size factors in \f$b\f$.
+ * (If the size factors are the library sizes, this is equivalent to the original definition.)
+ * The Pearson residual is then defined as \f$(x_{gc} - \mu_{gc}) / \sqrt{\mu_{gc} + \mu_{gc}^2/\theta}\f$ and clipped to \f$[-k, k]\f$,
+ * where \f$\theta\f$ and \f$k\f$ are set in `PearsonResidualOptions`.
+ * Genes are typically ranked by the variance of their residuals, e.g., with `choose_highly_variable_genes()`.
+ *
+ * The residuals are never explicitly formed.
+ * Instead, we only visit the non-zero counts, and the contribution of the zero counts is computed from the rate \f$\beta_{gb}\f$ for each gene and block.
+ * Specifically, the sum of the residuals and the sum of their squared deviations from the mean for zero counts in all cells of a block are tabulated as a function of \f$\log\beta_{gb}\f$,
+ * and interpolated for each gene; this yields relative errors of order \f$10^{-8}\f$ in the zero contributions.
+ * The zero residuals of the cells with non-zero counts are then replaced by their actual residuals with the pairwise updates of Chan et al. (1979),
+ * avoiding the loss of precision from subtracting the squared mean from the mean of squares.
+ * The cost is thus proportional to the number of non-zero counts, plus the number of genes and blocks, plus the number of cells multiplied by the size of the table.
+ * For genes where zero counts would be clipped, or if there are fewer genes than table entries, the zero contributions are computed exactly from all cells in the block.
+ *
+ * The per-block means and variances are stored in `buffers.per_block`,
+ * after which trend fitting and averaging across blocks are performed as described in `model_gene_variances_blocked()`.
+ * As Pearson residuals are already variance-stabilized, users may prefer to set `ModelGeneVariancesOptions::trend = false` and use the variances directly.
+ * `ModelGeneVariancesOptions::extra_statistics` and the access pattern options are ignored.
+ *
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam SizeFactor_ Floating-point type of the size factors.
+ * @tparam Block_ Integer type of the block IDs.
+ * @tparam Stat_ Floating-point type of the output statistics.
+ *
+ * @param mat Matrix of non-negative counts.
+ * Rows should be genes while columns should be cells.
+ * @param[in] size_factors Pointer to an array of length equal to the number of cells, containing the size factor for each cell.
+ * All size factors should be positive and finite.
+ * @param[in] block Pointer to an array of length equal to the number of cells.
+ * Each entry should be a 0-based block identifier in \f$[0, B)\f$ where \f$B\f$ is the total number of blocks.
+ * `block` can also be a `nullptr`, in which case all cells are assumed to belong to the same block.
+ * @param[out] buffers Collection of pointers of arrays in which to store the output statistics.
+ * The length of `ModelGeneVariancesBlockedResults::per_block` should be equal to the number of blocks.
+ * @param options Further options.
+ * @param pearson_options Options for computing the Pearson residuals.
+ */
+template<typename Value_, typename Index_, typename SizeFactor_, typename Block_, typename Stat_>
+void model_pearson_residual_variances_blocked(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const SizeFactor_* const size_factors,
+    const Block_* const block,
+    const ModelGeneVariancesBlockedBuffers<Stat_>& buffers,
+    const ModelGeneVariancesOptions& options,
+    const PearsonResidualOptions& pearson_options
+) {
+    const Index_ NR = mat.nrow(), NC = mat.ncol();
+    std::vector<Index_> block_size;
+    if (block) {
+        block_size = tatami_stats::tabulate_groups(block, NC);
+    } else {
+        block_size.push_back(NC); // everything is one big block.
+    }
+    const auto nblocks = block_size.size();
+    const auto get_block = [&](const Index_ c) -> std::size_t { return block ? block[c] : 0; };
+
+    if (!(pearson_options.theta > 0)) {
+        throw std::runtime_error("theta should be positive");
+    }
+    const Stat_ clip = (pearson_options.clip < 0 ? std::sqrt(static_cast<Stat_>(NC)) : pearson_options.clip);
+    const internal::PearsonResidual<Stat_> residual(pearson_options.theta, clip);
+
+    auto block_sf = sanisizer::create<std::vector<std::vector<Stat_> > >(nblocks);
+    for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+        block_sf[b].reserve(block_size[b]);
+    }
+    auto total_sf = sanisizer::create<std::vector<Stat_> >(nblocks);
+    for (Index_ c = 0; c < NC; ++c) {
+        const Stat_ sf = size_factors[c];
+        if (!std::isfinite(sf) || sf <= 0) {
+            throw std::runtime_error("size factors should be positive and finite");
+        }
+        const auto b = get_block(c);
+        block_sf[b].push_back(sf);
+        total_sf[b] += sf;
+    }
+
+    // First pass to compute the rate for each gene and block.
+    const auto ncombos = sanisizer::product<typename std::vector<Stat_>::size_type>(NR, nblocks);
+    auto rates = sanisizer::create<std::vector<Stat_> >(ncombos);
+    internal::traverse_nonzeros(mat, options.num_threads, internal::get_memory_resource(options), [&](const Index_ r, const Index_ c, const Value_ x) -> void {
+        rates[static_cast<std::size_t>(r) * nblocks + get_block(c)] += x; // cast is safe as the product was already checked above.
+    });
+    for (Index_ r = 0; r < NR; ++r) {
+        for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+            auto& current = rates[static_cast<std::size_t>(r) * nblocks + b];
+            current = (total_sf[b] > 0 ? current / total_sf[b] : 0);
+        }
+    }
+
+    // Second pass to compute the running mean and sum of squared deviations of
+    // the residuals for the non-zero counts, along with those of the residuals
+    // that these cells would have had for a zero count. The latter are needed
+    // to remove the non-zero cells from the zero contributions of all cells.
+    auto nonzero_count = sanisizer::create<std::vector<Index_> >(ncombos);
+    auto nonzero_mean = sanisizer::create<std::vector<Stat_> >(ncombos);
+    auto nonzero_deviation = sanisizer::create<std::vector<Stat_> >(ncombos);
+    auto replaced_mean = sanisizer::create<std::vector<Stat_> >(ncombos);
+    auto replaced_deviation = sanisizer::create<std::vector<Stat_> >(ncombos);
+    internal::traverse_nonzeros(mat, options.num_threads, internal::get_memory_resource(options), [&](const Index_ r, const Index_ c, const Value_ x) -> void {
+        const auto offset = static_cast<std::size_t>(r) * nblocks + get_block(c);
+        const Stat_ mu = size_factors[c] * rates[offset];
+        const Stat_ count = ++nonzero_count[offset];
+
+        const Stat_ z = residual.compute(x, mu);
+        const Stat_ delta = z - nonzero_mean[offset];
+        nonzero_mean[offset] += delta / count;
+        nonzero_deviation[offset] += delta * (z - nonzero_mean[offset]);
+
+        const Stat_ z0 = residual.compute(0, mu);
+        const Stat_ delta0 = z0 - replaced_mean[offset];
+        replaced_mean[offset] += delta0 / count;
+        replaced_deviation[offset] += delta0 * (z0 - replaced_mean[offset]);
+    });
+
+    const Stat_ clip_threshold = residual.zero_clip_threshold();
+    for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+        const auto& cur_sf = block_sf[b];
+        const Stat_ count = block_size[b];
+        const Stat_ max_sf = (cur_sf.empty() ? 0 : *std::max_element(cur_sf.begin(), cur_sf.end()));
+
+        // Genes with zero counts that might be clipped are handled exactly.
+        const auto tabulated = [&](const Stat_ rate) -> bool {
+            return rate > 0 && max_sf * rate < clip_threshold;
+        };
+
+        Stat_ min_rate = std::numeric_limits<Stat_>::infinity(), max_rate = 0;
+        Index_ ntabulated = 0;
+        for (Index_ r = 0; r < NR; ++r) {
+            const auto rate = rates[static_cast<std::size_t>(r) * nblocks + b];
+            if (tabulated(rate)) {
+                min_rate = std::min(min_rate, rate);
+                max_rate = std::max(max_rate, rate);
+                ++ntabulated;
+            }
+        }
+
+        std::vector<internal::ZeroResidualTable<Stat_> > table;
+        if (ntabulated) {
+            const Stat_ npoints = std::ceil((std::log(max_rate) - std::log(min_rate)) / internal::ZeroResidualTable<Stat_>::spacing) + 1;
+            if (npoints < ntabulated) {
+                table.emplace_back(cur_sf, residual, min_rate, max_rate, options.num_threads);
+            }
+        }
+
+        tatami::parallelize([&](const int, const Index_ start, const Index_ length) -> void {
+            for (Index_ r = start, end = start + length; r < end; ++r) {
+                const auto offset = static_cast<std::size_t>(r) * nblocks + b;
+                const Stat_ rate = rates[offset];
+
+                auto& current = buffers.per_block[b];
+                if (count == 0) {
+                    current.means[r] = std::numeric_limits<Stat_>::quiet_NaN();
+                    current.variances[r] = std::numeric_limits<Stat_>::quiet_NaN();
+                    continue;
+                }
+
+                // All residuals are zero if the rate is zero.
+                Stat_ mean = 0, deviation = 0;
+                if (rate > 0) {
+                    // Mean and sum of squared deviations for a zero count in every cell.
+                    std::pair<Stat_, Stat_> zero;
+                    if (!table.empty() && tabulated(rate)) {
+                        zero = table.front().get(rate);
+                        zero.first /= -count;
+                    } else {
+                        zero = internal::compute_zero_moments(cur_sf, residual, rate);
+                    }
+                    mean = zero.first;
+                    deviation = zero.second;
+
+                    // Replacing the zero residuals of the cells with non-zero counts, see Chan et al. (1979).
+                    const Stat_ nnonzero = nonzero_count[offset];
+                    if (nnonzero == count) {
+                        mean = nonzero_mean[offset];
+                        deviation = nonzero_deviation[offset];
+                    } else if (nnonzero > 0) {
+                        const Stat_ nzero = count - nnonzero;
+                        const Stat_ scale = nnonzero * nzero / count;
+
+                        const Stat_ zero_mean = (count * mean - nnonzero * replaced_mean[offset]) / nzero;
+                        const Stat_ replaced_delta = replaced_mean[offset] - zero_mean;
+                        const Stat_ zero_deviation = std::max(static_cast<Stat_>(0), deviation - replaced_deviation[offset] - replaced_delta * replaced_delta * scale);
+
+                        const Stat_ nonzero_delta = nonzero_mean[offset] - zero_mean;
+                        mean = zero_mean + nonzero_delta * (nnonzero / count);
+                        deviation = zero_deviation + nonzero_deviation[offset] + nonzero_delta * nonzero_delta * scale;
+                    }
+                }
+
+                current.means[r] = mean;
+                current.variances[r] = (count == 1 ? std::numeric_limits<Stat_>::quiet_NaN() : deviation / (count - 1));
+            }
+        }, NR, options.num_threads);
+    }
+
+    internal::fit_and_average(NR, block_size, buffers, options);
+}
+
+/**
+ * Compute the mean and variance of the analytic Pearson residuals for each gene.
+ * See `model_pearson_residual_variances_blocked()` for details.
+ *
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam SizeFactor_ Floating-point type of the size factors.
+ * @tparam Stat_ Floating-point type of the output statistics.
+ *
+ * @param mat Matrix of non-negative counts.
+ * Rows should be genes while columns should be cells.
+ * @param[in] size_factors Pointer to an array of length equal to the number of cells, containing the size factor for each cell.
+ * @param buffers Collection of buffers in which to store the computed statistics.
+ * @param options Further options.
+ * @param pearson_options Options for computing the Pearson residuals.
+ */
+template<typename Value_, typename Index_, typename SizeFactor_, typename Stat_>
+void model_pearson_residual_variances(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const SizeFactor_* const size_factors,
+    ModelGeneVariancesBuffers<Stat_> buffers,
+    const ModelGeneVariancesOptions& options,
+    const PearsonResidualOptions& pearson_options
+) {
+    ModelGeneVariancesBlockedBuffers<Stat_> bbuffers;
+    bbuffers.per_block.emplace_back(std::move(buffers));
+
+    bbuffers.average.means = NULL;
+    bbuffers.average.variances = NULL;
+    bbuffers.average.fitted = NULL;
+    bbuffers.average.residuals = NULL;
+
+    model_pearson_residual_variances_blocked(mat, size_factors, static_cast<Index_*>(NULL), bbuffers, options, pearson_options);
+}
+
+/**
+ * Overload of `model_pearson_residual_variances()` that allocates space for the output statistics.
+ *
+ * @tparam Stat_ Floating-point type of the output statistics.
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam SizeFactor_ Floating-point type of the size factors.
+ *
+ * @param mat Matrix of non-negative counts.
+ * Rows should be genes while columns should be cells.
+ * @param[in] size_factors Pointer to an array of length equal to the number of cells, containing the size factor for each cell.
+ * @param options Further options.
+ * @param pearson_options Options for computing the Pearson residuals.
+ *
+ * @return Results of the variance modelling.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename SizeFactor_>
+ModelGeneVariancesResults<Stat_> model_pearson_residual_variances(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const SizeFactor_* const size_factors,
+    const ModelGeneVariancesOptions& options,
+    const PearsonResidualOptions& pearson_options
+) {
+    ModelGeneVariancesResults<Stat_> output(mat.nrow(), options.trend); // cast is safe, as any tatami Index_ can always fit into a size_t.
+    internal::track_results(options.allocation_tracker, output);
+    model_pearson_residual_variances(mat, size_factors, internal::get_buffers(output, true, options.trend), options, pearson_options);
+    return output;
+}
+
+/**
+ * Overload of `model_pearson_residual_variances_blocked()` that allocates space for the output statistics.
+ *
+ * @tparam Stat_ Floating-point type of the output statistics.
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam SizeFactor_ Floating-point type of the size factors.
+ * @tparam Block_ Integer type of the block IDs.
+ *
+ * @param mat Matrix of non-negative counts.
+ * Rows should be genes while columns should be cells.
+ * @param[in] size_factors Pointer to an array of length equal to the number of cells, containing the size factor for each cell.
+ * @param[in] block Pointer to an array of length equal to the number of cells, containing the block ID for each cell.
+ * This may also be `NULL`, see `model_pearson_residual_variances_blocked()` for details.
+ * @param options Further options.
+ * @param pearson_options Options for computing the Pearson residuals.
+ *
+ * @return Results of the variance modelling in each block.
+ */
+template<typename Stat_ = double, typename Value_, typename Index_, typename SizeFactor_, typename Block_>
+ModelGeneVariancesBlockedResults<Stat_> model_pearson_residual_variances_blocked(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const SizeFactor_* const size_factors,
+    const Block_* const block,
+    const ModelGeneVariancesOptions& options,
+    const PearsonResidualOptions& pearson_options
+) {
+    const auto nblocks = (block ? tatami_stats::total_groups(block, mat.ncol()) : 1);
+
+    const bool do_average = internal::use_average(options);
+    ModelGeneVariancesBlockedResults<Stat_> output(
+        mat.nrow(), // cast is safe, any tatami Index_ can always fit into a size_t.
+        nblocks,
+        do_average,
+        options.trend
+    );
+    internal::track_results(options.allocation_tracker, output);
+
+    const auto buffers = internal::get_blocked_buffers(output, do_average, options.trend);
+    model_pearson_residual_variances_blocked(mat, size_factors, block, buffers, options, pearson_options);
+    return output;
+}
+
+}
+
+#endif
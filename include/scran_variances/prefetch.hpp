@@ -0,0 +1,227 @@
+#ifndef SCRAN_VARIANCES_PREFETCH_HPP
+#define SCRAN_VARIANCES_PREFETCH_HPP
+
+#include <vector>
+#include <array>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <algorithm>
+#include <cstddef>
+#include <type_traits>
+
+#include "tatami/tatami.hpp"
+#include "sanisizer/sanisizer.hpp"
+
+/**
+ * @cond
+ */
+namespace scran_variances {
+
+namespace internal {
+
+/*
+ * Wrapper around a consecutive tatami extractor that optionally uses a
+ * separate reader thread to fetch the next chunk of rows/columns while the
+ * current chunk is being processed by the caller. The buffer budget is split
+ * into two slots so that one slot can be filled while the other is consumed.
+ * If the budget is zero, this just forwards to the underlying extractor.
+ */
+template<bool sparse_, typename Value_, typename Index_>
+class PrefetchExtractor {
+private:
+    typedef std::conditional_t<sparse_, tatami::OracularSparseExtractor<Value_, Index_>, tatami::OracularDenseExtractor<Value_, Index_> > Extractor;
+
+public:
+    template<class CreateExtractor_>
+    PrefetchExtractor(CreateExtractor_ create, const Index_ extent, const Index_ length, const std::size_t buffer_size) :
+        my_ext(create()),
+        my_extent(extent),
+        my_remaining(length)
+    {
+        if (buffer_size == 0 || length == 0) {
+            return;
+        }
+
+        // Figuring out how many rows/columns fit into each slot.
+        std::size_t per_element = sizeof(Value_);
+        if constexpr(sparse_) {
+            per_element += sizeof(Index_);
+        }
+        const std::size_t per_fetch = std::max<std::size_t>(1, static_cast<std::size_t>(extent) * per_element);
+        const std::size_t chunk = std::max<std::size_t>(1, buffer_size / 2 / per_fetch);
+        my_chunk_size = (chunk < static_cast<std::size_t>(length) ? static_cast<Index_>(chunk) : length);
+
+        const auto slot_size = sanisizer::product<typename std::vector<Value_>::size_type>(my_chunk_size, extent);
+        for (auto& slot : my_slots) {
+            sanisizer::resize(slot.values, slot_size);
+            if constexpr(sparse_) {
+                sanisizer::resize(slot.indices, slot_size);
+                sanisizer::resize(slot.number, my_chunk_size);
+            }
+        }
+
+        my_prefetch = true;
+        my_reader = std::thread([&]() -> void { read(); });
+    }
+
+    ~PrefetchExtractor() {
+        if (my_prefetch) {
+            {
+                std::lock_guard<std::mutex> lck(my_lock);
+                my_cancelled = true;
+            }
+            my_cv.notify_all();
+            my_reader.join();
+        }
+    }
+
+    PrefetchExtractor(const PrefetchExtractor&) = delete;
+    PrefetchExtractor& operator=(const PrefetchExtractor&) = delete;
+
+    std::size_t bytes() const {
+        std::size_t output = 0;
+        for (const auto& slot : my_slots) {
+            output += slot.values.capacity() * sizeof(Value_) + slot.indices.capacity() * sizeof(Index_) + slot.number.capacity() * sizeof(Index_);
+        }
+        return output;
+    }
+
+private:
+    std::unique_ptr<Extractor> my_ext;
+    Index_ my_extent;
+    Index_ my_remaining;
+
+    bool my_prefetch = false;
+    Index_ my_chunk_size = 0;
+
+    struct Slot {
+        std::vector<Value_> values;
+        std::vector<Index_> indices;
+        std::vector<Index_> number;
+        Index_ filled = 0;
+        bool ready = false;
+    };
+    std::array<Slot, 2> my_slots;
+
+    std::thread my_reader;
+    std::mutex my_lock;
+    std::condition_variable my_cv;
+    bool my_cancelled = false;
+    std::exception_ptr my_error;
+
+    bool my_started = false;
+    unsigned char my_current = 0;
+    Index_ my_position = 0;
+
+private:
+    void read() {
+        try {
+            unsigned char current = 0;
+            while (my_remaining > 0) {
+                auto& slot = my_slots[current];
+                {
+                    std::unique_lock<std::mutex> lck(my_lock);
+                    my_cv.wait(lck, [&]() -> bool { return my_cancelled || !slot.ready; });
+                    if (my_cancelled) {
+                        return;
+                    }
+                }
+
+                // Only the reader thread touches the slot while it is not ready, so no need to hold the lock here.
+                const Index_ num = std::min(my_chunk_size, my_remaining);
+                for (Index_ i = 0; i < num; ++i) {
+                    const auto offset = static_cast<std::size_t>(i) * static_cast<std::size_t>(my_extent); // cast is safe as the product was already checked in the constructor.
+                    auto vdest = slot.values.data() + offset;
+                    if constexpr(sparse_) {
+                        auto idest = slot.indices.data() + offset;
+                        const auto range = my_ext->fetch(vdest, idest);
+                        tatami::copy_n(range.value, range.number, vdest);
+                        tatami::copy_n(range.index, range.number, idest);
+                        slot.number[i] = range.number;
+                    } else {
+                        const auto ptr = my_ext->fetch(vdest);
+                        tatami::copy_n(ptr, my_extent, vdest);
+                    }
+                }
+
+                {
+                    std::lock_guard<std::mutex> lck(my_lock);
+                    slot.filled = num;
+                    slot.ready = true;
+                }
+                my_cv.notify_all();
+
+                my_remaining -= num;
+                current = 1 - current;
+            }
+
+        } catch (...) {
+            {
+                std::lock_guard<std::mutex> lck(my_lock);
+                my_error = std::current_exception();
+            }
+            my_cv.notify_all();
+        }
+    }
+
+    Slot& next() {
+        auto& previous = my_slots[my_current];
+        if (my_started && my_position < previous.filled) {
+            return previous;
+        }
+
+        {
+            std::unique_lock<std::mutex> lck(my_lock);
+            if (my_started) {
+                previous.ready = false;
+                my_current = 1 - my_current;
+            }
+            my_started = true;
+
+            // We need to notify the reader thread that the previous slot is free, hence the lack of an early return here.
+            my_cv.notify_all();
+            auto& slot = my_slots[my_current];
+            my_cv.wait(lck, [&]() -> bool { return slot.ready || my_error; });
+            if (my_error) {
+                std::rethrow_exception(my_error);
+            }
+        }
+
+        my_position = 0;
+        return my_slots[my_current];
+    }
+
+public:
+    const Value_* fetch(Value_* buffer) {
+        if (!my_prefetch) {
+            return my_ext->fetch(buffer);
+        }
+        auto& slot = next();
+        const auto offset = static_cast<std::size_t>(my_position) * static_cast<std::size_t>(my_extent);
+        ++my_position;
+        return slot.values.data() + offset;
+    }
+
+    tatami::SparseRange<Value_, Index_> fetch(Value_* vbuffer, Index_* ibuffer) {
+        if (!my_prefetch) {
+            return my_ext->fetch(vbuffer, ibuffer);
+        }
+        auto& slot = next();
+        const auto offset = static_cast<std::size_t>(my_position) * static_cast<std::size_t>(my_extent);
+        tatami::SparseRange<Value_, Index_> output(slot.number[my_position], slot.values.data() + offset, slot.indices.data() + offset);
+        ++my_position;
+        return output;
+    }
+};
+
+}
+
+}
+/**
+ * @endcond
+ */
+
+#endif
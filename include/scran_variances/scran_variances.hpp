@@ -3,6 +3,14 @@
 
 #include "fit_variance_trend.hpp"
 #include "model_gene_variances.hpp"
+#include "allocation_tracker.hpp"
+#include "model_gene_variances_async.hpp"
+#include "model_gene_variances_bootstrap.hpp"
+#include "model_gene_variances_weighted.hpp"
+#include "estimate_model_gene_variances_resources.hpp"
+#include "model_gene_variances_from_counts.hpp"
+#include "pearson_residual_variances.hpp"
+#include "update_model_gene_variances.hpp"
 #include "choose_highly_variable_genes.hpp"
 
 /**
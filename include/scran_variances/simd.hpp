@@ -0,0 +1,276 @@
+#ifndef SCRAN_VARIANCES_SIMD_HPP
+#define SCRAN_VARIANCES_SIMD_HPP
+
+#include <cstddef>
+#include <limits>
+#include <utility>
+#include <type_traits>
+
+#include "tatami_stats/tatami_stats.hpp"
+
+#if !defined(SCRAN_VARIANCES_DISABLE_SIMD) && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SCRAN_VARIANCES_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/**
+ * @cond
+ */
+namespace scran_variances {
+
+namespace internal {
+
+namespace simd {
+
+/*
+ * Explicitly vectorized reductions for double-precision values. Each
+ * instruction set has its own implementation, compiled with the relevant
+ * target attribute so that the library itself can be built for a
+ * conservative baseline ISA. The best available implementation is chosen at
+ * runtime based on the host CPU. Summation order differs between instruction
+ * sets, so results may differ in the last few bits across hosts.
+ */
+enum class Isa : unsigned char { SCALAR, SSE42, AVX2, AVX512 };
+
+inline double sum_scalar(const double* x, const std::size_t n) {
+    double output = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+        output += x[i];
+    }
+    return output;
+}
+
+inline double sum_squared_deviations_scalar(const double* x, const std::size_t n, const double mean) {
+    double output = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+        const double delta = x[i] - mean;
+        output += delta * delta;
+    }
+    return output;
+}
+
+#ifdef SCRAN_VARIANCES_X86_SIMD
+inline double horizontal_sum(const double* lanes) {
+    // Pairwise summation of 8 lanes, for a fixed order regardless of the compiler.
+    return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+}
+
+__attribute__((target("sse4.2")))
+inline double sum_sse42(const double* x, const std::size_t n) {
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_loadu_pd(x + i));
+        acc1 = _mm_add_pd(acc1, _mm_loadu_pd(x + i + 2));
+    }
+    acc0 = _mm_add_pd(acc0, acc1);
+    double lanes[2];
+    _mm_storeu_pd(lanes, acc0);
+    return lanes[0] + lanes[1] + sum_scalar(x + i, n - i);
+}
+
+__attribute__((target("sse4.2")))
+inline double sum_squared_deviations_sse42(const double* x, const std::size_t n, const double mean) {
+    const __m128d center = _mm_set1_pd(mean);
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const __m128d delta0 = _mm_sub_pd(_mm_loadu_pd(x + i), center);
+        const __m128d delta1 = _mm_sub_pd(_mm_loadu_pd(x + i + 2), center);
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(delta0, delta0));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(delta1, delta1));
+    }
+    acc0 = _mm_add_pd(acc0, acc1);
+    double lanes[2];
+    _mm_storeu_pd(lanes, acc0);
+    return lanes[0] + lanes[1] + sum_squared_deviations_scalar(x + i, n - i, mean);
+}
+
+__attribute__((target("avx2,fma")))
+inline double sum_avx2(const double* x, const std::size_t n) {
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(x + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(x + i + 4));
+    }
+    acc0 = _mm256_add_pd(acc0, acc1);
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc0);
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + sum_scalar(x + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+inline double sum_squared_deviations_avx2(const double* x, const std::size_t n, const double mean) {
+    const __m256d center = _mm256_set1_pd(mean);
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256d delta0 = _mm256_sub_pd(_mm256_loadu_pd(x + i), center);
+        const __m256d delta1 = _mm256_sub_pd(_mm256_loadu_pd(x + i + 4), center);
+        acc0 = _mm256_fmadd_pd(delta0, delta0, acc0);
+        acc1 = _mm256_fmadd_pd(delta1, delta1, acc1);
+    }
+    acc0 = _mm256_add_pd(acc0, acc1);
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc0);
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + sum_squared_deviations_scalar(x + i, n - i, mean);
+}
+
+__attribute__((target("avx512f")))
+inline double sum_avx512(const double* x, const std::size_t n) {
+    __m512d acc0 = _mm512_setzero_pd(), acc1 = _mm512_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm512_add_pd(acc0, _mm512_loadu_pd(x + i));
+        acc1 = _mm512_add_pd(acc1, _mm512_loadu_pd(x + i + 8));
+    }
+    double lanes[8];
+    _mm512_storeu_pd(lanes, _mm512_add_pd(acc0, acc1));
+    return horizontal_sum(lanes) + sum_scalar(x + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+inline double sum_squared_deviations_avx512(const double* x, const std::size_t n, const double mean) {
+    const __m512d center = _mm512_set1_pd(mean);
+    __m512d acc0 = _mm512_setzero_pd(), acc1 = _mm512_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m512d delta0 = _mm512_sub_pd(_mm512_loadu_pd(x + i), center);
+        const __m512d delta1 = _mm512_sub_pd(_mm512_loadu_pd(x + i + 8), center);
+        acc0 = _mm512_fmadd_pd(delta0, delta0, acc0);
+        acc1 = _mm512_fmadd_pd(delta1, delta1, acc1);
+    }
+    double lanes[8];
+    _mm512_storeu_pd(lanes, _mm512_add_pd(acc0, acc1));
+    return horizontal_sum(lanes) + sum_squared_deviations_scalar(x + i, n - i, mean);
+}
+#endif
+
+inline bool is_supported(const Isa isa) {
+#ifdef SCRAN_VARIANCES_X86_SIMD
+    __builtin_cpu_init();
+    switch (isa) {
+        case Isa::AVX512:
+            return __builtin_cpu_supports("avx512f");
+        case Isa::AVX2:
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+        case Isa::SSE42:
+            return __builtin_cpu_supports("sse4.2");
+        default:
+            return true;
+    }
+#else
+    return isa == Isa::SCALAR;
+#endif
+}
+
+inline Isa detect_isa() {
+    static const Isa chosen = []() -> Isa {
+        for (auto isa : { Isa::AVX512, Isa::AVX2, Isa::SSE42 }) {
+            if (is_supported(isa)) {
+                return isa;
+            }
+        }
+        return Isa::SCALAR;
+    }();
+    return chosen;
+}
+
+inline double sum(const double* x, const std::size_t n, const Isa isa) {
+#ifdef SCRAN_VARIANCES_X86_SIMD
+    switch (isa) {
+        case Isa::AVX512:
+            return sum_avx512(x, n);
+        case Isa::AVX2:
+            return sum_avx2(x, n);
+        case Isa::SSE42:
+            return sum_sse42(x, n);
+        default:
+            break;
+    }
+#else
+    (void)isa;
+#endif
+    return sum_scalar(x, n);
+}
+
+inline double sum_squared_deviations(const double* x, const std::size_t n, const double mean, const Isa isa) {
+#ifdef SCRAN_VARIANCES_X86_SIMD
+    switch (isa) {
+        case Isa::AVX512:
+            return sum_squared_deviations_avx512(x, n, mean);
+        case Isa::AVX2:
+            return sum_squared_deviations_avx2(x, n, mean);
+        case Isa::SSE42:
+            return sum_squared_deviations_sse42(x, n, mean);
+        default:
+            break;
+    }
+#else
+    (void)isa;
+#endif
+    return sum_squared_deviations_scalar(x, n, mean);
+}
+
+/*
+ * Two-pass mean and variance of a dense array, with the same handling of
+ * small 'n' as tatami_stats::variances::direct().
+ */
+inline std::pair<double, double> dense_variances(const double* x, const std::size_t n, const Isa isa) {
+    if (n == 0) {
+        return std::make_pair(std::numeric_limits<double>::quiet_NaN(), std::numeric_limits<double>::quiet_NaN());
+    }
+    const double mean = sum(x, n, isa) / n;
+    if (n == 1) {
+        return std::make_pair(mean, std::numeric_limits<double>::quiet_NaN());
+    }
+    return std::make_pair(mean, sum_squared_deviations(x, n, mean, isa) / (n - 1));
+}
+
+template<typename Value_, typename Index_>
+std::pair<double, double> dense_variances(const Value_* x, const Index_ n) {
+    if constexpr(std::is_same<Value_, double>::value) {
+        return dense_variances(x, static_cast<std::size_t>(n), detect_isa());
+    } else {
+        return tatami_stats::variances::direct(x, n, false);
+    }
+}
+
+
+/*
+ * Mean and variance of a sparse array of length 'n' with 'nnz' non-zero
+ * values. The reductions only involve the non-zero values, with the
+ * contribution of the structural zeros added afterwards.
+ */
+inline std::pair<double, double> sparse_variances(const double* value, const std::size_t nnz, const std::size_t n, const Isa isa) {
+    if (n == 0) {
+        return std::make_pair(std::numeric_limits<double>::quiet_NaN(), std::numeric_limits<double>::quiet_NaN());
+    }
+    const double mean = sum(value, nnz, isa) / n;
+    if (n == 1) {
+        return std::make_pair(mean, std::numeric_limits<double>::quiet_NaN());
+    }
+    const double ssd = sum_squared_deviations(value, nnz, mean, isa) + mean * mean * static_cast<double>(n - nnz);
+    return std::make_pair(mean, ssd / (n - 1));
+}
+
+template<typename Value_, typename Index_>
+std::pair<double, double> sparse_variances(const Value_* value, const Index_ nnz, const Index_ n) {
+    if constexpr(std::is_same<Value_, double>::value) {
+        return sparse_variances(value, static_cast<std::size_t>(nnz), static_cast<std::size_t>(n), detect_isa());
+    } else {
+        return tatami_stats::variances::direct(value, nnz, n, false);
+    }
+}
+
+}
+
+}
+
+}
+/**
+ * @endcond
+ */
+
+#endif
@@ -0,0 +1,260 @@
+#ifndef SCRAN_VARIANCES_UPDATE_MODEL_GENE_VARIANCES_HPP
+#define SCRAN_VARIANCES_UPDATE_MODEL_GENE_VARIANCES_HPP
+
+#include <vector>
+#include <stdexcept>
+#include <limits>
+#include <algorithm>
+#include <cstddef>
+
+#include "tatami/tatami.hpp"
+#include "tatami_stats/tatami_stats.hpp"
+
+#include "model_gene_variances.hpp"
+#include "utils.hpp"
+
+/**
+ * @file update_model_gene_variances.hpp
+ * @brief Update the results of `model_gene_variances_blocked()` after adding or removing cells.
+ */
+
+namespace scran_variances {
+
+/**
+ * @cond
+ */
+namespace internal {
+
+template<typename Index_, typename Stat_>
+void check_existing_results(const Index_ NR, const ModelGeneVariancesBlockedResults<Stat_>& results, const std::vector<Index_>& block_size, const bool trend) {
+    const auto nblocks = results.per_block.size();
+    if (nblocks != block_size.size()) {
+        throw std::runtime_error("length of 'block_size' should be equal to the number of existing blocks");
+    }
+    for (const auto& current : results.per_block) {
+        if (current.means.size() != static_cast<std::size_t>(NR)) { // cast is safe as any tatami Index_ can fit into a size_t.
+            throw std::runtime_error("number of genes in the existing results should be equal to the number of rows in 'mat'");
+        }
+        if (current.fitted.empty() == trend && NR > 0) {
+            throw std::runtime_error("'options.trend' should be consistent with the existing results");
+        }
+    }
+}
+
+template<typename Index_, typename Stat_>
+void recompute_averages(const Index_ NR, ModelGeneVariancesBlockedResults<Stat_>& results, const std::vector<Index_>& block_size, const ModelGeneVariancesOptions& options) {
+    const bool do_average = use_average(options);
+    results.average = ModelGeneVariancesResults<Stat_>(do_average ? NR : 0, options.trend);
+    const auto buffers = get_blocked_buffers(results, do_average, options.trend);
+    average_blocks(NR, block_size, buffers, options);
+}
+
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Add new blocks to the results of `model_gene_variances_blocked()`, e.g., when new samples are added to a growing dataset.
+ * The means and variances (and trends, if `ModelGeneVariancesOptions::trend = true`) are computed for the new blocks only,
+ * using a matrix that contains only the cells in the new blocks.
+ * The existing per-block statistics are not modified, and the averages across blocks are recomputed using both existing and new blocks.
+ * The cost of this function is proportional to the size of the new data, plus the cost of averaging across blocks.
+ *
+ * The results should be the same as calling `model_gene_variances_blocked()` on the combined matrix,
+ * where the new blocks are assigned identifiers after those of the existing blocks.
+ *
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam Block_ Integer type of the block IDs.
+ * @tparam Stat_ Floating-point type of the output statistics.
+ *
+ * @param mat Matrix of expression values for the cells in the new blocks only.
+ * Rows should be genes while columns should be cells.
+ * The number and order of genes should be the same as that used to compute `results`.
+ * @param[in] block Pointer to an array of length equal to the number of columns in `mat`.
+ * Each entry should be a 0-based identifier for the new block containing each cell, i.e., in \f$[0, N)\f$ where \f$N\f$ is the number of new blocks.
+ * In the updated results, new block \f$i\f$ will be stored at index \f$B + i\f$ of `ModelGeneVariancesBlockedResults::per_block`, where \f$B\f$ is the number of existing blocks.
+ * This can also be a `nullptr`, in which case all cells are assumed to belong to the same new block.
+ * @param[in,out] results Existing results from `model_gene_variances_blocked()`.
+ * On output, this will contain statistics for the new blocks and the updated averages.
+ * @param[in,out] block_size Vector of length equal to the number of existing blocks, containing the number of cells in each block.
+ * On output, this will be extended with the number of cells in each new block.
+ * @param options Further options.
+ * These should be the same as those used to compute `results`.
+ */
+template<typename Value_, typename Index_, typename Block_, typename Stat_>
+void update_model_gene_variances_blocked(
+    const tatami::Matrix<Value_, Index_>& mat,
+    const Block_* const block,
+    ModelGeneVariancesBlockedResults<Stat_>& results,
+    std::vector<Index_>& block_size,
+    const ModelGeneVariancesOptions& options
+) {
+    const Index_ NR = mat.nrow(), NC = mat.ncol();
+    internal::check_existing_results(NR, results, block_size, options.trend);
+
+    std::vector<Index_> new_block_size;
+    if (block) {
+        new_block_size = tatami_stats::tabulate_groups(block, NC);
+    } else {
+        new_block_size.push_back(NC); // everything is one big block.
+    }
+
+    const auto old_nblocks = results.per_block.size();
+    const auto new_nblocks = new_block_size.size();
+    for (I<decltype(new_nblocks)> b = 0; b < new_nblocks; ++b) {
+        results.per_block.emplace_back(NR, options.trend);
+    }
+
+    std::vector<ModelGeneVariancesBuffers<Stat_> > new_buffers;
+    new_buffers.reserve(new_nblocks);
+    for (I<decltype(new_nblocks)> b = 0; b < new_nblocks; ++b) {
+        new_buffers.push_back(internal::get_buffers(results.per_block[old_nblocks + b], true, options.trend));
+    }
+    internal::compute_variances(mat, new_buffers, block, new_block_size, internal::drop_gene_chunk_callback(options));
+
+    FitVarianceTrendWorkspace<Stat_> work;
+    auto fopt = options.fit_variance_trend_options;
+    fopt.num_threads = internal::choose_fit_num_threads(NR, options); // same as model_gene_variances_blocked().
+    for (I<decltype(new_nblocks)> b = 0; b < new_nblocks; ++b) {
+        internal::fit_block_trend(NR, new_block_size[b], new_buffers[b], work, fopt);
+    }
+
+    block_size.insert(block_size.end(), new_block_size.begin(), new_block_size.end());
+
+    internal::recompute_averages(NR, results, block_size, options);
+}
+
+/**
+ * Remove cells from the results of `model_gene_variances_blocked()`, e.g., after discarding doublets that were identified after the variance modelling.
+ * The contributions of the removed cells are subtracted from the per-block means and variances using the pairwise update formulas of Chan et al. (1979), applied in reverse.
+ * The trend is then refitted for each block that lost cells (if `ModelGeneVariancesOptions::trend = true`), and the averages across blocks are recomputed.
+ * The cost of this function is proportional to the number of removed cells, plus the cost of refitting the trends for the affected blocks and averaging across blocks.
+ *
+ * The results should be the same as calling `model_gene_variances_blocked()` on a matrix containing only the retained cells, up to numerical precision.
+ * Note that the block identifiers are not changed, even if a block no longer contains any cells.
+ *
+ * @tparam Value_ Data type of the matrix.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam Block_ Integer type of the block IDs.
+ * @tparam Stat_ Floating-point type of the output statistics.
+ *
+ * @param removed Matrix of expression values for the removed cells only.
+ * Rows should be genes while columns should be cells.
+ * The number and order of genes should be the same as that used to compute `results`.
+ * @param[in] block Pointer to an array of length equal to the number of columns in `removed`,
+ * containing the 0-based identifier of the existing block for each removed cell.
+ * This can also be a `nullptr`, in which case all cells are assumed to belong to the first block.
+ * @param[in,out] results Existing results from `model_gene_variances_blocked()`.
+ * On output, this will contain the statistics after removing the cells.
+ * @param[in,out] block_size Vector of length equal to the number of existing blocks, containing the number of cells in each block.
+ * On output, this will contain the number of retained cells in each block.
+ * @param options Further options.
+ * These should be the same as those used to compute `results`.
+ */
+template<typename Value_, typename Index_, typename Block_, typename Stat_>
+void downdate_model_gene_variances_blocked(
+    const tatami::Matrix<Value_, Index_>& removed,
+    const Block_* const block,
+    ModelGeneVariancesBlockedResults<Stat_>& results,
+    std::vector<Index_>& block_size,
+    const ModelGeneVariancesOptions& options
+) {
+    const Index_ NR = removed.nrow(), NC = removed.ncol();
+    internal::check_existing_results(NR, results, block_size, options.trend);
+
+    const auto nblocks = block_size.size();
+    std::vector<Index_> removed_size(nblocks);
+    if (block) {
+        for (Index_ c = 0; c < NC; ++c) {
+            if (static_cast<std::size_t>(block[c]) >= nblocks) {
+                throw std::runtime_error("block identifiers for removed cells should refer to existing blocks");
+            }
+            ++removed_size[block[c]];
+        }
+    } else if (NC) {
+        if (nblocks == 0) {
+            throw std::runtime_error("block identifiers for removed cells should refer to existing blocks");
+        }
+        removed_size[0] = NC;
+    }
+
+    // Only computing statistics for the blocks that actually lost cells.
+    std::vector<std::size_t> affected, remapping(nblocks);
+    std::vector<Index_> affected_size;
+    for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+        if (removed_size[b] > block_size[b]) {
+            throw std::runtime_error("number of removed cells should not exceed the number of cells in each block");
+        }
+        if (removed_size[b]) {
+            remapping[b] = affected.size();
+            affected.push_back(b);
+            affected_size.push_back(removed_size[b]);
+        }
+    }
+    if (affected.empty()) {
+        return;
+    }
+
+    auto remapped_block = tatami::create_container_of_Index_size<std::vector<std::size_t> >(NC);
+    for (Index_ c = 0; c < NC; ++c) {
+        remapped_block[c] = remapping[block ? static_cast<std::size_t>(block[c]) : 0];
+    }
+
+    const auto naffected = affected.size();
+    std::vector<ModelGeneVariancesResults<Stat_> > removed_stats;
+    removed_stats.reserve(naffected);
+    std::vector<ModelGeneVariancesBuffers<Stat_> > removed_buffers;
+    removed_buffers.reserve(naffected);
+    for (I<decltype(naffected)> a = 0; a < naffected; ++a) {
+        removed_stats.emplace_back(NR, false);
+        removed_buffers.push_back(internal::get_buffers(removed_stats.back(), true, false));
+    }
+    internal::compute_variances(removed, removed_buffers, remapped_block.data(), affected_size, internal::drop_gene_chunk_callback(options));
+
+    FitVarianceTrendWorkspace<Stat_> work;
+    auto fopt = options.fit_variance_trend_options;
+    fopt.num_threads = internal::choose_fit_num_threads(NR, options); // same as model_gene_variances_blocked().
+
+    for (I<decltype(naffected)> a = 0; a < naffected; ++a) {
+        const auto b = affected[a];
+        auto& current = results.per_block[b];
+        const Stat_ n = block_size[b], k = removed_size[b], m = n - k;
+        const auto& rmeans = removed_stats[a].means;
+        const auto& rvariances = removed_stats[a].variances;
+
+        for (Index_ g = 0; g < NR; ++g) {
+            if (m == 0) {
+                current.means[g] = std::numeric_limits<Stat_>::quiet_NaN();
+                current.variances[g] = std::numeric_limits<Stat_>::quiet_NaN();
+                continue;
+            }
+
+            const Stat_ kept_mean = (n * current.means[g] - k * rmeans[g]) / m;
+            if (m < 2) {
+                current.means[g] = kept_mean;
+                current.variances[g] = std::numeric_limits<Stat_>::quiet_NaN();
+                continue;
+            }
+
+            // Reversing Chan's formula for combining the sums of squared differences from two sets of observations.
+            const Stat_ total_ss = current.variances[g] * (n - 1);
+            const Stat_ removed_ss = (k >= 2 ? rvariances[g] * (k - 1) : 0);
+            const Stat_ delta = rmeans[g] - kept_mean;
+            const Stat_ kept_ss = total_ss - removed_ss - delta * delta * k * m / n;
+
+            current.means[g] = kept_mean;
+            current.variances[g] = std::max(kept_ss, static_cast<Stat_>(0)) / (m - 1); // avoid negative values from numerical imprecision.
+        }
+
+        block_size[b] -= removed_size[b];
+        internal::fit_block_trend(NR, block_size[b], internal::get_buffers(current, true, options.trend), work, fopt);
+    }
+
+    internal::recompute_averages(NR, results, block_size, options);
+}
+
+}
+
+#endif
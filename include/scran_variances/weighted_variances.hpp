@@ -0,0 +1,210 @@
+#ifndef SCRAN_VARIANCES_WEIGHTED_VARIANCES_HPP
+#define SCRAN_VARIANCES_WEIGHTED_VARIANCES_HPP
+
+#include <vector>
+#include <memory_resource>
+#include <limits>
+#include <cstddef>
+#include <algorithm>
+
+#include "sanisizer/sanisizer.hpp"
+
+#include "allocation_tracker.hpp"
+#include "utils.hpp"
+
+/**
+ * @cond
+ */
+namespace scran_variances {
+
+namespace internal {
+
+/*
+ * Weighted means and variances, where the weights are interpreted as
+ * frequencies, i.e., a cell with weight 'w' is equivalent to 'w' copies of
+ * that cell. All functions here compute the means and the weighted sums of
+ * squared differences from the mean, which can be combined across subsets of
+ * cells; finish_weighted_variance() should then be called to convert the sums
+ * of squares into variances once the total weight of each block is known.
+ */
+template<typename Total_, typename Stat_>
+void finish_weighted_variance(const Total_ total, Stat_& mean, Stat_& variance) {
+    const Stat_ dtotal = total;
+    if (!(dtotal > 0)) {
+        mean = std::numeric_limits<Stat_>::quiet_NaN();
+    }
+    variance = (dtotal > 1 ? variance / (dtotal - 1) : std::numeric_limits<Stat_>::quiet_NaN());
+}
+
+/*
+ * Weighted mean and sum of squares of each block for a single row. For sparse
+ * rows, the structural zeros contribute to the sum of squares through the
+ * difference between the total weight of each block and the weight of the
+ * non-zero values; 'nonzero_weight' is only used for sparse rows and may be
+ * NULL for dense rows. 'totals' should contain the total weight of each block
+ * across the cells in the row, and 'weights' and 'block' are indexed by the
+ * position of each value in a dense row or by 'indices' for a sparse row.
+ */
+template<typename Value_, typename Index_, typename Weight_, typename Block_, typename Total_, typename Stat_>
+void compute_weighted_row_sums(
+    const Value_* const values,
+    const Index_* const indices,
+    const Index_ number,
+    const Weight_* const weights,
+    const Block_* const block,
+    const Total_* const totals,
+    const std::size_t nblocks,
+    Stat_* const means,
+    Stat_* const sum_squares,
+    Stat_* const nonzero_weight)
+{
+    const auto get_cell = [&](const Index_ i) -> Index_ { return (indices ? indices[i] : i); };
+
+    std::fill_n(means, nblocks, 0);
+    for (Index_ i = 0; i < number; ++i) {
+        const auto c = get_cell(i);
+        const auto w = weights[c];
+        if (w) {
+            means[block ? block[c] : 0] += static_cast<Stat_>(w) * values[i];
+        }
+    }
+    for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+        if (totals[b] > 0) {
+            means[b] /= totals[b];
+        }
+    }
+
+    // Second pass for numerical stability, see tatami_stats::variances.
+    std::fill_n(sum_squares, nblocks, 0);
+    if (indices) {
+        std::fill_n(nonzero_weight, nblocks, 0);
+    }
+    for (Index_ i = 0; i < number; ++i) {
+        const auto c = get_cell(i);
+        const auto w = weights[c];
+        if (w) {
+            const auto b = (block ? block[c] : 0);
+            const Stat_ delta = values[i] - means[b];
+            sum_squares[b] += static_cast<Stat_>(w) * delta * delta;
+            if (indices) {
+                nonzero_weight[b] += w;
+            }
+        }
+    }
+
+    if (indices) {
+        for (I<decltype(nblocks)> b = 0; b < nblocks; ++b) {
+            sum_squares[b] += (static_cast<Stat_>(totals[b]) - nonzero_weight[b]) * means[b] * means[b]; // contribution of structural zeros.
+        }
+    }
+}
+
+/*
+ * Weighted counterparts to tatami_stats::variances::RunningDense and
+ * RunningSparse, using the weighted update of West (1979). All genes in a
+ * block share the same total weight, so we only need to track it once. For
+ * sparse columns, each gene has its own running statistics for the non-zero
+ * values, which are combined with the structural zeros in finish().
+ */
+template<typename Stat_, typename Value_, typename Index_>
+class WeightedRunningDense {
+public:
+    WeightedRunningDense(const Index_ num, Stat_* const mean, Stat_* const sum_squares) :
+        my_num(num), my_mean(mean), my_sum_squares(sum_squares)
+    {
+        std::fill_n(my_mean, my_num, 0);
+        std::fill_n(my_sum_squares, my_num, 0);
+    }
+
+    template<typename Weight_>
+    void add(const Value_* const ptr, const Weight_ weight) {
+        if (!(weight > 0)) {
+            return;
+        }
+        const Stat_ dweight = weight;
+        my_total += dweight;
+        const Stat_ ratio = dweight / my_total;
+        for (Index_ i = 0; i < my_num; ++i) {
+            const Stat_ delta = ptr[i] - my_mean[i];
+            my_mean[i] += delta * ratio;
+            my_sum_squares[i] += dweight * delta * (ptr[i] - my_mean[i]);
+        }
+    }
+
+    void finish() {
+        // Nothing to do, this only exists for consistency with WeightedRunningSparse.
+    }
+
+private:
+    Index_ my_num;
+    Stat_* my_mean;
+    Stat_* my_sum_squares;
+    Stat_ my_total = 0;
+};
+
+template<typename Stat_, typename Value_, typename Index_>
+class WeightedRunningSparse {
+public:
+    WeightedRunningSparse(const Index_ num, Stat_* const mean, Stat_* const sum_squares, const Index_ subtract, std::pmr::memory_resource* const resource = std::pmr::get_default_resource()) :
+        my_num(num),
+        my_mean(mean),
+        my_sum_squares(sum_squares),
+        my_nonzero_weight(sanisizer::cast<I<decltype(my_nonzero_weight.size())> >(num), resource),
+        my_subtract(subtract)
+    {
+        std::fill_n(my_mean, my_num, 0);
+        std::fill_n(my_sum_squares, my_num, 0);
+    }
+
+    template<typename Weight_>
+    void add(const Value_* const value, const Index_* const index, const Index_ number, const Weight_ weight) {
+        if (!(weight > 0)) {
+            return;
+        }
+        const Stat_ dweight = weight;
+        my_total += dweight;
+        for (Index_ i = 0; i < number; ++i) {
+            const auto g = index[i] - my_subtract;
+            auto& nzw = my_nonzero_weight[g];
+            nzw += dweight;
+            const Stat_ delta = value[i] - my_mean[g];
+            my_mean[g] += delta * (dweight / nzw);
+            my_sum_squares[g] += dweight * delta * (value[i] - my_mean[g]);
+        }
+    }
+
+    void finish() {
+        if (!(my_total > 0)) {
+            return;
+        }
+
+        // Combining the non-zero values with the structural zeros, see Chan et al. (1979).
+        for (Index_ i = 0; i < my_num; ++i) {
+            const Stat_ nzw = my_nonzero_weight[i];
+            const Stat_ mean_nz = my_mean[i];
+            my_mean[i] = mean_nz * (nzw / my_total);
+            my_sum_squares[i] += mean_nz * mean_nz * nzw * (my_total - nzw) / my_total;
+        }
+    }
+
+    std::size_t bytes() const {
+        return container_bytes(my_nonzero_weight);
+    }
+
+private:
+    Index_ my_num;
+    Stat_* my_mean;
+    Stat_* my_sum_squares;
+    std::pmr::vector<Stat_> my_nonzero_weight;
+    Index_ my_subtract;
+    Stat_ my_total = 0;
+};
+
+}
+
+}
+/**
+ * @endcond
+ */
+
+#endif
@@ -0,0 +1,146 @@
+#include "scran_tests/scran_tests.hpp"
+
+#include "tatami/tatami.hpp"
+#include "scran_variances/model_gene_variances.hpp"
+#include "scran_variances/allocation_tracker.hpp"
+
+TEST(AllocationTracker, Basic) {
+    scran_variances::AllocationTracker tracker;
+    tracker.allocate(scran_variances::AllocationPhase::EXTRACTION, 0, 100);
+    tracker.allocate(scran_variances::AllocationPhase::EXTRACTION, 2, 50);
+    tracker.allocate(scran_variances::AllocationPhase::TREND, 0, 20);
+    tracker.release(scran_variances::AllocationPhase::EXTRACTION, 0, 100);
+    tracker.allocate(scran_variances::AllocationPhase::EXTRACTION, 0, 30);
+
+    EXPECT_EQ(tracker.peak(scran_variances::AllocationPhase::EXTRACTION), 150);
+    EXPECT_EQ(tracker.peak(scran_variances::AllocationPhase::EXTRACTION, 0), 100);
+    EXPECT_EQ(tracker.peak(scran_variances::AllocationPhase::EXTRACTION, 1), 0);
+    EXPECT_EQ(tracker.peak(scran_variances::AllocationPhase::EXTRACTION, 2), 50);
+    EXPECT_EQ(tracker.peak(scran_variances::AllocationPhase::EXTRACTION, 10), 0);
+    EXPECT_EQ(tracker.num_threads(scran_variances::AllocationPhase::EXTRACTION), 3);
+    EXPECT_EQ(tracker.peak(scran_variances::AllocationPhase::TREND), 20);
+    EXPECT_EQ(tracker.peak(scran_variances::AllocationPhase::OUTPUT), 0);
+    EXPECT_EQ(tracker.peak(), 170);
+    EXPECT_EQ(tracker.current(), 100);
+
+    tracker.reset();
+    EXPECT_EQ(tracker.peak(), 0);
+    EXPECT_EQ(tracker.current(), 0);
+    EXPECT_EQ(tracker.num_threads(scran_variances::AllocationPhase::EXTRACTION), 0);
+}
+
+TEST(AllocationTracker, TrackedAllocation) {
+    scran_variances::AllocationTracker tracker;
+    {
+        scran_variances::internal::TrackedAllocation tracked(&tracker, scran_variances::AllocationPhase::TREND, 1, 10);
+        EXPECT_EQ(tracker.current(), 10);
+        tracked.update(40);
+        EXPECT_EQ(tracker.current(), 40);
+        tracked.update(25);
+        EXPECT_EQ(tracker.current(), 25);
+    }
+    EXPECT_EQ(tracker.current(), 0);
+    EXPECT_EQ(tracker.peak(scran_variances::AllocationPhase::TREND, 1), 40);
+
+    // No-op without a tracker.
+    scran_variances::internal::TrackedAllocation tracked(NULL, scran_variances::AllocationPhase::TREND, 1, 10);
+    tracked.update(20);
+}
+
+class AllocationTrackerModelTest : public ::testing::TestWithParam<std::tuple<scran_variances::ComputePath, bool> > {};
+
+TEST_P(AllocationTrackerModelTest, Phases) {
+    const auto param = GetParam();
+    const auto path = std::get<0>(param);
+    const bool cell_split = std::get<1>(param);
+
+    // Cells are split across threads if there are too few genes, in which case we can't fit a trend.
+    const int nr = (cell_split ? 2 : 201), nc = 103;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.2;
+        sparams.seed = 7272;
+        sparams.lower = 0;
+        return sparams;
+    }());
+    tatami::DenseRowMatrix<double, int> dense_row(nr, nc, std::move(vec));
+    auto sparse_column = tatami::convert_to_compressed_sparse(&dense_row, false);
+    const tatami::NumericMatrix& mat = (scran_variances::internal::is_row_path(path) ? static_cast<const tatami::NumericMatrix&>(dense_row) : *sparse_column);
+
+    std::vector<int> blocks(nc);
+    for (int c = 0; c < nc; ++c) {
+        blocks[c] = c % 3;
+    }
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.compute_path = path;
+    opt.num_threads = 3;
+    opt.extra_statistics = true;
+    opt.trend = !cell_split;
+    EXPECT_EQ(scran_variances::plan_model_gene_variances(mat, 3, opt).cell_split, cell_split);
+    auto ref = scran_variances::model_gene_variances_blocked(mat, blocks.data(), opt);
+
+    scran_variances::AllocationTracker tracker;
+    opt.allocation_tracker = &tracker;
+    auto res = scran_variances::model_gene_variances_blocked(mat, blocks.data(), opt);
+
+    // Tracking has no effect on the results.
+    for (int b = 0; b < 3; ++b) {
+        EXPECT_EQ(ref.per_block[b].means, res.per_block[b].means);
+        EXPECT_EQ(ref.per_block[b].variances, res.per_block[b].variances);
+    }
+    EXPECT_EQ(ref.average.variances, res.average.variances);
+
+    const std::size_t output_bytes = scran_variances::internal::results_bytes(res);
+    EXPECT_EQ(tracker.peak(scran_variances::AllocationPhase::OUTPUT), output_bytes);
+    EXPECT_EQ(tracker.current(), output_bytes);
+
+    EXPECT_GT(tracker.peak(scran_variances::AllocationPhase::EXTRACTION), 0);
+    EXPECT_GT(tracker.peak(scran_variances::AllocationPhase::STATISTICS), 0);
+    EXPECT_GT(tracker.peak(scran_variances::AllocationPhase::AVERAGE), 0);
+    if (cell_split) {
+        EXPECT_EQ(tracker.peak(scran_variances::AllocationPhase::TREND), 0);
+    } else {
+        EXPECT_GT(tracker.peak(scran_variances::AllocationPhase::TREND), 0);
+    }
+
+    // Each thread performs its own extraction.
+    EXPECT_EQ(tracker.num_threads(scran_variances::AllocationPhase::EXTRACTION), 3);
+    for (int t = 0; t < 3; ++t) {
+        EXPECT_GT(tracker.peak(scran_variances::AllocationPhase::EXTRACTION, t), 0);
+    }
+
+    std::size_t total = 0;
+    for (auto phase : {
+        scran_variances::AllocationPhase::OUTPUT,
+        scran_variances::AllocationPhase::EXTRACTION,
+        scran_variances::AllocationPhase::STATISTICS,
+        scran_variances::AllocationPhase::TREND,
+        scran_variances::AllocationPhase::AVERAGE
+    }) {
+        total += tracker.peak(phase);
+    }
+    EXPECT_LE(tracker.peak(), total);
+    EXPECT_GT(tracker.peak(), output_bytes);
+
+    // High-water marks accumulate across calls until reset.
+    const auto previous = tracker.peak();
+    auto res2 = scran_variances::model_gene_variances_blocked(mat, blocks.data(), opt);
+    EXPECT_GT(tracker.peak(), previous);
+    tracker.reset();
+    EXPECT_EQ(tracker.current(), 0);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    AllocationTracker,
+    AllocationTrackerModelTest,
+    ::testing::Combine(
+        ::testing::Values(
+            scran_variances::ComputePath::DENSE_ROW,
+            scran_variances::ComputePath::SPARSE_ROW,
+            scran_variances::ComputePath::DENSE_COLUMN,
+            scran_variances::ComputePath::SPARSE_COLUMN
+        ),
+        ::testing::Values(false, true) // whether to split cells across threads
+    )
+);
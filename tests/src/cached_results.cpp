@@ -0,0 +1,168 @@
+#include "scran_tests/scran_tests.hpp"
+
+#include "tatami/tatami.hpp"
+#include "scran_variances/cached_results.hpp"
+
+#include <filesystem>
+#include <string>
+
+#include <unistd.h>
+
+class CachedResultsTest : public ::testing::Test {
+protected:
+    inline static std::shared_ptr<tatami::NumericMatrix> mat, other;
+    inline static std::vector<int> blocks;
+
+    static void SetUpTestSuite() {
+        int nr = 87, nc = 121;
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.3;
+        sparams.lower = 0;
+        sparams.upper = 5;
+        sparams.seed = 2000;
+        auto vec = scran_tests::simulate_vector(nr * nc, sparams);
+        mat.reset(new tatami::DenseRowMatrix<double, int>(nr, nc, vec));
+
+        // Same dimensions, different contents.
+        vec[0] += 1;
+        other.reset(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+
+        blocks.resize(nc);
+        for (int c = 0; c < nc; ++c) {
+            blocks[c] = c % 3;
+        }
+    }
+
+    std::filesystem::path dir;
+
+    void SetUp() {
+        dir = std::filesystem::temp_directory_path() / ("scran_variances_cache_test_" + std::to_string(::getpid()));
+        std::filesystem::remove_all(dir);
+    }
+
+    void TearDown() {
+        std::filesystem::remove_all(dir);
+    }
+
+    size_t count_files() const {
+        size_t count = 0;
+        for ([[maybe_unused]] const auto& entry : std::filesystem::directory_iterator(dir)) {
+            ++count;
+        }
+        return count;
+    }
+};
+
+TEST_F(CachedResultsTest, Basic) {
+    scran_variances::ModelGeneVariancesOptions opt;
+    scran_variances::ModelGeneVariancesCacheOptions copt;
+    copt.directory = dir.string();
+
+    auto ref = scran_variances::model_gene_variances_blocked(*mat, blocks.data(), opt);
+    auto first = scran_variances::model_gene_variances_blocked_cached(*mat, blocks.data(), opt, copt);
+    EXPECT_EQ(count_files(), 1);
+
+    for (int b = 0; b < 3; ++b) {
+        EXPECT_EQ(ref.per_block[b].means, first.per_block[b].means);
+        EXPECT_EQ(ref.per_block[b].variances, first.per_block[b].variances);
+        EXPECT_EQ(ref.per_block[b].residuals, first.per_block[b].residuals);
+    }
+    EXPECT_EQ(ref.average.residuals, first.average.residuals);
+
+    // Trend and averaging options are respected when re-using the cache.
+    opt.fit_variance_trend_options.minimum_mean = 0.5;
+    opt.block_average_policy = scran_variances::BlockAveragePolicy::QUANTILE;
+    auto ref2 = scran_variances::model_gene_variances_blocked(*mat, blocks.data(), opt);
+    auto second = scran_variances::model_gene_variances_blocked_cached(*mat, blocks.data(), opt, copt);
+    EXPECT_EQ(count_files(), 1);
+    for (int b = 0; b < 3; ++b) {
+        EXPECT_EQ(ref2.per_block[b].means, second.per_block[b].means);
+        EXPECT_EQ(ref2.per_block[b].fitted, second.per_block[b].fitted);
+    }
+    EXPECT_EQ(ref2.average.means, second.average.means);
+    EXPECT_EQ(ref2.average.residuals, second.average.residuals);
+}
+
+TEST_F(CachedResultsTest, Reused) {
+    scran_variances::ModelGeneVariancesOptions opt;
+    scran_variances::ModelGeneVariancesCacheOptions copt;
+    copt.directory = dir.string();
+    scran_variances::model_gene_variances_blocked_cached(*mat, blocks.data(), opt, copt);
+
+    // Modifying the cached file to check that it's actually being used.
+    auto path = dir / scran_variances::model_gene_variances_cache_key(*mat, blocks.data(), copt);
+    {
+        auto cached = scran_variances::ModelGeneVariancesMappedResults<double>::open(path.string(), true);
+        cached.per_block(1).means[0] = 100;
+    }
+    auto res = scran_variances::model_gene_variances_blocked_cached(*mat, blocks.data(), opt, copt);
+    EXPECT_EQ(res.per_block[1].means[0], 100);
+
+    // Different contents, blocks or keys give different cache entries.
+    auto res2 = scran_variances::model_gene_variances_blocked_cached(*other, blocks.data(), opt, copt);
+    EXPECT_NE(res2.per_block[1].means[0], 100);
+    EXPECT_EQ(count_files(), 2);
+
+    auto alt_blocks = blocks;
+    alt_blocks[1] = 0;
+    scran_variances::model_gene_variances_blocked_cached(*mat, alt_blocks.data(), opt, copt);
+    EXPECT_EQ(count_files(), 3);
+
+    scran_variances::model_gene_variances_blocked_cached(*mat, static_cast<int*>(NULL), opt, copt);
+    EXPECT_EQ(count_files(), 4);
+
+    copt.extra_key = "foo";
+    scran_variances::model_gene_variances_blocked_cached(*mat, blocks.data(), opt, copt);
+    EXPECT_EQ(count_files(), 5);
+}
+
+TEST_F(CachedResultsTest, Corrupted) {
+    scran_variances::ModelGeneVariancesOptions opt;
+    scran_variances::ModelGeneVariancesCacheOptions copt;
+    copt.directory = dir.string();
+    auto ref = scran_variances::model_gene_variances_blocked_cached(*mat, blocks.data(), opt, copt);
+
+    // Corrupted files are just treated as a cache miss.
+    auto path = dir / scran_variances::model_gene_variances_cache_key(*mat, blocks.data(), copt);
+    std::filesystem::resize_file(path, 10);
+    auto res = scran_variances::model_gene_variances_blocked_cached(*mat, blocks.data(), opt, copt);
+    EXPECT_EQ(ref.per_block[0].means, res.per_block[0].means);
+    EXPECT_EQ(ref.average.residuals, res.average.residuals);
+    EXPECT_GT(std::filesystem::file_size(path), 10);
+}
+
+TEST_F(CachedResultsTest, FailedWrite) {
+    scran_variances::ModelGeneVariancesOptions opt;
+    scran_variances::ModelGeneVariancesCacheOptions copt;
+    copt.directory = dir.string();
+
+    // Occupying the cache path with a non-empty directory so that the rename fails.
+    auto path = dir / scran_variances::model_gene_variances_cache_key(*mat, blocks.data(), copt);
+    std::filesystem::create_directories(path / "foo");
+
+    bool failed = false;
+    try {
+        scran_variances::model_gene_variances_blocked_cached(*mat, blocks.data(), opt, copt);
+    } catch (std::exception&) {
+        failed = true;
+    }
+    EXPECT_TRUE(failed);
+
+    // Temporary file is cleaned up.
+    EXPECT_EQ(count_files(), 1);
+    EXPECT_TRUE(std::filesystem::is_directory(path));
+}
+
+TEST(CachedResults, Fingerprint) {
+    int nr = 20, nc = 30;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.2;
+        return sparams;
+    }());
+    tatami::DenseRowMatrix<double, int> mat(nr, nc, vec);
+    tatami::DenseRowMatrix<double, int> tmat(nc, nr, vec);
+    EXPECT_EQ(scran_variances::fingerprint_matrix(mat, 100), scran_variances::fingerprint_matrix(mat, 100));
+    EXPECT_NE(scran_variances::fingerprint_matrix(mat, 100), scran_variances::fingerprint_matrix(tmat, 100));
+    EXPECT_NE(scran_variances::fingerprint_matrix(mat, 100), scran_variances::fingerprint_matrix(mat, 5));
+}
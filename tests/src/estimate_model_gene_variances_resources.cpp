@@ -0,0 +1,213 @@
+#include "scran_tests/scran_tests.hpp"
+
+#include "tatami/tatami.hpp"
+#include "scran_variances/estimate_model_gene_variances_resources.hpp"
+#include "scran_variances/model_gene_variances_from_counts.hpp"
+#include "scran_variances/allocation_tracker.hpp"
+
+#include <cstddef>
+#include <algorithm>
+
+/*
+ * The allocation tracker records the same set of allocations that are covered
+ * by the estimate. We sum the per-thread peaks for the computation phases, as
+ * the threads may not run concurrently, in which case the overall peak would
+ * be lower than the estimate. The trend fitting workspace is an upper bound as
+ * it assumes that all genes are kept.
+ */
+static double sum_thread_peaks(const scran_variances::AllocationTracker& tracker, const scran_variances::AllocationPhase phase) {
+    double total = 0;
+    const auto nthreads = tracker.num_threads(phase);
+    for (std::size_t t = 0; t < nthreads; ++t) {
+        total += tracker.peak(phase, t);
+    }
+    return total;
+}
+
+static void check_peak(const scran_variances::AllocationTracker& tracker, const scran_variances::ModelGeneVariancesResourceEstimate& est) {
+    EXPECT_EQ(tracker.peak(scran_variances::AllocationPhase::OUTPUT), est.output_bytes);
+
+    const double compute = sum_thread_peaks(tracker, scran_variances::AllocationPhase::EXTRACTION) + sum_thread_peaks(tracker, scran_variances::AllocationPhase::STATISTICS);
+    EXPECT_LE(compute, est.compute_bytes);
+    EXPECT_GE(compute, est.compute_bytes * 0.99);
+
+    const auto fit = tracker.peak(scran_variances::AllocationPhase::TREND);
+    EXPECT_LE(fit, est.fit_bytes);
+    EXPECT_GE(fit, est.fit_bytes * 0.95);
+
+    // The overall peak never exceeds the estimate, apart from the small buffers for averaging.
+    EXPECT_LE(tracker.peak(), est.peak_bytes + tracker.peak(scran_variances::AllocationPhase::AVERAGE));
+}
+
+class EstimateModelGeneVariancesResourcesTest : public ::testing::TestWithParam<std::tuple<scran_variances::ComputePath, int, int, bool, std::size_t> > {
+protected:
+    inline static int nr = 2001, nc = 503;
+    inline static std::shared_ptr<tatami::NumericMatrix> dense_row, dense_column, sparse_row, sparse_column;
+
+    static void SetUpTestSuite() {
+        auto vec = scran_tests::simulate_vector(nr * nc, []{
+            scran_tests::SimulateVectorParameters sparams;
+            sparams.density = 0.1;
+            sparams.seed = 9191;
+            sparams.lower = 0;
+            return sparams;
+        }());
+        dense_row = std::unique_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+        dense_column = tatami::convert_to_dense(dense_row.get(), false);
+        sparse_row = tatami::convert_to_compressed_sparse(dense_row.get(), true);
+        sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+    }
+
+    // Configures the options and summary for the requested access pattern, and returns the corresponding matrix.
+    static std::shared_ptr<tatami::NumericMatrix> choose(scran_variances::ModelGeneVariancesOptions& opt, scran_variances::ModelGeneVariancesMatrixSummary& summary) {
+        const auto param = GetParam();
+        const auto path = std::get<0>(param);
+        opt.compute_path = path;
+        opt.num_threads = std::get<1>(param);
+        opt.extra_statistics = std::get<3>(param);
+        opt.prefetch_buffer_size = std::get<4>(param);
+
+        summary.num_genes = nr;
+        summary.num_cells = nc;
+        switch (path) {
+            case scran_variances::ComputePath::DENSE_ROW:
+                return dense_row;
+            case scran_variances::ComputePath::SPARSE_ROW:
+                summary.sparse_proportion = 1;
+                summary.density = 0.1;
+                return sparse_row;
+            case scran_variances::ComputePath::DENSE_COLUMN:
+                summary.prefer_rows_proportion = 0;
+                opt.column_batch_size = 16;
+                return dense_column;
+            default:
+                summary.sparse_proportion = 1;
+                summary.density = scran_variances::internal::estimate_density(*sparse_column, false, 20); // same as the tile size calculation in the run.
+                summary.prefer_rows_proportion = 0;
+                opt.sparse_column_tile_cache_size = 16 * 1024;
+                return sparse_column;
+        }
+    }
+
+    static std::vector<int> create_blocks(const int nblocks) {
+        std::vector<int> blocks(nc);
+        for (int c = 0; c < nc; ++c) {
+            blocks[c] = c % nblocks;
+        }
+        return blocks;
+    }
+};
+
+TEST_P(EstimateModelGeneVariancesResourcesTest, Peak) {
+    scran_variances::ModelGeneVariancesOptions opt;
+    scran_variances::ModelGeneVariancesMatrixSummary summary;
+    const auto mat = choose(opt, summary);
+    const int nblocks = std::get<2>(GetParam());
+    const auto blocks = create_blocks(nblocks);
+
+    const auto est = scran_variances::estimate_model_gene_variances_resources(summary, nblocks, opt);
+    EXPECT_EQ(est.plan.path, opt.compute_path);
+    EXPECT_EQ(est.plan.cell_split, scran_variances::plan_model_gene_variances(*mat, nblocks, opt).cell_split);
+    EXPECT_GT(est.work, 0);
+    EXPECT_EQ(est.peak_bytes, est.output_bytes + std::max(est.compute_bytes, est.fit_bytes));
+
+    // The tracker records the same set of allocations that are covered by the estimate.
+    scran_variances::AllocationTracker tracker;
+    opt.allocation_tracker = &tracker;
+    auto res = scran_variances::model_gene_variances_blocked(*mat, (nblocks > 1 ? blocks.data() : static_cast<int*>(NULL)), opt); // a single block is treated as no blocking by the estimate.
+    check_peak(tracker, est);
+}
+
+TEST_P(EstimateModelGeneVariancesResourcesTest, FromCounts) {
+    scran_variances::ModelGeneVariancesOptions opt;
+    scran_variances::ModelGeneVariancesMatrixSummary summary;
+    const auto mat = choose(opt, summary);
+    const int nblocks = std::get<2>(GetParam());
+    const auto blocks = create_blocks(nblocks);
+    std::vector<double> size_factors(nc, 1.5);
+
+    for (std::size_t table_size : { 0, 16 }) {
+        scran_variances::LogNormalizeOptions lopt;
+        lopt.lookup_table_size = table_size;
+        const auto est = scran_variances::estimate_model_gene_variances_from_counts_resources(summary, nblocks, opt, lopt);
+        const auto ref = scran_variances::estimate_model_gene_variances_resources(summary, nblocks, opt);
+        EXPECT_EQ(est.output_bytes, ref.output_bytes);
+        EXPECT_GE(est.compute_bytes, ref.compute_bytes + static_cast<std::size_t>(nc) * (table_size + 1) * sizeof(double));
+
+        scran_variances::AllocationTracker tracker;
+        auto topt = opt;
+        topt.allocation_tracker = &tracker;
+        auto res = scran_variances::model_gene_variances_blocked_from_counts(*mat, size_factors.data(), (nblocks > 1 ? blocks.data() : static_cast<int*>(NULL)), topt, lopt);
+        check_peak(tracker, est);
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    EstimateModelGeneVariancesResources,
+    EstimateModelGeneVariancesResourcesTest,
+    ::testing::Combine(
+        ::testing::Values(
+            scran_variances::ComputePath::DENSE_ROW,
+            scran_variances::ComputePath::SPARSE_ROW,
+            scran_variances::ComputePath::DENSE_COLUMN,
+            scran_variances::ComputePath::SPARSE_COLUMN
+        ),
+        ::testing::Values(1, 3), // number of threads
+        ::testing::Values(1, 4), // number of blocks
+        ::testing::Values(false, true), // extra statistics
+        ::testing::Values(0, 100000) // prefetch buffer size
+    )
+);
+
+TEST(EstimateModelGeneVariancesResources, CellSplit) {
+    int nr = 7, nc = 20001;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.2;
+        sparams.seed = 9192;
+        return sparams;
+    }());
+    tatami::DenseRowMatrix<double, int> mat(nr, nc, std::move(vec));
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.num_threads = 8;
+    opt.trend = false;
+    opt.extra_statistics = true;
+
+    scran_variances::ModelGeneVariancesMatrixSummary summary;
+    summary.num_genes = nr;
+    summary.num_cells = nc;
+    const auto est = scran_variances::estimate_model_gene_variances_resources(summary, 1, opt);
+    EXPECT_TRUE(est.plan.cell_split);
+    EXPECT_EQ(est.fit_bytes, 0);
+
+    scran_variances::AllocationTracker tracker;
+    opt.allocation_tracker = &tracker;
+    auto res = scran_variances::model_gene_variances_blocked(mat, static_cast<int*>(NULL), opt);
+    check_peak(tracker, est);
+}
+
+TEST(EstimateModelGeneVariancesResources, Scaling) {
+    scran_variances::ModelGeneVariancesMatrixSummary summary;
+    summary.num_genes = 30000;
+    summary.num_cells = 1000000;
+    summary.sparse_proportion = 1;
+    summary.density = 0.05;
+    summary.prefer_rows_proportion = 0;
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    const auto single = scran_variances::estimate_model_gene_variances_resources(summary, 1, opt);
+    EXPECT_EQ(single.plan.path, scran_variances::ComputePath::SPARSE_COLUMN);
+
+    // More blocks require more output and more running statistics.
+    const auto blocked = scran_variances::estimate_model_gene_variances_resources(summary, 10, opt);
+    EXPECT_GT(blocked.output_bytes, single.output_bytes);
+    EXPECT_GT(blocked.compute_bytes, single.compute_bytes);
+
+    // More threads require more buffers but less work per thread.
+    opt.num_threads = 8;
+    const auto threaded = scran_variances::estimate_model_gene_variances_resources(summary, 1, opt);
+    EXPECT_EQ(threaded.output_bytes, single.output_bytes);
+    EXPECT_GT(threaded.compute_bytes, single.compute_bytes);
+    EXPECT_LT(threaded.work, single.work);
+}
@@ -1,6 +1,7 @@
 #include "scran_tests/scran_tests.hpp"
 
 #include <random>
+#include <cmath>
 
 #include "scran_variances/fit_variance_trend.hpp"
 
@@ -161,3 +162,92 @@ TEST(FitVarianceTrendTest, MinWidth) {
     foutput2 = scran_variances::fit_variance_trend(x.size(), x.data(), y.data(), opt2);
     EXPECT_EQ(output2.residuals, foutput2.residuals);
 }
+
+TEST(FitVarianceTrendTest, Parallel) {
+    auto x = scran_tests::simulate_vector(1001, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.lower = 0;
+        sparams.upper = 2;
+        sparams.seed = 999;
+        return sparams;
+    }());
+    for (auto& val : x) {
+        val = std::round(val * 50) / 50; // injecting some ties.
+    }
+    auto y = scran_tests::simulate_vector(1001, []{ 
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.lower = 0.1;
+        sparams.upper = 2;
+        sparams.seed = 888;
+        return sparams;
+    }());
+
+    for (bool filter : { true, false }) {
+        scran_variances::FitVarianceTrendOptions opt;
+        opt.mean_filter = filter;
+        auto ref = scran_variances::fit_variance_trend(x.size(), x.data(), y.data(), opt);
+
+        for (int nthreads : { 2, 3, 7 }) {
+            opt.num_threads = nthreads;
+            auto par = scran_variances::fit_variance_trend(x.size(), x.data(), y.data(), opt);
+            EXPECT_EQ(ref.fitted, par.fitted);
+            EXPECT_EQ(ref.residuals, par.residuals);
+        }
+    }
+}
+
+TEST(FitVarianceTrendTest, Sweep) {
+    auto x = scran_tests::simulate_vector(201, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.lower = 0;
+        sparams.upper = 2;
+        sparams.seed = 1234;
+        return sparams;
+    }());
+    auto y = scran_tests::simulate_vector(201, []{ 
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.lower = 0.1;
+        sparams.upper = 2;
+        sparams.seed = 5678;
+        return sparams;
+    }());
+
+    std::vector<scran_variances::FitVarianceTrendOptions> settings(5);
+    settings[1].minimum_width = 0.5;
+    settings[2].minimum_window_count = 20;
+    settings[3].use_minimum_width = false;
+    settings[4].use_minimum_width = false;
+    settings[4].span = 0.5;
+
+    for (int nthreads : { 1, 3 }) {
+        auto swept = scran_variances::fit_variance_trend_sweep(x.size(), x.data(), y.data(), settings, nthreads);
+        ASSERT_EQ(swept.size(), settings.size());
+        for (size_t s = 0; s < settings.size(); ++s) {
+            auto ref = scran_variances::fit_variance_trend(x.size(), x.data(), y.data(), settings[s]);
+            EXPECT_EQ(ref.fitted, swept[s].fitted);
+            EXPECT_EQ(ref.residuals, swept[s].residuals);
+        }
+    }
+
+    // Same for different filtering and transformation choices.
+    for (auto& current : settings) {
+        current.mean_filter = false;
+        current.transform = false;
+    }
+    auto swept = scran_variances::fit_variance_trend_sweep(x.size(), x.data(), y.data(), settings, 2);
+    for (size_t s = 0; s < settings.size(); ++s) {
+        auto ref = scran_variances::fit_variance_trend(x.size(), x.data(), y.data(), settings[s]);
+        EXPECT_EQ(ref.fitted, swept[s].fitted);
+        EXPECT_EQ(ref.residuals, swept[s].residuals);
+    }
+
+    // Inconsistent preparation options are not allowed.
+    settings[2].transform = true;
+    std::string msg;
+    try {
+        scran_variances::fit_variance_trend_sweep(x.size(), x.data(), y.data(), settings, 1);
+    } catch (std::exception& e) {
+        msg = e.what();
+    }
+    EXPECT_TRUE(msg.find("same filtering") != std::string::npos);
+}
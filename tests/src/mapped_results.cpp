@@ -0,0 +1,132 @@
+#include "scran_tests/scran_tests.hpp"
+
+#include "tatami/tatami.hpp"
+#include "scran_variances/mapped_results.hpp"
+
+#include <filesystem>
+#include <string>
+
+#include <unistd.h>
+
+class MappedResultsTest : public ::testing::Test {
+protected:
+    inline static std::shared_ptr<tatami::NumericMatrix> mat;
+    inline static std::vector<int> blocks;
+
+    static void SetUpTestSuite() {
+        int nr = 98, nc = 113;
+        auto vec = scran_tests::simulate_vector(nr * nc, []{
+            scran_tests::SimulateVectorParameters sparams;
+            sparams.density = 0.3;
+            sparams.lower = 0;
+            sparams.upper = 5;
+            sparams.seed = 1000;
+            return sparams;
+        }());
+        mat.reset(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+
+        blocks.resize(nc);
+        for (int c = 0; c < nc; ++c) {
+            blocks[c] = c % 3;
+        }
+    }
+
+    static std::string temp_path(const std::string& name) {
+        // Including the PID to avoid collisions between test executables that run concurrently.
+        return (std::filesystem::temp_directory_path() / ("scran_variances_" + name + "_" + std::to_string(::getpid()))).string();
+    }
+};
+
+TEST_F(MappedResultsTest, Basic) {
+    auto path = temp_path("mapped_basic");
+    scran_variances::ModelGeneVariancesOptions opt;
+    auto ref = scran_variances::model_gene_variances_blocked(*mat, blocks.data(), opt);
+
+    {
+        auto mapped = scran_variances::model_gene_variances_blocked_mapped(*mat, blocks.data(), path, opt);
+        EXPECT_EQ(mapped.num_genes(), mat->nrow());
+        EXPECT_EQ(mapped.num_blocks(), 3);
+        EXPECT_TRUE(mapped.has_trend());
+        EXPECT_TRUE(mapped.has_average());
+        mapped.sync();
+    }
+
+    auto reopened = scran_variances::ModelGeneVariancesMappedResults<double>::open(path);
+    ASSERT_EQ(reopened.num_blocks(), 3);
+    size_t ngenes = reopened.num_genes();
+    ASSERT_EQ(ngenes, mat->nrow());
+
+    auto as_vector = [&](const double* ptr) -> std::vector<double> {
+        return std::vector<double>(ptr, ptr + ngenes);
+    };
+    for (int b = 0; b < 3; ++b) {
+        auto current = reopened.per_block(b);
+        EXPECT_EQ(as_vector(current.means), ref.per_block[b].means);
+        EXPECT_EQ(as_vector(current.variances), ref.per_block[b].variances);
+        EXPECT_EQ(as_vector(current.fitted), ref.per_block[b].fitted);
+        EXPECT_EQ(as_vector(current.residuals), ref.per_block[b].residuals);
+    }
+
+    auto ave = reopened.average();
+    EXPECT_EQ(as_vector(ave.means), ref.average.means);
+    EXPECT_EQ(as_vector(ave.variances), ref.average.variances);
+    EXPECT_EQ(as_vector(ave.fitted), ref.average.fitted);
+    EXPECT_EQ(as_vector(ave.residuals), ref.average.residuals);
+
+    std::filesystem::remove(path);
+}
+
+TEST_F(MappedResultsTest, NoTrendOrAverage) {
+    auto path = temp_path("mapped_notrend");
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.trend = false;
+    opt.block_average_policy = scran_variances::BlockAveragePolicy::NONE;
+    auto ref = scran_variances::model_gene_variances_blocked(*mat, blocks.data(), opt);
+
+    scran_variances::model_gene_variances_blocked_mapped(*mat, blocks.data(), path, opt);
+    auto reopened = scran_variances::ModelGeneVariancesMappedResults<double>::open(path);
+    EXPECT_FALSE(reopened.has_trend());
+    EXPECT_FALSE(reopened.has_average());
+    EXPECT_TRUE(reopened.average().means == NULL);
+
+    for (int b = 0; b < 3; ++b) {
+        auto current = reopened.per_block(b);
+        EXPECT_EQ(std::vector<double>(current.means, current.means + mat->nrow()), ref.per_block[b].means);
+        EXPECT_EQ(std::vector<double>(current.variances, current.variances + mat->nrow()), ref.per_block[b].variances);
+        EXPECT_TRUE(current.fitted == NULL);
+        EXPECT_TRUE(current.residuals == NULL);
+    }
+
+    std::filesystem::remove(path);
+}
+
+TEST_F(MappedResultsTest, Errors) {
+    auto path = temp_path("mapped_errors");
+    scran_variances::ModelGeneVariancesMappedResults<double>::create(path, 10, 2, true, true);
+
+    std::string msg;
+    try {
+        scran_variances::ModelGeneVariancesMappedResults<float>::open(path);
+    } catch (std::exception& e) {
+        msg = e.what();
+    }
+    EXPECT_TRUE(msg.find("size of the statistic type") != std::string::npos);
+
+    std::filesystem::resize_file(path, 100);
+    msg.clear();
+    try {
+        scran_variances::ModelGeneVariancesMappedResults<double>::open(path);
+    } catch (std::exception& e) {
+        msg = e.what();
+    }
+    EXPECT_TRUE(msg.find("unexpected file size") != std::string::npos);
+
+    std::filesystem::remove(path);
+    msg.clear();
+    try {
+        scran_variances::ModelGeneVariancesMappedResults<double>::open(path);
+    } catch (std::exception& e) {
+        msg = e.what();
+    }
+    EXPECT_TRUE(msg.find("failed to open") != std::string::npos);
+}
@@ -5,6 +5,10 @@
 #include "scran_variances/model_gene_variances.hpp"
 
 #include <cmath>
+#include <algorithm>
+#include <limits>
+#include <atomic>
+#include <memory_resource>
 
 class ModelGeneVariancesTest : public ::testing::TestWithParam<int> {
 protected:
@@ -27,6 +31,39 @@ protected:
     }
 };
 
+static void compare_extra_statistics(const tatami::NumericMatrix& mat, const std::vector<int>& blocks, const scran_variances::ModelGeneVariancesBlockedResults<double>& res) {
+    const int nr = mat.nrow(), nc = mat.ncol();
+    const std::size_t nblocks = res.per_block.size();
+    std::vector<double> buffer(nc);
+    auto ext = tatami::consecutive_extractor<false>(mat, true, 0, nr);
+
+    for (int r = 0; r < nr; ++r) {
+        auto ptr = ext->fetch(buffer.data());
+        std::vector<double> detected(nblocks), sums(nblocks);
+        std::vector<double> minimum(nblocks, std::numeric_limits<double>::quiet_NaN()), maximum(nblocks, std::numeric_limits<double>::quiet_NaN());
+        for (int c = 0; c < nc; ++c) {
+            const auto b = blocks[c];
+            detected[b] += (ptr[c] != 0);
+            sums[b] += ptr[c];
+            minimum[b] = (std::isnan(minimum[b]) ? ptr[c] : std::min(minimum[b], ptr[c]));
+            maximum[b] = (std::isnan(maximum[b]) ? ptr[c] : std::max(maximum[b], ptr[c]));
+        }
+
+        for (std::size_t b = 0; b < nblocks; ++b) {
+            const auto& current = res.per_block[b];
+            EXPECT_EQ(current.detected[r], detected[b]);
+            scran_tests::compare_almost_equal(current.sums[r], sums[b]);
+            if (std::isnan(minimum[b])) {
+                EXPECT_TRUE(std::isnan(current.minimum[r]));
+                EXPECT_TRUE(std::isnan(current.maximum[r]));
+            } else {
+                EXPECT_EQ(current.minimum[r], minimum[b]);
+                EXPECT_EQ(current.maximum[r], maximum[b]);
+            }
+        }
+    }
+}
+
 TEST_P(ModelGeneVariancesTest, Unblocked) {
     scran_variances::ModelGeneVariancesOptions opt;
     auto ref = scran_variances::model_gene_variances(*dense_row, opt);
@@ -259,6 +296,382 @@ TEST_P(ModelGeneVariancesTest, BlockedMedian) {
     EXPECT_EQ(expected_residuals, ares.average.residuals);
 }
 
+TEST_P(ModelGeneVariancesTest, Prefetch) {
+    std::vector<int> blocks(dense_row->ncol());
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        blocks[i] = i % 3;
+    }
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.num_threads = GetParam();
+
+    for (const auto& mat : { dense_row, dense_column, sparse_row, sparse_column }) {
+        auto ref = scran_variances::model_gene_variances_blocked(*mat, blocks.data(), opt);
+
+        // Trying a variety of buffer sizes, from one row/column per slot to everything in one slot.
+        for (std::size_t bufsize : { 1, 1000, 10000, 10000000 }) {
+            auto popt = opt;
+            popt.prefetch_buffer_size = bufsize;
+            auto res = scran_variances::model_gene_variances_blocked(*mat, blocks.data(), popt);
+            for (size_t b = 0; b < 3; ++b) {
+                EXPECT_EQ(ref.per_block[b].means, res.per_block[b].means);
+                EXPECT_EQ(ref.per_block[b].variances, res.per_block[b].variances);
+            }
+            EXPECT_EQ(ref.average.residuals, res.average.residuals);
+
+            auto ures = scran_variances::model_gene_variances(*mat, popt);
+            auto uref = scran_variances::model_gene_variances(*mat, opt);
+            EXPECT_EQ(uref.means, ures.means);
+            EXPECT_EQ(uref.variances, ures.variances);
+        }
+    }
+}
+
+TEST_P(ModelGeneVariancesTest, ColumnBatch) {
+    // Using both interleaved and sorted blocks, to check the runs of consecutive columns.
+    std::vector<int> interleaved(dense_column->ncol()), sorted(dense_column->ncol());
+    for (size_t i = 0; i < interleaved.size(); ++i) {
+        interleaved[i] = i % 3;
+        sorted[i] = (i * 3) / sorted.size();
+    }
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.num_threads = GetParam();
+    auto uref = scran_variances::model_gene_variances(*dense_column, opt);
+
+    for (std::size_t batch : { 2, 7, 100, 10000 }) {
+        auto bopt = opt;
+        bopt.column_batch_size = batch;
+        auto ures = scran_variances::model_gene_variances(*dense_column, bopt);
+        scran_tests::compare_almost_equal_containers(uref.means, ures.means, {});
+        scran_tests::compare_almost_equal_containers(uref.variances, ures.variances, {});
+
+        for (const auto& blocks : { interleaved, sorted }) {
+            auto ref = scran_variances::model_gene_variances_blocked(*dense_column, blocks.data(), opt);
+            auto res = scran_variances::model_gene_variances_blocked(*dense_column, blocks.data(), bopt);
+            for (size_t b = 0; b < 3; ++b) {
+                scran_tests::compare_almost_equal_containers(ref.per_block[b].means, res.per_block[b].means, {});
+                scran_tests::compare_almost_equal_containers(ref.per_block[b].variances, res.per_block[b].variances, {});
+            }
+            scran_tests::compare_almost_equal_containers(ref.average.residuals, res.average.residuals, {});
+        }
+
+        // Also works with prefetching.
+        bopt.prefetch_buffer_size = 1000;
+        auto pres = scran_variances::model_gene_variances(*dense_column, bopt);
+        scran_tests::compare_almost_equal_containers(uref.means, pres.means, {});
+        scran_tests::compare_almost_equal_containers(uref.variances, pres.variances, {});
+    }
+}
+
+TEST_P(ModelGeneVariancesTest, SparseColumnTiles) {
+    std::vector<int> blocks(sparse_column->ncol());
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        blocks[i] = i % 3;
+    }
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.num_threads = GetParam();
+    auto ref = scran_variances::model_gene_variances_blocked(*sparse_column, blocks.data(), opt);
+    auto uref = scran_variances::model_gene_variances(*sparse_column, opt);
+
+    // Small cache sizes force multiple tiles, while the largest cache size yields a single tile.
+    for (std::size_t cache : { 1, 1000, 10000000 }) {
+        auto topt = opt;
+        topt.sparse_column_tile_cache_size = cache;
+        auto res = scran_variances::model_gene_variances_blocked(*sparse_column, blocks.data(), topt);
+        for (size_t b = 0; b < 3; ++b) {
+            EXPECT_EQ(ref.per_block[b].means, res.per_block[b].means);
+            EXPECT_EQ(ref.per_block[b].variances, res.per_block[b].variances);
+        }
+        EXPECT_EQ(ref.average.residuals, res.average.residuals);
+
+        auto ures = scran_variances::model_gene_variances(*sparse_column, topt);
+        EXPECT_EQ(uref.means, ures.means);
+        EXPECT_EQ(uref.variances, ures.variances);
+
+        // Also works with prefetching.
+        topt.prefetch_buffer_size = 1000;
+        auto pres = scran_variances::model_gene_variances(*sparse_column, topt);
+        EXPECT_EQ(uref.means, pres.means);
+        EXPECT_EQ(uref.variances, pres.variances);
+    }
+}
+
+TEST_P(ModelGeneVariancesTest, ForcedPath) {
+    std::vector<int> blocks(dense_row->ncol());
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        blocks[i] = i % 3;
+    }
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.num_threads = GetParam();
+    auto ref = scran_variances::model_gene_variances_blocked(*dense_row, blocks.data(), opt);
+
+    for (auto path : {
+        scran_variances::ComputePath::DENSE_ROW,
+        scran_variances::ComputePath::SPARSE_ROW,
+        scran_variances::ComputePath::DENSE_COLUMN,
+        scran_variances::ComputePath::SPARSE_COLUMN
+    }) {
+        auto popt = opt;
+        popt.compute_path = path;
+        for (const auto& mat : { dense_row, dense_column, sparse_row, sparse_column }) {
+            auto plan = scran_variances::plan_model_gene_variances(*mat, 3, popt);
+            EXPECT_EQ(plan.path, path);
+            EXPECT_TRUE(std::isnan(plan.costs[0]));
+
+            auto res = scran_variances::model_gene_variances_blocked(*mat, blocks.data(), popt);
+            for (size_t b = 0; b < 3; ++b) {
+                scran_tests::compare_almost_equal_containers(ref.per_block[b].means, res.per_block[b].means, {});
+                scran_tests::compare_almost_equal_containers(ref.per_block[b].variances, res.per_block[b].variances, {});
+            }
+            scran_tests::compare_almost_equal_containers(ref.average.residuals, res.average.residuals, {});
+        }
+    }
+}
+
+TEST_P(ModelGeneVariancesTest, ExtraStatistics) {
+    std::vector<int> blocks(dense_row->ncol());
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        blocks[i] = i % 3;
+    }
+    std::vector<int> unblocked(dense_row->ncol());
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.num_threads = GetParam();
+    auto ref = scran_variances::model_gene_variances_blocked(*dense_row, blocks.data(), opt);
+    EXPECT_TRUE(ref.per_block[0].detected.empty());
+    EXPECT_TRUE(ref.per_block[0].sums.empty());
+
+    opt.extra_statistics = true;
+    for (const auto& mat : { dense_row, dense_column, sparse_row, sparse_column }) {
+        for (auto path : {
+            scran_variances::ComputePath::AUTO,
+            scran_variances::ComputePath::DENSE_ROW,
+            scran_variances::ComputePath::SPARSE_ROW,
+            scran_variances::ComputePath::DENSE_COLUMN,
+            scran_variances::ComputePath::SPARSE_COLUMN
+        }) {
+            auto popt = opt;
+            popt.compute_path = path;
+            auto res = scran_variances::model_gene_variances_blocked(*mat, blocks.data(), popt);
+            compare_extra_statistics(*dense_row, blocks, res);
+            EXPECT_TRUE(res.average.detected.empty());
+
+            // Other statistics are unaffected.
+            for (size_t b = 0; b < 3; ++b) {
+                scran_tests::compare_almost_equal_containers(ref.per_block[b].means, res.per_block[b].means, {});
+                scran_tests::compare_almost_equal_containers(ref.per_block[b].variances, res.per_block[b].variances, {});
+            }
+
+            auto ures = scran_variances::model_gene_variances(*mat, popt);
+            scran_variances::ModelGeneVariancesBlockedResults<double> wrapped;
+            wrapped.per_block.push_back(std::move(ures));
+            compare_extra_statistics(*dense_row, unblocked, wrapped);
+        }
+    }
+
+    // Works with the batched and tiled column calculations.
+    auto bopt = opt;
+    bopt.column_batch_size = 7;
+    compare_extra_statistics(*dense_row, blocks, scran_variances::model_gene_variances_blocked(*dense_column, blocks.data(), bopt));
+
+    auto topt = opt;
+    topt.sparse_column_tile_cache_size = 1000;
+    compare_extra_statistics(*dense_row, blocks, scran_variances::model_gene_variances_blocked(*sparse_column, blocks.data(), topt));
+
+    // Only the requested statistics are computed with the buffer-based overloads.
+    int nr = dense_row->nrow();
+    std::vector<double> means(nr), variances(nr), sums(nr);
+    scran_variances::ModelGeneVariancesBuffers<double> buffers;
+    buffers.means = means.data();
+    buffers.variances = variances.data();
+    buffers.fitted = NULL;
+    buffers.residuals = NULL;
+    buffers.sums = sums.data();
+    scran_variances::model_gene_variances(*sparse_column, buffers, opt);
+    auto full = scran_variances::model_gene_variances(*sparse_column, opt);
+    EXPECT_EQ(full.sums, sums);
+}
+
+// Counts the requests to the upstream resource, which must be thread-safe.
+class CountingResource : public std::pmr::memory_resource {
+public:
+    std::atomic<std::size_t> num_allocations = 0;
+
+private:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) {
+        ++num_allocations;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void* ptr, std::size_t bytes, std::size_t alignment) {
+        std::pmr::new_delete_resource()->deallocate(ptr, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+        return this == &other;
+    }
+};
+
+TEST_P(ModelGeneVariancesTest, MemoryResource) {
+    std::vector<int> blocks(dense_row->ncol());
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        blocks[i] = i % 3;
+    }
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.num_threads = GetParam();
+    opt.extra_statistics = true;
+    auto ref = scran_variances::model_gene_variances_blocked(*dense_row, blocks.data(), opt);
+
+    CountingResource counter;
+    opt.memory_resource = &counter;
+    for (const auto& mat : { dense_row, sparse_row, dense_column, sparse_column }) {
+        counter.num_allocations = 0;
+        auto res = scran_variances::model_gene_variances_blocked(*mat, blocks.data(), opt);
+        EXPECT_GT(counter.num_allocations, 0);
+        for (size_t b = 0; b < 3; ++b) {
+            scran_tests::compare_almost_equal_containers(ref.per_block[b].means, res.per_block[b].means, {});
+            scran_tests::compare_almost_equal_containers(ref.per_block[b].variances, res.per_block[b].variances, {});
+            EXPECT_EQ(ref.per_block[b].detected, res.per_block[b].detected);
+        }
+        scran_tests::compare_almost_equal_containers(ref.average.residuals, res.average.residuals, {});
+    }
+
+    // Repeated calls are served entirely by the pool after the first call.
+    // Worker threads are re-created on each call, so we only check this for a single thread.
+    if (opt.num_threads == 1) {
+        std::pmr::pool_options popt;
+        popt.largest_required_pool_block = 1 << 20;
+        std::pmr::unsynchronized_pool_resource pool(popt, &counter);
+        opt.memory_resource = &pool;
+        for (const auto& mat : { dense_row, sparse_column }) {
+            scran_variances::model_gene_variances_blocked(*mat, blocks.data(), opt);
+            counter.num_allocations = 0;
+            scran_variances::model_gene_variances_blocked(*mat, blocks.data(), opt);
+            EXPECT_EQ(counter.num_allocations, 0);
+        }
+    }
+}
+
+TEST_P(ModelGeneVariancesTest, Workspace) {
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.num_threads = GetParam();
+    opt.extra_statistics = true;
+    scran_variances::ModelGeneVariancesWorkspace<double, int> work;
+
+    // Re-using the workspace across subsets with different dimensions and numbers of blocks.
+    const int nr = dense_row->nrow(), nc = dense_row->ncol();
+    for (int nblocks : { 3, 1, 5, 2 }) {
+        auto sub = std::make_shared<tatami::DelayedSubsetBlock<double, int> >(dense_row, nblocks, nc - nblocks * 10, false);
+        const int nsub = sub->ncol();
+
+        std::vector<int> blocks(nsub);
+        for (int c = 0; c < nsub; ++c) {
+            blocks[c] = c % nblocks;
+        }
+
+        auto ref = scran_variances::model_gene_variances_blocked(*sub, blocks.data(), opt);
+        auto res = scran_variances::model_gene_variances_blocked(*sub, blocks.data(), opt, work);
+        ASSERT_EQ(res.per_block.size(), nblocks);
+        for (int b = 0; b < nblocks; ++b) {
+            EXPECT_EQ(ref.per_block[b].means, res.per_block[b].means);
+            EXPECT_EQ(ref.per_block[b].variances, res.per_block[b].variances);
+            EXPECT_EQ(ref.per_block[b].residuals, res.per_block[b].residuals);
+            EXPECT_EQ(ref.per_block[b].detected, res.per_block[b].detected);
+        }
+        EXPECT_EQ(ref.average.means, res.average.means);
+        EXPECT_EQ(ref.average.residuals, res.average.residuals);
+
+        auto uref = scran_variances::model_gene_variances(*sub, opt);
+        auto ures = scran_variances::model_gene_variances(*sub, opt, work);
+        EXPECT_EQ(uref.variances, ures.variances);
+        EXPECT_EQ(uref.residuals, ures.residuals);
+    }
+
+    // Same results with a weighted mean and a caller-supplied resource.
+    opt.block_average_policy = scran_variances::BlockAveragePolicy::MEAN;
+    opt.memory_resource = std::pmr::new_delete_resource();
+    std::vector<int> blocks(nc);
+    for (int c = 0; c < nc; ++c) {
+        blocks[c] = (c % 7 == 0 ? 1 : 0);
+    }
+    auto ref = scran_variances::model_gene_variances_blocked(*sparse_column, blocks.data(), opt);
+    for (int it = 0; it < 2; ++it) {
+        auto res = scran_variances::model_gene_variances_blocked(*sparse_column, blocks.data(), opt, work);
+        EXPECT_EQ(ref.average.variances, res.average.variances);
+        EXPECT_EQ(ref.average.residuals, res.average.residuals);
+        EXPECT_EQ(res.per_block[0].means.size(), nr);
+    }
+}
+
+TEST_P(ModelGeneVariancesTest, GeneChunkCallback) {
+    const int nr = dense_row->nrow(), nc = dense_row->ncol();
+    std::vector<int> blocks(nc);
+    for (int c = 0; c < nc; ++c) {
+        blocks[c] = c % 3;
+    }
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.num_threads = GetParam();
+    opt.extra_statistics = true;
+    auto ref = scran_variances::model_gene_variances_blocked(*dense_row, blocks.data(), opt);
+
+    for (auto path : {
+        scran_variances::ComputePath::DENSE_ROW,
+        scran_variances::ComputePath::SPARSE_ROW,
+        scran_variances::ComputePath::DENSE_COLUMN,
+        scran_variances::ComputePath::SPARSE_COLUMN
+    }) {
+        for (std::size_t chunk_size : { 0, 7 }) {
+            auto copt = opt;
+            copt.compute_path = path;
+            copt.gene_chunk_size = chunk_size;
+
+            // Taking a snapshot of the statistics for each chunk when it is reported.
+            scran_variances::ModelGeneVariancesBlockedResults<double> res(nr, 3, true, true, true);
+            auto buffers = scran_variances::internal::get_blocked_buffers(res, true, true);
+            std::vector<int> seen(nr);
+            std::vector<std::vector<double> > snapshot(3, std::vector<double>(nr));
+            std::vector<std::size_t> lengths;
+            std::atomic<bool> busy(false);
+            copt.gene_chunk_callback = [&](std::size_t start, std::size_t length) -> void {
+                EXPECT_FALSE(busy.exchange(true));
+                lengths.push_back(length);
+                for (std::size_t g = start; g < start + length; ++g) {
+                    ++seen[g];
+                    for (int b = 0; b < 3; ++b) {
+                        snapshot[b][g] = buffers.per_block[b].means[g];
+                    }
+                }
+                busy = false;
+            };
+
+            scran_variances::model_gene_variances_blocked(*sparse_column, blocks.data(), buffers, copt);
+            EXPECT_EQ(seen, std::vector<int>(nr, 1));
+            for (int b = 0; b < 3; ++b) {
+                EXPECT_EQ(snapshot[b], res.per_block[b].means);
+                scran_tests::compare_almost_equal_containers(ref.per_block[b].variances, res.per_block[b].variances, {});
+                EXPECT_EQ(ref.per_block[b].detected, res.per_block[b].detected);
+            }
+
+            const bool row = (path == scran_variances::ComputePath::DENSE_ROW || path == scran_variances::ComputePath::SPARSE_ROW);
+            if (!row) {
+                EXPECT_EQ(lengths, std::vector<std::size_t>{ static_cast<std::size_t>(nr) });
+            } else if (chunk_size) {
+                EXPECT_GT(lengths.size(), 1);
+                for (auto l : lengths) {
+                    EXPECT_LE(l, chunk_size);
+                }
+            } else {
+                EXPECT_EQ(lengths.size(), opt.num_threads);
+            }
+        }
+    }
+}
+
 INSTANTIATE_TEST_SUITE_P(
     ModelGeneVariances,
     ModelGeneVariancesTest,
@@ -354,6 +767,222 @@ TEST_F(ModelGeneVariancesNearEmptyBlockTest, Median) {
     EXPECT_EQ(mref.average.means, res.average.means);
 }
 
+class ModelGeneVariancesCellSplitTest : public ::testing::TestWithParam<int> {
+protected:
+    inline static int nr = 7, nc = 1001;
+    inline static std::shared_ptr<tatami::NumericMatrix> dense_row, dense_column, sparse_row, sparse_column;
+
+    static void SetUpTestSuite() {
+        auto vec = scran_tests::simulate_vector(nr * nc, []{
+            scran_tests::SimulateVectorParameters sparams;
+            sparams.density = 0.2;
+            sparams.lower = 0;
+            sparams.upper = 5;
+            sparams.seed = 999;
+            return sparams;
+        }());
+
+        dense_row = std::unique_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+        dense_column = tatami::convert_to_dense(dense_row.get(), false);
+        sparse_row = tatami::convert_to_compressed_sparse(dense_row.get(), true);
+        sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+    }
+};
+
+TEST_P(ModelGeneVariancesCellSplitTest, Unblocked) {
+    scran_variances::ModelGeneVariancesOptions opt;
+    auto ref = scran_variances::model_gene_variances(*dense_row, opt);
+
+    opt.num_threads = GetParam();
+    for (const auto& mat : { dense_row, dense_column, sparse_row, sparse_column }) {
+        EXPECT_EQ(scran_variances::internal::use_cell_split(*mat, opt.num_threads), !mat->prefer_rows() || opt.num_threads > nr);
+        auto res = scran_variances::model_gene_variances(*mat, opt);
+        scran_tests::compare_almost_equal_containers(ref.means, res.means, {});
+        scran_tests::compare_almost_equal_containers(ref.variances, res.variances, {});
+        scran_tests::compare_almost_equal_containers(ref.residuals, res.residuals, {});
+
+        auto popt = opt;
+        popt.prefetch_buffer_size = 1000;
+        auto pres = scran_variances::model_gene_variances(*mat, popt);
+        EXPECT_EQ(res.means, pres.means);
+        EXPECT_EQ(res.variances, pres.variances);
+    }
+}
+
+TEST_P(ModelGeneVariancesCellSplitTest, Blocked) {
+    // Sorted blocks, so that some threads have no cells from some blocks.
+    // Block 3 only contains a single cell, and block 2 is empty.
+    std::vector<int> blocks(nc);
+    for (int c = 0; c < nc; ++c) {
+        blocks[c] = (c < nc / 2 ? 0 : 1);
+    }
+    blocks[nc / 3] = 3;
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    auto ref = scran_variances::model_gene_variances_blocked(*dense_row, blocks.data(), opt);
+
+    opt.num_threads = GetParam();
+    for (const auto& mat : { dense_row, dense_column, sparse_row, sparse_column }) {
+        auto res = scran_variances::model_gene_variances_blocked(*mat, blocks.data(), opt);
+        ASSERT_EQ(res.per_block.size(), 4);
+        for (int b = 0; b < 4; ++b) {
+            scran_tests::compare_almost_equal_containers(ref.per_block[b].means, res.per_block[b].means, {});
+            scran_tests::compare_almost_equal_containers(ref.per_block[b].variances, res.per_block[b].variances, {});
+        }
+        scran_tests::compare_almost_equal_containers(ref.average.means, res.average.means, {});
+        scran_tests::compare_almost_equal_containers(ref.average.variances, res.average.variances, {});
+
+        EXPECT_TRUE(std::isnan(res.per_block[2].means[0]));
+        EXPECT_TRUE(std::isnan(res.per_block[2].variances[0]));
+        EXPECT_FALSE(std::isnan(res.per_block[3].means[0]));
+        EXPECT_TRUE(std::isnan(res.per_block[3].variances[0]));
+
+        auto eopt = opt;
+        eopt.extra_statistics = true;
+        compare_extra_statistics(*dense_row, blocks, scran_variances::model_gene_variances_blocked(*mat, blocks.data(), eopt));
+    }
+}
+
+TEST(ModelGeneVariancesCellSplit, Choice) {
+    tatami::DenseRowMatrix<double, int> tall_row(100, 10, std::vector<double>(1000));
+    EXPECT_FALSE(scran_variances::internal::use_cell_split(tall_row, 1));
+    EXPECT_FALSE(scran_variances::internal::use_cell_split(tall_row, 4));
+    EXPECT_FALSE(scran_variances::internal::use_cell_split(tall_row, 20)); // not enough cells.
+
+    tatami::DenseRowMatrix<double, int> wide_row(10, 100, std::vector<double>(1000));
+    EXPECT_FALSE(scran_variances::internal::use_cell_split(wide_row, 4));
+    EXPECT_TRUE(scran_variances::internal::use_cell_split(wide_row, 20));
+
+    tatami::DenseColumnMatrix<double, int> wide_column(100, 1000, std::vector<double>(100000));
+    EXPECT_FALSE(scran_variances::internal::use_cell_split(wide_column, 1));
+    EXPECT_FALSE(scran_variances::internal::use_cell_split(wide_column, 2));
+    EXPECT_TRUE(scran_variances::internal::use_cell_split(wide_column, 4));
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    ModelGeneVariances,
+    ModelGeneVariancesCellSplitTest,
+    ::testing::Values(2, 4, 13) // number of threads
+);
+
+TEST(ModelGeneVariancesPlan, Auto) {
+    int nr = 178, nc = 155;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.1;
+        sparams.seed = 100;
+        return sparams;
+    }());
+    std::shared_ptr<tatami::NumericMatrix> dense_row(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+    auto dense_column = tatami::convert_to_dense(dense_row.get(), false);
+    auto sparse_row = tatami::convert_to_compressed_sparse(dense_row.get(), true);
+    auto sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+
+    // For reasonably sized matrices, the preferred access pattern is chosen.
+    scran_variances::ModelGeneVariancesOptions opt;
+    EXPECT_EQ(scran_variances::plan_model_gene_variances(*dense_row, 1, opt).path, scran_variances::ComputePath::DENSE_ROW);
+    EXPECT_EQ(scran_variances::plan_model_gene_variances(*dense_column, 1, opt).path, scran_variances::ComputePath::DENSE_COLUMN);
+    EXPECT_EQ(scran_variances::plan_model_gene_variances(*sparse_row, 1, opt).path, scran_variances::ComputePath::SPARSE_ROW);
+    EXPECT_EQ(scran_variances::plan_model_gene_variances(*sparse_column, 1, opt).path, scran_variances::ComputePath::SPARSE_COLUMN);
+
+    // Costs are not estimated for entirely sparse matrices with a uniform preferred dimension.
+    auto plan = scran_variances::plan_model_gene_variances(*sparse_column, 1, opt);
+    EXPECT_FALSE(plan.cell_split);
+    for (auto c : plan.costs) {
+        EXPECT_TRUE(std::isnan(c));
+    }
+    EXPECT_TRUE(std::isnan(plan.density));
+
+    plan = scran_variances::plan_model_gene_variances(*dense_column, 1, opt);
+    for (auto c : plan.costs) {
+        EXPECT_TRUE(c > 0);
+    }
+    EXPECT_EQ(*std::min_element(plan.costs.begin(), plan.costs.end()), plan.costs[2]);
+    EXPECT_EQ(plan.density, 1);
+
+    // Otherwise, the density is estimated from a sample.
+    class PartlySparse : public tatami::DelayedSubsetBlock<double, int> {
+    public:
+        PartlySparse(std::shared_ptr<const tatami::NumericMatrix> mat) : tatami::DelayedSubsetBlock<double, int>(mat, 0, mat->ncol(), false) {}
+        double is_sparse_proportion() const { return 0.5; }
+    };
+    PartlySparse partly(sparse_column);
+    plan = scran_variances::plan_model_gene_variances(partly, 1, opt);
+    EXPECT_GT(plan.density, 0);
+    EXPECT_LT(plan.density, 1);
+    EXPECT_FALSE(std::isnan(plan.costs[0]));
+
+    // With very few genes, row access is cheaper even for column-major matrices.
+    auto wide = scran_tests::simulate_vector(5 * 2000, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.3;
+        sparams.seed = 101;
+        return sparams;
+    }());
+    tatami::DenseRowMatrix<double, int> wide_row(5, 2000, std::move(wide));
+    auto wide_column = tatami::convert_to_dense(&wide_row, false);
+    EXPECT_EQ(scran_variances::plan_model_gene_variances(*wide_column, 1, opt).path, scran_variances::ComputePath::DENSE_ROW);
+
+    opt.num_threads = 8;
+    plan = scran_variances::plan_model_gene_variances(*wide_column, 1, opt);
+    EXPECT_EQ(plan.path, scran_variances::ComputePath::DENSE_ROW);
+    EXPECT_TRUE(plan.cell_split);
+    EXPECT_EQ(plan.num_threads, 8);
+    EXPECT_EQ(plan.fit_num_threads, 8);
+}
+
+TEST(ModelGeneVariancesPlan, AutoTune) {
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.auto_tune = true;
+    opt.num_threads = 100; // ignored.
+    const auto hw = scran_variances::internal::detect_hardware();
+
+    // Small matrices are always processed with a single thread.
+    int nr = 50, nc = 20;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.density = 0.5;
+        sparams.seed = 102;
+        return sparams;
+    }());
+    std::shared_ptr<tatami::NumericMatrix> small_row(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+    auto small_column = tatami::convert_to_dense(small_row.get(), false);
+
+    auto plan = scran_variances::plan_model_gene_variances(*small_row, 1, opt);
+    EXPECT_EQ(plan.num_threads, 1);
+    EXPECT_EQ(plan.fit_num_threads, 1);
+    EXPECT_EQ(plan.column_batch_size, 0);
+    EXPECT_EQ(plan.path, scran_variances::ComputePath::DENSE_ROW);
+
+    // Large matrices use as many cores as are available. We use a constant
+    // matrix so that we don't actually have to allocate the full matrix.
+    tatami::ConstantMatrix<double, int> large(50000, 100000, 1);
+    plan = scran_variances::plan_model_gene_variances(large, 1, opt);
+    EXPECT_EQ(plan.num_threads, hw.num_cores);
+    EXPECT_EQ(plan.fit_num_threads, std::min(hw.num_cores, 25));
+
+    // Granularity is tuned for the column-based paths, but user-supplied values are respected.
+    opt.compute_path = scran_variances::ComputePath::DENSE_COLUMN;
+    plan = scran_variances::plan_model_gene_variances(large, 1, opt);
+    EXPECT_GT(plan.column_batch_size, 1);
+    opt.column_batch_size = 7;
+    plan = scran_variances::plan_model_gene_variances(large, 1, opt);
+    EXPECT_EQ(plan.column_batch_size, 7);
+
+    opt.compute_path = scran_variances::ComputePath::SPARSE_COLUMN;
+    plan = scran_variances::plan_model_gene_variances(large, 1, opt);
+    EXPECT_EQ(plan.sparse_column_tile_cache_size, hw.l2_cache_size);
+
+    // Results are unaffected by tuning.
+    opt = scran_variances::ModelGeneVariancesOptions();
+    auto ref = scran_variances::model_gene_variances(*small_column, opt);
+    opt.auto_tune = true;
+    auto res = scran_variances::model_gene_variances(*small_column, opt);
+    scran_tests::compare_almost_equal_containers(ref.means, res.means, {});
+    scran_tests::compare_almost_equal_containers(ref.variances, res.variances, {});
+    scran_tests::compare_almost_equal_containers(ref.residuals, res.residuals, {});
+}
+
 TEST(ModelGeneVariances, NullAverages) {
     // Get some test coverage for the case where the Buffer::average pointers
     // null and thus should be skipped regardless of what block_average_policy says.
@@ -0,0 +1,117 @@
+#include "scran_tests/scran_tests.hpp"
+
+#include "tatami/tatami.hpp"
+#include "scran_variances/model_gene_variances_async.hpp"
+
+#include <thread>
+#include <vector>
+#include <functional>
+
+class ModelGeneVariancesAsyncTest : public ::testing::Test {
+protected:
+    inline static int nr = 111, nc = 87;
+    inline static std::shared_ptr<tatami::NumericMatrix> dense_row, sparse_column;
+
+    static void SetUpTestSuite() {
+        auto vec = scran_tests::simulate_vector(nr * nc, []{
+            scran_tests::SimulateVectorParameters sparams;
+            sparams.density = 0.2;
+            sparams.seed = 8080;
+            sparams.lower = 0;
+            return sparams;
+        }());
+        dense_row = std::unique_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+        sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+    }
+
+    // Runs each task on its own thread, which is joined on destruction.
+    struct ThreadExecutor {
+        std::vector<std::thread> threads;
+        void operator()(std::function<void()> task) {
+            threads.emplace_back(std::move(task));
+        }
+        ~ThreadExecutor() {
+            for (auto& t : threads) {
+                t.join();
+            }
+        }
+    };
+};
+
+TEST_F(ModelGeneVariancesAsyncTest, Unblocked) {
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.extra_statistics = true;
+    auto ref = scran_variances::model_gene_variances(*dense_row, opt);
+
+    ThreadExecutor exec;
+    for (const auto& mat : { dense_row, sparse_column }) {
+        auto fut = scran_variances::model_gene_variances_async(*mat, opt, std::ref(exec));
+        const auto& stats = fut.statistics();
+        scran_tests::compare_almost_equal_containers(ref.means, stats.means, {});
+        scran_tests::compare_almost_equal_containers(ref.variances, stats.variances, {});
+        EXPECT_EQ(ref.detected, stats.detected);
+
+        const auto& res = fut.get();
+        scran_tests::compare_almost_equal_containers(ref.fitted, res.fitted, {});
+        scran_tests::compare_almost_equal_containers(ref.residuals, res.residuals, {});
+    }
+
+    // Works with an executor that runs the task immediately.
+    auto fut = scran_variances::model_gene_variances_async(*dense_row, opt, [](std::function<void()> task) -> void { task(); });
+    auto status = fut.stages().finished.wait_for(std::chrono::seconds(0));
+    EXPECT_EQ(status, std::future_status::ready);
+    EXPECT_EQ(ref.residuals, fut.get().residuals);
+}
+
+TEST_F(ModelGeneVariancesAsyncTest, Blocked) {
+    std::vector<int> blocks(nc);
+    for (int c = 0; c < nc; ++c) {
+        blocks[c] = c % 3;
+    }
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.num_threads = 2;
+    auto ref = scran_variances::model_gene_variances_blocked(*dense_row, blocks.data(), opt);
+
+    ThreadExecutor exec;
+    auto fut = scran_variances::model_gene_variances_blocked_async(*sparse_column, blocks.data(), opt, std::ref(exec));
+    const auto& stats = fut.statistics();
+    ASSERT_EQ(stats.per_block.size(), 3);
+    for (int b = 0; b < 3; ++b) {
+        scran_tests::compare_almost_equal_containers(ref.per_block[b].means, stats.per_block[b].means, {});
+        scran_tests::compare_almost_equal_containers(ref.per_block[b].variances, stats.per_block[b].variances, {});
+    }
+
+    const auto& res = fut.get();
+    for (int b = 0; b < 3; ++b) {
+        scran_tests::compare_almost_equal_containers(ref.per_block[b].residuals, res.per_block[b].residuals, {});
+    }
+    scran_tests::compare_almost_equal_containers(ref.average.means, res.average.means, {});
+    scran_tests::compare_almost_equal_containers(ref.average.residuals, res.average.residuals, {});
+
+    // Same results with caller-supplied buffers.
+    auto copy = ref;
+    auto buffers = scran_variances::internal::get_blocked_buffers(copy, true, true);
+    auto stages = scran_variances::model_gene_variances_blocked_async(*dense_row, blocks.data(), buffers, opt, std::ref(exec));
+    stages.finished.get();
+    EXPECT_EQ(copy.average.residuals, ref.average.residuals);
+}
+
+TEST_F(ModelGeneVariancesAsyncTest, Errors) {
+    // Trend fitting fails when all means are zero, but the statistics are still available.
+    tatami::DenseRowMatrix<double, int> mat(10, 5, std::vector<double>(50));
+    scran_variances::ModelGeneVariancesOptions opt;
+
+    ThreadExecutor exec;
+    auto fut = scran_variances::model_gene_variances_async(mat, opt, std::ref(exec));
+    const auto& stats = fut.statistics();
+    EXPECT_EQ(stats.means, std::vector<double>(10));
+
+    std::string msg;
+    try {
+        fut.get();
+    } catch (std::exception& e) {
+        msg = e.what();
+    }
+    EXPECT_FALSE(msg.empty());
+}
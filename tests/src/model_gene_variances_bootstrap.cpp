@@ -0,0 +1,223 @@
+#include "scran_tests/scran_tests.hpp"
+
+#include "tatami/tatami.hpp"
+#include "scran_variances/model_gene_variances_bootstrap.hpp"
+
+#include <vector>
+#include <string>
+#include <cmath>
+
+class ModelGeneVariancesBootstrapTest : public ::testing::TestWithParam<int> {
+protected:
+    inline static int nr = 83, nc = 121;
+    inline static std::shared_ptr<tatami::NumericMatrix> dense_row, dense_column, sparse_row, sparse_column;
+    inline static std::vector<double> values;
+
+    static void SetUpTestSuite() {
+        values = scran_tests::simulate_vector(nr * nc, []{
+            scran_tests::SimulateVectorParameters sparams;
+            sparams.density = 0.3;
+            sparams.lower = 0;
+            sparams.upper = 5;
+            sparams.seed = 4242;
+            return sparams;
+        }());
+        dense_row = std::unique_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, values));
+        dense_column = tatami::convert_to_dense(dense_row.get(), false);
+        sparse_row = tatami::convert_to_compressed_sparse(dense_row.get(), true);
+        sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+    }
+
+    // Explicitly expanding the matrix by repeating each cell according to its multiplicity.
+    static std::pair<tatami::DenseRowMatrix<double, int>, std::vector<int> > expand(std::uint64_t seed, std::size_t r, const std::vector<int>& blocks) {
+        std::vector<int> kept;
+        for (int c = 0; c < nc; ++c) {
+            const int mult = scran_variances::internal::bootstrap_multiplicity(seed, r, c);
+            for (int m = 0; m < mult; ++m) {
+                kept.push_back(c);
+            }
+        }
+
+        const int nkept = kept.size();
+        std::vector<double> expanded(nr * nkept);
+        std::vector<int> expanded_blocks(nkept);
+        for (int k = 0; k < nkept; ++k) {
+            for (int g = 0; g < nr; ++g) {
+                expanded[g * nkept + k] = values[g * nc + kept[k]];
+            }
+            expanded_blocks[k] = blocks[kept[k]];
+        }
+        return std::make_pair(tatami::DenseRowMatrix<double, int>(nr, nkept, std::move(expanded)), std::move(expanded_blocks));
+    }
+};
+
+TEST_P(ModelGeneVariancesBootstrapTest, Blocked) {
+    std::vector<int> blocks(nc);
+    for (int c = 0; c < nc; ++c) {
+        blocks[c] = c % 3;
+    }
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.num_threads = GetParam();
+    scran_variances::ModelGeneVariancesBootstrapOptions bopt;
+    bopt.num_replicates = 5;
+    bopt.choose_highly_variable_genes_options.top = 10;
+
+    auto res = scran_variances::model_gene_variances_bootstrap_blocked(*dense_row, blocks.data(), opt, bopt);
+    ASSERT_EQ(res.replicates.size(), 5);
+
+    for (std::size_t r = 0; r < bopt.num_replicates; ++r) {
+        auto expanded = expand(bopt.seed, r, blocks);
+        auto ref = scran_variances::model_gene_variances_blocked(expanded.first, expanded.second.data(), opt);
+        const auto& current = res.replicates[r];
+        ASSERT_EQ(current.per_block.size(), 3);
+        for (int b = 0; b < 3; ++b) {
+            scran_tests::compare_almost_equal_containers(ref.per_block[b].means, current.per_block[b].means, {});
+            scran_tests::compare_almost_equal_containers(ref.per_block[b].variances, current.per_block[b].variances, {});
+            scran_tests::compare_almost_equal_containers(ref.per_block[b].residuals, current.per_block[b].residuals, {});
+            EXPECT_TRUE(current.per_block[b].detected.empty());
+        }
+        scran_tests::compare_almost_equal_containers(ref.average.residuals, current.average.residuals, {});
+    }
+
+    // Replicates are actually different.
+    EXPECT_NE(res.replicates[0].per_block[0].means, res.replicates[1].per_block[0].means);
+
+    ASSERT_EQ(res.selection_frequency.size(), nr);
+    double total = 0;
+    for (auto f : res.selection_frequency) {
+        EXPECT_GE(f, 0);
+        EXPECT_LE(f, 1);
+        total += f;
+    }
+    EXPECT_GT(total, 0);
+
+    // Same results for a sparse matrix.
+    auto sres = scran_variances::model_gene_variances_bootstrap_blocked(*sparse_column, blocks.data(), opt, bopt);
+    for (std::size_t r = 0; r < bopt.num_replicates; ++r) {
+        for (int b = 0; b < 3; ++b) {
+            scran_tests::compare_almost_equal_containers(res.replicates[r].per_block[b].means, sres.replicates[r].per_block[b].means, {});
+            scran_tests::compare_almost_equal_containers(res.replicates[r].per_block[b].variances, sres.replicates[r].per_block[b].variances, {});
+        }
+    }
+    EXPECT_EQ(res.selection_frequency, sres.selection_frequency);
+
+    // Results do not depend on the number of threads.
+    if (opt.num_threads > 1) {
+        auto sopt = opt;
+        sopt.num_threads = 1;
+        auto serial = scran_variances::model_gene_variances_bootstrap_blocked(*dense_row, blocks.data(), sopt, bopt);
+        for (std::size_t r = 0; r < bopt.num_replicates; ++r) {
+            EXPECT_EQ(serial.replicates[r].average.residuals, res.replicates[r].average.residuals);
+        }
+        EXPECT_EQ(serial.selection_frequency, res.selection_frequency);
+    }
+
+    // Different seeds give different results.
+    bopt.seed = 1;
+    auto other = scran_variances::model_gene_variances_bootstrap_blocked(*dense_row, blocks.data(), opt, bopt);
+    EXPECT_NE(other.replicates[0].per_block[0].means, res.replicates[0].per_block[0].means);
+}
+
+TEST_P(ModelGeneVariancesBootstrapTest, ComputePath) {
+    std::vector<int> blocks(nc);
+    for (int c = 0; c < nc; ++c) {
+        blocks[c] = c % 4;
+    }
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.num_threads = GetParam();
+    scran_variances::ModelGeneVariancesBootstrapOptions bopt;
+    bopt.num_replicates = 4;
+    opt.compute_path = scran_variances::ComputePath::DENSE_ROW;
+    auto ref = scran_variances::model_gene_variances_bootstrap_blocked(*dense_row, blocks.data(), opt, bopt);
+
+    // Each replicate is computed with the same access pattern as the non-bootstrapped calculation.
+    const std::vector<std::pair<scran_variances::ComputePath, std::shared_ptr<tatami::NumericMatrix> > > choices{
+        { scran_variances::ComputePath::SPARSE_ROW, sparse_row },
+        { scran_variances::ComputePath::DENSE_COLUMN, dense_column },
+        { scran_variances::ComputePath::SPARSE_COLUMN, sparse_column }
+    };
+    for (const auto& choice : choices) {
+        opt.compute_path = choice.first;
+        auto res = scran_variances::model_gene_variances_bootstrap_blocked(*(choice.second), blocks.data(), opt, bopt);
+        for (std::size_t r = 0; r < bopt.num_replicates; ++r) {
+            for (int b = 0; b < 4; ++b) {
+                scran_tests::compare_almost_equal_containers(ref.replicates[r].per_block[b].means, res.replicates[r].per_block[b].means, {});
+                scran_tests::compare_almost_equal_containers(ref.replicates[r].per_block[b].variances, res.replicates[r].per_block[b].variances, {});
+            }
+        }
+        EXPECT_EQ(ref.selection_frequency, res.selection_frequency);
+    }
+}
+
+TEST_P(ModelGeneVariancesBootstrapTest, Unblocked) {
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.num_threads = GetParam();
+    scran_variances::ModelGeneVariancesBootstrapOptions bopt;
+    bopt.num_replicates = 3;
+
+    auto res = scran_variances::model_gene_variances_bootstrap(*sparse_column, opt, bopt);
+    ASSERT_EQ(res.replicates.size(), 3);
+    std::vector<int> blocks(nc);
+    for (std::size_t r = 0; r < bopt.num_replicates; ++r) {
+        const auto& current = res.replicates[r];
+        ASSERT_EQ(current.per_block.size(), 1);
+        EXPECT_TRUE(current.average.means.empty());
+
+        auto expanded = expand(bopt.seed, r, blocks);
+        auto ref = scran_variances::model_gene_variances(expanded.first, opt);
+        scran_tests::compare_almost_equal_containers(ref.variances, current.per_block[0].variances, {});
+        scran_tests::compare_almost_equal_containers(ref.residuals, current.per_block[0].residuals, {});
+    }
+
+    // The default of top = 4000 selects all genes with positive residuals.
+    for (int g = 0; g < nr; ++g) {
+        double expected = 0;
+        for (const auto& current : res.replicates) {
+            expected += (current.per_block[0].residuals[g] > 0);
+        }
+        scran_tests::compare_almost_equal(expected / bopt.num_replicates, res.selection_frequency[g]);
+    }
+}
+
+TEST(ModelGeneVariancesBootstrap, Multiplicity) {
+    // Checking that the multiplicities follow a Poisson(1) distribution.
+    const int n = 100000;
+    double sum = 0, sumsq = 0, zeros = 0;
+    for (int c = 0; c < n; ++c) {
+        const double m = scran_variances::internal::bootstrap_multiplicity(42, 0, c);
+        sum += m;
+        sumsq += m * m;
+        zeros += (m == 0);
+    }
+    const double mean = sum / n;
+    EXPECT_LT(std::abs(mean - 1), 0.02);
+    EXPECT_LT(std::abs(sumsq / n - mean * mean - 1), 0.03);
+    EXPECT_LT(std::abs(zeros / n - std::exp(-1.0)), 0.01);
+
+    // Deterministic.
+    EXPECT_EQ(scran_variances::internal::bootstrap_multiplicity(42, 5, 10), scran_variances::internal::bootstrap_multiplicity(42, 5, 10));
+}
+
+TEST(ModelGeneVariancesBootstrap, Errors) {
+    tatami::DenseRowMatrix<double, int> mat(2, 4, std::vector<double>{ 0, 1, 2, 3, 4, 5, 6, 7 });
+    std::vector<int> blocks{ 0, 0, 1, 1 };
+
+    // Genes cannot be chosen from multiple blocks without an average.
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.block_average_policy = scran_variances::BlockAveragePolicy::NONE;
+    std::string msg;
+    try {
+        scran_variances::model_gene_variances_bootstrap_blocked(mat, blocks.data(), opt, scran_variances::ModelGeneVariancesBootstrapOptions());
+    } catch (std::exception& e) {
+        msg = e.what();
+    }
+    EXPECT_TRUE(msg.find("average across blocks") != std::string::npos) << msg;
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    ModelGeneVariancesBootstrap,
+    ModelGeneVariancesBootstrapTest,
+    ::testing::Values(1, 3) // number of threads
+);
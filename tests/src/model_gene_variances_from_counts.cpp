@@ -0,0 +1,233 @@
+#include "scran_tests/scran_tests.hpp"
+
+#include "tatami/tatami.hpp"
+#include "scran_variances/model_gene_variances_from_counts.hpp"
+
+#include <cmath>
+#include <atomic>
+
+class ModelGeneVariancesFromCountsTest : public ::testing::TestWithParam<std::tuple<double, std::size_t> > {
+protected:
+    inline static int nr = 117, nc = 151;
+    inline static std::vector<double> counts, size_factors;
+    inline static std::shared_ptr<tatami::NumericMatrix> dense_row, dense_column, sparse_row, sparse_column;
+
+    static void SetUpTestSuite() {
+        counts = scran_tests::simulate_vector(nr * nc, []{
+            scran_tests::SimulateVectorParameters sparams;
+            sparams.density = 0.2;
+            sparams.lower = 1;
+            sparams.upper = 30;
+            sparams.seed = 4242;
+            return sparams;
+        }());
+        for (auto& x : counts) {
+            x = std::floor(x); // mix of small and large integer counts.
+        }
+
+        size_factors = scran_tests::simulate_vector(nc, []{
+            scran_tests::SimulateVectorParameters sparams;
+            sparams.lower = 0.2;
+            sparams.upper = 3;
+            sparams.seed = 4243;
+            return sparams;
+        }());
+
+        dense_row = std::unique_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, counts));
+        dense_column = tatami::convert_to_dense(dense_row.get(), false);
+        sparse_row = tatami::convert_to_compressed_sparse(dense_row.get(), true);
+        sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+    }
+
+    static std::shared_ptr<tatami::NumericMatrix> log_normalize(const double pseudo_count) {
+        auto copy = counts;
+        for (int r = 0; r < nr; ++r) {
+            for (int c = 0; c < nc; ++c) {
+                auto& x = copy[static_cast<std::size_t>(r) * nc + c];
+                x = std::log2(x / size_factors[c] + pseudo_count);
+            }
+        }
+        return std::shared_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(copy)));
+    }
+};
+
+TEST_P(ModelGeneVariancesFromCountsTest, Unblocked) {
+    auto param = GetParam();
+    scran_variances::LogNormalizeOptions lopt;
+    lopt.pseudo_count = std::get<0>(param);
+    lopt.lookup_table_size = std::get<1>(param);
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    auto ref = scran_variances::model_gene_variances(*log_normalize(lopt.pseudo_count), opt);
+
+    for (const auto& mat : { dense_row, dense_column, sparse_row, sparse_column }) {
+        auto res = scran_variances::model_gene_variances_from_counts(*mat, size_factors.data(), opt, lopt);
+        scran_tests::compare_almost_equal_containers(ref.means, res.means, {});
+        scran_tests::compare_almost_equal_containers(ref.variances, res.variances, {});
+        scran_tests::compare_almost_equal_containers(ref.fitted, res.fitted, {});
+        scran_tests::compare_almost_equal_containers(ref.residuals, res.residuals, {});
+    }
+
+    // Same results with column batching.
+    auto bopt = opt;
+    bopt.column_batch_size = 10;
+    auto bres = scran_variances::model_gene_variances_from_counts(*dense_column, size_factors.data(), bopt, lopt);
+    scran_tests::compare_almost_equal_containers(ref.means, bres.means, {});
+    scran_tests::compare_almost_equal_containers(ref.variances, bres.variances, {});
+
+    // Same results with multiple threads.
+    opt.num_threads = 3;
+    auto res = scran_variances::model_gene_variances_from_counts(*sparse_column, size_factors.data(), opt, lopt);
+    scran_tests::compare_almost_equal_containers(ref.means, res.means, {});
+    scran_tests::compare_almost_equal_containers(ref.variances, res.variances, {});
+}
+
+TEST_P(ModelGeneVariancesFromCountsTest, Blocked) {
+    auto param = GetParam();
+    scran_variances::LogNormalizeOptions lopt;
+    lopt.pseudo_count = std::get<0>(param);
+    lopt.lookup_table_size = std::get<1>(param);
+
+    std::vector<int> blocks(nc);
+    for (int c = 0; c < nc; ++c) {
+        blocks[c] = c % 3;
+    }
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    auto ref = scran_variances::model_gene_variances_blocked(*log_normalize(lopt.pseudo_count), blocks.data(), opt);
+
+    for (const auto& mat : { dense_row, dense_column, sparse_row, sparse_column }) {
+        auto res = scran_variances::model_gene_variances_blocked_from_counts(*mat, size_factors.data(), blocks.data(), opt, lopt);
+        ASSERT_EQ(res.per_block.size(), 3);
+        for (int b = 0; b < 3; ++b) {
+            scran_tests::compare_almost_equal_containers(ref.per_block[b].means, res.per_block[b].means, {});
+            scran_tests::compare_almost_equal_containers(ref.per_block[b].variances, res.per_block[b].variances, {});
+            scran_tests::compare_almost_equal_containers(ref.per_block[b].residuals, res.per_block[b].residuals, {});
+        }
+        scran_tests::compare_almost_equal_containers(ref.average.means, res.average.means, {});
+        scran_tests::compare_almost_equal_containers(ref.average.variances, res.average.variances, {});
+        scran_tests::compare_almost_equal_containers(ref.average.residuals, res.average.residuals, {});
+    }
+
+    // Extra statistics are reported on the log-scale, but detection is still based on the counts.
+    opt.extra_statistics = true;
+    auto eref = scran_variances::model_gene_variances_blocked(*log_normalize(lopt.pseudo_count), blocks.data(), opt);
+    auto cref = scran_variances::model_gene_variances_blocked(*dense_row, blocks.data(), opt);
+    for (const auto& mat : { dense_row, dense_column, sparse_row, sparse_column }) {
+        auto res = scran_variances::model_gene_variances_blocked_from_counts(*mat, size_factors.data(), blocks.data(), opt, lopt);
+        for (int b = 0; b < 3; ++b) {
+            EXPECT_EQ(cref.per_block[b].detected, res.per_block[b].detected);
+            scran_tests::compare_almost_equal_containers(eref.per_block[b].sums, res.per_block[b].sums, {});
+            scran_tests::compare_almost_equal_containers(eref.per_block[b].minimum, res.per_block[b].minimum, {});
+            scran_tests::compare_almost_equal_containers(eref.per_block[b].maximum, res.per_block[b].maximum, {});
+        }
+    }
+}
+
+TEST_F(ModelGeneVariancesFromCountsTest, GeneChunkCallback) {
+    std::vector<int> blocks(nc);
+    for (int c = 0; c < nc; ++c) {
+        blocks[c] = c % 3;
+    }
+
+    // Using a pseudo-count that is not 1, so the statistics need to be shifted before they are reported.
+    scran_variances::LogNormalizeOptions lopt;
+    lopt.pseudo_count = 4;
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.extra_statistics = true;
+    auto ref = scran_variances::model_gene_variances_blocked(*log_normalize(lopt.pseudo_count), blocks.data(), opt);
+
+    for (const auto& mat : { dense_row, dense_column, sparse_row, sparse_column }) {
+        for (int nthreads : { 1, 3 }) {
+            auto copt = opt;
+            copt.num_threads = nthreads;
+            copt.gene_chunk_size = 7;
+
+            scran_variances::ModelGeneVariancesBlockedResults<double> res(nr, 3, true, true, true);
+            auto buffers = scran_variances::internal::get_blocked_buffers(res, true, true);
+            std::vector<int> seen(nr);
+            std::vector<std::vector<double> > mean_snapshot(3, std::vector<double>(nr)), sum_snapshot = mean_snapshot, min_snapshot = mean_snapshot, max_snapshot = mean_snapshot;
+            std::atomic<bool> busy(false);
+            copt.gene_chunk_callback = [&](std::size_t start, std::size_t length) -> void {
+                EXPECT_FALSE(busy.exchange(true));
+                for (std::size_t g = start; g < start + length; ++g) {
+                    ++seen[g];
+                    for (int b = 0; b < 3; ++b) {
+                        mean_snapshot[b][g] = buffers.per_block[b].means[g];
+                        sum_snapshot[b][g] = buffers.per_block[b].sums[g];
+                        min_snapshot[b][g] = buffers.per_block[b].minimum[g];
+                        max_snapshot[b][g] = buffers.per_block[b].maximum[g];
+                    }
+                }
+                busy = false;
+            };
+
+            scran_variances::model_gene_variances_blocked_from_counts(*mat, size_factors.data(), blocks.data(), buffers, copt, lopt);
+            EXPECT_EQ(seen, std::vector<int>(nr, 1));
+            for (int b = 0; b < 3; ++b) {
+                EXPECT_EQ(mean_snapshot[b], res.per_block[b].means);
+                EXPECT_EQ(sum_snapshot[b], res.per_block[b].sums);
+                EXPECT_EQ(min_snapshot[b], res.per_block[b].minimum);
+                EXPECT_EQ(max_snapshot[b], res.per_block[b].maximum);
+                scran_tests::compare_almost_equal_containers(ref.per_block[b].means, res.per_block[b].means, {});
+                scran_tests::compare_almost_equal_containers(ref.per_block[b].sums, res.per_block[b].sums, {});
+            }
+        }
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    ModelGeneVariancesFromCounts,
+    ModelGeneVariancesFromCountsTest,
+    ::testing::Combine(
+        ::testing::Values(1.0, 0.5, 3.0), // pseudo-count
+        ::testing::Values(0, 16, 100) // lookup table size
+    )
+);
+
+TEST(ModelGeneVariancesFromCounts, IntegerCounts) {
+    int nr = 23, nc = 47;
+    std::vector<int> icounts(nr * nc);
+    std::vector<double> dcounts(nr * nc);
+    for (int i = 0; i < nr * nc; ++i) {
+        icounts[i] = (i * 7) % 13;
+        dcounts[i] = icounts[i];
+    }
+    std::vector<double> sf(nc);
+    for (int c = 0; c < nc; ++c) {
+        sf[c] = 0.5 + c / 20.0;
+    }
+
+    tatami::DenseRowMatrix<int, int> imat(nr, nc, std::move(icounts));
+    tatami::DenseRowMatrix<double, int> dmat(nr, nc, std::move(dcounts));
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    scran_variances::LogNormalizeOptions lopt;
+    lopt.lookup_table_size = 5;
+    auto ires = scran_variances::model_gene_variances_from_counts(imat, sf.data(), opt, lopt);
+    lopt.lookup_table_size = 0;
+    auto dres = scran_variances::model_gene_variances_from_counts(dmat, sf.data(), opt, lopt);
+    scran_tests::compare_almost_equal_containers(ires.means, dres.means, {});
+    scran_tests::compare_almost_equal_containers(ires.variances, dres.variances, {});
+}
+
+TEST(ModelGeneVariancesFromCounts, Errors) {
+    tatami::DenseRowMatrix<double, int> mat(2, 3, std::vector<double>(6, 1));
+    scran_variances::ModelGeneVariancesOptions opt;
+
+    auto check_error = [&](const std::vector<double>& sf, const double pseudo_count, const std::string& expected) {
+        scran_variances::LogNormalizeOptions lopt;
+        lopt.pseudo_count = pseudo_count;
+        std::string msg;
+        try {
+            scran_variances::model_gene_variances_from_counts(mat, sf.data(), opt, lopt);
+        } catch (std::exception& e) {
+            msg = e.what();
+        }
+        EXPECT_TRUE(msg.find(expected) != std::string::npos) << msg;
+    };
+
+    check_error({ 1, 0, 1 }, 1, "size factors should be positive");
+    check_error({ 1, 1, 1 }, 0, "pseudo-count should be positive");
+}
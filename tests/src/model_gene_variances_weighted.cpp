@@ -0,0 +1,302 @@
+#include "scran_tests/scran_tests.hpp"
+
+#include "tatami/tatami.hpp"
+#include "scran_variances/model_gene_variances_weighted.hpp"
+#include "scran_variances/allocation_tracker.hpp"
+
+#include <vector>
+#include <limits>
+#include <string>
+#include <atomic>
+
+class ModelGeneVariancesWeightedTest : public ::testing::TestWithParam<std::tuple<scran_variances::ComputePath, int> > {
+protected:
+    inline static int nr = 67, nc = 113;
+    inline static std::shared_ptr<tatami::NumericMatrix> dense_row, dense_column, sparse_row, sparse_column;
+    inline static std::vector<double> values;
+
+    static void SetUpTestSuite() {
+        values = scran_tests::simulate_vector(nr * nc, []{
+            scran_tests::SimulateVectorParameters sparams;
+            sparams.density = 0.3;
+            sparams.lower = 0;
+            sparams.upper = 5;
+            sparams.seed = 5353;
+            return sparams;
+        }());
+        dense_row = std::unique_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, values));
+        dense_column = tatami::convert_to_dense(dense_row.get(), false);
+        sparse_row = tatami::convert_to_compressed_sparse(dense_row.get(), true);
+        sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+    }
+
+    static const std::shared_ptr<tatami::NumericMatrix>& choose_ptr(scran_variances::ComputePath path) {
+        switch (path) {
+            case scran_variances::ComputePath::DENSE_ROW:
+                return dense_row;
+            case scran_variances::ComputePath::SPARSE_ROW:
+                return sparse_row;
+            case scran_variances::ComputePath::DENSE_COLUMN:
+                return dense_column;
+            default:
+                return sparse_column;
+        }
+    }
+
+    static const tatami::NumericMatrix& choose(scran_variances::ComputePath path) {
+        return *choose_ptr(path);
+    }
+
+    // Explicitly expanding the matrix by repeating each cell according to its weight.
+    static std::pair<tatami::DenseRowMatrix<double, int>, std::vector<int> > expand(const std::vector<int>& weights, const std::vector<int>& blocks) {
+        std::vector<int> kept;
+        for (int c = 0; c < nc; ++c) {
+            for (int m = 0; m < weights[c]; ++m) {
+                kept.push_back(c);
+            }
+        }
+
+        const int nkept = kept.size();
+        std::vector<double> expanded(nr * nkept);
+        std::vector<int> expanded_blocks(nkept);
+        for (int k = 0; k < nkept; ++k) {
+            for (int g = 0; g < nr; ++g) {
+                expanded[g * nkept + k] = values[g * nc + kept[k]];
+            }
+            expanded_blocks[k] = blocks[kept[k]];
+        }
+        return std::make_pair(tatami::DenseRowMatrix<double, int>(nr, nkept, std::move(expanded)), std::move(expanded_blocks));
+    }
+};
+
+TEST_P(ModelGeneVariancesWeightedTest, Blocked) {
+    const auto param = GetParam();
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.compute_path = std::get<0>(param);
+    opt.num_threads = std::get<1>(param);
+
+    std::vector<int> blocks(nc), weights(nc);
+    for (int c = 0; c < nc; ++c) {
+        blocks[c] = c % 3;
+        weights[c] = (c * 7) % 4; // includes some zero weights.
+    }
+
+    const auto& mat = choose(opt.compute_path);
+    auto res = scran_variances::model_gene_variances_blocked_weighted(mat, blocks.data(), weights.data(), opt);
+    ASSERT_EQ(res.per_block.size(), 3);
+
+    auto expanded = expand(weights, blocks);
+    auto ref = scran_variances::model_gene_variances_blocked(expanded.first, expanded.second.data(), opt);
+    for (int b = 0; b < 3; ++b) {
+        scran_tests::compare_almost_equal_containers(ref.per_block[b].means, res.per_block[b].means, {});
+        scran_tests::compare_almost_equal_containers(ref.per_block[b].variances, res.per_block[b].variances, {});
+        scran_tests::compare_almost_equal_containers(ref.per_block[b].fitted, res.per_block[b].fitted, {});
+        scran_tests::compare_almost_equal_containers(ref.per_block[b].residuals, res.per_block[b].residuals, {});
+    }
+    scran_tests::compare_almost_equal_containers(ref.average.means, res.average.means, {});
+    scran_tests::compare_almost_equal_containers(ref.average.variances, res.average.variances, {});
+    scran_tests::compare_almost_equal_containers(ref.average.residuals, res.average.residuals, {});
+}
+
+TEST_P(ModelGeneVariancesWeightedTest, Unblocked) {
+    const auto param = GetParam();
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.compute_path = std::get<0>(param);
+    opt.num_threads = std::get<1>(param);
+    const auto& mat = choose(opt.compute_path);
+
+    // Unit weights are the same as the unweighted calculation.
+    std::vector<double> weights(nc, 1);
+    auto res = scran_variances::model_gene_variances_weighted(mat, weights.data(), opt);
+    auto ref = scran_variances::model_gene_variances(mat, opt);
+    scran_tests::compare_almost_equal_containers(ref.means, res.means, {});
+    scran_tests::compare_almost_equal_containers(ref.variances, res.variances, {});
+    scran_tests::compare_almost_equal_containers(ref.residuals, res.residuals, {});
+
+    // Non-integer weights give the same means as a weighted average.
+    for (int c = 0; c < nc; ++c) {
+        weights[c] = 0.5 + (c % 5) * 0.25;
+    }
+    res = scran_variances::model_gene_variances_weighted(mat, weights.data(), opt);
+    double total = 0;
+    for (auto w : weights) {
+        total += w;
+    }
+    for (int g = 0; g < nr; ++g) {
+        double expected = 0;
+        for (int c = 0; c < nc; ++c) {
+            expected += values[g * nc + c] * weights[c];
+        }
+        scran_tests::compare_almost_equal(expected / total, res.means[g]);
+    }
+}
+
+TEST_P(ModelGeneVariancesWeightedTest, Tuning) {
+    const auto param = GetParam();
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.compute_path = std::get<0>(param);
+    opt.num_threads = std::get<1>(param);
+    const auto& mat = choose(opt.compute_path);
+
+    std::vector<int> blocks(nc);
+    std::vector<double> weights(nc);
+    for (int c = 0; c < nc; ++c) {
+        blocks[(c * 13) % nc] = c / 40; // runs of consecutive cells in the same block, in a shuffled order.
+        weights[c] = (c % 7) * 0.3;
+    }
+    auto ref = scran_variances::model_gene_variances_blocked_weighted(mat, blocks.data(), weights.data(), opt);
+
+    // Same results with column batching, tiling and prefetching.
+    auto topt = opt;
+    topt.column_batch_size = 7;
+    topt.sparse_column_tile_cache_size = 256;
+    topt.prefetch_buffer_size = 5000;
+    std::vector<int> reported(nr);
+    topt.gene_chunk_callback = [&](std::size_t start, std::size_t length) -> void {
+        for (std::size_t g = start; g < start + length; ++g) {
+            ++reported[g];
+        }
+    };
+    topt.gene_chunk_size = 5;
+    scran_variances::AllocationTracker tracker;
+    topt.allocation_tracker = &tracker;
+
+    auto res = scran_variances::model_gene_variances_blocked_weighted(mat, blocks.data(), weights.data(), topt);
+    for (std::size_t b = 0; b < ref.per_block.size(); ++b) {
+        scran_tests::compare_almost_equal_containers(ref.per_block[b].means, res.per_block[b].means, {});
+        scran_tests::compare_almost_equal_containers(ref.per_block[b].variances, res.per_block[b].variances, {});
+    }
+    EXPECT_EQ(reported, std::vector<int>(nr, 1));
+    EXPECT_GT(tracker.peak(scran_variances::AllocationPhase::EXTRACTION), 0);
+}
+
+TEST_P(ModelGeneVariancesWeightedTest, GeneChunkCallback) {
+    const auto param = GetParam();
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.compute_path = std::get<0>(param);
+    opt.num_threads = std::get<1>(param);
+    const auto& mat = choose(opt.compute_path);
+
+    std::vector<int> blocks(nc);
+    std::vector<double> weights(nc);
+    for (int c = 0; c < nc; ++c) {
+        blocks[c] = c % 3;
+        weights[c] = 0.2 + (c % 4) * 0.5;
+    }
+    auto ref = scran_variances::model_gene_variances_blocked_weighted(mat, blocks.data(), weights.data(), opt);
+
+    for (std::size_t chunk_size : { 0, 7 }) {
+        auto copt = opt;
+        copt.gene_chunk_size = chunk_size;
+
+        // Taking a snapshot of the statistics for each chunk when it is reported.
+        scran_variances::ModelGeneVariancesBlockedResults<double> res(nr, 3, true, true, false);
+        auto buffers = scran_variances::internal::get_blocked_buffers(res, true, true);
+        std::vector<int> seen(nr);
+        std::vector<std::vector<double> > mean_snapshot(3, std::vector<double>(nr)), var_snapshot = mean_snapshot;
+        std::atomic<bool> busy(false);
+        copt.gene_chunk_callback = [&](std::size_t start, std::size_t length) -> void {
+            EXPECT_FALSE(busy.exchange(true));
+            for (std::size_t g = start; g < start + length; ++g) {
+                ++seen[g];
+                for (int b = 0; b < 3; ++b) {
+                    mean_snapshot[b][g] = buffers.per_block[b].means[g];
+                    var_snapshot[b][g] = buffers.per_block[b].variances[g];
+                }
+            }
+            busy = false;
+        };
+
+        scran_variances::model_gene_variances_blocked_weighted(mat, blocks.data(), weights.data(), buffers, copt);
+        EXPECT_EQ(seen, std::vector<int>(nr, 1));
+        for (int b = 0; b < 3; ++b) {
+            EXPECT_EQ(mean_snapshot[b], res.per_block[b].means);
+            EXPECT_EQ(var_snapshot[b], res.per_block[b].variances);
+            scran_tests::compare_almost_equal_containers(ref.per_block[b].means, res.per_block[b].means, {});
+            scran_tests::compare_almost_equal_containers(ref.per_block[b].variances, res.per_block[b].variances, {});
+        }
+    }
+}
+
+TEST_P(ModelGeneVariancesWeightedTest, CellSplit) {
+    const auto param = GetParam();
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.compute_path = std::get<0>(param);
+    opt.trend = false;
+
+    // Using only a few genes so that the cells are split across threads.
+    tatami::DelayedSubsetBlock<double, int> sub(choose_ptr(opt.compute_path), 0, 5, true);
+    std::vector<int> blocks(nc);
+    std::vector<double> weights(nc);
+    for (int c = 0; c < nc; ++c) {
+        blocks[c] = c % 2;
+        weights[c] = 0.1 + (c % 3) * 0.2; // some subsets of cells have a total weight below 1.
+    }
+    auto ref = scran_variances::model_gene_variances_blocked_weighted(sub, blocks.data(), weights.data(), opt);
+
+    opt.num_threads = 7 * std::get<1>(param);
+    EXPECT_TRUE(scran_variances::plan_model_gene_variances(sub, 2, opt).cell_split);
+    auto res = scran_variances::model_gene_variances_blocked_weighted(sub, blocks.data(), weights.data(), opt);
+    for (int b = 0; b < 2; ++b) {
+        scran_tests::compare_almost_equal_containers(ref.per_block[b].means, res.per_block[b].means, {});
+        scran_tests::compare_almost_equal_containers(ref.per_block[b].variances, res.per_block[b].variances, {});
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    ModelGeneVariancesWeighted,
+    ModelGeneVariancesWeightedTest,
+    ::testing::Combine(
+        ::testing::Values(
+            scran_variances::ComputePath::DENSE_ROW,
+            scran_variances::ComputePath::SPARSE_ROW,
+            scran_variances::ComputePath::DENSE_COLUMN,
+            scran_variances::ComputePath::SPARSE_COLUMN
+        ),
+        ::testing::Values(1, 3) // number of threads
+    )
+);
+
+TEST(ModelGeneVariancesWeighted, EmptyBlock) {
+    int nr = 11, nc = 20;
+    auto vec = scran_tests::simulate_vector(nr * nc, scran_tests::SimulateVectorParameters());
+    tatami::DenseColumnMatrix<double, int> mat(nr, nc, std::move(vec));
+
+    // Second block has zero total weight.
+    std::vector<int> blocks(nc), weights(nc, 1);
+    for (int c = 10; c < nc; ++c) {
+        blocks[c] = 1;
+        weights[c] = 0;
+    }
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    auto res = scran_variances::model_gene_variances_blocked_weighted(mat, blocks.data(), weights.data(), opt);
+    for (int g = 0; g < nr; ++g) {
+        EXPECT_TRUE(std::isnan(res.per_block[1].means[g]));
+        EXPECT_TRUE(std::isnan(res.per_block[1].variances[g]));
+    }
+    EXPECT_EQ(res.average.residuals, res.per_block[0].residuals);
+}
+
+TEST(ModelGeneVariancesWeighted, Errors) {
+    tatami::DenseRowMatrix<double, int> mat(2, 3, std::vector<double>(6));
+    scran_variances::ModelGeneVariancesOptions opt;
+
+    std::vector<double> weights{ 1, -1, 1 };
+    std::string msg;
+    try {
+        scran_variances::model_gene_variances_weighted(mat, weights.data(), opt);
+    } catch (std::exception& e) {
+        msg = e.what();
+    }
+    EXPECT_TRUE(msg.find("non-negative") != std::string::npos);
+
+    weights[1] = std::numeric_limits<double>::infinity();
+    msg.clear();
+    try {
+        scran_variances::model_gene_variances_weighted(mat, weights.data(), opt);
+    } catch (std::exception& e) {
+        msg = e.what();
+    }
+    EXPECT_TRUE(msg.find("finite") != std::string::npos);
+}
@@ -0,0 +1,200 @@
+#include "scran_tests/scran_tests.hpp"
+
+#include "tatami/tatami.hpp"
+#include "scran_variances/pearson_residual_variances.hpp"
+#include "scran_variances/model_gene_variances.hpp"
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+class PearsonResidualVariancesTest : public ::testing::TestWithParam<std::tuple<double, double> > {
+protected:
+    inline static int nr = 213, nc = 151;
+    inline static std::vector<double> counts, size_factors;
+    inline static std::shared_ptr<tatami::NumericMatrix> dense_row, dense_column, sparse_row, sparse_column;
+
+    static void SetUpTestSuite() {
+        counts = scran_tests::simulate_vector(nr * nc, []{
+            scran_tests::SimulateVectorParameters sparams;
+            sparams.density = 0.3;
+            sparams.lower = 1;
+            sparams.upper = 10;
+            sparams.seed = 6969;
+            return sparams;
+        }());
+        for (int r = 0; r < nr; ++r) {
+            const double scale = std::pow(2.0, r % 11 - 3); // spreading the rates across several orders of magnitude.
+            for (int c = 0; c < nc; ++c) {
+                auto& x = counts[static_cast<std::size_t>(r) * nc + c];
+                x = std::floor(x * scale);
+            }
+        }
+
+        size_factors = scran_tests::simulate_vector(nc, []{
+            scran_tests::SimulateVectorParameters sparams;
+            sparams.lower = 0.2;
+            sparams.upper = 3;
+            sparams.seed = 6970;
+            return sparams;
+        }());
+
+        dense_row = std::unique_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, counts));
+        dense_column = tatami::convert_to_dense(dense_row.get(), false);
+        sparse_row = tatami::convert_to_compressed_sparse(dense_row.get(), true);
+        sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+    }
+
+    static std::shared_ptr<tatami::NumericMatrix> compute_residuals(const int* block, const double theta, const double clip) {
+        const int nblocks = (block ? *std::max_element(block, block + nc) + 1 : 1);
+        auto get_block = [&](int c) -> int { return block ? block[c] : 0; };
+
+        std::vector<double> total_sf(nblocks);
+        for (int c = 0; c < nc; ++c) {
+            total_sf[get_block(c)] += size_factors[c];
+        }
+
+        std::vector<double> residuals(counts.size());
+        for (int r = 0; r < nr; ++r) {
+            std::vector<double> total_counts(nblocks);
+            for (int c = 0; c < nc; ++c) {
+                total_counts[get_block(c)] += counts[static_cast<std::size_t>(r) * nc + c];
+            }
+
+            for (int c = 0; c < nc; ++c) {
+                const auto b = get_block(c);
+                const double mu = size_factors[c] * total_counts[b] / total_sf[b];
+                const auto offset = static_cast<std::size_t>(r) * nc + c;
+                if (mu > 0) {
+                    const double z = (counts[offset] - mu) / std::sqrt(mu + mu * mu / theta);
+                    residuals[offset] = std::max(-clip, std::min(clip, z));
+                }
+            }
+        }
+
+        return std::shared_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(residuals)));
+    }
+
+    static void compare(const std::vector<double>& ref, const std::vector<double>& obs) {
+        ASSERT_EQ(ref.size(), obs.size());
+        for (std::size_t i = 0; i < ref.size(); ++i) {
+            EXPECT_NEAR(ref[i], obs[i], 1e-6 * std::max(1.0, std::abs(ref[i])));
+        }
+    }
+
+    // Small variances should still be accurate relative to their own size, i.e., without cancellation.
+    static void compare_relative(const std::vector<double>& ref, const std::vector<double>& obs) {
+        ASSERT_EQ(ref.size(), obs.size());
+        for (std::size_t i = 0; i < ref.size(); ++i) {
+            EXPECT_NEAR(ref[i], obs[i], 1e-6 * std::abs(ref[i]) + 1e-12);
+        }
+    }
+};
+
+TEST_P(PearsonResidualVariancesTest, Unblocked) {
+    auto param = GetParam();
+    scran_variances::PearsonResidualOptions popt;
+    popt.theta = std::get<0>(param);
+    popt.clip = std::get<1>(param);
+    const double clip = (popt.clip < 0 ? std::sqrt(static_cast<double>(nc)) : popt.clip);
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.trend = false; // residual means are mostly negative, so there might not be enough genes above the minimum mean.
+    auto ref = scran_variances::model_gene_variances(*compute_residuals(NULL, popt.theta, clip), opt);
+
+    for (const auto& mat : { dense_row, dense_column, sparse_row, sparse_column }) {
+        auto res = scran_variances::model_pearson_residual_variances(*mat, size_factors.data(), opt, popt);
+        compare(ref.means, res.means);
+        compare_relative(ref.variances, res.variances);
+        EXPECT_TRUE(res.fitted.empty());
+    }
+
+    // Same results with multiple threads.
+    opt.num_threads = 3;
+    auto res = scran_variances::model_pearson_residual_variances(*sparse_column, size_factors.data(), opt, popt);
+    compare(ref.means, res.means);
+    compare(ref.variances, res.variances);
+
+    // Same results when there are too few genes for the interpolation table.
+    tatami::DelayedSubsetBlock<double, int> sub(sparse_row, 0, 5, true);
+    auto subres = scran_variances::model_pearson_residual_variances(sub, size_factors.data(), opt, popt);
+    compare(std::vector<double>(ref.means.begin(), ref.means.begin() + 5), subres.means);
+    compare(std::vector<double>(ref.variances.begin(), ref.variances.begin() + 5), subres.variances);
+}
+
+TEST_P(PearsonResidualVariancesTest, Blocked) {
+    auto param = GetParam();
+    scran_variances::PearsonResidualOptions popt;
+    popt.theta = std::get<0>(param);
+    popt.clip = std::get<1>(param);
+    const double clip = (popt.clip < 0 ? std::sqrt(static_cast<double>(nc)) : popt.clip);
+
+    std::vector<int> blocks(nc);
+    for (int c = 0; c < nc; ++c) {
+        blocks[c] = c % 3;
+    }
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.trend = false; // residual means are mostly negative, so there might not be enough genes above the minimum mean.
+    auto ref = scran_variances::model_gene_variances_blocked(*compute_residuals(blocks.data(), popt.theta, clip), blocks.data(), opt);
+
+    for (const auto& mat : { dense_row, sparse_column }) {
+        auto res = scran_variances::model_pearson_residual_variances_blocked(*mat, size_factors.data(), blocks.data(), opt, popt);
+        ASSERT_EQ(res.per_block.size(), 3);
+        for (int b = 0; b < 3; ++b) {
+            compare(ref.per_block[b].means, res.per_block[b].means);
+            compare_relative(ref.per_block[b].variances, res.per_block[b].variances);
+        }
+        compare(ref.average.means, res.average.means);
+        compare(ref.average.variances, res.average.variances);
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    PearsonResidualVariances,
+    PearsonResidualVariancesTest,
+    ::testing::Combine(
+        ::testing::Values(100.0, 10.0, std::numeric_limits<double>::infinity()), // theta
+        ::testing::Values(-1.0, 1.5, std::numeric_limits<double>::infinity()) // clip
+    )
+);
+
+TEST(PearsonResidualVariances, Empty) {
+    // All-zero genes and empty blocks.
+    tatami::DenseRowMatrix<double, int> mat(3, 4, std::vector<double>{ 0, 0, 0, 0, 1, 0, 2, 0, 0, 0, 0, 5 });
+    std::vector<double> sf{ 1, 2, 1, 0.5 };
+    std::vector<int> block{ 0, 0, 0, 2 };
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.trend = false;
+    auto res = scran_variances::model_pearson_residual_variances_blocked(mat, sf.data(), block.data(), opt, scran_variances::PearsonResidualOptions());
+    ASSERT_EQ(res.per_block.size(), 3);
+    EXPECT_EQ(res.per_block[0].means[0], 0);
+    EXPECT_EQ(res.per_block[0].variances[0], 0);
+    EXPECT_EQ(res.per_block[0].means[2], 0);
+    EXPECT_TRUE(std::isnan(res.per_block[1].means[0]));
+    EXPECT_TRUE(std::isnan(res.per_block[1].variances[1]));
+    EXPECT_EQ(res.per_block[2].means[2], 0);
+    EXPECT_TRUE(std::isnan(res.per_block[2].variances[2]));
+}
+
+TEST(PearsonResidualVariances, Errors) {
+    tatami::DenseRowMatrix<double, int> mat(2, 3, std::vector<double>(6, 1));
+    scran_variances::ModelGeneVariancesOptions opt;
+
+    auto check_error = [&](const std::vector<double>& sf, const double theta, const std::string& expected) {
+        scran_variances::PearsonResidualOptions popt;
+        popt.theta = theta;
+        std::string msg;
+        try {
+            scran_variances::model_pearson_residual_variances(mat, sf.data(), opt, popt);
+        } catch (std::exception& e) {
+            msg = e.what();
+        }
+        EXPECT_TRUE(msg.find(expected) != std::string::npos) << msg;
+    };
+
+    check_error({ 1, 0, 1 }, 100, "size factors should be positive");
+    check_error({ 1, 1, std::numeric_limits<double>::infinity() }, 100, "size factors should be positive");
+    check_error({ 1, 1, 1 }, 0, "theta should be positive");
+}
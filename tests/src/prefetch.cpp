@@ -0,0 +1,177 @@
+#include "scran_tests/scran_tests.hpp"
+
+#include "tatami/tatami.hpp"
+#include "scran_variances/prefetch.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+/*
+ * Wrapper around a consecutive extractor that sleeps in each fetch, to mimic
+ * a matrix with high-latency reads (e.g., from disk or over the network).
+ * This gives the caller plenty of opportunity to interleave with the reader
+ * thread. It can also be instructed to throw at a particular fetch.
+ */
+template<bool sparse_>
+class SleepyExtractor : public std::conditional_t<sparse_, tatami::OracularSparseExtractor<double, int>, tatami::OracularDenseExtractor<double, int> > {
+public:
+    SleepyExtractor(const tatami::NumericMatrix& mat, std::atomic<int>& counter, const int fail_at) :
+        my_ext(tatami::consecutive_extractor<sparse_>(mat, true, 0, mat.nrow())),
+        my_counter(counter),
+        my_fail_at(fail_at)
+    {}
+
+private:
+    std::unique_ptr<std::conditional_t<sparse_, tatami::OracularSparseExtractor<double, int>, tatami::OracularDenseExtractor<double, int> > > my_ext;
+    std::atomic<int>& my_counter;
+    int my_fail_at;
+
+    void wait() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        if (my_counter++ == my_fail_at) {
+            throw std::runtime_error("failed to read from the sleepy matrix");
+        }
+    }
+
+public:
+    const double* fetch(int, double* buffer) {
+        wait();
+        return my_ext->fetch(buffer);
+    }
+
+    tatami::SparseRange<double, int> fetch(int, double* vbuffer, int* ibuffer) {
+        wait();
+        return my_ext->fetch(vbuffer, ibuffer);
+    }
+};
+
+class PrefetchExtractorTest : public ::testing::TestWithParam<int> {
+protected:
+    inline static int nr = 51, nc = 23;
+    inline static std::shared_ptr<tatami::NumericMatrix> dense_row;
+
+    static void SetUpTestSuite() {
+        auto vec = scran_tests::simulate_vector(nr * nc, []{
+            scran_tests::SimulateVectorParameters sparams;
+            sparams.density = 0.2;
+            sparams.seed = 4343;
+            return sparams;
+        }());
+        dense_row = std::unique_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+    }
+
+    template<bool sparse_>
+    static auto create(std::atomic<int>& counter, const int fail_at = -1) {
+        return [&counter,fail_at]() {
+            typedef std::conditional_t<sparse_, tatami::OracularSparseExtractor<double, int>, tatami::OracularDenseExtractor<double, int> > Extractor;
+            return std::unique_ptr<Extractor>(new SleepyExtractor<sparse_>(*dense_row, counter, fail_at));
+        };
+    }
+
+    // Converting the number of rows in each slot into a buffer size.
+    static std::size_t buffer_size(const int chunk, const bool sparse) {
+        return static_cast<std::size_t>(chunk) * nc * (sizeof(double) + (sparse ? sizeof(int) : 0)) * 2;
+    }
+};
+
+TEST_P(PrefetchExtractorTest, Dense) {
+    const int chunk = GetParam();
+    std::atomic<int> counter(0);
+    scran_variances::internal::PrefetchExtractor<false, double, int> ext(create<false>(counter), nc, nr, buffer_size(chunk, false));
+    EXPECT_EQ(ext.bytes() > 0, chunk > 0);
+
+    auto ref = tatami::consecutive_extractor<false>(*dense_row, true, 0, nr);
+    std::vector<double> buffer(nc), rbuffer(nc);
+    for (int r = 0; r < nr; ++r) {
+        auto ptr = ext.fetch(buffer.data());
+        auto rptr = ref->fetch(rbuffer.data());
+        EXPECT_EQ(std::vector<double>(ptr, ptr + nc), std::vector<double>(rptr, rptr + nc));
+    }
+    EXPECT_EQ(counter.load(), nr);
+}
+
+TEST_P(PrefetchExtractorTest, Sparse) {
+    const int chunk = GetParam();
+    std::atomic<int> counter(0);
+    scran_variances::internal::PrefetchExtractor<true, double, int> ext(create<true>(counter), nc, nr, buffer_size(chunk, true));
+    EXPECT_EQ(ext.bytes() > 0, chunk > 0);
+
+    auto ref = tatami::consecutive_extractor<true>(*dense_row, true, 0, nr);
+    std::vector<double> vbuffer(nc), rvbuffer(nc);
+    std::vector<int> ibuffer(nc), ribuffer(nc);
+    for (int r = 0; r < nr; ++r) {
+        auto range = ext.fetch(vbuffer.data(), ibuffer.data());
+        auto rrange = ref->fetch(rvbuffer.data(), ribuffer.data());
+        ASSERT_EQ(range.number, rrange.number);
+        EXPECT_EQ(std::vector<double>(range.value, range.value + range.number), std::vector<double>(rrange.value, rrange.value + rrange.number));
+        EXPECT_EQ(std::vector<int>(range.index, range.index + range.number), std::vector<int>(rrange.index, rrange.index + rrange.number));
+    }
+    EXPECT_EQ(counter.load(), nr);
+}
+
+TEST_P(PrefetchExtractorTest, Error) {
+    const int chunk = GetParam();
+    const int fail_at = 17;
+
+    for (bool sparse : { false, true }) {
+        std::atomic<int> counter(0);
+        std::string msg;
+        int fetched = 0;
+        try {
+            if (sparse) {
+                scran_variances::internal::PrefetchExtractor<true, double, int> ext(create<true>(counter, fail_at), nc, nr, buffer_size(chunk, true));
+                std::vector<double> vbuffer(nc);
+                std::vector<int> ibuffer(nc);
+                for (; fetched < nr; ++fetched) {
+                    ext.fetch(vbuffer.data(), ibuffer.data());
+                }
+            } else {
+                scran_variances::internal::PrefetchExtractor<false, double, int> ext(create<false>(counter, fail_at), nc, nr, buffer_size(chunk, false));
+                std::vector<double> buffer(nc);
+                for (; fetched < nr; ++fetched) {
+                    ext.fetch(buffer.data());
+                }
+            }
+        } catch (std::exception& e) {
+            msg = e.what();
+        }
+
+        // The exception from the reader thread is forwarded to the caller before it can see the failed row.
+        EXPECT_TRUE(msg.find("sleepy matrix") != std::string::npos);
+        EXPECT_LE(fetched, fail_at);
+        EXPECT_EQ(counter.load(), fail_at + 1);
+    }
+}
+
+TEST_P(PrefetchExtractorTest, EarlyDestruction) {
+    const int chunk = GetParam();
+    if (chunk == 0) {
+        return;
+    }
+
+    for (int consumed : { 0, 1, 4 }) {
+        std::atomic<int> counter(0);
+        {
+            scran_variances::internal::PrefetchExtractor<false, double, int> ext(create<false>(counter), nc, nr, buffer_size(chunk, false));
+            std::vector<double> buffer(nc);
+            for (int r = 0; r < consumed; ++r) {
+                ext.fetch(buffer.data());
+            }
+        } // destructor should cancel the reader thread without hanging.
+
+        // The reader can only fill the two slots ahead of the caller's current position.
+        const int current_chunk = (consumed + chunk - 1) / chunk;
+        EXPECT_LE(counter.load(), std::min(nr, (current_chunk + 2) * chunk));
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    PrefetchExtractor,
+    PrefetchExtractorTest,
+    ::testing::Values(0, 1, 3, 100) // number of rows per slot
+);
@@ -0,0 +1,82 @@
+#include "scran_tests/scran_tests.hpp"
+
+#include "scran_variances/simd.hpp"
+
+#include <cmath>
+
+class SimdTest : public ::testing::TestWithParam<scran_variances::internal::simd::Isa> {};
+
+TEST_P(SimdTest, DenseVariances) {
+    auto isa = GetParam();
+    if (!scran_variances::internal::simd::is_supported(isa)) {
+        GTEST_SKIP() << "instruction set not supported on this host";
+    }
+
+    auto x = scran_tests::simulate_vector(1001, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.lower = 0;
+        sparams.upper = 10;
+        sparams.seed = 696969;
+        return sparams;
+    }());
+
+    // Checking a variety of lengths to exercise the remainder loops.
+    for (std::size_t n : { 2, 3, 5, 8, 15, 16, 17, 31, 33, 100, 1001 }) {
+        auto ref = tatami_stats::variances::direct(x.data(), n, false);
+        auto res = scran_variances::internal::simd::dense_variances(x.data(), n, isa);
+        scran_tests::compare_almost_equal(ref.first, res.first, {});
+        scran_tests::compare_almost_equal(ref.second, res.second, {});
+    }
+
+    auto empty = scran_variances::internal::simd::dense_variances(x.data(), 0, isa);
+    EXPECT_TRUE(std::isnan(empty.first));
+    EXPECT_TRUE(std::isnan(empty.second));
+
+    auto single = scran_variances::internal::simd::dense_variances(x.data(), 1, isa);
+    EXPECT_EQ(single.first, x[0]);
+    EXPECT_TRUE(std::isnan(single.second));
+}
+
+TEST_P(SimdTest, SparseVariances) {
+    auto isa = GetParam();
+    if (!scran_variances::internal::simd::is_supported(isa)) {
+        GTEST_SKIP() << "instruction set not supported on this host";
+    }
+
+    auto x = scran_tests::simulate_vector(101, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.lower = 1;
+        sparams.upper = 10;
+        sparams.seed = 424242;
+        return sparams;
+    }());
+
+    for (std::size_t nnz : { 0, 1, 7, 16, 33, 101 }) {
+        for (std::size_t n : { nnz, nnz + 1, nnz * 20 + 2 }) {
+            auto ref = tatami_stats::variances::direct(x.data(), nnz, n, false);
+            auto res = scran_variances::internal::simd::sparse_variances(x.data(), nnz, n, isa);
+            if (n == 0) {
+                EXPECT_TRUE(std::isnan(res.first));
+                EXPECT_TRUE(std::isnan(res.second));
+                continue;
+            }
+            scran_tests::compare_almost_equal(ref.first, res.first, {});
+            if (n == 1) {
+                EXPECT_TRUE(std::isnan(res.second));
+            } else {
+                scran_tests::compare_almost_equal(ref.second, res.second, {});
+            }
+        }
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Simd,
+    SimdTest,
+    ::testing::Values(
+        scran_variances::internal::simd::Isa::SCALAR,
+        scran_variances::internal::simd::Isa::SSE42,
+        scran_variances::internal::simd::Isa::AVX2,
+        scran_variances::internal::simd::Isa::AVX512
+    )
+);
@@ -0,0 +1,275 @@
+#include "scran_tests/scran_tests.hpp"
+
+#include "tatami/tatami.hpp"
+#include "scran_variances/update_model_gene_variances.hpp"
+
+#include <numeric>
+#include <cmath>
+
+static void compare_results(const scran_variances::ModelGeneVariancesBlockedResults<double>& ref, const scran_variances::ModelGeneVariancesBlockedResults<double>& res) {
+    ASSERT_EQ(ref.per_block.size(), res.per_block.size());
+    for (size_t b = 0; b < ref.per_block.size(); ++b) {
+        scran_tests::compare_almost_equal_containers(ref.per_block[b].means, res.per_block[b].means, {});
+        scran_tests::compare_almost_equal_containers(ref.per_block[b].variances, res.per_block[b].variances, {});
+        scran_tests::compare_almost_equal_containers(ref.per_block[b].fitted, res.per_block[b].fitted, {});
+        scran_tests::compare_almost_equal_containers(ref.per_block[b].residuals, res.per_block[b].residuals, {});
+    }
+    scran_tests::compare_almost_equal_containers(ref.average.means, res.average.means, {});
+    scran_tests::compare_almost_equal_containers(ref.average.variances, res.average.variances, {});
+    scran_tests::compare_almost_equal_containers(ref.average.fitted, res.average.fitted, {});
+    scran_tests::compare_almost_equal_containers(ref.average.residuals, res.average.residuals, {});
+}
+
+class UpdateModelGeneVariancesTest : public ::testing::TestWithParam<int> {
+protected:
+    inline static std::shared_ptr<tatami::NumericMatrix> dense_row, sparse_column;
+    inline static int nr = 123, nc = 181, nold = 100;
+
+    static void SetUpTestSuite() {
+        auto vec = scran_tests::simulate_vector(nr * nc, []{
+            scran_tests::SimulateVectorParameters sparams;
+            sparams.density = 0.3;
+            sparams.lower = 0;
+            sparams.upper = 5;
+            sparams.seed = 3000;
+            return sparams;
+        }());
+
+        dense_row = std::unique_ptr<tatami::NumericMatrix>(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+        sparse_column = tatami::convert_to_compressed_sparse(dense_row.get(), false);
+    }
+};
+
+TEST_P(UpdateModelGeneVariancesTest, Basic) {
+    std::vector<int> blocks(nc);
+    for (int c = 0; c < nc; ++c) {
+        blocks[c] = (c < nold ? c % 2 : 2 + c % 3);
+    }
+    std::vector<int> new_blocks(blocks.begin() + nold, blocks.end());
+    for (auto& b : new_blocks) {
+        b -= 2;
+    }
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.num_threads = GetParam();
+
+    for (auto policy : { scran_variances::BlockAveragePolicy::MEAN, scran_variances::BlockAveragePolicy::QUANTILE }) {
+        opt.block_average_policy = policy;
+
+        for (const auto& mat : { dense_row, sparse_column }) {
+            auto ref = scran_variances::model_gene_variances_blocked(*mat, blocks.data(), opt);
+
+            auto old_mat = std::make_shared<tatami::DelayedSubsetBlock<double, int> >(mat, 0, nold, false);
+            auto res = scran_variances::model_gene_variances_blocked(*old_mat, blocks.data(), opt);
+            auto block_size = tatami_stats::tabulate_groups(blocks.data(), nold);
+
+            tatami::DelayedSubsetBlock<double, int> new_mat(mat, nold, nc - nold, false);
+            scran_variances::update_model_gene_variances_blocked(new_mat, new_blocks.data(), res, block_size, opt);
+            EXPECT_EQ(block_size, tatami_stats::tabulate_groups(blocks.data(), nc));
+            compare_results(ref, res);
+        }
+    }
+}
+
+TEST_P(UpdateModelGeneVariancesTest, SingleNewBlock) {
+    std::vector<int> blocks(nc);
+    for (int c = 0; c < nc; ++c) {
+        blocks[c] = (c < nold ? c % 2 : 2);
+    }
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.num_threads = GetParam();
+    auto ref = scran_variances::model_gene_variances_blocked(*dense_row, blocks.data(), opt);
+
+    auto old_mat = std::make_shared<tatami::DelayedSubsetBlock<double, int> >(dense_row, 0, nold, false);
+    auto res = scran_variances::model_gene_variances_blocked(*old_mat, blocks.data(), opt);
+    auto block_size = tatami_stats::tabulate_groups(blocks.data(), nold);
+
+    tatami::DelayedSubsetBlock<double, int> new_mat(dense_row, nold, nc - nold, false);
+    scran_variances::update_model_gene_variances_blocked(new_mat, static_cast<int*>(NULL), res, block_size, opt);
+    compare_results(ref, res);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    UpdateModelGeneVariances,
+    UpdateModelGeneVariancesTest,
+    ::testing::Values(1, 3) // number of threads
+);
+
+TEST(UpdateModelGeneVariances, Errors) {
+    int nr = 10, nc = 6;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.lower = 0;
+        sparams.upper = 5;
+        return sparams;
+    }());
+    tatami::DenseMatrix<double, int, decltype(vec)> mat(nr, nc, std::move(vec), true);
+    std::vector<int> block { 0, 1, 0, 1, 0, 1 };
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.trend = false;
+    auto res = scran_variances::model_gene_variances_blocked(mat, block.data(), opt);
+
+    auto check_error = [&](std::vector<int> block_size, const scran_variances::ModelGeneVariancesOptions& opt, const std::string& expected) {
+        std::string msg;
+        try {
+            scran_variances::update_model_gene_variances_blocked(mat, block.data(), res, block_size, opt);
+        } catch (std::exception& e) {
+            msg = e.what();
+        }
+        EXPECT_TRUE(msg.find(expected) != std::string::npos) << msg;
+    };
+
+    check_error({ 3 }, opt, "number of existing blocks");
+    opt.trend = true;
+    check_error({ 3, 3 }, opt, "consistent");
+}
+
+class DowndateModelGeneVariancesTest : public ::testing::TestWithParam<int> {
+protected:
+    inline static int nr = 111, nc = 157;
+    inline static std::vector<double> values;
+
+    static void SetUpTestSuite() {
+        values = scran_tests::simulate_vector(nr * nc, []{
+            scran_tests::SimulateVectorParameters sparams;
+            sparams.density = 0.3;
+            sparams.lower = 0;
+            sparams.upper = 5;
+            sparams.seed = 4000;
+            return sparams;
+        }());
+    }
+
+    // Creating a row-major matrix from a subset of columns.
+    static std::shared_ptr<tatami::NumericMatrix> subset_columns(const std::vector<int>& keep, bool sparse) {
+        std::vector<double> subvalues;
+        subvalues.reserve(nr * keep.size());
+        for (int r = 0; r < nr; ++r) {
+            for (auto c : keep) {
+                subvalues.push_back(values[r * nc + c]);
+            }
+        }
+        std::shared_ptr<tatami::NumericMatrix> output(new tatami::DenseRowMatrix<double, int>(nr, keep.size(), std::move(subvalues)));
+        if (sparse) {
+            output = tatami::convert_to_compressed_sparse(output.get(), false);
+        }
+        return output;
+    }
+};
+
+TEST_P(DowndateModelGeneVariancesTest, Basic) {
+    std::vector<int> blocks(nc);
+    for (int c = 0; c < nc; ++c) {
+        blocks[c] = c % 4;
+    }
+
+    // Removing a scattering of cells from blocks 0, 1 and 3, but not 2.
+    std::vector<int> all, kept, removed, kept_blocks, removed_blocks;
+    for (int c = 0; c < nc; ++c) {
+        all.push_back(c);
+        if (blocks[c] != 2 && c % 5 == 0) {
+            removed.push_back(c);
+            removed_blocks.push_back(blocks[c]);
+        } else {
+            kept.push_back(c);
+            kept_blocks.push_back(blocks[c]);
+        }
+    }
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.num_threads = GetParam();
+
+    for (bool sparse : { false, true }) {
+        auto full = subset_columns(all, sparse);
+        auto res = scran_variances::model_gene_variances_blocked(*full, blocks.data(), opt);
+        auto block_size = tatami_stats::tabulate_groups(blocks.data(), nc);
+        auto untouched = res.per_block[2];
+
+        auto rmat = subset_columns(removed, sparse);
+        scran_variances::downdate_model_gene_variances_blocked(*rmat, removed_blocks.data(), res, block_size, opt);
+        EXPECT_EQ(block_size, tatami_stats::tabulate_groups(kept_blocks.data(), static_cast<int>(kept.size())));
+
+        auto kmat = subset_columns(kept, sparse);
+        auto ref = scran_variances::model_gene_variances_blocked(*kmat, kept_blocks.data(), opt);
+        compare_results(ref, res);
+
+        // Unaffected blocks are left alone.
+        EXPECT_EQ(untouched.means, res.per_block[2].means);
+        EXPECT_EQ(untouched.residuals, res.per_block[2].residuals);
+    }
+}
+
+TEST_P(DowndateModelGeneVariancesTest, EmptiedBlock) {
+    std::vector<int> blocks(nc);
+    for (int c = 0; c < nc; ++c) {
+        blocks[c] = (c < 3 ? 0 : 1 + c % 2);
+    }
+
+    // Removing all but one cell of block 0, and then the last one.
+    std::vector<int> kept, removed, kept_blocks, removed_blocks;
+    for (int c = 0; c < nc; ++c) {
+        if (c == 1 || c == 2) {
+            removed.push_back(c);
+            removed_blocks.push_back(blocks[c]);
+        } else {
+            kept.push_back(c);
+            kept_blocks.push_back(blocks[c]);
+        }
+    }
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    opt.num_threads = GetParam();
+    std::vector<int> all(nc);
+    std::iota(all.begin(), all.end(), 0);
+    auto res = scran_variances::model_gene_variances_blocked(*subset_columns(all, false), blocks.data(), opt);
+    auto block_size = tatami_stats::tabulate_groups(blocks.data(), nc);
+
+    scran_variances::downdate_model_gene_variances_blocked(*subset_columns(removed, false), removed_blocks.data(), res, block_size, opt);
+    auto ref = scran_variances::model_gene_variances_blocked(*subset_columns(kept, false), kept_blocks.data(), opt);
+    compare_results(ref, res);
+    EXPECT_TRUE(std::isnan(res.per_block[0].variances[0]));
+    EXPECT_FALSE(std::isnan(res.per_block[0].means[0]));
+
+    std::vector<int> last_block{ 0 };
+    scran_variances::downdate_model_gene_variances_blocked(*subset_columns(std::vector<int>{ 0 }, false), last_block.data(), res, block_size, opt);
+    EXPECT_EQ(block_size[0], 0);
+    EXPECT_TRUE(std::isnan(res.per_block[0].means[0]));
+    EXPECT_TRUE(std::isnan(res.per_block[0].fitted[0]));
+    EXPECT_FALSE(std::isnan(res.average.residuals[0]));
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    DowndateModelGeneVariances,
+    DowndateModelGeneVariancesTest,
+    ::testing::Values(1, 3) // number of threads
+);
+
+TEST(DowndateModelGeneVariances, Errors) {
+    int nr = 10, nc = 6;
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulateVectorParameters sparams;
+        sparams.lower = 0;
+        sparams.upper = 5;
+        return sparams;
+    }());
+    tatami::DenseMatrix<double, int, decltype(vec)> mat(nr, nc, std::move(vec), true);
+    std::vector<int> block { 0, 1, 0, 1, 0, 1 };
+
+    scran_variances::ModelGeneVariancesOptions opt;
+    auto res = scran_variances::model_gene_variances_blocked(mat, block.data(), opt);
+
+    auto check_error = [&](const std::vector<int>& removed_block, std::vector<int> block_size, const std::string& expected) {
+        std::string msg;
+        try {
+            scran_variances::downdate_model_gene_variances_blocked(mat, removed_block.data(), res, block_size, opt);
+        } catch (std::exception& e) {
+            msg = e.what();
+        }
+        EXPECT_TRUE(msg.find(expected) != std::string::npos) << msg;
+    };
+
+    check_error(std::vector<int>{ 0, 1, 2, 0, 1, 0 }, { 3, 3 }, "existing blocks");
+    check_error(block, { 3, 2 }, "should not exceed");
+}